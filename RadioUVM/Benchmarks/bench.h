@@ -0,0 +1,76 @@
+/*
+ * The checks of the Linux benchmarks, in place of XCTest.
+ * A failed check is printed and counted; main() returns bench::result().
+ */
+
+#ifndef BENCHMARKS_BENCH_H
+#define BENCHMARKS_BENCH_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+namespace bench {
+
+inline unsigned& failures()
+{
+    static unsigned count = 0;
+    return count;
+}
+
+inline void fail(const char *file, int line, const char *check, const std::string& values)
+{
+    failures()++;
+    fprintf(stderr, "%s:%d: check failed: %s%s\n", file, line, check, values.c_str());
+}
+
+inline std::string values(double a, double b)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), " (%.17g vs %.17g)", a, b);
+    return buf;
+}
+
+/* Runs a test if its name contains the filter of the command line, if any */
+inline void run(int argc, char **argv, const char *name, void (*test)())
+{
+    if (argc > 1 && !strstr(name, argv[1])) {
+        return;
+    }
+    printf("== %s\n", name);
+    fflush(stdout);
+
+    test();
+}
+
+inline int result()
+{
+    if (failures() > 0) {
+        printf("FAILED: %u checks\n", failures());
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+} // namespace bench
+
+#define BENCH_CHECK(e) \
+    do { if (!(e)) bench::fail(__FILE__, __LINE__, #e, ""); } while (0)
+
+#define BENCH_CHECK_OP(a, op, b) \
+    do { if (!((a) op (b))) bench::fail(__FILE__, __LINE__, #a " " #op " " #b, bench::values((double)(a), (double)(b))); } while (0)
+
+#define BENCH_CHECK_EQUAL(a, b) BENCH_CHECK_OP(a, ==, b)
+#define BENCH_CHECK_LESS(a, b) BENCH_CHECK_OP(a, <, b)
+#define BENCH_CHECK_LESS_EQUAL(a, b) BENCH_CHECK_OP(a, <=, b)
+#define BENCH_CHECK_GREATER(a, b) BENCH_CHECK_OP(a, >, b)
+#define BENCH_CHECK_GREATER_EQUAL(a, b) BENCH_CHECK_OP(a, >=, b)
+
+#define BENCH_RUN(test) bench::run(argc, argv, #test, test)
+
+#endif // BENCHMARKS_BENCH_H
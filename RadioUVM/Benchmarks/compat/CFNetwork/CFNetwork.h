@@ -0,0 +1,22 @@
+/*
+ * The CFNetwork types in the astreamer headers. Nothing of CFNetwork
+ * runs on Linux: the recorders read through Socket_Stream there.
+ */
+
+#ifndef BENCHMARKS_COMPAT_CF_NETWORK_H
+#define BENCHMARKS_COMPAT_CF_NETWORK_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct __CFReadStream *CFReadStreamRef;
+typedef CFOptionFlags CFStreamEventType;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BENCHMARKS_COMPAT_CF_NETWORK_H
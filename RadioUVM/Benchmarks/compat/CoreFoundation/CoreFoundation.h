@@ -0,0 +1,132 @@
+/*
+ * The part of CoreFoundation the portable astreamer sources use, so that
+ * they build and run on Linux for the benchmarks. Strings are kept in
+ * UTF-8; only the encodings the parsers ask for are converted.
+ */
+
+#ifndef BENCHMARKS_COMPAT_CORE_FOUNDATION_H
+#define BENCHMARKS_COMPAT_CORE_FOUNDATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t SInt8;
+typedef int16_t SInt16;
+typedef int32_t SInt32;
+typedef int64_t SInt64;
+typedef unsigned char Boolean;
+typedef int32_t OSStatus;
+
+enum {
+    noErr = 0
+};
+
+typedef long CFIndex;
+typedef unsigned long CFOptionFlags;
+typedef double CFTimeInterval;
+typedef CFTimeInterval CFAbsoluteTime;
+
+typedef const void *CFTypeRef;
+typedef const struct __CFAllocator *CFAllocatorRef;
+typedef const struct __CFString *CFStringRef;
+typedef const struct __CFArray *CFArrayRef;
+typedef const struct __CFURL *CFURLRef;
+
+typedef struct {
+    CFIndex location;
+    CFIndex length;
+} CFRange;
+
+extern const CFAllocatorRef kCFAllocatorDefault;
+
+CFTypeRef CFRetain(CFTypeRef cf);
+void CFRelease(CFTypeRef cf);
+CFIndex CFGetRetainCount(CFTypeRef cf);
+
+/* Strings */
+
+typedef UInt32 CFStringEncoding;
+
+enum {
+    kCFStringEncodingMacRoman = 0,
+    kCFStringEncodingWindowsLatin1 = 0x0500,
+    kCFStringEncodingISOLatin1 = 0x0201,
+    kCFStringEncodingASCII = 0x0600,
+    kCFStringEncodingUnicode = 0x0100,
+    kCFStringEncodingUTF8 = 0x08000100,
+    kCFStringEncodingUTF16 = 0x0100,
+    kCFStringEncodingUTF16BE = 0x10000100,
+    kCFStringEncodingUTF16LE = 0x14000100
+};
+
+typedef enum {
+    kCFCompareLessThan = -1,
+    kCFCompareEqualTo = 0,
+    kCFCompareGreaterThan = 1
+} CFComparisonResult;
+
+enum {
+    kCFCompareCaseInsensitive = 1
+};
+
+CFStringRef __CFStringMakeConstantString(const char *cStr);
+#define CFSTR(cStr) __CFStringMakeConstantString("" cStr "")
+
+/* NULL if the bytes aren't valid in the encoding */
+CFStringRef CFStringCreateWithBytes(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, Boolean isExternalRepresentation);
+CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding);
+CFStringRef CFStringCreateCopy(CFAllocatorRef alloc, CFStringRef theString);
+
+/* In UTF-16 code units, as on Apple platforms */
+CFIndex CFStringGetLength(CFStringRef theString);
+CFIndex CFStringGetMaximumSizeForEncoding(CFIndex length, CFStringEncoding encoding);
+Boolean CFStringGetCString(CFStringRef theString, char *buffer, CFIndex bufferSize, CFStringEncoding encoding);
+const char *CFStringGetCStringPtr(CFStringRef theString, CFStringEncoding encoding);
+CFStringEncoding CFStringGetSystemEncoding(void);
+
+/* Case insensitive for ASCII only */
+CFComparisonResult CFStringCompare(CFStringRef theString1, CFStringRef theString2, CFOptionFlags compareOptions);
+
+/* Arrays */
+
+typedef struct {
+    CFIndex version;
+    const void *(*retain)(CFAllocatorRef allocator, const void *value);
+    void (*release)(CFAllocatorRef allocator, const void *value);
+    CFStringRef (*copyDescription)(const void *value);
+    Boolean (*equal)(const void *value1, const void *value2);
+} CFArrayCallBacks;
+
+extern const CFArrayCallBacks kCFTypeArrayCallBacks;
+
+CFArrayRef CFArrayCreate(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFArrayCallBacks *callBacks);
+CFIndex CFArrayGetCount(CFArrayRef theArray);
+const void *CFArrayGetValueAtIndex(CFArrayRef theArray, CFIndex idx);
+
+/* URLs */
+
+CFURLRef CFURLCreateWithString(CFAllocatorRef allocator, CFStringRef URLString, CFURLRef baseURL);
+CFStringRef CFURLGetString(CFURLRef anURL);
+CFStringRef CFURLCopyScheme(CFURLRef anURL);
+
+/* The path of a file URL, percent decoded */
+Boolean CFURLGetFileSystemRepresentation(CFURLRef url, Boolean resolveAgainstBase, UInt8 *buffer, CFIndex maxBufLen);
+
+/* Time */
+
+/* Seconds since 1 January 2001 */
+CFAbsoluteTime CFAbsoluteTimeGetCurrent(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BENCHMARKS_COMPAT_CORE_FOUNDATION_H
@@ -0,0 +1,497 @@
+/*
+ * The CoreFoundation subset of compat/CoreFoundation/CoreFoundation.h.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct __CFType {
+    std::atomic<long> m_retainCount;
+
+    __CFType() : m_retainCount(1) {}
+    virtual ~__CFType() {}
+};
+
+struct __CFString : public __CFType {
+    std::string m_utf8;
+};
+
+struct __CFArray : public __CFType {
+    std::vector<CFTypeRef> m_values;
+    bool m_retainsValues;
+
+    ~__CFArray()
+    {
+        if (m_retainsValues) {
+            for (size_t i = 0; i < m_values.size(); i++) {
+                CFRelease(m_values[i]);
+            }
+        }
+    }
+};
+
+struct __CFURL : public __CFType {
+    CFStringRef m_string;
+
+    ~__CFURL()
+    {
+        CFRelease(m_string);
+    }
+};
+
+static const long kConstantRetainCount = -1;
+
+/* Every object derives from __CFType alone, so its address is that of its __CFType */
+static __CFType *typeOf(CFTypeRef cf)
+{
+    return const_cast<__CFType *>(static_cast<const __CFType *>(cf));
+}
+
+const CFAllocatorRef kCFAllocatorDefault = NULL;
+
+CFTypeRef CFRetain(CFTypeRef cf)
+{
+    __CFType *type = typeOf(cf);
+
+    if (type->m_retainCount != kConstantRetainCount) {
+        type->m_retainCount++;
+    }
+    return cf;
+}
+
+void CFRelease(CFTypeRef cf)
+{
+    __CFType *type = typeOf(cf);
+
+    if (type->m_retainCount != kConstantRetainCount && --type->m_retainCount == 0) {
+        delete type;
+    }
+}
+
+CFIndex CFGetRetainCount(CFTypeRef cf)
+{
+    return typeOf(cf)->m_retainCount;
+}
+
+/* Strings */
+
+static void appendUtf8(std::string *out, UInt32 c)
+{
+    if (c < 0x80) {
+        *out += (char)c;
+    } else if (c < 0x800) {
+        *out += (char)(0xc0 | (c >> 6));
+        *out += (char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        *out += (char)(0xe0 | (c >> 12));
+        *out += (char)(0x80 | ((c >> 6) & 0x3f));
+        *out += (char)(0x80 | (c & 0x3f));
+    } else {
+        *out += (char)(0xf0 | (c >> 18));
+        *out += (char)(0x80 | ((c >> 12) & 0x3f));
+        *out += (char)(0x80 | ((c >> 6) & 0x3f));
+        *out += (char)(0x80 | (c & 0x3f));
+    }
+}
+
+/* The next code point, or -1 if the sequence is not valid UTF-8 */
+static long nextUtf8(const UInt8 *bytes, size_t numBytes, size_t *offset)
+{
+    const UInt8 lead = bytes[(*offset)++];
+
+    if (lead < 0x80) {
+        return lead;
+    }
+
+    size_t trailing;
+    UInt32 c, min;
+
+    if ((lead & 0xe0) == 0xc0) {
+        trailing = 1, c = lead & 0x1f, min = 0x80;
+    } else if ((lead & 0xf0) == 0xe0) {
+        trailing = 2, c = lead & 0x0f, min = 0x800;
+    } else if ((lead & 0xf8) == 0xf0) {
+        trailing = 3, c = lead & 0x07, min = 0x10000;
+    } else {
+        return -1;
+    }
+
+    if (numBytes - *offset < trailing) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < trailing; i++) {
+        const UInt8 b = bytes[(*offset)++];
+
+        if ((b & 0xc0) != 0x80) {
+            return -1;
+        }
+        c = (c << 6) | (b & 0x3f);
+    }
+
+    if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+        return -1;
+    }
+    return c;
+}
+
+/* The code points of 0x80 - 0x9F in Windows-1252, 0 where undefined */
+static const UInt16 windowsLatin1High[32] = {
+    0x20ac, 0, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+    0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017d, 0,
+    0, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+    0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0, 0x017e, 0x0178
+};
+
+static bool decodeUtf16(const UInt8 *bytes, size_t numBytes, bool bigEndian, bool byteOrderMark, std::string *out)
+{
+    size_t i = 0;
+
+    if (byteOrderMark && numBytes >= 2) {
+        if (bytes[0] == 0xfe && bytes[1] == 0xff) {
+            bigEndian = true, i = 2;
+        } else if (bytes[0] == 0xff && bytes[1] == 0xfe) {
+            bigEndian = false, i = 2;
+        }
+    }
+
+    if ((numBytes - i) % 2 != 0) {
+        return false;
+    }
+
+    for (; i < numBytes; i += 2) {
+        UInt32 c = (bigEndian ? (bytes[i] << 8) | bytes[i + 1] : (bytes[i + 1] << 8) | bytes[i]);
+
+        if (c >= 0xdc00 && c <= 0xdfff) {
+            return false;
+        }
+        if (c >= 0xd800 && c <= 0xdbff) {
+            if (numBytes - i < 4) {
+                return false;
+            }
+            i += 2;
+
+            const UInt32 low = (bigEndian ? (bytes[i] << 8) | bytes[i + 1] : (bytes[i + 1] << 8) | bytes[i]);
+
+            if (low < 0xdc00 || low > 0xdfff) {
+                return false;
+            }
+            c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+        }
+        appendUtf8(out, c);
+    }
+    return true;
+}
+
+static bool decode(const UInt8 *bytes, size_t numBytes, CFStringEncoding encoding, bool isExternalRepresentation, std::string *out)
+{
+    switch (encoding) {
+        case kCFStringEncodingUTF8: {
+            for (size_t offset = 0; offset < numBytes;) {
+                if (nextUtf8(bytes, numBytes, &offset) < 0) {
+                    return false;
+                }
+            }
+            out->assign((const char *)bytes, numBytes);
+            return true;
+        }
+        case kCFStringEncodingASCII:
+            for (size_t i = 0; i < numBytes; i++) {
+                if (bytes[i] >= 0x80) {
+                    return false;
+                }
+            }
+            out->assign((const char *)bytes, numBytes);
+            return true;
+        case kCFStringEncodingISOLatin1:
+            for (size_t i = 0; i < numBytes; i++) {
+                appendUtf8(out, bytes[i]);
+            }
+            return true;
+        case kCFStringEncodingWindowsLatin1:
+            for (size_t i = 0; i < numBytes; i++) {
+                if (bytes[i] >= 0x80 && bytes[i] < 0xa0) {
+                    if (!windowsLatin1High[bytes[i] - 0x80]) {
+                        return false;
+                    }
+                    appendUtf8(out, windowsLatin1High[bytes[i] - 0x80]);
+                } else {
+                    appendUtf8(out, bytes[i]);
+                }
+            }
+            return true;
+        case kCFStringEncodingUTF16:
+            // Big endian unless a byte order mark tells otherwise
+            return decodeUtf16(bytes, numBytes, true, true, out);
+        case kCFStringEncodingUTF16BE:
+            return decodeUtf16(bytes, numBytes, true, isExternalRepresentation, out);
+        case kCFStringEncodingUTF16LE:
+            return decodeUtf16(bytes, numBytes, false, isExternalRepresentation, out);
+        default:
+            return false;
+    }
+}
+
+CFStringRef __CFStringMakeConstantString(const char *cStr)
+{
+    // Never destroyed, like the constants of CoreFoundation
+    static std::mutex *mutex = new std::mutex;
+    static std::map<std::string, __CFString *> *constants = new std::map<std::string, __CFString *>;
+
+    std::lock_guard<std::mutex> lock(*mutex);
+
+    __CFString *&str = (*constants)[cStr];
+
+    if (!str) {
+        str = new __CFString;
+        str->m_retainCount = kConstantRetainCount;
+        str->m_utf8 = cStr;
+    }
+    return str;
+}
+
+CFStringRef CFStringCreateWithBytes(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, Boolean isExternalRepresentation)
+{
+    __CFString *str = new __CFString;
+
+    if (!decode(bytes, (size_t)numBytes, encoding, isExternalRepresentation, &str->m_utf8)) {
+        delete str;
+        return NULL;
+    }
+    return str;
+}
+
+CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding)
+{
+    return CFStringCreateWithBytes(alloc, (const UInt8 *)cStr, strlen(cStr), encoding, false);
+}
+
+CFStringRef CFStringCreateCopy(CFAllocatorRef alloc, CFStringRef theString)
+{
+    __CFString *str = new __CFString;
+    str->m_utf8 = theString->m_utf8;
+
+    return str;
+}
+
+CFIndex CFStringGetLength(CFStringRef theString)
+{
+    const std::string& utf8 = theString->m_utf8;
+    CFIndex length = 0;
+
+    for (size_t i = 0; i < utf8.size(); i++) {
+        const UInt8 b = (UInt8)utf8[i];
+
+        if ((b & 0xc0) != 0x80) {
+            // Beyond the BMP it takes a surrogate pair
+            length += ((b & 0xf8) == 0xf0 ? 2 : 1);
+        }
+    }
+    return length;
+}
+
+CFIndex CFStringGetMaximumSizeForEncoding(CFIndex length, CFStringEncoding encoding)
+{
+    switch (encoding) {
+        case kCFStringEncodingUTF8:
+            return length * 3;
+        case kCFStringEncodingUTF16:
+        case kCFStringEncodingUTF16BE:
+        case kCFStringEncodingUTF16LE:
+            return length * 2;
+        default:
+            return length;
+    }
+}
+
+Boolean CFStringGetCString(CFStringRef theString, char *buffer, CFIndex bufferSize, CFStringEncoding encoding)
+{
+    const std::string& utf8 = theString->m_utf8;
+    std::string encoded;
+
+    if (encoding == kCFStringEncodingUTF8) {
+        encoded = utf8;
+    } else if (encoding == kCFStringEncodingISOLatin1 || encoding == kCFStringEncodingASCII) {
+        const UInt32 max = (encoding == kCFStringEncodingASCII ? 0x7f : 0xff);
+
+        for (size_t offset = 0; offset < utf8.size();) {
+            const long c = nextUtf8((const UInt8 *)utf8.data(), utf8.size(), &offset);
+
+            if (c < 0 || (UInt32)c > max) {
+                return false;
+            }
+            encoded += (char)c;
+        }
+    } else {
+        return false;
+    }
+
+    if ((CFIndex)encoded.size() >= bufferSize) {
+        return false;
+    }
+    memcpy(buffer, encoded.c_str(), encoded.size() + 1);
+
+    return true;
+}
+
+const char *CFStringGetCStringPtr(CFStringRef theString, CFStringEncoding encoding)
+{
+    return (encoding == kCFStringEncodingUTF8 ? theString->m_utf8.c_str() : NULL);
+}
+
+CFStringEncoding CFStringGetSystemEncoding(void)
+{
+    return kCFStringEncodingUTF8;
+}
+
+CFComparisonResult CFStringCompare(CFStringRef theString1, CFStringRef theString2, CFOptionFlags compareOptions)
+{
+    const std::string& a = theString1->m_utf8;
+    const std::string& b = theString2->m_utf8;
+
+    int result;
+
+    if (compareOptions & kCFCompareCaseInsensitive) {
+        result = 0;
+
+        for (size_t i = 0; i < a.size() && i < b.size() && result == 0; i++) {
+            const int ca = (a[i] >= 'A' && a[i] <= 'Z' ? a[i] - 'A' + 'a' : (UInt8)a[i]);
+            const int cb = (b[i] >= 'A' && b[i] <= 'Z' ? b[i] - 'A' + 'a' : (UInt8)b[i]);
+
+            result = ca - cb;
+        }
+        if (result == 0) {
+            result = (a.size() < b.size() ? -1 : (a.size() > b.size() ? 1 : 0));
+        }
+    } else {
+        // Byte order of UTF-8 is code point order
+        result = a.compare(b);
+    }
+
+    return (result < 0 ? kCFCompareLessThan : (result > 0 ? kCFCompareGreaterThan : kCFCompareEqualTo));
+}
+
+/* Arrays */
+
+const CFArrayCallBacks kCFTypeArrayCallBacks = { 0, NULL, NULL, NULL, NULL };
+
+CFArrayRef CFArrayCreate(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFArrayCallBacks *callBacks)
+{
+    __CFArray *array = new __CFArray;
+    array->m_values.assign(values, values + numValues);
+    array->m_retainsValues = (callBacks == &kCFTypeArrayCallBacks);
+
+    if (array->m_retainsValues) {
+        for (CFIndex i = 0; i < numValues; i++) {
+            CFRetain(values[i]);
+        }
+    }
+    return array;
+}
+
+CFIndex CFArrayGetCount(CFArrayRef theArray)
+{
+    return (CFIndex)theArray->m_values.size();
+}
+
+const void *CFArrayGetValueAtIndex(CFArrayRef theArray, CFIndex idx)
+{
+    return theArray->m_values[idx];
+}
+
+/* URLs */
+
+CFURLRef CFURLCreateWithString(CFAllocatorRef allocator, CFStringRef URLString, CFURLRef baseURL)
+{
+    __CFURL *url = new __CFURL;
+    url->m_string = CFStringCreateCopy(allocator, URLString);
+
+    return url;
+}
+
+CFStringRef CFURLGetString(CFURLRef anURL)
+{
+    return anURL->m_string;
+}
+
+CFStringRef CFURLCopyScheme(CFURLRef anURL)
+{
+    const std::string& url = anURL->m_string->m_utf8;
+    const size_t colon = url.find(':');
+
+    if (colon == std::string::npos || colon == 0 || url.find('/') < colon) {
+        return NULL;
+    }
+
+    __CFString *scheme = new __CFString;
+    scheme->m_utf8 = url.substr(0, colon);
+
+    return scheme;
+}
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+Boolean CFURLGetFileSystemRepresentation(CFURLRef url, Boolean resolveAgainstBase, UInt8 *buffer, CFIndex maxBufLen)
+{
+    const std::string& str = url->m_string->m_utf8;
+    size_t start;
+
+    if (str.compare(0, 16, "file://localhost") == 0) {
+        start = 16;
+    } else if (str.compare(0, 7, "file://") == 0) {
+        start = 7;
+    } else {
+        return false;
+    }
+
+    std::string path;
+
+    for (size_t i = start; i < str.size(); i++) {
+        if (str[i] == '%' && i + 2 < str.size() && hexValue(str[i + 1]) >= 0 && hexValue(str[i + 2]) >= 0) {
+            path += (char)(hexValue(str[i + 1]) * 16 + hexValue(str[i + 2]));
+            i += 2;
+        } else {
+            path += str[i];
+        }
+    }
+
+    if (path.empty() || (CFIndex)path.size() >= maxBufLen) {
+        return false;
+    }
+    memcpy(buffer, path.c_str(), path.size() + 1);
+
+    return true;
+}
+
+/* Time */
+
+CFAbsoluteTime CFAbsoluteTimeGetCurrent(void)
+{
+    // The seconds from 1970 to 2001
+    static const double kAbsoluteTimeIntervalSince1970 = 978307200.0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9 - kAbsoluteTimeIntervalSince1970;
+}
@@ -0,0 +1,96 @@
+/*
+ * HTTP_Stream reads through CFNetwork, which Linux doesn't have. It
+ * handles no URL here, so Stream_Recorder takes Socket_Stream for its
+ * http URLs, as it does on any event loop without a run loop.
+ */
+
+#include "http_stream.h"
+
+namespace astreamer {
+
+HTTP_Stream::HTTP_Stream(Event_Loop *eventLoop) :
+    m_eventLoop(eventLoop),
+    m_url(0),
+    m_readStream(0),
+    m_scheduledInRunLoop(false),
+    m_readPending(false),
+    m_httpHeadersParsed(false),
+    m_contentType(0),
+    m_contentLength(0),
+    m_totalLength(0),
+    m_bytesToSkip(0),
+    m_icyStream(false),
+    m_icyHeaderCR(false),
+    m_icyHeadersRead(false),
+    m_icyHeadersParsed(false),
+    m_icyName(0),
+    m_icyParser(0),
+    m_httpReadBuffer(0),
+    m_id3Parser(0)
+{
+    m_position.start = 0;
+    m_position.end = 0;
+}
+
+HTTP_Stream::~HTTP_Stream()
+{
+}
+
+Input_Stream_Position HTTP_Stream::position()
+{
+    return m_position;
+}
+
+CFStringRef HTTP_Stream::contentType()
+{
+    return m_contentType;
+}
+
+size_t HTTP_Stream::contentLength()
+{
+    return m_contentLength;
+}
+
+size_t HTTP_Stream::totalLength()
+{
+    return m_totalLength;
+}
+
+bool HTTP_Stream::open()
+{
+    return false;
+}
+
+bool HTTP_Stream::open(const Input_Stream_Position& position)
+{
+    return false;
+}
+
+void HTTP_Stream::close()
+{
+}
+
+void HTTP_Stream::setScheduledInRunLoop(bool scheduledInRunLoop)
+{
+    m_scheduledInRunLoop = scheduledInRunLoop;
+}
+
+void HTTP_Stream::setUrl(CFURLRef url)
+{
+    m_url = url;
+}
+
+bool HTTP_Stream::canHandleUrl(CFURLRef url)
+{
+    return false;
+}
+
+void HTTP_Stream::id3metaDataAvailable(Meta_Data&& metaData)
+{
+}
+
+void HTTP_Stream::icyMetaDataAvailable(Meta_Data&& metaData)
+{
+}
+
+} // namespace astreamer
@@ -0,0 +1,532 @@
+/*
+ * The incremental ID3v2 parser: the same fields from ID3v2.2, 2.3 and
+ * 2.4 tags, a throughput benchmark against buffering the tag byte by
+ * byte, and a fuzz corpus of malformed and mutated tags fed in reads of
+ * random sizes.
+ *
+ * A Linux port of Id3ParserTests.mm.
+ */
+
+#include "bench.h"
+
+#include "id3_parser.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace astreamer;
+
+typedef std::vector<UInt8> bytes_t;
+
+static unsigned nextRandom(unsigned *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7fff;
+}
+
+static void appendSyncsafe(bytes_t *out, UInt32 value)
+{
+    out->push_back((value >> 21) & 0x7f);
+    out->push_back((value >> 14) & 0x7f);
+    out->push_back((value >> 7) & 0x7f);
+    out->push_back(value & 0x7f);
+}
+
+static void appendBigEndian(bytes_t *out, UInt32 value, unsigned numBytes)
+{
+    for (unsigned i = numBytes; i > 0; i--) {
+        out->push_back((value >> ((i - 1) * 8)) & 0xff);
+    }
+}
+
+/* A zero byte after every 0xFF, so no false frame sync remains */
+static bytes_t unsynchronise(const bytes_t& data)
+{
+    bytes_t out;
+
+    for (size_t i = 0; i < data.size(); i++) {
+        out.push_back(data[i]);
+
+        if (data[i] == 0xff) {
+            out.push_back(0);
+        }
+    }
+    return out;
+}
+
+static bytes_t textContent(const char *text)
+{
+    const size_t length = strlen(text);
+
+    bytes_t content(1 + length, 0);     // ISO-8859-1
+    memcpy(content.data() + 1, text, length);
+    return content;
+}
+
+static bytes_t pictureContent(UInt8 version, size_t pictureSize)
+{
+    // ID3v2.2 has a three letter image format instead of the MIME type
+    const char v22Header[] = "JPG\x03" "Cover\0";
+    const char header[] = "image/jpeg\0\x03" "Cover\0";
+
+    bytes_t content(1, 0);
+
+    if (version == 2) {
+        content.insert(content.end(), (const UInt8 *)v22Header, (const UInt8 *)v22Header + sizeof(v22Header) - 1);
+    } else {
+        content.insert(content.end(), (const UInt8 *)header, (const UInt8 *)header + sizeof(header) - 1);
+    }
+
+    for (size_t i = 0; i < pictureSize; i++) {
+        content.push_back((UInt8)(i * 13));
+    }
+    return content;
+}
+
+static void appendFrame(bytes_t *body, UInt8 version, const char *frameId, const bytes_t& content)
+{
+    if (version == 2) {
+        body->insert(body->end(), frameId, frameId + 3);
+        appendBigEndian(body, (UInt32)content.size(), 3);
+    } else {
+        body->insert(body->end(), frameId, frameId + 4);
+
+        if (version == 4) {
+            // Only ID3v2.4 has synchsafe frame sizes
+            appendSyncsafe(body, (UInt32)content.size());
+        } else {
+            appendBigEndian(body, (UInt32)content.size(), 4);
+        }
+        body->push_back(0);
+        body->push_back(0);
+    }
+    body->insert(body->end(), content.begin(), content.end());
+}
+
+enum {
+    kTagUnsynchronised = 0x80,
+    kTagExtendedHeader = 0x40,
+    kTagFooter = 0x10
+};
+
+/* Title, artist and album; a picture too if pictureSize > 0 */
+static bytes_t buildTag(UInt8 version, UInt8 flags, const char *title, size_t pictureSize)
+{
+    static const char *frameIds[2][4] = {
+        { "TT2", "TP1", "TAL", "PIC" },
+        { "TIT2", "TPE1", "TALB", "APIC" }
+    };
+    const char **ids = frameIds[version == 2 ? 0 : 1];
+
+    bytes_t body;
+
+    if (flags & kTagExtendedHeader) {
+        if (version == 4) {
+            // The size includes itself; one flag byte, no flags set
+            appendSyncsafe(&body, 6);
+            body.push_back(1);
+            body.push_back(0);
+        } else {
+            // The size excludes itself; the flags and the padding size
+            appendBigEndian(&body, 6, 4);
+            appendBigEndian(&body, 0, 4);
+            appendBigEndian(&body, 0, 2);
+        }
+    }
+
+    bytes_t contents[4] = {
+        textContent(title),
+        textContent("Mot\xF6rhead"),
+        textContent("Ace of Spades \xFF\xFE"),
+        pictureContent(version, pictureSize)
+    };
+
+    for (unsigned i = 0; i < (pictureSize > 0 ? 4 : 3); i++) {
+        // ID3v2.4 unsynchronises the frames one by one
+        appendFrame(&body, version, ids[i], (version == 4 && (flags & kTagUnsynchronised) ?
+                                             unsynchronise(contents[i]) : contents[i]));
+    }
+
+    body.insert(body.end(), 64, 0);      // padding
+
+    if (version != 4 && (flags & kTagUnsynchronised)) {
+        body = unsynchronise(body);
+    }
+
+    const char *magic = "ID3";
+
+    bytes_t tag(magic, magic + 3);
+    tag.push_back(version);
+    tag.push_back(0);
+    tag.push_back(flags);
+    appendSyncsafe(&tag, (UInt32)body.size());
+    tag.insert(tag.end(), body.begin(), body.end());
+
+    if (version == 4 && (flags & kTagFooter)) {
+        const char *footerMagic = "3DI";
+
+        tag.insert(tag.end(), footerMagic, footerMagic + 3);
+        tag.push_back(version);
+        tag.push_back(0);
+        tag.push_back(flags);
+        appendSyncsafe(&tag, (UInt32)(body.size()));
+    }
+    return tag;
+}
+
+class Recording_Delegate : public ID3_Parser_Delegate, public ID3_Parser_Picture_Sink {
+public:
+    Meta_Data m_metaData;
+    unsigned m_deliveries;
+    size_t m_pictureBytes;
+    unsigned m_picturesBegun;
+    unsigned m_picturesComplete;
+    bool m_pictureOpen;
+    unsigned m_errors;
+
+    Recording_Delegate() :
+        m_deliveries(0),
+        m_pictureBytes(0),
+        m_picturesBegun(0),
+        m_picturesComplete(0),
+        m_pictureOpen(false),
+        m_errors(0)
+    {
+    }
+
+    void id3metaDataAvailable(Meta_Data&& metaData)
+    {
+        for (size_t i = 0; i < metaData.count(); i++) {
+            if (!metaData.keyAt(i) || !metaData.valueAt(i)) {
+                m_errors++;
+            }
+        }
+        m_metaData = std::move(metaData);
+        m_deliveries++;
+    }
+
+    void id3pictureBegin(CFStringRef mimeType, UInt8 pictureType)
+    {
+        if (m_pictureOpen) {
+            m_errors++;
+        }
+        m_pictureOpen = true;
+        m_picturesBegun++;
+    }
+
+    void id3pictureData(const UInt8 *data, size_t numBytes)
+    {
+        if (!m_pictureOpen) {
+            m_errors++;
+        }
+        m_pictureBytes += numBytes;
+    }
+
+    void id3pictureEnd(bool complete)
+    {
+        if (!m_pictureOpen) {
+            m_errors++;
+        }
+        m_pictureOpen = false;
+
+        if (complete) {
+            m_picturesComplete++;
+        }
+    }
+};
+
+/* Feeds the tag and a bit of audio after it, in reads of up to maxRead bytes (all at once if 0) */
+static void parse(const bytes_t& tag, size_t maxRead, unsigned seed, Recording_Delegate *delegate)
+{
+    ID3_Parser parser;
+    parser.m_delegate = delegate;
+    parser.m_pictureSink = delegate;
+
+    bytes_t stream(tag);
+    stream.insert(stream.end(), 4096, 0xff);
+
+    size_t offset = 0;
+
+    while (offset < stream.size() && parser.wantData()) {
+        size_t n = (maxRead > 0 ? 1 + nextRandom(&seed) % maxRead : stream.size());
+
+        if (n > stream.size() - offset) {
+            n = stream.size() - offset;
+        }
+
+        // The parser may not write into the caller's buffer
+        bytes_t read(stream.begin() + offset, stream.begin() + offset + n);
+
+        parser.feedData(&read[0], (UInt32)n);
+
+        if (memcmp(&read[0], &stream[offset], n) != 0) {
+            delegate->m_errors++;
+        }
+        offset += n;
+    }
+}
+
+static bool equalValue(const Meta_Data& metaData, CFStringRef key, const char *expected)
+{
+    CFStringRef value = metaData.value(key);
+
+    if (!value) {
+        return false;
+    }
+
+    CFStringRef expectedValue = CFStringCreateWithBytes(kCFAllocatorDefault,
+                                                        (const UInt8 *)expected,
+                                                        strlen(expected),
+                                                        kCFStringEncodingISOLatin1,
+                                                        false);
+
+    const bool equal = (CFStringCompare(value, expectedValue, 0) == kCFCompareEqualTo);
+
+    CFRelease(expectedValue);
+
+    return equal;
+}
+
+static bool equalRecords(const Meta_Data& a, const Meta_Data& b)
+{
+    if (a.count() != b.count()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.count(); i++) {
+        CFStringRef value = b.value(a.keyAt(i));
+
+        if (!value || CFStringCompare(value, a.valueAt(i), 0) != kCFCompareEqualTo) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The former ID3_Parser_Private::feedData(): every byte pushed into the tag buffer */
+class Byte_Vector_Collector {
+public:
+    std::vector<UInt8> m_tagData;
+    size_t m_tagSize;
+
+    Byte_Vector_Collector(size_t tagSize) : m_tagSize(tagSize) {}
+
+    bool wantData()
+    {
+        return m_tagData.size() < m_tagSize;
+    }
+
+    void feedData(UInt8 *data, UInt32 numBytes)
+    {
+        for (CFIndex i = 0; i < numBytes && wantData(); i++) {
+            m_tagData.push_back(data[i]);
+        }
+    }
+};
+
+static void testAllVersionsYieldTheSameFields()
+{
+    // A 300 byte title: the ID3v2.3 frame size has bit 7 set in its last byte
+    char longTitle[301];
+    memset(longTitle, 'x', 300);
+    longTitle[300] = 0;
+
+    const struct {
+        UInt8 version;
+        UInt8 flags;
+        const char *title;
+    } tags[] = {
+        { 2, 0, "Ace of Spades" },
+        { 2, kTagUnsynchronised, "Ace of Spades" },
+        { 3, 0, longTitle },
+        { 3, kTagUnsynchronised | kTagExtendedHeader, "Ace of Spades" },
+        { 4, 0, longTitle },
+        { 4, kTagUnsynchronised | kTagExtendedHeader | kTagFooter, "Ace of Spades" }
+    };
+
+    for (unsigned i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        const bytes_t tag = buildTag(tags[i].version, tags[i].flags, tags[i].title, 100000);
+
+        for (size_t maxRead = 0; maxRead <= 64; maxRead += 7) {
+            Recording_Delegate delegate;
+
+            parse(tag, maxRead, i + 1, &delegate);
+
+            BENCH_CHECK_EQUAL(delegate.m_errors, (unsigned)0);
+            BENCH_CHECK_EQUAL(delegate.m_metaData.count(), (size_t)3);
+            BENCH_CHECK(equalValue(delegate.m_metaData, CFSTR("MPMediaItemPropertyTitle"), tags[i].title));
+            BENCH_CHECK(equalValue(delegate.m_metaData, CFSTR("MPMediaItemPropertyArtist"), "Mot\xF6rhead"));
+            BENCH_CHECK(equalValue(delegate.m_metaData, CFSTR("MPMediaItemPropertyAlbumTitle"), "Ace of Spades \xFF\xFE"));
+
+            // The unsynchronised ID3v2.4 pictures are skipped, not streamed
+            const bool streamed = !(tags[i].version == 4 && (tags[i].flags & kTagUnsynchronised));
+
+            BENCH_CHECK_EQUAL(delegate.m_picturesComplete, (unsigned)(streamed ? 1 : 0));
+            BENCH_CHECK_EQUAL(delegate.m_pictureBytes, (size_t)(streamed ? 100000 : 0));
+        }
+    }
+}
+
+static void testThroughput()
+{
+    // Typical of a podcast episode: the text frames and a large cover picture
+    const bytes_t tag = buildTag(3, 0, "Ace of Spades", 4 * 1024 * 1024);
+
+    const size_t kReadSize = 1024;
+    const unsigned kPasses = 8;
+
+    bytes_t read(kReadSize);
+    size_t checksum = 0;
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+    for (unsigned pass = 0; pass < kPasses; pass++) {
+        Byte_Vector_Collector collector(tag.size());
+
+        for (size_t offset = 0; offset < tag.size() && collector.wantData(); offset += kReadSize) {
+            const size_t n = std::min(kReadSize, tag.size() - offset);
+
+            memcpy(&read[0], &tag[offset], n);
+            collector.feedData(&read[0], (UInt32)n);
+        }
+        checksum += collector.m_tagData.size();
+    }
+
+    const double byteVectorTime = CFAbsoluteTimeGetCurrent() - start;
+
+    start = CFAbsoluteTimeGetCurrent();
+
+    for (unsigned pass = 0; pass < kPasses; pass++) {
+        Recording_Delegate delegate;
+
+        ID3_Parser parser;
+        parser.m_delegate = &delegate;
+        parser.m_pictureSink = &delegate;
+
+        for (size_t offset = 0; offset < tag.size() && parser.wantData(); offset += kReadSize) {
+            const size_t n = std::min(kReadSize, tag.size() - offset);
+
+            memcpy(&read[0], &tag[offset], n);
+            parser.feedData(&read[0], (UInt32)n);
+        }
+        checksum += delegate.m_pictureBytes + delegate.m_metaData.count();
+    }
+
+    const double parserTime = CFAbsoluteTimeGetCurrent() - start;
+
+    const double megabytes = kPasses * tag.size() / (1024.0 * 1024.0);
+
+    printf("ID3 tag, %zu byte reads: byte vector %.0f MB/s, parser %.0f MB/s (%zu)\n",
+          kReadSize,
+          megabytes / byteVectorTime,
+          megabytes / parserTime,
+          checksum);
+
+    BENCH_CHECK_GREATER(checksum, kPasses * tag.size());
+    BENCH_CHECK_LESS(parserTime * 2, byteVectorTime);
+}
+
+static void testMalformedTags()
+{
+    bytes_t corpus[] = {
+        // Truncated and invalid tag headers
+        bytes_t((const UInt8 *)"ID3", (const UInt8 *)"ID3" + 3),
+        bytes_t((const UInt8 *)"ID3\x05\x00\x00\x00\x00\x01\x00", (const UInt8 *)"ID3\x05\x00\x00\x00\x00\x01\x00" + 10),
+        bytes_t((const UInt8 *)"ID3\x03\x00\x00\x80\x00\x00\x00", (const UInt8 *)"ID3\x03\x00\x00\x80\x00\x00\x00" + 10),
+        bytes_t((const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x00", (const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x00" + 10),
+        // A frame larger than the tag
+        bytes_t((const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x14TIT2\x7f\xff\xff\xff\x00\x00\x00" "abcdefghi",
+                (const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x14TIT2\x7f\xff\xff\xff\x00\x00\x00" "abcdefghi" + 30),
+        // An invalid frame ID
+        bytes_t((const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x14ti\x01" "2\x00\x00\x00\x02\x00\x00\x00" "a" "abcdefghi",
+                (const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x14ti\x01" "2\x00\x00\x00\x02\x00\x00\x00" "a" "abcdefghi" + 30),
+        // An extended header larger than the tag
+        bytes_t((const UInt8 *)"ID3\x03\x00\x40\x00\x00\x00\x14\xff\xff\xff\xff" "abcdefghijklmnop",
+                (const UInt8 *)"ID3\x03\x00\x40\x00\x00\x00\x14\xff\xff\xff\xff" "abcdefghijklmnop" + 30),
+        // An ID3v2.4 extended header smaller than itself
+        bytes_t((const UInt8 *)"ID3\x04\x00\x40\x00\x00\x00\x14\x00\x00\x00\x01" "abcdefghijklmnop",
+                (const UInt8 *)"ID3\x04\x00\x40\x00\x00\x00\x14\x00\x00\x00\x01" "abcdefghijklmnop" + 30),
+        // ID3v2.4 data length indicator and grouping flags on a 2 byte frame
+        bytes_t((const UInt8 *)"ID3\x04\x00\x00\x00\x00\x00\x14TIT2\x00\x00\x00\x02\x00\x41\x03" "a" "abcdefghi",
+                (const UInt8 *)"ID3\x04\x00\x00\x00\x00\x00\x14TIT2\x00\x00\x00\x02\x00\x41\x03" "a" "abcdefghi" + 30),
+        // An unknown text encoding and an odd length UTF-16 text
+        bytes_t((const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x14TIT2\x00\x00\x00\x03\x00\x00\x07" "abTPE1\x00\x00\x00\x02\x00\x00\x01\xff",
+                (const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x14TIT2\x00\x00\x00\x03\x00\x00\x07" "abTPE1\x00\x00\x00\x02\x00\x00\x01\xff" + 35),
+        // A picture header without terminators
+        bytes_t((const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x14" "APIC\x00\x00\x00\x0a\x00\x00\x00image/jpeg",
+                (const UInt8 *)"ID3\x03\x00\x00\x00\x00\x00\x14" "APIC\x00\x00\x00\x0a\x00\x00\x00image/jpeg" + 30),
+        // A tag ending in the middle of an unsynchronised 0xFF
+        bytes_t((const UInt8 *)"ID3\x03\x00\x80\x00\x00\x00\x0cTIT2\x00\x00\x00\x02\x00\x00\x00\xff",
+                (const UInt8 *)"ID3\x03\x00\x80\x00\x00\x00\x0cTIT2\x00\x00\x00\x02\x00\x00\x00\xff" + 22)
+    };
+
+    for (unsigned i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+        Recording_Delegate whole, pieces;
+
+        parse(corpus[i], 0, i, &whole);
+        parse(corpus[i], 3, i, &pieces);
+
+        BENCH_CHECK_EQUAL(whole.m_errors, (unsigned)0);
+        BENCH_CHECK_EQUAL(pieces.m_errors, (unsigned)0);
+        BENCH_CHECK(!whole.m_pictureOpen);
+        BENCH_CHECK(equalRecords(whole.m_metaData, pieces.m_metaData));
+    }
+}
+
+static void testMutatedTags()
+{
+    const bytes_t templates[] = {
+        buildTag(2, 0, "Ace of Spades", 300),
+        buildTag(3, kTagUnsynchronised | kTagExtendedHeader, "Ace of Spades", 300),
+        buildTag(4, kTagExtendedHeader | kTagFooter, "Ace of Spades", 300),
+        buildTag(4, kTagUnsynchronised, "Ace of Spades", 300)
+    };
+
+    unsigned seed = 1;
+    unsigned mutations = 0;
+
+    for (unsigned t = 0; t < sizeof(templates) / sizeof(templates[0]); t++) {
+        for (unsigned round = 0; round < 5000; round++) {
+            bytes_t tag(templates[t]);
+
+            // Most of the structure is in the headers at the front
+            const unsigned changes = 1 + nextRandom(&seed) % 8;
+
+            for (unsigned c = 0; c < changes; c++) {
+                const size_t range = (nextRandom(&seed) & 1 ? 64 : tag.size());
+                const size_t pos = nextRandom(&seed) % std::min(range, tag.size());
+
+                switch (nextRandom(&seed) % 4) {
+                    case 0: tag[pos] ^= (UInt8)(1 << (nextRandom(&seed) % 8)); break;
+                    case 1: tag[pos] = 0xff; break;
+                    case 2: tag[pos] = 0; break;
+                    default: tag.resize(std::max(pos, (size_t)1)); break;
+                }
+            }
+
+            Recording_Delegate whole, pieces;
+
+            parse(tag, 0, round, &whole);
+            parse(tag, 1 + round % 97, round, &pieces);
+
+            // However broken the tag, reads of any size give the same result
+            BENCH_CHECK_EQUAL(whole.m_errors + pieces.m_errors, (unsigned)0);
+            BENCH_CHECK_EQUAL(whole.m_pictureBytes, pieces.m_pictureBytes);
+            BENCH_CHECK_EQUAL(whole.m_picturesComplete, pieces.m_picturesComplete);
+            BENCH_CHECK(equalRecords(whole.m_metaData, pieces.m_metaData));
+
+            mutations++;
+        }
+    }
+
+    printf("%u mutated tags parsed\n", mutations);
+}
+
+int main(int argc, char **argv)
+{
+    BENCH_RUN(testAllVersionsYieldTheSameFields);
+    BENCH_RUN(testThroughput);
+    BENCH_RUN(testMalformedTags);
+    BENCH_RUN(testMutatedTags);
+
+    return bench::result();
+}
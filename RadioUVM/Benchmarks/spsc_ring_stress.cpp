@@ -0,0 +1,231 @@
+/*
+ * Stress tests for the lock-free ring between the network, decode and
+ * owner threads: a producer and a consumer thread hammer a small ring
+ * with odd sized transfers and the consumer checks every byte.
+ *
+ * A Linux port of SpscRingTests.mm.
+ */
+
+#include "bench.h"
+
+#include "spsc_ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+using namespace astreamer;
+
+typedef struct {
+    Spsc_Ring *ring;
+    UInt64 totalBytes;
+    unsigned seed;
+    bool useRegions;        // the decode thread reads in place
+    UInt64 mismatches;
+    UInt64 stalls;
+} stress_t;
+
+static unsigned nextRandom(unsigned *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7fff;
+}
+
+/* The byte at a stream position; a prime period so wraps don't line up */
+static UInt8 patternByte(UInt64 position)
+{
+    return (UInt8)((position * 7 + position / 251) & 0xff);
+}
+
+static void *producerMain(void *arg)
+{
+    stress_t *s = (stress_t *)arg;
+    unsigned seed = s->seed;
+    UInt8 chunk[4096];
+    UInt64 position = 0;
+
+    while (position < s->totalBytes) {
+        size_t n = 1 + nextRandom(&seed) % sizeof(chunk);
+
+        if (n > s->totalBytes - position) {
+            n = (size_t)(s->totalBytes - position);
+        }
+        for (size_t i = 0; i < n; i++) {
+            chunk[i] = patternByte(position + i);
+        }
+
+        size_t written = 0;
+
+        while (written < n) {
+            size_t w = s->ring->write(chunk + written, n - written);
+
+            if (w == 0) {
+                s->stalls++;
+                sched_yield();
+            }
+            written += w;
+        }
+        position += n;
+    }
+    return NULL;
+}
+
+static void *consumerMain(void *arg)
+{
+    stress_t *s = (stress_t *)arg;
+    unsigned seed = s->seed * 31 + 7;
+    UInt8 chunk[4096];
+    UInt64 position = 0;
+
+    while (position < s->totalBytes) {
+        if (s->useRegions && (nextRandom(&seed) & 1)) {
+            const void *data;
+            size_t n = s->ring->readRegion(&data);
+
+            if (n > 0) {
+                // Leave some behind now and then, like a parser stopping mid-region
+                size_t take = 1 + nextRandom(&seed) % n;
+
+                for (size_t i = 0; i < take; i++) {
+                    if (((const UInt8 *)data)[i] != patternByte(position + i)) {
+                        s->mismatches++;
+                    }
+                }
+                s->ring->readAdvance(take);
+                position += take;
+                continue;
+            }
+        } else {
+            size_t n = s->ring->read(chunk, 1 + nextRandom(&seed) % sizeof(chunk));
+
+            for (size_t i = 0; i < n; i++) {
+                if (chunk[i] != patternByte(position + i)) {
+                    s->mismatches++;
+                }
+            }
+            position += n;
+
+            if (n > 0) {
+                continue;
+            }
+        }
+        sched_yield();
+    }
+    return NULL;
+}
+
+static void runStress(size_t capacity, UInt64 totalBytes, bool useRegions, stress_t *s)
+{
+    Spsc_Ring ring(capacity);
+
+    s->ring = &ring;
+    s->totalBytes = totalBytes;
+    s->useRegions = useRegions;
+    s->mismatches = 0;
+    s->stalls = 0;
+
+    pthread_t producer, consumer;
+
+    const CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+    pthread_create(&consumer, NULL, consumerMain, s);
+    pthread_create(&producer, NULL, producerMain, s);
+
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    const double elapsed = CFAbsoluteTimeGetCurrent() - start;
+
+    printf("ring %zu bytes, %s: %llu MB in %.2f s, %llu producer stalls\n",
+          capacity,
+          (useRegions ? "regions" : "copies"),
+          (unsigned long long)(totalBytes >> 20),
+          elapsed,
+          (unsigned long long)s->stalls);
+
+    BENCH_CHECK_EQUAL(ring.readAvailable(), (size_t)0);
+}
+
+static void testCapacityRoundsUpToAPowerOfTwo()
+{
+    Spsc_Ring ring(1000);
+
+    BENCH_CHECK_EQUAL(ring.capacity(), (size_t)1024);
+    BENCH_CHECK_EQUAL(ring.writeAvailable(), (size_t)1024);
+}
+
+static void testWrapAroundKeepsTheOrder()
+{
+    Spsc_Ring ring(16);
+    UInt8 in[12], out[12];
+
+    for (unsigned round = 0; round < 10; round++) {
+        for (unsigned i = 0; i < sizeof(in); i++) {
+            in[i] = (UInt8)(round * 16 + i);
+        }
+
+        BENCH_CHECK_EQUAL(ring.write(in, sizeof(in)), sizeof(in));
+
+        // Only what fits is taken
+        BENCH_CHECK_EQUAL(ring.write(in, sizeof(in)), (size_t)4);
+        BENCH_CHECK_EQUAL(ring.writeAvailable(), (size_t)0);
+
+        BENCH_CHECK_EQUAL(ring.read(out, sizeof(out)), sizeof(out));
+        BENCH_CHECK_EQUAL(memcmp(in, out, sizeof(in)), 0);
+
+        // The region stops at the end of the storage
+        const void *data;
+        size_t n = ring.readRegion(&data);
+
+        BENCH_CHECK_GREATER(n, (size_t)0);
+        BENCH_CHECK_LESS_EQUAL(n, (size_t)4);
+
+        ring.readAdvance(n);
+
+        if (ring.readAvailable() > 0) {
+            ring.readAdvance(ring.readAvailable());
+        }
+        BENCH_CHECK_EQUAL(ring.readAvailable(), (size_t)0);
+    }
+}
+
+static void testStressWithCopies()
+{
+    stress_t s;
+    s.seed = 1;
+
+    runStress(4096, 64ULL << 20, false, &s);
+
+    BENCH_CHECK_EQUAL(s.mismatches, (UInt64)0);
+}
+
+static void testStressWithRegions()
+{
+    stress_t s;
+    s.seed = 2;
+
+    runStress(4096, 64ULL << 20, true, &s);
+
+    BENCH_CHECK_EQUAL(s.mismatches, (UInt64)0);
+}
+
+static void testStressWithATinyRing()
+{
+    // Every transfer wraps and most of them find the ring full or empty
+    stress_t s;
+    s.seed = 3;
+
+    runStress(64, 8ULL << 20, true, &s);
+
+    BENCH_CHECK_EQUAL(s.mismatches, (UInt64)0);
+}
+
+int main(int argc, char **argv)
+{
+    BENCH_RUN(testCapacityRoundsUpToAPowerOfTwo);
+    BENCH_RUN(testWrapAroundKeepsTheOrder);
+    BENCH_RUN(testStressWithCopies);
+    BENCH_RUN(testStressWithRegions);
+    BENCH_RUN(testStressWithATinyRing);
+
+    return bench::result();
+}
@@ -0,0 +1,490 @@
+/*
+ * 200 recorders of 128 kbit/s stations on one event loop, against a
+ * stand-in Shoutcast server on the loopback interface: every station
+ * must be recorded in full, and the recorders, with all the threads
+ * they use, must take well under one core.
+ *
+ * A Linux port of StreamRecorderTests.mm.
+ */
+
+#include "bench.h"
+
+#include "stream_recorder.h"
+#include "stream_configuration.h"
+#include "meta_data.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace astreamer;
+
+enum {
+    kStations = 200,
+    kBytesPerSecond = 16000,        // 128 kbit/s
+    kMetaDataInterval = 16000,      // a title update every second
+    kRecordingSeconds = 5
+};
+
+/* The byte at a stream position of a station */
+static UInt8 stationByte(unsigned station, UInt64 position)
+{
+    return (UInt8)(position * 31 + station * 7 + position / 997);
+}
+
+/*
+ * Streams to any number of listeners at the bit rate of a station, from
+ * its own thread. The station is the number in the request path.
+ */
+class Stand_In_Server {
+public:
+    Stand_In_Server() :
+        m_port(0),
+        m_cpuTime(0),
+        m_socket(-1),
+        m_stopping(false)
+    {
+    }
+
+    bool start()
+    {
+        m_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (m_socket < 0) {
+            return false;
+        }
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+
+        socklen_t length = sizeof(address);
+
+        if (bind(m_socket, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+            listen(m_socket, kStations) != 0 ||
+            getsockname(m_socket, (struct sockaddr *)&address, &length) != 0) {
+            return false;
+        }
+
+        fcntl(m_socket, F_SETFL, fcntl(m_socket, F_GETFL) | O_NONBLOCK);
+
+        m_port = ntohs(address.sin_port);
+
+        return (pthread_create(&m_thread, NULL, threadMain, this) == 0);
+    }
+
+    void stop()
+    {
+        __sync_synchronize();
+        m_stopping = true;
+
+        pthread_join(m_thread, NULL);
+
+        for (std::vector<Listener>::iterator l = m_listeners.begin(); l != m_listeners.end(); ++l) {
+            close(l->fd);
+        }
+        close(m_socket);
+    }
+
+    unsigned m_port;
+    volatile double m_cpuTime;      // of the server thread, to tell it apart from the recorders
+
+private:
+    struct Listener {
+        int fd;
+        unsigned station;
+        bool streaming;
+        std::string request;
+        UInt64 position;            // the audio bytes generated
+        unsigned titles;
+        std::string pending;        // generated but not sent yet
+        CFAbsoluteTime startTime;
+    };
+
+    int m_socket;
+    volatile bool m_stopping;
+    pthread_t m_thread;
+    std::vector<Listener> m_listeners;
+
+    void acceptListeners()
+    {
+        for (;;) {
+            const int fd = accept(m_socket, NULL, NULL);
+
+            if (fd < 0) {
+                return;
+            }
+
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#if defined (SO_NOSIGPIPE)
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+            Listener listener;
+            listener.fd = fd;
+            listener.station = 0;
+            listener.streaming = false;
+            listener.position = 0;
+            listener.titles = 0;
+            listener.startTime = 0;
+
+            m_listeners.push_back(listener);
+        }
+    }
+
+    void readRequest(Listener *listener)
+    {
+        char buf[1024];
+        ssize_t n;
+
+        while ((n = recv(listener->fd, buf, sizeof(buf), 0)) > 0) {
+            listener->request.append(buf, n);
+        }
+
+        if (listener->request.find("\r\n\r\n") == std::string::npos) {
+            return;
+        }
+
+        listener->station = (unsigned)strtoul(listener->request.c_str() + strlen("GET /"), NULL, 10);
+        listener->streaming = true;
+        listener->startTime = CFAbsoluteTimeGetCurrent();
+
+        char headers[256];
+        snprintf(headers, sizeof(headers),
+                 "ICY 200 OK\r\nicy-name: Station %u\r\nContent-Type: audio/mpeg\r\nicy-metaint: %u\r\n\r\n",
+                 listener->station,
+                 kMetaDataInterval);
+
+        listener->pending = headers;
+    }
+
+    void generate(Listener *listener, CFAbsoluteTime now)
+    {
+        const UInt64 due = (UInt64)((now - listener->startTime) * kBytesPerSecond);
+
+        while (listener->position < due) {
+            const UInt64 intervalEnd = (listener->position / kMetaDataInterval + 1) * kMetaDataInterval;
+            const UInt64 end = std::min(due, intervalEnd);
+
+            for (UInt64 p = listener->position; p < end; p++) {
+                listener->pending += (char)stationByte(listener->station, p);
+            }
+            listener->position = end;
+
+            if (end < intervalEnd) {
+                break;
+            }
+
+            char text[64];
+            const int length = snprintf(text, sizeof(text), "StreamTitle='Station %u - Song %u';",
+                                        listener->station, listener->titles++);
+            const size_t blocks = (length + 15) / 16;
+
+            listener->pending += (char)blocks;
+            listener->pending.append(text, length);
+            listener->pending.append(blocks * 16 - length, 0);
+        }
+    }
+
+    static void *threadMain(void *info)
+    {
+        Stand_In_Server *THIS = (Stand_In_Server *)info;
+
+        while (!THIS->m_stopping) {
+            usleep(20000);
+
+            THIS->acceptListeners();
+
+            const CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+
+            for (std::vector<Listener>::iterator l = THIS->m_listeners.begin(); l != THIS->m_listeners.end(); ++l) {
+                if (!l->streaming) {
+                    THIS->readRequest(&*l);
+                } else {
+                    THIS->generate(&*l, now);
+                }
+
+                if (l->pending.empty()) {
+                    continue;
+                }
+
+#if defined (MSG_NOSIGNAL)
+                const ssize_t n = send(l->fd, l->pending.data(), l->pending.size(), MSG_NOSIGNAL);
+#else
+                const ssize_t n = send(l->fd, l->pending.data(), l->pending.size(), 0);
+#endif
+
+                if (n > 0) {
+                    l->pending.erase(0, n);
+                }
+            }
+
+            struct timespec ts;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+            THIS->m_cpuTime = ts.tv_sec + ts.tv_nsec / 1e9;
+        }
+        return NULL;
+    }
+};
+
+class Counting_Delegate : public Stream_Recorder_Delegate {
+public:
+    unsigned m_metaData;
+    unsigned m_ends;
+    unsigned m_errors;
+
+    Counting_Delegate() : m_metaData(0), m_ends(0), m_errors(0) {}
+
+    void streamRecorderMetaDataAvailable(Stream_Recorder *recorder, Meta_Data&& metaData)
+    {
+        m_metaData++;
+    }
+
+    void streamRecorderEndEncountered(Stream_Recorder *recorder)
+    {
+        m_ends++;
+    }
+
+    void streamRecorderErrorOccurred(Stream_Recorder *recorder)
+    {
+        m_errors++;
+    }
+};
+
+static CFURLRef createUrl(const char *format, const char *a, unsigned b)
+{
+    char url[1024];
+    snprintf(url, sizeof(url), format, a, b);
+
+    CFStringRef urlString = CFStringCreateWithCString(kCFAllocatorDefault, url, kCFStringEncodingUTF8);
+    CFURLRef urlRef = CFURLCreateWithString(kCFAllocatorDefault, urlString, NULL);
+
+    CFRelease(urlString);
+
+    return urlRef;
+}
+
+/* The CPU time of the whole process, the writer and the resolver threads too, but not the server */
+static double recorderCpuTime(Stand_In_Server *server)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9 - server->m_cpuTime;
+}
+
+static void test200StationsOnOneEventLoop()
+{
+    // A socket and an output file for each recorder, and a socket for each at the server
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+
+    if (limit.rlim_cur < 4 * kStations) {
+        limit.rlim_cur = std::min((rlim_t)(4 * kStations), limit.rlim_max);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // The read size of FSAudioStream
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    const unsigned savedReadBufferSize = config->httpConnectionBufferSize;
+
+    config->httpConnectionBufferSize = 1024;
+
+    Stand_In_Server server;
+
+    BENCH_CHECK(server.start());
+
+    char port[16];
+    snprintf(port, sizeof(port), "%u", server.m_port);
+
+    const char *tmp = (getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp/");
+    std::string directory(tmp);
+
+    if (directory[directory.size() - 1] != '/') {
+        directory += '/';
+    }
+
+    Event_Loop *eventLoop = Event_Loop::create();
+    Counting_Delegate delegate;
+    std::vector<Stream_Recorder *> recorders;
+
+    for (unsigned i = 0; i < kStations; i++) {
+        Stream_Recorder *recorder = new Stream_Recorder(eventLoop);
+        recorder->m_delegate = &delegate;
+
+        CFURLRef url = createUrl("http://127.0.0.1:%s/%u", port, i);
+        CFURLRef file = createUrl("file://%srecorder-%u.mp3", directory.c_str(), i);
+
+        recorder->setUrl(url);
+        recorder->setOutputFile(file);
+
+        CFRelease(url);
+        CFRelease(file);
+
+        BENCH_CHECK(recorder->start());
+
+        recorders.push_back(recorder);
+    }
+
+    const double cpuStart = recorderCpuTime(&server);
+    const CFAbsoluteTime end = CFAbsoluteTimeGetCurrent() + kRecordingSeconds;
+
+    while (CFAbsoluteTimeGetCurrent() < end) {
+        eventLoop->runOnce(100);
+    }
+
+    const double cpu = recorderCpuTime(&server) - cpuStart;
+
+    UInt64 received = 0;
+    UInt64 minReceived = UINT64_MAX;
+    unsigned errors = 0, reconnects = 0;
+    std::vector<UInt64> written;
+
+    for (unsigned i = 0; i < kStations; i++) {
+        const Stream_Recorder_Stats stats = recorders[i]->stats();
+
+        received += stats.bytesReceived;
+        minReceived = std::min(minReceived, stats.bytesReceived);
+        errors += stats.errors;
+        reconnects += stats.reconnects;
+
+        BENCH_CHECK_EQUAL(stats.bytesSkipped, (UInt64)0);
+        BENCH_CHECK_EQUAL(stats.bytesWritten, stats.bytesReceived);
+
+        written.push_back(stats.bytesWritten);
+    }
+
+    printf("%u stations for %u s: %llu KB received, at least %llu KB per station, %.2f s of CPU (%.0f%% of one core)\n",
+          kStations,
+          kRecordingSeconds,
+          (unsigned long long)(received / 1024),
+          (unsigned long long)(minReceived / 1024),
+          cpu,
+          100 * cpu / kRecordingSeconds);
+
+    // Each station delivers the bytes of its bit rate, less the time to connect
+    BENCH_CHECK_GREATER(minReceived, (UInt64)(kBytesPerSecond * (kRecordingSeconds - 1)));
+    BENCH_CHECK_GREATER_EQUAL(delegate.m_metaData, (unsigned)(kStations * (kRecordingSeconds - 1)));
+    BENCH_CHECK_EQUAL(errors, (unsigned)0);
+    BENCH_CHECK_EQUAL(reconnects, (unsigned)0);
+    BENCH_CHECK_EQUAL(delegate.m_ends, (unsigned)0);
+    BENCH_CHECK_EQUAL(delegate.m_errors, (unsigned)0);
+
+    BENCH_CHECK_LESS(cpu, kRecordingSeconds * 0.5);
+
+    // Deleting a recorder writes out its file
+    for (unsigned i = 0; i < kStations; i++) {
+        delete recorders[i];
+    }
+    delete eventLoop;
+
+    server.stop();
+
+    config->httpConnectionBufferSize = savedReadBufferSize;
+
+    unsigned mismatches = 0;
+
+    for (unsigned i = 0; i < kStations; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%srecorder-%u.mp3", directory.c_str(), i);
+
+        FILE *f = fopen(path, "rb");
+
+        BENCH_CHECK(f != NULL);
+
+        if (!f) {
+            continue;
+        }
+
+        std::vector<UInt8> contents(written[i] + 1);
+        const size_t n = fread(&contents[0], 1, contents.size(), f);
+
+        fclose(f);
+        unlink(path);
+
+        BENCH_CHECK_EQUAL((UInt64)n, written[i]);
+
+        for (size_t p = 0; p < n; p++) {
+            if (contents[p] != stationByte(i, p)) {
+                mismatches++;
+                break;
+            }
+        }
+    }
+
+    BENCH_CHECK_EQUAL(mismatches, (unsigned)0);
+}
+
+static void testUnwritableOutputFileStopsTheRecording()
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    const unsigned savedReadBufferSize = config->httpConnectionBufferSize;
+
+    config->httpConnectionBufferSize = 1024;
+
+    Stand_In_Server server;
+
+    BENCH_CHECK(server.start());
+
+    char port[16];
+    snprintf(port, sizeof(port), "%u", server.m_port);
+
+    Event_Loop *eventLoop = Event_Loop::create();
+    Counting_Delegate delegate;
+
+    Stream_Recorder *recorder = new Stream_Recorder(eventLoop);
+    recorder->m_delegate = &delegate;
+
+    CFURLRef url = createUrl("http://127.0.0.1:%s/%u", port, 0);
+    CFURLRef file = createUrl("file:///%s/recorder-%u.mp3", "no-such-directory", 0);
+
+    recorder->setUrl(url);
+    recorder->setOutputFile(file);
+
+    CFRelease(url);
+    CFRelease(file);
+
+    BENCH_CHECK(recorder->start());
+
+    const CFAbsoluteTime end = CFAbsoluteTimeGetCurrent() + 5;
+
+    while (delegate.m_errors == 0 && CFAbsoluteTimeGetCurrent() < end) {
+        eventLoop->runOnce(100);
+    }
+
+    // Reported once, and not retried like a dropped connection
+    BENCH_CHECK_EQUAL(delegate.m_errors, (unsigned)1);
+    BENCH_CHECK(!recorder->isRecording());
+    BENCH_CHECK_EQUAL(recorder->stats().errors, (unsigned)1);
+    BENCH_CHECK_EQUAL(recorder->stats().reconnects, (unsigned)0);
+
+    delete recorder;
+    delete eventLoop;
+
+    server.stop();
+
+    config->httpConnectionBufferSize = savedReadBufferSize;
+}
+
+int main(int argc, char **argv)
+{
+    BENCH_RUN(test200StationsOnOneEventLoop);
+    BENCH_RUN(testUnwritableOutputFileStopsTheRecording);
+
+    return bench::result();
+}
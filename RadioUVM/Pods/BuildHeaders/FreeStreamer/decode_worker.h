@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/decode_worker.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/event_loop.h
\ No newline at end of file
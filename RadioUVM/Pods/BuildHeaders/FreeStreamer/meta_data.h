@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/meta_data.h
\ No newline at end of file
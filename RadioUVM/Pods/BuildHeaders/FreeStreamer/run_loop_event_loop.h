@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/run_loop_event_loop.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/socket_stream.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/stream_recorder.h
\ No newline at end of file
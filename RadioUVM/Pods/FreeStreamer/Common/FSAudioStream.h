@@ -65,9 +65,18 @@ typedef enum {
     kFsAudioStreamErrorStreamParse = 2,
     kFsAudioStreamErrorNetwork = 3,
     kFsAudioStreamErrorUnsupportedFormat = 4,
-    kFsAudioStreamErrorStreamBouncing = 5
+    kFsAudioStreamErrorStreamBouncing = 5,
+    kFsAudioStreamErrorOutputFile = 6
 } FSAudioStreamError;
 
+/**
+ * The sample format of the decoded PCM audio.
+ */
+typedef enum {
+    kFsSampleFormatInt16 = 0,
+    kFsSampleFormatFloat32 = 1
+} FSSampleFormat;
+
 @protocol FSPCMAudioStreamDelegate;
 @class FSAudioStreamPrivate;
 
@@ -107,7 +116,8 @@ typedef struct {
  */
 @property (nonatomic,assign) unsigned maxPacketDescs;
 /**
- * The decode queue size.
+ * The decode queue size in packets. Used instead of the startup buffer
+ * duration for formats whose packet duration is not known.
  */
 @property (nonatomic,assign) unsigned decodeQueueSize;
 /**
@@ -122,6 +132,10 @@ typedef struct {
  * The number of output channels.
  */
 @property (nonatomic,assign) long     outputNumChannels;
+/**
+ * The sample format of the decoded audio.
+ */
+@property (nonatomic,assign) FSSampleFormat outputSampleFormat;
 /**
  * The interval within the stream may enter to the buffering state before it fails.
  */
@@ -135,9 +149,56 @@ typedef struct {
  */
 @property (nonatomic,assign) int      startupWatchdogPeriod;
 /**
- * Allow buffering of this many bytes before the cache is full.
+ * The number of times a dropped stream is reconnected before it fails.
+ * Content with a known length resumes from the next byte, a live stream
+ * continues from the buffered audio. 0 disables the reconnects.
+ */
+@property (nonatomic,assign) int      maxReconnectCount;
+/**
+ * The milliseconds before the first reconnect. The delay is doubled for
+ * each next reconnect, up to maxReconnectDelayMs.
+ */
+@property (nonatomic,assign) int      reconnectDelayMs;
+/**
+ * The longest delay between the reconnects, in milliseconds.
+ */
+@property (nonatomic,assign) int      maxReconnectDelayMs;
+/**
+ * The milliseconds the name resolution and the connecting of a plain HTTP
+ * stream may take before the connection fails. 0 waits forever.
+ */
+@property (nonatomic,assign) int      connectTimeoutMs;
+/**
+ * A plain HTTP connection which receives no data for this many milliseconds
+ * has stalled and fails, and is reconnected like a dropped one. 0 waits forever.
+ */
+@property (nonatomic,assign) int      readTimeoutMs;
+/**
+ * Allow buffering of this many bytes before the cache is full. Used instead
+ * of the high watermark for formats whose packet duration is not known.
  */
 @property (nonatomic,assign) int      maxPrebufferedByteCount;
+/**
+ * The milliseconds of audio buffered before the playback starts, or resumes
+ * after running out of data.
+ */
+@property (nonatomic,assign) int      startupBufferMs;
+/**
+ * While playing, the milliseconds of audio buffered before the incoming audio is
+ * decoded ahead of the playback. A played buffer is refilled with whatever is
+ * buffered, so this doesn't hold audio back from the playback.
+ */
+@property (nonatomic,assign) int      lowWatermarkMs;
+/**
+ * Once the cache is full, the network is resumed when the buffered audio
+ * drops below this many milliseconds. Keep it well above the low watermark,
+ * so that the cache refills before the playback eats into the lead.
+ */
+@property (nonatomic,assign) int      refillWatermarkMs;
+/**
+ * The milliseconds of audio buffered before the cache is full.
+ */
+@property (nonatomic,assign) int      highWatermarkMs;
 /**
  * The HTTP user agent used for stream operations.
  */
@@ -151,9 +212,27 @@ typedef struct {
  */
 @property (nonatomic,assign) BOOL cacheEnabled;
 /**
- * The maximum size of the disk cache in bytes.
+ * The maximum size of the disk cache in bytes. The least recently used
+ * files are removed as the cache grows over it.
  */
 @property (nonatomic,assign) int maxDiskCacheSize;
+/**
+ * The property determining if the stream is parsed and decoded on a
+ * dedicated thread instead of the thread which opened the stream.
+ * The PCM delegate is called on the decode thread when enabled.
+ */
+@property (nonatomic,assign) BOOL backgroundDecoding;
+/**
+ * The names of the ICY metadata fields delivered, for instance
+ * @[@"StreamTitle", @"IcecastStationName"]. The other fields are
+ * skipped without creating strings. nil delivers all the fields.
+ */
+@property (nonatomic,strong) NSArray *icyMetaDataFields;
+/**
+ * Unchanged ICY metadata is delivered again after this many seconds.
+ * With 0, the metadata is delivered only when it changes.
+ */
+@property (nonatomic,assign) int icyMetaDataRefreshInterval;
 
 @end
 
@@ -282,7 +361,9 @@ NSString*             freeStreamerReleaseVersion();
  */
 @property (nonatomic,assign) BOOL strictContentTypeChecking;
 /**
- * Set an output file to store the stream contents to a file.
+ * Set an output file to store the stream contents to a file. If writing
+ * the file fails, kFsAudioStreamErrorOutputFile is reported and the stream
+ * keeps playing without it.
  */
 @property (nonatomic,assign) NSURL *outputFile;
 /**
@@ -325,6 +406,10 @@ NSString*             freeStreamerReleaseVersion();
  * This property has the number of bytes buffered for this stream.
  */
 @property (nonatomic,readonly) size_t prebufferedByteCount;
+/**
+ * This property has the duration of the audio buffered for this stream, in seconds.
+ */
+@property (nonatomic,readonly) double prebufferedDuration;
 /**
  * Called upon completion of the stream. Note that for continuous
  * streams this is never called.
@@ -342,6 +427,11 @@ NSString*             freeStreamerReleaseVersion();
  * Called upon a failure.
  */
 @property (copy) void (^onFailure)(FSAudioStreamError error);
+/**
+ * Called when a dropped stream is reconnected, with the time
+ * the stream received no data.
+ */
+@property (copy) void (^onReconnect)(NSTimeInterval gap);
 /**
  * The property has the low-level stream configuration.
  */
@@ -363,10 +453,21 @@ NSString*             freeStreamerReleaseVersion();
  * Called when there are PCM audio samples available. Do not do any blocking operations
  * when you receive the data. Instead, copy the data and process it so that the
  * main event loop doesn't block. Failing to do so may cause glitches to the audio playback.
+ * It is called on the thread of the stream, also when the decoding runs in the
+ * background; samples which the thread falls too far behind on are not delivered.
  *
  * @param audioStream The audio stream the samples are from.
  * @param samples The PCM audio samples.
  * @param count The number of samples available.
  */
 - (void)audioStream:(FSAudioStream *)audioStream samplesAvailable:(const int16_t *)samples count:(NSUInteger)count;
+/**
+ * Like audioStream:samplesAvailable:count:, but called instead of it when the
+ * output sample format is kFsSampleFormatFloat32.
+ *
+ * @param audioStream The audio stream the samples are from.
+ * @param samples The PCM audio samples.
+ * @param count The number of samples available.
+ */
+- (void)audioStream:(FSAudioStream *)audioStream floatSamplesAvailable:(const float *)samples count:(NSUInteger)count;
 @end
@@ -13,6 +13,7 @@
 #include "audio_stream.h"
 #include "stream_configuration.h"
 #include "input_stream.h"
+#include "cache_index.h"
 
 #import <AVFoundation/AVFoundation.h>
 
@@ -20,44 +21,6 @@
 #import <AudioToolbox/AudioToolbox.h>
 #endif
 
-@interface FSCacheObject : NSObject {
-}
-
-@property (strong,nonatomic) NSString *path;
-@property (strong,nonatomic) NSString *name;
-@property (strong,nonatomic) NSDictionary *attributes;
-@property (nonatomic,readonly) unsigned long long fileSize;
-@property (nonatomic,readonly) NSDate *modificationDate;
-
-@end
-
-@implementation FSCacheObject
-
-- (unsigned long long)fileSize
-{
-    NSNumber *fileSizeNumber = [self.attributes objectForKey:NSFileSize];
-    return [fileSizeNumber longLongValue];
-}
-
-- (NSDate *)modificationDate
-{
-    NSDate *date = [self.attributes objectForKey:NSFileModificationDate];
-    return date;
-}
-
-@end
-
-static NSInteger sortCacheObjects(id co1, id co2, void *keyForSorting)
-{
-    FSCacheObject *cached1 = (FSCacheObject *)co1;
-    FSCacheObject *cached2 = (FSCacheObject *)co2;
-    
-    NSDate *d1 = cached1.modificationDate;
-    NSDate *d2 = cached2.modificationDate;
-    
-    return [d1 compare:d2];
-}
-
 @implementation FSStreamConfiguration
 
 - (id)init
@@ -80,13 +43,25 @@ static NSInteger sortCacheObjects(id co1, id co2, void *keyForSorting)
         self.httpConnectionBufferSize = 1024;
         self.outputSampleRate = 44100;
         self.outputNumChannels = 2;
+        self.outputSampleFormat = kFsSampleFormatInt16;
         self.bounceInterval    = 10;
         self.maxBounceCount    = 4;   // Max number of bufferings in bounceInterval seconds
         self.startupWatchdogPeriod = 30; // If the stream doesn't start to play in this seconds, the watchdog will fail it
+        self.maxReconnectCount = 5;
+        self.reconnectDelayMs = 500;     // Doubled for each reconnect in a row
+        self.maxReconnectDelayMs = 8000;
+        self.connectTimeoutMs = 15000;
+        self.readTimeoutMs = 30000;
         self.maxPrebufferedByteCount = 1000000; // 1 MB
+        self.startupBufferMs = 2000;
+        self.lowWatermarkMs = 1000;
+        self.refillWatermarkMs = 15000;
+        self.highWatermarkMs = 30000;
         self.userAgent = [NSString stringWithFormat:@"FreeStreamer/%@ (%@)", freeStreamerReleaseVersion(), systemVersion];
         self.cacheEnabled = YES;
         self.maxDiskCacheSize = 100000000;
+        self.backgroundDecoding = NO;
+        self.icyMetaDataRefreshInterval = 0;
         
         NSArray *paths = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, YES);
         
@@ -173,7 +148,8 @@ public:
     
     void audioStreamErrorOccurred(int errorCode);
     void audioStreamStateChanged(astreamer::Audio_Stream::State state);
-    void audioStreamMetaDataAvailable(std::map<CFStringRef,CFStringRef> metaData);
+    void audioStreamMetaDataAvailable(astreamer::Meta_Data&& metaData);
+    void audioStreamReconnected(double gap);
     void samplesAvailable(AudioBufferList samples, AudioStreamPacketDescription description);
 };
 
@@ -206,6 +182,7 @@ public:
 @property (nonatomic,assign) BOOL wasDisconnected;
 @property (nonatomic,assign) BOOL wasContinuousStream;
 @property (readonly) size_t prebufferedByteCount;
+@property (readonly) double prebufferedDuration;
 @property (readonly) FSSeekByteOffset currentSeekByteOffset;
 @property (readonly) FSStreamConfiguration *configuration;
 @property (readonly) NSString *formatDescription;
@@ -214,6 +191,7 @@ public:
 @property (copy) void (^onStateChange)(FSAudioStreamState state);
 @property (copy) void (^onMetaDataAvailable)(NSDictionary *metaData);
 @property (copy) void (^onFailure)(FSAudioStreamError error);
+@property (copy) void (^onReconnect)(NSTimeInterval gap);
 @property (nonatomic,unsafe_unretained) id<FSPCMAudioStreamDelegate> delegate;
 @property (nonatomic,unsafe_unretained) FSAudioStream *stream;
 
@@ -292,49 +270,9 @@ public:
         return;
     }
     
-    unsigned long long totalCacheSize = 0;
-    
-    NSMutableArray *cachedFiles = [[NSMutableArray alloc] init];
-    
-    for (NSString *file in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:self.configuration.cacheDirectory error:nil]) {
-        if ([file hasPrefix:@"FSCache-"]) {
-            FSCacheObject *cacheObj = [[FSCacheObject alloc] init];
-            cacheObj.name = file;
-            cacheObj.path = [NSString stringWithFormat:@"%@/%@", self.configuration.cacheDirectory, cacheObj.name];
-            cacheObj.attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:cacheObj.path error:nil];
-            
-            totalCacheSize += [cacheObj fileSize];
-            
-            if (![cacheObj.name hasSuffix:@".metadata"]) {
-                [cachedFiles addObject:cacheObj];
-            }
-        }
-    }
-    
-    // Sort by the modification date.
-    // In this way the older content will be removed first from the cache.
-    [cachedFiles sortUsingFunction:sortCacheObjects context:NULL];
-    
-    for (FSCacheObject *cacheObj in cachedFiles) {
-        if (totalCacheSize < self.configuration.maxDiskCacheSize) {
-            break;
-        }
-        
-        FSCacheObject *cachedMetaData = [[FSCacheObject alloc] init];
-        cachedMetaData.name = [NSString stringWithFormat:@"%@.metadata", cacheObj.name];
-        cachedMetaData.path = [NSString stringWithFormat:@"%@/%@", self.configuration.cacheDirectory, cachedMetaData.name];
-        cachedMetaData.attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:cachedMetaData.path error:nil];
-        
-        if (![[NSFileManager defaultManager] removeItemAtPath:cachedMetaData.path error:nil]) {
-            continue;
-        }
-        totalCacheSize -= [cachedMetaData fileSize];
-                
-        if (![[NSFileManager defaultManager] removeItemAtPath:cacheObj.path error:nil]) {
-            continue;
-        }
-        totalCacheSize -= [cacheObj fileSize];
-    }
+    // The files are evicted while they are written; this only applies
+    // a lowered maxDiskCacheSize, without listing the cache directory.
+    astreamer::Cache_Index::index()->evict();
 }
 
 - (AudioStreamStateObserver *)streamStateObserver
@@ -495,6 +433,11 @@ public:
     return _audioStream->cachedDataSize();
 }
 
+- (double)prebufferedDuration
+{
+    return _audioStream->cachedDataDuration();
+}
+
 - (FSSeekByteOffset)currentSeekByteOffset
 {
     FSSeekByteOffset offset;
@@ -530,15 +473,31 @@ public:
     config.httpConnectionBufferSize = c->httpConnectionBufferSize;
     config.outputSampleRate         = c->outputSampleRate;
     config.outputNumChannels        = c->outputNumChannels;
+    config.outputSampleFormat       = (FSSampleFormat)c->outputSampleFormat;
     config.bounceInterval           = c->bounceInterval;
     config.maxBounceCount           = c->maxBounceCount;
     config.startupWatchdogPeriod    = c->startupWatchdogPeriod;
+    config.maxReconnectCount        = c->maxReconnectCount;
+    config.reconnectDelayMs         = c->reconnectDelayMs;
+    config.maxReconnectDelayMs      = c->maxReconnectDelayMs;
+    config.connectTimeoutMs         = c->connectTimeoutMs;
+    config.readTimeoutMs            = c->readTimeoutMs;
     config.maxPrebufferedByteCount  = c->maxPrebufferedByteCount;
+    config.startupBufferMs          = c->startupBufferMs;
+    config.lowWatermarkMs           = c->lowWatermarkMs;
+    config.refillWatermarkMs        = c->refillWatermarkMs;
+    config.highWatermarkMs          = c->highWatermarkMs;
+    config.backgroundDecoding       = c->backgroundDecoding;
+    config.icyMetaDataRefreshInterval = c->icyMetaDataRefreshInterval;
     
     if (c->userAgent) {
         // Let the Objective-C side handle the memory for the copy of the original user-agent
         config.userAgent = (__bridge_transfer NSString *)CFStringCreateCopy(kCFAllocatorDefault, c->userAgent);
     }
+    
+    if (c->icyMetaDataFields) {
+        config.icyMetaDataFields = (__bridge_transfer NSArray *)CFArrayCreateCopy(kCFAllocatorDefault, c->icyMetaDataFields);
+    }
 
     return config;
 }
@@ -555,9 +514,7 @@ public:
     if (self.url) {
         NSString *cacheIdentifier = (NSString*)CFBridgingRelease(_audioStream->createCacheIdentifierForURL((__bridge CFURLRef)self.url));
         
-        NSString *fullPath = [NSString stringWithFormat:@"%@/%@.metadata", self.configuration.cacheDirectory, cacheIdentifier];
-        
-        cachedFileExists = [[NSFileManager defaultManager] fileExistsAtPath:fullPath];
+        cachedFileExists = astreamer::Cache_Index::index()->isCached([cacheIdentifier UTF8String]);
     }
     
     return cachedFileExists;
@@ -580,6 +537,14 @@ public:
     if (self.wasDisconnected && internetConnectionAvailable) {
         self.wasDisconnected = NO;
         
+        /*
+         * The stream reconnects by itself after a dropped connection. Only
+         * restart it if it ran out of reconnects and failed.
+         */
+        if (_audioStream->state() != astreamer::Audio_Stream::FAILED) {
+            return;
+        }
+        
 #if defined(DEBUG) || (TARGET_IPHONE_SIMULATOR)
         NSLog(@"FSAudioStream: Internet connection available again. Restarting stream playback.");
 #endif
@@ -717,7 +682,7 @@ public:
 
 -(NSString *)description
 {
-    return [NSString stringWithFormat:@"[FreeStreamer %@] URL: %@\nbufferCount: %i\nbufferSize: %i\nmaxPacketDescs: %i\ndecodeQueueSize: %i\nhttpConnectionBufferSize: %i\noutputSampleRate: %f\noutputNumChannels: %ld\nbounceInterval: %i\nmaxBounceCount: %i\nstartupWatchdogPeriod: %i\nmaxPrebufferedByteCount: %i\nformat: %@\nuserAgent: %@\ncacheDirectory: %@\ncacheEnabled: %@\nmaxDiskCacheSize: %i",
+    return [NSString stringWithFormat:@"[FreeStreamer %@] URL: %@\nbufferCount: %i\nbufferSize: %i\nmaxPacketDescs: %i\ndecodeQueueSize: %i\nhttpConnectionBufferSize: %i\noutputSampleRate: %f\noutputNumChannels: %ld\noutputSampleFormat: %i\nbounceInterval: %i\nmaxBounceCount: %i\nstartupWatchdogPeriod: %i\nmaxReconnectCount: %i\nreconnectDelayMs: %i\nmaxReconnectDelayMs: %i\nconnectTimeoutMs: %i\nreadTimeoutMs: %i\nmaxPrebufferedByteCount: %i\nstartupBufferMs: %i\nlowWatermarkMs: %i\nrefillWatermarkMs: %i\nhighWatermarkMs: %i\nformat: %@\nuserAgent: %@\ncacheDirectory: %@\ncacheEnabled: %@\nmaxDiskCacheSize: %i\nbackgroundDecoding: %@\nicyMetaDataFields: %@\nicyMetaDataRefreshInterval: %i",
             freeStreamerReleaseVersion(),
             self.url,
             self.configuration.bufferCount,
@@ -727,15 +692,28 @@ public:
             self.configuration.httpConnectionBufferSize,
             self.configuration.outputSampleRate,
             self.configuration.outputNumChannels,
+            self.configuration.outputSampleFormat,
             self.configuration.bounceInterval,
             self.configuration.maxBounceCount,
             self.configuration.startupWatchdogPeriod,
+            self.configuration.maxReconnectCount,
+            self.configuration.reconnectDelayMs,
+            self.configuration.maxReconnectDelayMs,
+            self.configuration.connectTimeoutMs,
+            self.configuration.readTimeoutMs,
             self.configuration.maxPrebufferedByteCount,
+            self.configuration.startupBufferMs,
+            self.configuration.lowWatermarkMs,
+            self.configuration.refillWatermarkMs,
+            self.configuration.highWatermarkMs,
             self.formatDescription,
             self.configuration.userAgent,
             self.configuration.cacheDirectory,
             (self.configuration.cacheEnabled ? @"YES" : @"NO"),
-            self.configuration.maxDiskCacheSize];
+            self.configuration.maxDiskCacheSize,
+            (self.configuration.backgroundDecoding ? @"YES" : @"NO"),
+            self.configuration.icyMetaDataFields,
+            self.configuration.icyMetaDataRefreshInterval];
 }
 
 @end
@@ -778,12 +756,25 @@ public:
         c->httpConnectionBufferSize = configuration.httpConnectionBufferSize;
         c->outputSampleRate         = configuration.outputSampleRate;
         c->outputNumChannels        = configuration.outputNumChannels;
+        c->outputSampleFormat       = (configuration.outputSampleFormat == kFsSampleFormatFloat32 ?
+                                       astreamer::SAMPLE_FORMAT_FLOAT32 : astreamer::SAMPLE_FORMAT_INT16);
         c->maxBounceCount           = configuration.maxBounceCount;
         c->bounceInterval           = configuration.bounceInterval;
         c->startupWatchdogPeriod    = configuration.startupWatchdogPeriod;
+        c->maxReconnectCount        = configuration.maxReconnectCount;
+        c->reconnectDelayMs         = configuration.reconnectDelayMs;
+        c->maxReconnectDelayMs      = configuration.maxReconnectDelayMs;
+        c->connectTimeoutMs         = configuration.connectTimeoutMs;
+        c->readTimeoutMs            = configuration.readTimeoutMs;
         c->maxPrebufferedByteCount  = configuration.maxPrebufferedByteCount;
+        c->startupBufferMs          = configuration.startupBufferMs;
+        c->lowWatermarkMs           = configuration.lowWatermarkMs;
+        c->refillWatermarkMs        = configuration.refillWatermarkMs;
+        c->highWatermarkMs          = configuration.highWatermarkMs;
         c->cacheEnabled             = configuration.cacheEnabled;
         c->maxDiskCacheSize         = configuration.maxDiskCacheSize;
+        c->backgroundDecoding       = configuration.backgroundDecoding;
+        c->icyMetaDataRefreshInterval = configuration.icyMetaDataRefreshInterval;
         
         if (c->userAgent) {
             CFRelease(c->userAgent);
@@ -799,6 +790,15 @@ public:
             c->cacheDirectory = NULL;
         }
         
+        if (c->icyMetaDataFields) {
+            CFRelease(c->icyMetaDataFields);
+        }
+        if (configuration.icyMetaDataFields) {
+            c->icyMetaDataFields = CFArrayCreateCopy(kCFAllocatorDefault, (__bridge CFArrayRef)configuration.icyMetaDataFields);
+        } else {
+            c->icyMetaDataFields = NULL;
+        }
+        
         _private = [[FSAudioStreamPrivate alloc] init];
         _private.stream = self;
     }
@@ -962,6 +962,11 @@ public:
     return _private.prebufferedByteCount;
 }
 
+- (double)prebufferedDuration
+{
+    return _private.prebufferedDuration;
+}
+
 - (void (^)())onCompletion
 {
     return _private.onCompletion;
@@ -1002,6 +1007,16 @@ public:
     _private.onFailure = onFailure;
 }
 
+- (void (^)(NSTimeInterval gap))onReconnect
+{
+    return _private.onReconnect;
+}
+
+- (void)setOnReconnect:(void (^)(NSTimeInterval gap))onReconnect
+{
+    _private.onReconnect = onReconnect;
+}
+
 - (FSStreamConfiguration *)configuration
 {
     return _private.configuration;
@@ -1082,6 +1097,15 @@ void AudioStreamStateObserver::audioStreamErrorOccurred(int errorCode)
             
             break;
             
+        case kFsAudioStreamErrorOutputFile:
+            error = kFsAudioStreamErrorOutputFile;
+            
+#if defined(DEBUG) || (TARGET_IPHONE_SIMULATOR)
+            NSLog(@"FSAudioStream: Writing the output file failed: %@", priv);
+#endif
+            
+            break;
+            
         default:
             break;
     }
@@ -1164,15 +1188,13 @@ void AudioStreamStateObserver::audioStreamStateChanged(astreamer::Audio_Stream::
     [[NSNotificationCenter defaultCenter] postNotification:notification];
 }
     
-void AudioStreamStateObserver::audioStreamMetaDataAvailable(std::map<CFStringRef,CFStringRef> metaData)
+void AudioStreamStateObserver::audioStreamMetaDataAvailable(astreamer::Meta_Data&& metaData)
 {
-    NSMutableDictionary *metaDataDictionary = [[NSMutableDictionary alloc] init];
+    NSMutableDictionary *metaDataDictionary = [[NSMutableDictionary alloc] initWithCapacity:metaData.count()];
     
-    for (std::map<CFStringRef,CFStringRef>::iterator iter = metaData.begin(); iter != metaData.end(); ++iter) {
-        CFStringRef key = iter->first;
-        CFStringRef value = iter->second;
-        
-        metaDataDictionary[CFBridgingRelease(key)] = CFBridgingRelease(value);
+    // The record keeps the ownership of the strings, the dictionary retains them
+    for (size_t i=0; i < metaData.count(); i++) {
+        metaDataDictionary[(__bridge NSString *)metaData.keyAt(i)] = (__bridge NSString *)metaData.valueAt(i);
     }
     
     if (priv.onMetaDataAvailable) {
@@ -1185,10 +1207,28 @@ void AudioStreamStateObserver::audioStreamMetaDataAvailable(std::map<CFStringRef
     
     [[NSNotificationCenter defaultCenter] postNotification:notification];
 }
+    
+void AudioStreamStateObserver::audioStreamReconnected(double gap)
+{
+#if defined(DEBUG) || (TARGET_IPHONE_SIMULATOR)
+    NSLog(@"FSAudioStream: Reconnected after %.3f seconds without data: %@", gap, priv);
+#endif
+    
+    if (priv.onReconnect) {
+        priv.onReconnect(gap);
+    }
+}
 
 void AudioStreamStateObserver::samplesAvailable(AudioBufferList samples, AudioStreamPacketDescription description)
 {
-    if ([priv.delegate respondsToSelector:@selector(audioStream:samplesAvailable:count:)]) {
+    if (source->outputFormat().mFormatFlags & kAudioFormatFlagIsFloat) {
+        if ([priv.delegate respondsToSelector:@selector(audioStream:floatSamplesAvailable:count:)]) {
+            float *buffer = (float *)samples.mBuffers[0].mData;
+            NSUInteger count = description.mDataByteSize / sizeof(float);
+            
+            [priv.delegate audioStream:priv.stream floatSamplesAvailable:buffer count:count];
+        }
+    } else if ([priv.delegate respondsToSelector:@selector(audioStream:samplesAvailable:count:)]) {
         int16_t *buffer = (int16_t *)samples.mBuffers[0].mData;
         NSUInteger count = description.mDataByteSize / sizeof(int16_t);
         
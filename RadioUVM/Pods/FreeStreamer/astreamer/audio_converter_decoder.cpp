@@ -0,0 +1,143 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "audio_converter_decoder.h"
+
+//#define ACD_DEBUG 1
+
+#if !defined (ACD_DEBUG)
+#define ACD_TRACE(...) do {} while (0)
+#else
+#define ACD_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+namespace astreamer {
+
+/* public */
+
+Audio_Converter_Decoder::~Audio_Converter_Decoder()
+{
+    if (m_converter) {
+        AudioConverterDispose(m_converter), m_converter = 0;
+    }
+}
+
+Audio_Converter_Decoder* Audio_Converter_Decoder::create(const AudioStreamBasicDescription& srcFormat,
+                                                         const AudioStreamBasicDescription& dstFormat,
+                                                         OSStatus *error)
+{
+    *error = noErr;
+
+    AudioConverterRef converter;
+
+    OSStatus err = AudioConverterNew(&srcFormat, &dstFormat, &converter);
+
+    if (err) {
+        *error = err;
+        return 0;
+    }
+
+    return new Audio_Converter_Decoder(converter, srcFormat);
+}
+
+OSStatus Audio_Converter_Decoder::decode(UInt32 *ioNumFrames, AudioBufferList *output)
+{
+    ACD_TRACE("calling AudioConverterFillComplexBuffer\n");
+
+    OSStatus err = AudioConverterFillComplexBuffer(m_converter,
+                                                   &inputDataCallback,
+                                                   this,
+                                                   ioNumFrames,
+                                                   output,
+                                                   NULL);
+
+    if (err == kInputStarvedErr) {
+        // The frames decoded so far are valid, the converter state is kept
+        ACD_TRACE("input starved after %u frames\n", (unsigned int)*ioNumFrames);
+        return noErr;
+    }
+    return err;
+}
+
+void Audio_Converter_Decoder::setMagicCookie(const void *cookie, UInt32 cookieSize)
+{
+    AudioConverterSetProperty(m_converter, kAudioConverterDecompressionMagicCookie, cookieSize, cookie);
+}
+
+void Audio_Converter_Decoder::reset()
+{
+    AudioConverterReset(m_converter);
+}
+
+/* private */
+
+Audio_Converter_Decoder::Audio_Converter_Decoder(AudioConverterRef converter, const AudioStreamBasicDescription& srcFormat) :
+    m_delegate(0),
+    m_converter(converter),
+    m_srcFormat(srcFormat)
+{
+}
+
+OSStatus Audio_Converter_Decoder::inputDataCallback(AudioConverterRef inAudioConverter, UInt32 *ioNumberDataPackets, AudioBufferList *ioData, AudioStreamPacketDescription **outDataPacketDescription, void *inUserData)
+{
+    Audio_Converter_Decoder *THIS = (Audio_Converter_Decoder *)inUserData;
+
+    // Hand the converter as many adjacent packets as it asks for, in place
+    const void *data = 0;
+    UInt32 numBytes = 0;
+    AudioStreamPacketDescription *descs = 0;
+
+    UInt32 numPackets = 0;
+
+    if (THIS->m_delegate) {
+        numPackets = THIS->m_delegate->decoderInputPackets(*ioNumberDataPackets, &data, &numBytes, &descs);
+    }
+
+    if (numPackets == 0) {
+        /*
+         * Returning zero packets with noErr would signal the end of stream,
+         * after which the converter must be reset and primed again. A momentary
+         * underrun is not the end: return zero packets with an error instead,
+         * which makes AudioConverterFillComplexBuffer return the output produced
+         * so far and keeps the decoder state for the next call.
+         */
+
+        ACD_TRACE("run out of data to provide for decoding\n");
+
+        *ioNumberDataPackets = 0;
+
+        ioData->mBuffers[0].mDataByteSize = 0;
+
+        return kInputStarvedErr;
+    }
+
+    if (THIS->m_srcFormat.mBytesPerPacket > 0) {
+        // Constant bit rate blocks are queued as one description
+        numPackets = numBytes / THIS->m_srcFormat.mBytesPerPacket;
+
+        if (numPackets > *ioNumberDataPackets) {
+            // The converter takes no more than it asked for
+            numPackets = *ioNumberDataPackets;
+            numBytes = numPackets * THIS->m_srcFormat.mBytesPerPacket;
+        }
+    }
+
+    *ioNumberDataPackets = numPackets;
+
+    ioData->mBuffers[0].mData = (void *)data;
+    ioData->mBuffers[0].mDataByteSize = numBytes;
+    ioData->mBuffers[0].mNumberChannels = THIS->m_srcFormat.mChannelsPerFrame;
+
+    if (outDataPacketDescription) {
+        *outDataPacketDescription = descs;
+    }
+
+    return noErr;
+}
+
+} // namespace astreamer
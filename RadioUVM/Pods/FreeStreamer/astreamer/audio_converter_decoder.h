@@ -0,0 +1,69 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_AUDIO_CONVERTER_DECODER_H
+#define ASTREAMER_AUDIO_CONVERTER_DECODER_H
+
+#include <AudioToolbox/AudioToolbox.h>
+
+namespace astreamer {
+
+class Decoder_Delegate;
+
+/*
+ * Decodes the queued source packets to PCM in the output format with
+ * the system audio converter (MP3, AAC, ...). The packets are pulled
+ * from the delegate while decoding.
+ */
+class Audio_Converter_Decoder {
+public:
+    Decoder_Delegate *m_delegate;
+
+    ~Audio_Converter_Decoder();
+
+    /* Returns 0 and sets the error if the converter can't be created */
+    static Audio_Converter_Decoder *create(const AudioStreamBasicDescription& srcFormat,
+                                           const AudioStreamBasicDescription& dstFormat,
+                                           OSStatus *error);
+
+    /* Decodes up to *ioNumFrames frames to the output, sets the number of frames decoded.
+       Running out of input is not an error; the decoder keeps its state and
+       continues from where it was when more packets are queued. */
+    OSStatus decode(UInt32 *ioNumFrames, AudioBufferList *output);
+
+    void setMagicCookie(const void *cookie, UInt32 cookieSize);
+
+    /* Drops the decoding state, for a discontinuity in the input */
+    void reset();
+
+private:
+    Audio_Converter_Decoder(AudioConverterRef converter, const AudioStreamBasicDescription& srcFormat);
+
+    Audio_Converter_Decoder(const Audio_Converter_Decoder&);
+    Audio_Converter_Decoder& operator=(const Audio_Converter_Decoder&);
+
+    AudioConverterRef m_converter;
+    AudioStreamBasicDescription m_srcFormat;
+
+    enum {
+        kInputStarvedErr = 'strv'
+    };
+
+    static OSStatus inputDataCallback(AudioConverterRef inAudioConverter, UInt32 *ioNumberDataPackets, AudioBufferList *ioData, AudioStreamPacketDescription **outDataPacketDescription, void *inUserData);
+};
+
+class Decoder_Delegate {
+public:
+    /* Returns the number of adjacent packets handed out, 0 when out of data.
+       Constant bit rate data comes as one block of at most maxPackets packets. */
+    virtual UInt32 decoderInputPackets(UInt32 maxPackets, const void **data, UInt32 *numBytes, AudioStreamPacketDescription **descs) = 0;
+};
+
+} // namespace astreamer
+
+#endif // ASTREAMER_AUDIO_CONVERTER_DECODER_H
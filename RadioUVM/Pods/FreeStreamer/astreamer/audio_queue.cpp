@@ -15,6 +15,7 @@
 
 #include "audio_queue.h"
 #include "stream_configuration.h"
+#include "run_loop_event_loop.h"
 
 //#define AQ_DEBUG 1
 
@@ -30,17 +31,12 @@
 
 namespace astreamer {
     
-typedef struct queued_packet {
-    AudioStreamPacketDescription desc;
-    struct queued_packet *next;
-    char data[];
-} queued_packet_t;
-    
 /* public */    
     
-Audio_Queue::Audio_Queue()
+Audio_Queue::Audio_Queue(Event_Loop *eventLoop)
     : m_delegate(0),
     m_state(IDLE),
+    m_eventLoop(eventLoop),
     m_outAQ(0),
     m_fillBufferIndex(0),
     m_bytesFilled(0),
@@ -48,8 +44,6 @@ Audio_Queue::Audio_Queue()
     m_buffersUsed(0),
     m_audioQueueStarted(false),
     m_waitingOnBuffer(false),
-    m_queuedHead(0),
-    m_queuedTail(0),
     m_lastError(noErr),
     m_initialOutputVolume(1.0)
 {
@@ -220,8 +214,10 @@ void Audio_Queue::handlePropertyChange(AudioFileStreamID inAudioFileStream, Audi
         {
             cleanup();
             
-            // create the audio queue
-            err = AudioQueueNewOutput(&m_streamDesc, audioQueueOutputCallback, this, CFRunLoopGetCurrent(), NULL, 0, &m_outAQ);
+            m_overflowPackets.setFormat(m_streamDesc);
+            
+            // create the audio queue; without a run loop, the callbacks come on an internal thread of the queue
+            err = AudioQueueNewOutput(&m_streamDesc, audioQueueOutputCallback, this, Run_Loop_Event_Loop::runLoopOf(m_eventLoop), NULL, 0, &m_outAQ);
             if (err) {
                 AQ_TRACE("%s: error in AudioQueueNewOutput\n", __PRETTY_FUNCTION__);
                 
@@ -292,7 +288,7 @@ void Audio_Queue::handleAudioPackets(UInt32 inNumberBytes, UInt32 inNumberPacket
      queue */
     UInt32 i;
     
-    for (i = 0; i < inNumberPackets && !m_waitingOnBuffer && m_queuedHead == NULL; i++) {
+    for (i = 0; i < inNumberPackets && !m_waitingOnBuffer && m_overflowPackets.empty(); i++) {
         AudioStreamPacketDescription *desc = &inPacketDescriptions[i];
         int ret = handlePacket((const char*)inInputData + desc->mStartOffset, desc);
         if (!ret) break;
@@ -301,24 +297,8 @@ void Audio_Queue::handleAudioPackets(UInt32 inNumberBytes, UInt32 inNumberPacket
         return;
     }
     
-    for (; i < inNumberPackets; i++) {
-        /* Allocate the packet */
-        UInt32 size = inPacketDescriptions[i].mDataByteSize;
-        queued_packet_t *packet = (queued_packet_t *)malloc(sizeof(queued_packet_t) + size);
-        
-        /* Prepare the packet */
-        packet->next = NULL;
-        packet->desc = inPacketDescriptions[i];
-        packet->desc.mStartOffset = 0;
-        memcpy(packet->data, (const char *)inInputData + inPacketDescriptions[i].mStartOffset,
-               size);
-        
-        if (m_queuedHead == NULL) {
-            m_queuedHead = m_queuedTail = packet;
-        } else {
-            m_queuedTail->next = packet;
-            m_queuedTail = packet;
-        }
+    if (!m_overflowPackets.push(inNumberPackets - i, inInputData, &inPacketDescriptions[i])) {
+        AQ_TRACE("%s: failed to queue %u packets, dropping\n", __PRETTY_FUNCTION__, (unsigned int)(inNumberPackets - i));
     }
 }
     
@@ -357,7 +337,13 @@ int Audio_Queue::handlePacket(const void *data, AudioStreamPacketDescription *de
     
     // copy data to the audio queue buffer
     AudioQueueBufferRef buf = m_audioQueueBuffer[m_fillBufferIndex];
-    memcpy((char*)buf->mAudioData, data, packetSize);
+    memcpy((char*)buf->mAudioData + m_bytesFilled, data, packetSize);
+    
+    if (m_streamDesc.mFormatID == kAudioFormatLinearPCM) {
+        // Constant bit rate, the queue doesn't need packet descriptions
+        m_bytesFilled += packetSize;
+        return 1;
+    }
     
     // fill out packet description to pass to enqueue() later on
     m_packetDescs[m_packetsFilled] = *desc;
@@ -373,6 +359,45 @@ int Audio_Queue::handlePacket(const void *data, AudioStreamPacketDescription *de
     }
     return 1;
 }
+    
+UInt32 Audio_Queue::lendBuffer(void **data)
+{
+    if (!initialized()) {
+        AQ_TRACE("%s: warning: attempt to lend a buffer from an uninitialized audio queue. return.\n", __PRETTY_FUNCTION__);
+        
+        return 0;
+    }
+    
+    /* The buffers are busy, or the queued packets must go first */
+    if (m_waitingOnBuffer || !m_overflowPackets.empty()) {
+        return 0;
+    }
+    
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    if (config->bufferSize - m_bytesFilled < m_streamDesc.mBytesPerFrame) {
+        if (enqueueBuffer() <= 0) {
+            return 0;
+        }
+    }
+    
+    AudioQueueBufferRef buf = m_audioQueueBuffer[m_fillBufferIndex];
+    *data = (char*)buf->mAudioData + m_bytesFilled;
+    
+    return config->bufferSize - m_bytesFilled;
+}
+    
+void Audio_Queue::commitBuffer(UInt32 numBytes)
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    m_bytesFilled += numBytes;
+    
+    /* Hand the buffer to the system as soon as it is full */
+    if (config->bufferSize - m_bytesFilled < m_streamDesc.mBytesPerFrame) {
+        enqueueBuffer();
+    }
+}
 
 /* private */
     
@@ -403,19 +428,16 @@ void Audio_Queue::cleanup()
         AQ_TRACE("%s: AudioQueueDispose failed!\n", __PRETTY_FUNCTION__);
     }
     m_outAQ = 0;
+    
+    // Drop the callbacks posted from the queue's thread
+    m_eventLoop->cancel(this);
     m_fillBufferIndex = m_bytesFilled = m_packetsFilled = m_buffersUsed = 0;
     
     for (size_t i=0; i < config->bufferCount; i++) {
         m_bufferInUse[i] = false;
     }
     
-    queued_packet_t *cur = m_queuedHead;
-    while (cur) {
-        queued_packet_t *tmp = cur->next;
-        free(cur);
-        cur = tmp;
-    }
-    m_queuedHead = m_queuedTail = 0;
+    m_overflowPackets.clear();
     
     m_waitingOnBuffer = false;
     m_lastError = noErr;
@@ -450,8 +472,15 @@ int Audio_Queue::enqueueBuffer()
     AudioQueueBufferRef fillBuf = m_audioQueueBuffer[m_fillBufferIndex];
     fillBuf->mAudioDataByteSize = m_bytesFilled;
     
-    AQ_ASSERT(m_packetsFilled > 0);
-    OSStatus err = AudioQueueEnqueueBuffer(m_outAQ, fillBuf, m_packetsFilled, m_packetDescs);
+    OSStatus err;
+    
+    if (m_streamDesc.mFormatID == kAudioFormatLinearPCM) {
+        AQ_ASSERT(m_bytesFilled > 0);
+        err = AudioQueueEnqueueBuffer(m_outAQ, fillBuf, 0, NULL);
+    } else {
+        AQ_ASSERT(m_packetsFilled > 0);
+        err = AudioQueueEnqueueBuffer(m_outAQ, fillBuf, m_packetsFilled, m_packetDescs);
+    }
     if (!err) {
         m_lastError = noErr;
         start();
@@ -505,71 +534,103 @@ void Audio_Queue::enqueueCachedData()
     AQ_ASSERT(!m_bufferInUse[m_fillBufferIndex]);
     
     /* Queue up as many packets as possible into the buffers */
-    queued_packet_t *cur = m_queuedHead;
-    while (cur) {
-        int ret = handlePacket(cur->data, &cur->desc);
+    AudioStreamPacketDescription *desc;
+    while ((desc = m_overflowPackets.front())) {
+        int ret = handlePacket(m_overflowPackets.packetData(desc), desc);
         if (ret == 0) {
            break; 
         }
-        queued_packet_t *next = cur->next;
-        free(cur);
-        cur = next;
+        m_overflowPackets.pop();
     }
-    m_queuedHead = cur;
     
     /* If we finished queueing all our saved packets, we can re-schedule the
      * stream to run */
-    if (cur == NULL) {
-        m_queuedTail = NULL;
+    if (m_overflowPackets.empty()) {
         if (m_delegate) {
             m_delegate->audioQueueUnderflow();
         }
     }
 }
     
-// this is called by the audio queue when it has finished decoding our data. 
-// The buffer is now free to be reused.
-void Audio_Queue::audioQueueOutputCallback(void *inClientData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer)
+void Audio_Queue::bufferFinished(AudioQueueBufferRef buffer)
 {
-    Audio_Queue *audioQueue = static_cast<Audio_Queue*>(inClientData);    
-    unsigned int bufIndex = audioQueue->findQueueBuffer(inBuffer);
+    unsigned int bufIndex = findQueueBuffer(buffer);
     
-    AQ_ASSERT(audioQueue->m_bufferInUse[bufIndex]);
+    AQ_ASSERT(m_bufferInUse[bufIndex]);
     
-    audioQueue->m_bufferInUse[bufIndex] = false;
-    audioQueue->m_buffersUsed--;
+    m_bufferInUse[bufIndex] = false;
+    m_buffersUsed--;
     
-    if (audioQueue->m_delegate) {
-        audioQueue->m_delegate->audioQueueFinishedPlayingPacket();
+    if (m_delegate) {
+        m_delegate->audioQueueFinishedPlayingPacket();
     }
     
-    if (audioQueue->m_buffersUsed == 0 && !audioQueue->m_queuedHead && audioQueue->m_delegate) {
-        audioQueue->m_delegate->audioQueueBuffersEmpty();
-    } else if (audioQueue->m_waitingOnBuffer) {
-        audioQueue->m_waitingOnBuffer = false;
-        audioQueue->enqueueCachedData();
+    if (m_buffersUsed == 0 && m_overflowPackets.empty() && m_delegate) {
+        m_delegate->audioQueueBuffersEmpty();
+    } else if (m_waitingOnBuffer) {
+        m_waitingOnBuffer = false;
+        enqueueCachedData();
     }
 }
-
-void Audio_Queue::audioQueueIsRunningCallback(void *inClientData, AudioQueueRef inAQ, AudioQueuePropertyID inID)
-{
-    Audio_Queue *audioQueue = static_cast<Audio_Queue*>(inClientData);
     
+void Audio_Queue::isRunningChanged()
+{
     AQ_TRACE("%s: enter\n", __PRETTY_FUNCTION__);
     
     UInt32 running;
     UInt32 output = sizeof(running);
-    OSStatus err = AudioQueueGetProperty(inAQ, kAudioQueueProperty_IsRunning, &running, &output);
+    OSStatus err = AudioQueueGetProperty(m_outAQ, kAudioQueueProperty_IsRunning, &running, &output);
     if (err) {
         AQ_TRACE("%s: error in kAudioQueueProperty_IsRunning\n", __PRETTY_FUNCTION__);
         return;
     }
     if (running) {
         AQ_TRACE("audio queue running!\n");
-        audioQueue->setState(RUNNING);
+        setState(RUNNING);
     } else {
-        audioQueue->setState(IDLE);
+        setState(IDLE);
+    }
+}
+    
+void Audio_Queue::bufferFinishedTask(void *info, intptr_t arg)
+{
+    Audio_Queue *audioQueue = static_cast<Audio_Queue*>(info);
+    
+    audioQueue->bufferFinished((AudioQueueBufferRef)arg);
+}
+    
+void Audio_Queue::isRunningChangedTask(void *info, intptr_t arg)
+{
+    Audio_Queue *audioQueue = static_cast<Audio_Queue*>(info);
+    
+    audioQueue->isRunningChanged();
+}
+    
+// this is called by the audio queue when it has finished decoding our data. 
+// The buffer is now free to be reused.
+void Audio_Queue::audioQueueOutputCallback(void *inClientData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer)
+{
+    Audio_Queue *audioQueue = static_cast<Audio_Queue*>(inClientData);
+    
+    if (!audioQueue->m_eventLoop->runsRunLoop()) {
+        // On the queue's own thread: the buffer is handled on the event loop
+        audioQueue->m_eventLoop->post(bufferFinishedTask, audioQueue, (intptr_t)inBuffer);
+        return;
     }
+    
+    audioQueue->bufferFinished(inBuffer);
+}
+
+void Audio_Queue::audioQueueIsRunningCallback(void *inClientData, AudioQueueRef inAQ, AudioQueuePropertyID inID)
+{
+    Audio_Queue *audioQueue = static_cast<Audio_Queue*>(inClientData);
+    
+    if (!audioQueue->m_eventLoop->runsRunLoop()) {
+        audioQueue->m_eventLoop->post(isRunningChangedTask, audioQueue, 0);
+        return;
+    }
+    
+    audioQueue->isRunningChanged();
 }    
     
 } // namespace astreamer
@@ -15,10 +15,12 @@
 
 #include <AudioToolbox/AudioToolbox.h> /* AudioFileStreamID */
 
+#include "packet_queue.h"
+#include "event_loop.h"
+
 namespace astreamer {
     
 class Audio_Queue_Delegate;
-struct queued_packet;
 	
 class Audio_Queue {
 public:
@@ -30,7 +32,7 @@ public:
         PAUSED
     };
     
-    Audio_Queue();
+    Audio_Queue(Event_Loop *eventLoop);
     virtual ~Audio_Queue();
     
     bool initialized();
@@ -39,6 +41,9 @@ public:
     void handleAudioPackets(UInt32 inNumberBytes, UInt32 inNumberPackets, const void *inInputData, AudioStreamPacketDescription *inPacketDescriptions);
     int handlePacket(const void *data, AudioStreamPacketDescription *desc);
     
+    UInt32 lendBuffer(void **data);
+    void commitBuffer(UInt32 numBytes);
+    
     void start();
     void pause();
     void stop(bool stopImmediately);
@@ -57,6 +62,8 @@ private:
     
     State m_state;
     
+    Event_Loop *m_eventLoop;
+    
     AudioQueueRef m_outAQ;                                           // the audio queue
     
     AudioQueueBufferRef *m_audioQueueBuffer;              // audio queue buffers
@@ -71,8 +78,7 @@ private:
     bool *m_bufferInUse;                                  // flags to indicate that a buffer is still in use
     bool m_waitingOnBuffer;
     
-    struct queued_packet *m_queuedHead;
-    struct queued_packet *m_queuedTail;
+    Packet_Queue m_overflowPackets;                                  // packets waiting for a free buffer
     
 public:
     OSStatus m_lastError;
@@ -86,6 +92,11 @@ private:
     int enqueueBuffer();
     int findQueueBuffer(AudioQueueBufferRef inBuffer);
     void enqueueCachedData();
+    void bufferFinished(AudioQueueBufferRef buffer);
+    void isRunningChanged();
+    
+    static void bufferFinishedTask(void *info, intptr_t arg);
+    static void isRunningChangedTask(void *info, intptr_t arg);
     
     static void audioQueueOutputCallback(void *inClientData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer);
     static void audioQueueIsRunningCallback(void *inClientData, AudioQueueRef inAQ, AudioQueuePropertyID inID);
@@ -12,6 +12,8 @@
 #include "http_stream.h"
 #include "file_stream.h"
 #include "caching_stream.h"
+#include "socket_stream.h"
+#include "run_loop_event_loop.h"
 
 #include <CommonCrypto/CommonDigest.h>
 
@@ -33,8 +35,14 @@
 
 namespace astreamer {
 	
-/* Create HTTP stream as Audio_Stream (this) as the delegate */
 Audio_Stream::Audio_Stream() :
+    Audio_Stream(new Run_Loop_Event_Loop())
+{
+    m_ownsEventLoop = true;
+}
+    
+/* Create HTTP stream as Audio_Stream (this) as the delegate */
+Audio_Stream::Audio_Stream(Event_Loop *eventLoop) :
     m_delegate(0),
     m_inputStreamRunning(false),
     m_audioStreamParserRunning(false),
@@ -42,12 +50,18 @@ Audio_Stream::Audio_Stream() :
     m_state(STOPPED),
     m_inputStream(0),
     m_audioQueue(0),
+    m_eventLoop(eventLoop),
+    m_ownsEventLoop(false),
     m_watchdogTimer(0),
+    m_reconnectTimer(0),
+    m_reconnectCount(0),
+    m_reconnecting(false),
+    m_disconnectTime(0),
+    m_inputPosition(0),
+    m_inputDiscontinuity(false),
     m_audioFileStream(0),
-    m_audioConverter(0),
+    m_decoder(0),
     m_initializationError(noErr),
-    m_outputBufferSize(Stream_Configuration::configuration()->bufferSize),
-    m_outputBuffer(new UInt8[m_outputBufferSize]),
     m_dataOffset(0),
     m_seekPosition(0),
     m_bounceCount(0),
@@ -62,31 +76,57 @@ Audio_Stream::Audio_Stream() :
     
     m_fileOutput(0),
     m_outputFile(NULL),
-    m_queuedHead(0),
-    m_queuedTail(0),
-    m_cachedDataSize(0),
+    m_packetQueue(new Packet_Queue()),
     m_processedPacketsCount(0),
     m_audioDataByteCount(0),
     m_packetDuration(0),
     m_bitrateBufferIndex(0),
     m_outputVolume(1.0),
     m_queueCanAcceptPackets(true),
-    m_converterRunOutOfData(false)
+    m_inputThrottled(false),
+    m_decodeWorker(0),
+    m_pendingInput(0),
+    m_pendingInputSize(0),
+    m_pendingInputCapacity(0),
+    m_inputEndPending(false),
+    m_decodeInputPaused(false),
+    m_decodeInputEnded(false),
+    m_decodeInputQueued(0),
+    m_decodeInputConsumed(0),
+    m_decodeDiscontinuity(UINT64_MAX),
+    m_parseDiscontinuity(false),
+    m_publishedTimePlayed(0),
+    m_publishedDuration(0),
+    m_publishedCachedDataSize(0),
+    m_publishedCachedPacketCount(0),
+    m_publishedCachedDataDuration(0)
 {
     memset(&m_srcFormat, 0, sizeof m_srcFormat);
     
+    memset(&m_decoderFormat, 0, sizeof m_decoderFormat);
+    
     memset(&m_dstFormat, 0, sizeof m_dstFormat);
     
     Stream_Configuration *config = Stream_Configuration::configuration();
     
+    // The audio queue plays mono or stereo; anything else is downmixed to stereo
+    UInt32 channels = (config->outputNumChannels == 1 ? 1 : 2);
+    
     m_dstFormat.mSampleRate = config->outputSampleRate;
     m_dstFormat.mFormatID = kAudioFormatLinearPCM;
-    m_dstFormat.mFormatFlags = kLinearPCMFormatFlagIsSignedInteger | kAudioFormatFlagsNativeEndian | kAudioFormatFlagIsPacked;
-    m_dstFormat.mBytesPerPacket = 4;
+    
+    if (config->outputSampleFormat == SAMPLE_FORMAT_FLOAT32) {
+        m_dstFormat.mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagsNativeEndian | kAudioFormatFlagIsPacked;
+        m_dstFormat.mBitsPerChannel = 32;
+    } else {
+        m_dstFormat.mFormatFlags = kLinearPCMFormatFlagIsSignedInteger | kAudioFormatFlagsNativeEndian | kAudioFormatFlagIsPacked;
+        m_dstFormat.mBitsPerChannel = 16;
+    }
+    
+    m_dstFormat.mChannelsPerFrame = channels;
+    m_dstFormat.mBytesPerFrame = channels * (m_dstFormat.mBitsPerChannel / 8);
     m_dstFormat.mFramesPerPacket = 1;
-    m_dstFormat.mBytesPerFrame = 4;
-    m_dstFormat.mChannelsPerFrame = 2;
-    m_dstFormat.mBitsPerChannel = 16;
+    m_dstFormat.mBytesPerPacket = m_dstFormat.mBytesPerFrame;
 }
 
 Audio_Stream::~Audio_Stream()
@@ -101,20 +141,33 @@ Audio_Stream::~Audio_Stream()
     
     close();
     
-    delete [] m_outputBuffer, m_outputBuffer = 0;
     
     if (m_inputStream) {
         m_inputStream->m_delegate = 0;
         delete m_inputStream, m_inputStream = 0;
     }
     
-    if (m_audioConverter) {
-        AudioConverterDispose(m_audioConverter), m_audioConverter = 0;
+    if (m_decoder) {
+        delete m_decoder, m_decoder = 0;
     }
     
     if (m_fileOutput) {
         delete m_fileOutput, m_fileOutput = 0;
     }
+    
+    if (m_decodeWorker) {
+        delete m_decodeWorker, m_decodeWorker = 0;
+    }
+    
+    free(m_pendingInput), m_pendingInput = 0;
+    
+    delete m_packetQueue, m_packetQueue = 0;
+    
+    m_eventLoop->cancel(this);
+    
+    if (m_ownsEventLoop) {
+        delete m_eventLoop, m_eventLoop = 0;
+    }
 }
     
 void Audio_Stream::open()
@@ -136,11 +189,14 @@ void Audio_Stream::open(Input_Stream_Position *position)
     m_processedPacketsCount = 0;
     m_bitrateBufferIndex = 0;
     m_initializationError = noErr;
-    m_converterRunOutOfData = false;
+    m_inputThrottled = false;
+    m_reconnectCount = 0;
+    m_inputPosition = (position ? position->start : 0);
+    m_inputDiscontinuity = false;
+    m_parseDiscontinuity = false;
     
     if (m_watchdogTimer) {
-        CFRunLoopTimerInvalidate(m_watchdogTimer);
-        CFRelease(m_watchdogTimer), m_watchdogTimer = 0;
+        m_eventLoop->stopTimer(m_watchdogTimer), m_watchdogTimer = 0;
     }
     
     Stream_Configuration *config = Stream_Configuration::configuration();
@@ -149,6 +205,30 @@ void Audio_Stream::open(Input_Stream_Position *position)
         CFRelease(m_contentType), m_contentType = NULL;
     }
     
+    m_pendingInputSize = 0;
+    m_inputEndPending = false;
+    m_decodeInputPaused = false;
+    m_decodeInputEnded = false;
+    m_decodeInputQueued = 0;
+    m_decodeInputConsumed = 0;
+    m_decodeDiscontinuity = UINT64_MAX;
+    
+    m_publishedTimePlayed = m_seekPosition;
+    m_publishedDuration = 0;
+    m_publishedCachedDataSize = 0;
+    m_publishedCachedPacketCount = 0;
+    m_publishedCachedDataDuration = 0;
+    
+    if (config->backgroundDecoding) {
+        if (!m_decodeWorker) {
+            m_decodeWorker = new Decode_Worker(kAudioStreamDecodeInputSize, kAudioStreamDecodeOutputSize, m_eventLoop);
+            m_decodeWorker->m_delegate = this;
+        }
+        if (!m_decodeWorker->start()) {
+            AS_TRACE("%s: failed to start the decode thread, decoding on this thread\n", __PRETTY_FUNCTION__);
+        }
+    }
+    
     bool success = false;
     
     if (position) {
@@ -173,19 +253,9 @@ void Audio_Stream::open(Input_Stream_Position *position)
              * (for instance some network error condition)
              */
             
-            CFRunLoopTimerContext ctx = {0, this, NULL, NULL, NULL};
-            
-            m_watchdogTimer = CFRunLoopTimerCreate(NULL,
-                                                   CFAbsoluteTimeGetCurrent() + config->startupWatchdogPeriod,
-                                                   0,
-                                                   0,
-                                                   0,
-                                                   watchdogTimerCallback,
-                                                   &ctx);
-            
             AS_TRACE("Starting the startup watchdog, period %i seconds\n", config->startupWatchdogPeriod);
             
-            CFRunLoopAddTimer(CFRunLoopGetCurrent(), m_watchdogTimer, kCFRunLoopCommonModes);
+            m_watchdogTimer = m_eventLoop->startTimer(config->startupWatchdogPeriod * 1000, false, watchdogTask, this, 0);
         }
     } else {
         AS_TRACE("%s: failed to open the HTTP stream\n", __PRETTY_FUNCTION__);
@@ -197,11 +267,21 @@ void Audio_Stream::close()
 {
     AS_TRACE("%s: enter\n", __PRETTY_FUNCTION__);
     
+    if (onDecodeThread()) {
+        // The stream is torn down on the owner thread
+        m_decodeWorker->postToOwner(closeTask, this, 0);
+        return;
+    }
+    
     if (m_watchdogTimer) {
-        CFRunLoopTimerInvalidate(m_watchdogTimer);
-        CFRelease(m_watchdogTimer), m_watchdogTimer = 0;
+        m_eventLoop->stopTimer(m_watchdogTimer), m_watchdogTimer = 0;
     }
     
+    if (m_reconnectTimer) {
+        m_eventLoop->stopTimer(m_reconnectTimer), m_reconnectTimer = 0;
+    }
+    m_reconnecting = false;
+    
     /* Close the HTTP stream first so that the audio stream parser
        isn't fed with more data to parse */
     if (m_inputStreamRunning) {
@@ -211,6 +291,14 @@ void Audio_Stream::close()
         m_inputStreamRunning = false;
     }
     
+    /* Then stop the decode thread; the worker is kept for the next open,
+       as this may be called from one of its owner thread callbacks */
+    if (m_decodeWorker) {
+        m_decodeWorker->stop();
+    }
+    m_pendingInputSize = 0;
+    m_inputEndPending = false;
+    
     if (m_audioStreamParserRunning) {
         if (m_audioFileStream) {
             if (AudioFileStreamClose(m_audioFileStream) != 0) {
@@ -235,25 +323,34 @@ void Audio_Stream::close()
     /*
      * Free any remaining queud packets for encoding.
      */
-    queued_packet_t *cur = m_queuedHead;
-    while (cur) {
-        queued_packet_t *tmp = cur->next;
-        free(cur);
-        cur = tmp;
-    }
-    m_queuedHead = m_queuedTail = 0;
-    m_cachedDataSize = 0;
+    m_packetQueue->clear();
+    
+    AS_TRACE("%s: %zu bytes allocated for the packet queue in %u allocations, high-water mark %zu packets, %zu bytes\n",
+             __PRETTY_FUNCTION__,
+             m_packetQueue->bytesAllocated(),
+             m_packetQueue->allocationCount(),
+             m_packetQueue->maxCount(),
+             m_packetQueue->maxByteSize());
     
     AS_TRACE("%s: leave\n", __PRETTY_FUNCTION__);
 }
     
 void Audio_Stream::pause()
 {
+    if (hasRemoteDecodeThread()) {
+        m_decodeWorker->perform([this]() { pause(); });
+        return;
+    }
+    
     audioQueue()->pause();
 }
     
 unsigned Audio_Stream::timePlayedInSeconds()
 {
+    if (hasRemoteDecodeThread()) {
+        return m_publishedTimePlayed;
+    }
+    
     if (m_audioStreamParserRunning) {
         return m_seekPosition + audioQueue()->timePlayedInSeconds();
     }
@@ -262,6 +359,10 @@ unsigned Audio_Stream::timePlayedInSeconds()
     
 unsigned Audio_Stream::durationInSeconds()
 {
+    if (hasRemoteDecodeThread()) {
+        return m_publishedDuration;
+    }
+    
     unsigned duration = 0;
     unsigned bitrate = this->bitrate();
     
@@ -315,6 +416,12 @@ Input_Stream_Position Audio_Stream::streamPositionForTime(unsigned newSeekTime)
     position.start = 0;
     position.end   = 0;
     
+    if (hasRemoteDecodeThread()) {
+        // The parser belongs to the decode thread
+        m_decodeWorker->perform([&]() { position = streamPositionForTime(newSeekTime); });
+        return position;
+    }
+    
     unsigned duration = durationInSeconds();
     if (!(duration > 0)) {
         return position;
@@ -350,6 +457,11 @@ void Audio_Stream::setVolume(float volume)
     if (volume > 1.0) {
         volume = 1.0;
     }
+    if (hasRemoteDecodeThread()) {
+        m_decodeWorker->perform([=]() { setVolume(volume); });
+        return;
+    }
+    
     // Store the volume so it will be used consequently when the queue plays
     m_outputVolume = volume;
     
@@ -360,6 +472,11 @@ void Audio_Stream::setVolume(float volume)
     
 void Audio_Stream::setPlayRate(float playRate)
 {
+    if (hasRemoteDecodeThread()) {
+        m_decodeWorker->perform([=]() { setPlayRate(playRate); });
+        return;
+    }
+    
     if (m_audioQueue) {
         m_audioQueue->setPlayRate(playRate);
     }
@@ -371,11 +488,15 @@ void Audio_Stream::setUrl(CFURLRef url)
         delete m_inputStream, m_inputStream = 0;
     }
     
-    if (HTTP_Stream::canHandleUrl(url)) {
+    if (!m_eventLoop->runsRunLoop() && Socket_Stream::canHandleUrl(url)) {
+        /* Without a run loop for CFNetwork, plain HTTP is read from a socket */
+        m_inputStream = new Socket_Stream(m_eventLoop);
+        m_inputStream->m_delegate = this;
+    } else if (HTTP_Stream::canHandleUrl(url)) {
         Stream_Configuration *config = Stream_Configuration::configuration();
         
         if (config->cacheEnabled) {
-            Caching_Stream *cache = new Caching_Stream(new HTTP_Stream());
+            Caching_Stream *cache = new Caching_Stream(new HTTP_Stream(m_eventLoop), m_eventLoop);
             
             CFStringRef cacheIdentifier = createCacheIdentifierForURL(url);
             
@@ -385,12 +506,12 @@ void Audio_Stream::setUrl(CFURLRef url)
             
             m_inputStream = cache;
         } else {
-            m_inputStream = new HTTP_Stream();
+            m_inputStream = new HTTP_Stream(m_eventLoop);
         }
         
         m_inputStream->m_delegate = this;
     } else if (File_Stream::canHandleUrl(url)) {
-        m_inputStream = new File_Stream();
+        m_inputStream = new File_Stream(m_eventLoop);
         m_inputStream->m_delegate = this;
     }
     
@@ -431,6 +552,7 @@ void Audio_Stream::setOutputFile(CFURLRef url)
     }
     if (url) {
         m_fileOutput = new File_Output(url);
+        m_fileOutput->setSyncPolicy(File_Output::SYNC_ON_CLOSE);
     }
     m_outputFile = url;
 }
@@ -447,6 +569,12 @@ Audio_Stream::State Audio_Stream::state()
     
 CFStringRef Audio_Stream::sourceFormatDescription()
 {
+    if (hasRemoteDecodeThread()) {
+        CFStringRef formatDescription = 0;
+        m_decodeWorker->perform([&]() { formatDescription = sourceFormatDescription(); });
+        return formatDescription;
+    }
+    
     unsigned char formatID[5];
     *(UInt32 *)formatID = OSSwapHostToBigInt32(m_srcFormat.mFormatID);
     
@@ -461,6 +589,11 @@ CFStringRef Audio_Stream::sourceFormatDescription()
     return formatDescription;
 }
 
+AudioStreamBasicDescription Audio_Stream::outputFormat()
+{
+    return m_dstFormat;
+}
+
 CFStringRef Audio_Stream::contentType()
 {
     return m_contentType;
@@ -480,7 +613,26 @@ CFStringRef Audio_Stream::createCacheIdentifierForURL(CFURLRef url)
     
 size_t Audio_Stream::cachedDataSize()
 {
-    return m_cachedDataSize;
+    if (hasRemoteDecodeThread()) {
+        return m_publishedCachedDataSize;
+    }
+    return m_packetQueue->byteSize();
+}
+    
+size_t Audio_Stream::cachedPacketCount()
+{
+    if (hasRemoteDecodeThread()) {
+        return m_publishedCachedPacketCount;
+    }
+    return m_packetQueue->count();
+}
+    
+double Audio_Stream::cachedDataDuration()
+{
+    if (hasRemoteDecodeThread()) {
+        return m_publishedCachedDataDuration;
+    }
+    return m_packetQueue->duration();
 }
     
 AudioFileTypeID Audio_Stream::audioStreamTypeFromContentType(CFStringRef contentType)
@@ -548,11 +700,16 @@ void Audio_Stream::audioQueueBuffersEmpty()
     
     Stream_Configuration *config = Stream_Configuration::configuration();
     
-    if (m_inputStreamRunning && FAILED != state()) {
+    if (inputRunning() && FAILED != state()) {
         /* Still feeding the audio queue with data,
            don't stop yet */
         setState(BUFFERING);
         
+        if (m_reconnecting) {
+            // Running out of data while the input reconnects is not bouncing
+            return;
+        }
+        
         if (m_firstBufferingTime == 0) {
             // Never buffered, just increase the counter
             m_firstBufferingTime = CFAbsoluteTimeGetCurrent();
@@ -590,9 +747,9 @@ void Audio_Stream::audioQueueBuffersEmpty()
     
     // Keep enqueuing the packets in the queue until we have them
     
-    int count = cachedDataCount();
+    size_t count = m_packetQueue->count();
     
-    AS_TRACE("%i cached packets, enqueuing\n", count);
+    AS_TRACE("%zu cached packets, enqueuing\n", count);
     
     if (count > 0) {
         enqueueCachedData(0);
@@ -615,6 +772,12 @@ void Audio_Stream::audioQueueUnderflow()
     
 void Audio_Stream::audioQueueInitializationFailed()
 {
+    if (onDecodeThread()) {
+        closeAndSignalError(audioQueue()->m_lastError == kAudioFormatUnsupportedDataFormatError ?
+                            AS_ERR_UNSUPPORTED_FORMAT : AS_ERR_STREAM_PARSE);
+        return;
+    }
+    
     if (m_inputStreamRunning) {
         if (m_inputStream) {
             m_inputStream->close();
@@ -635,11 +798,11 @@ void Audio_Stream::audioQueueInitializationFailed()
     
 void Audio_Stream::audioQueueFinishedPlayingPacket()
 {
-    int count = cachedDataCount();
-    
-    if (count > 0) {
+    if (!m_packetQueue->empty()) {
         enqueueCachedData(0);
     }
+    
+    publishStats();
 }
     
 void Audio_Stream::streamIsReadyRead()
@@ -703,24 +866,59 @@ void Audio_Stream::streamHasBytesAvailable(UInt8 *data, UInt32 numBytes)
         return;
     }
     
-    if (m_fileOutput) {
-        m_fileOutput->write(data, numBytes);
+    m_inputPosition += numBytes;
+    
+    if (m_reconnecting) {
+        m_reconnecting = false;
+        m_reconnectCount = 0;
+        
+        double gap = CFAbsoluteTimeGetCurrent() - m_disconnectTime;
+        
+        AS_TRACE("%s: reconnected, %f seconds without data\n", __PRETTY_FUNCTION__, gap);
+        
+        if (m_delegate) {
+            m_delegate->audioStreamReconnected(gap);
+            
+            if (!m_inputStreamRunning) {
+                return;
+            }
+        }
     }
-	
-    if (m_audioStreamParserRunning) {
-        OSStatus result = AudioFileStreamParseBytes(m_audioFileStream, numBytes, data, 0);
+    
+    if (m_inputDiscontinuity) {
+        m_inputDiscontinuity = false;
         
-        if (result != 0) {
-            AS_TRACE("%s: AudioFileStreamParseBytes error %d\n", __PRETTY_FUNCTION__, (int)result);
-            closeAndSignalError(AS_ERR_STREAM_PARSE);
-        } else if (m_initializationError == kAudioConverterErr_FormatNotSupported) {
-            AS_TRACE("Audio stream initialization failed due to unsupported format\n");
-            closeAndSignalError(AS_ERR_UNSUPPORTED_FORMAT);
-        } else if (m_initializationError != noErr) {
-            AS_TRACE("Audio stream initialization failed due to unknown error\n");
-            closeAndSignalError(AS_ERR_OPEN);
+        // The parser resyncs at the first bytes of the new connection
+        if (m_decodeWorker && m_decodeWorker->isRunning()) {
+            m_decodeDiscontinuity = m_decodeInputQueued;
+        } else {
+            m_parseDiscontinuity = true;
         }
     }
+    
+    if (m_fileOutput && m_fileOutput->write(data, numBytes) < 0) {
+        AS_TRACE("%s: writing the output file failed\n", __PRETTY_FUNCTION__);
+        
+        // Nothing more can be written to it
+        delete m_fileOutput, m_fileOutput = 0;
+        
+        if (m_delegate) {
+            m_delegate->audioStreamErrorOccurred(AS_ERR_OUTPUT_FILE);
+            
+            if (!m_inputStreamRunning) {
+                return;
+            }
+        }
+    }
+    
+    if (m_decodeWorker && m_decodeWorker->isRunning()) {
+        queueDecodeInput(data, numBytes);
+        return;
+    }
+	
+    if (m_audioStreamParserRunning) {
+        parseBytes(data, numBytes);
+    }
 }
 
 void Audio_Stream::streamEndEncountered()
@@ -732,12 +930,26 @@ void Audio_Stream::streamEndEncountered()
         return;
     }
     
+    // A connection closed before the end of the content dropped; the position is in the whole content
+    if (contentLength() > 0 && m_inputPosition < contentLength() && reconnectInput()) {
+        return;
+    }
+    
     setState(END_OF_FILE);
     
     if (m_inputStream) {
         m_inputStream->close();
     }
     m_inputStreamRunning = false;
+    
+    if (m_decodeWorker && m_decodeWorker->isRunning()) {
+        // The decode thread learns about the end after the last bytes
+        if (m_pendingInputSize > 0) {
+            m_inputEndPending = true;
+        } else {
+            m_decodeWorker->post(inputEndedTask, this, 0);
+        }
+    }
 }
 
 void Audio_Stream::streamErrorOccurred()
@@ -749,16 +961,125 @@ void Audio_Stream::streamErrorOccurred()
         return;
     }
     
+    if (reconnectInput()) {
+        return;
+    }
+    
     closeAndSignalError(AS_ERR_NETWORK);
 }
     
-void Audio_Stream::streamMetaDataAvailable(std::map<CFStringRef,CFStringRef> metaData)
+void Audio_Stream::streamMetaDataAvailable(Meta_Data&& metaData)
 {
     if (m_delegate) {
-        m_delegate->audioStreamMetaDataAvailable(metaData);
+        m_delegate->audioStreamMetaDataAvailable(std::move(metaData));
+    }
+}
+    
+void Audio_Stream::decodeWorkerInputAvailable()
+{
+    while (!m_decodeInputPaused && m_audioStreamParserRunning && FAILED != state()) {
+        const void *data;
+        size_t numBytes = m_decodeWorker->inputRegion(&data);
+        
+        if (numBytes == 0) {
+            break;
+        }
+        if (numBytes > kAudioStreamDecodeChunkSize) {
+            numBytes = kAudioStreamDecodeChunkSize;
+        }
+        
+        // Read after the region, so the mark of the bytes in it is seen
+        UInt64 discontinuity = m_decodeDiscontinuity;
+        
+        if (discontinuity < m_decodeInputConsumed + numBytes) {
+            if (discontinuity > m_decodeInputConsumed) {
+                // Parse up to the discontinuity first
+                numBytes = (size_t)(discontinuity - m_decodeInputConsumed);
+            } else {
+                m_decodeDiscontinuity.compare_exchange_strong(discontinuity, UINT64_MAX);
+                m_parseDiscontinuity = true;
+            }
+        }
+        
+        parseBytes((UInt8 *)data, (UInt32)numBytes);
+        
+        m_decodeWorker->inputAdvance(numBytes);
+        m_decodeInputConsumed += numBytes;
+    }
+}
+    
+void Audio_Stream::decodeWorkerInputSpaceAvailable()
+{
+    if (m_pendingInputSize > 0) {
+        size_t written = m_decodeWorker->writeInput(m_pendingInput, m_pendingInputSize);
+        
+        m_pendingInputSize -= written;
+        memmove(m_pendingInput, m_pendingInput + written, m_pendingInputSize);
+        
+        if (m_pendingInputSize > 0) {
+            // Still blocked, wait for the next notification
+            return;
+        }
+    }
+    
+    if (m_inputStreamRunning && m_inputStream) {
+        AS_TRACE("Decode input drained, enabling the HTTP stream\n");
+        
+        m_inputStream->setScheduledInRunLoop(true);
+    }
+    
+    if (m_inputEndPending) {
+        m_inputEndPending = false;
+        m_decodeWorker->post(inputEndedTask, this, 0);
+    }
+}
+    
+void Audio_Stream::decodeWorkerOutputAvailable()
+{
+    while (m_decodeWorker->readOutput(m_outputChunk)) {
+        if (!m_delegate || m_outputChunk.empty()) {
+            continue;
+        }
+        
+        AudioBufferList samples;
+        samples.mNumberBuffers = 1;
+        samples.mBuffers[0].mNumberChannels = m_dstFormat.mChannelsPerFrame;
+        samples.mBuffers[0].mDataByteSize = (UInt32)m_outputChunk.size();
+        samples.mBuffers[0].mData = &m_outputChunk[0];
+        
+        AudioStreamPacketDescription description;
+        description.mStartOffset = 0;
+        description.mDataByteSize = (UInt32)m_outputChunk.size();
+        description.mVariableFramesInPacket = 0;
+        
+        m_delegate->samplesAvailable(samples, description);
     }
 }
     
+UInt32 Audio_Stream::decoderInputPackets(UInt32 maxPackets, const void **data, UInt32 *numBytes, AudioStreamPacketDescription **descs)
+{
+    AS_TRACE("decoderInputPackets called\n");
+    
+    // Hand the decoder as many adjacent packets as it asks for, in place
+    UInt32 numPackets;
+    
+    if (m_srcFormat.mBytesPerPacket > 0) {
+        // Constant bit rate data is queued in blocks, split one if it holds more
+        numPackets = m_packetQueue->consumeBytes((size_t)maxPackets * m_srcFormat.mBytesPerPacket, data, numBytes, descs);
+    } else {
+        numPackets = m_packetQueue->consume(maxPackets, data, numBytes, descs);
+    }
+    
+    if (numPackets == 0) {
+        AS_TRACE("run out of data to provide for decoding\n");
+        return 0;
+    }
+    
+    m_processedPacketsCount += numPackets;
+    
+    return numPackets;
+}
+    
 /* private */
     
 CFStringRef Audio_Stream::createHashForString(CFStringRef str)
@@ -800,7 +1121,12 @@ Audio_Queue* Audio_Stream::audioQueue()
     if (!m_audioQueue) {
         AS_TRACE("No audio queue, creating\n");
         
-        m_audioQueue = new Audio_Queue();
+        /* The queue calls back on the thread which decodes into it */
+        if (m_decodeWorker && m_decodeWorker->isRunning()) {
+            m_audioQueue = new Audio_Queue(m_decodeWorker->eventLoop());
+        } else {
+            m_audioQueue = new Audio_Queue(m_eventLoop);
+        }
         
         m_audioQueue->m_delegate = this;
         m_audioQueue->m_streamDesc = m_dstFormat;
@@ -812,6 +1138,92 @@ Audio_Queue* Audio_Stream::audioQueue()
     return m_audioQueue;
 }
     
+void Audio_Stream::createDecoder()
+{
+    if (m_decoder && memcmp(&m_decoderFormat, &m_srcFormat, sizeof m_srcFormat) == 0) {
+        // Same source format as before (a reconnect or a seek), reuse the decoder
+        AS_TRACE("Reusing the decoder\n");
+        
+        m_decoder->reset();
+        return;
+    }
+    
+    if (m_decoder) {
+        delete m_decoder, m_decoder = 0;
+    }
+    
+    OSStatus err;
+    
+    m_decoder = Audio_Converter_Decoder::create(m_srcFormat, m_dstFormat, &err);
+    
+    if (!m_decoder) {
+        AS_TRACE("Error in creating a decoder, error %i\n", err);
+        
+        m_initializationError = err;
+        return;
+    }
+    
+    m_decoder->m_delegate = this;
+    m_decoderFormat = m_srcFormat;
+}
+    
+double Audio_Stream::queuedDuration()
+{
+    double duration = m_packetQueue->duration();
+    
+    if (duration > 0 || m_packetQueue->empty()) {
+        return duration;
+    }
+    
+    // No frame counts for the format, estimate from the observed bitrate
+    unsigned bitrate = this->bitrate();
+    
+    if (bitrate > 0) {
+        return m_packetQueue->byteSize() * 8.0 / bitrate;
+    }
+    return -1;
+}
+    
+bool Audio_Stream::decodeThresholdReached()
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    double duration = queuedDuration();
+    
+    if (duration < 0) {
+        return (m_packetQueue->count() > config->decodeQueueSize);
+    }
+    
+    // Keep a smaller lead once playing, build up the startup buffer otherwise
+    int thresholdMs = (state() == PLAYING ? config->lowWatermarkMs : config->startupBufferMs);
+    
+    return (duration * 1000 >= thresholdMs);
+}
+    
+bool Audio_Stream::prebufferFull()
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    double duration = queuedDuration();
+    
+    if (duration < 0) {
+        return (m_packetQueue->byteSize() >= config->maxPrebufferedByteCount);
+    }
+    return (duration * 1000 >= config->highWatermarkMs);
+}
+    
+bool Audio_Stream::refillNeeded()
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    double duration = queuedDuration();
+    
+    if (duration < 0) {
+        return (m_packetQueue->byteSize() < config->maxPrebufferedByteCount / 2);
+    }
+    return (duration * 1000 < config->refillWatermarkMs);
+}
+    
 void Audio_Stream::closeAudioQueue()
 {
     if (!m_audioQueue) {
@@ -828,17 +1240,70 @@ UInt64 Audio_Stream::contentLength()
 {
     if (m_contentLength == 0) {
         if (m_inputStream) {
-            m_contentLength = m_inputStream->contentLength();
+            // Opened at an offset, the response only has the rest of the content
+            m_contentLength = m_inputStream->totalLength();
         }
     }
     return m_contentLength;
 }
 
+bool Audio_Stream::reconnectInput()
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    /* Only a stream which already plays is reconnected; a failing
+       open is reported as it is */
+    if (!m_audioStreamParserRunning || FAILED == state()) {
+        return false;
+    }
+    if (config->maxReconnectCount <= 0 || m_reconnectCount >= (unsigned)config->maxReconnectCount) {
+        AS_TRACE("%s: no reconnects left\n", __PRETTY_FUNCTION__);
+        return false;
+    }
+    if (contentLength() > 0 && m_inputPosition >= contentLength()) {
+        return false;
+    }
+    
+    if (m_inputStream) {
+        m_inputStream->close();
+    }
+    
+    if (!m_reconnecting) {
+        m_reconnecting = true;
+        m_disconnectTime = CFAbsoluteTimeGetCurrent();
+    }
+    
+    unsigned delayMs = (config->reconnectDelayMs > 0 ? config->reconnectDelayMs : 0);
+    
+    for (unsigned i = 0; i < m_reconnectCount && (int)delayMs < config->maxReconnectDelayMs; i++) {
+        delayMs *= 2;
+    }
+    if ((int)delayMs > config->maxReconnectDelayMs) {
+        delayMs = config->maxReconnectDelayMs;
+    }
+    
+    m_reconnectCount++;
+    
+    AS_TRACE("%s: reconnect %u in %u ms\n", __PRETTY_FUNCTION__, m_reconnectCount, delayMs);
+    
+    m_reconnectTimer = m_eventLoop->startTimer(delayMs, false, reconnectTask, this, 0);
+    
+    return true;
+}
+    
 void Audio_Stream::closeAndSignalError(int errorCode)
 {
     AS_TRACE("%s: error %i\n", __PRETTY_FUNCTION__, errorCode);
     
     setState(FAILED);
+    
+    if (onDecodeThread()) {
+        // Stop decoding, the owner thread closes the stream
+        m_decodeInputPaused = true;
+        m_decodeWorker->postToOwner(errorTask, this, errorCode);
+        return;
+    }
+    
     close();
     
     if (m_delegate) {
@@ -854,8 +1319,142 @@ void Audio_Stream::setState(State state)
     
     m_state = state;
     
+    if (onDecodeThread()) {
+        // The delegate is always called on the owner thread
+        m_decodeWorker->postToOwner(stateChangedTask, this, state);
+        return;
+    }
+    
+    notifyStateChange(state);
+}
+    
+void Audio_Stream::notifyStateChange(State state)
+{
+    if (state == PLAYING && m_watchdogTimer) {
+        AS_TRACE("The stream started to play, canceling the watchdog\n");
+        
+        m_eventLoop->stopTimer(m_watchdogTimer), m_watchdogTimer = 0;
+    }
+    
     if (m_delegate) {
-        m_delegate->audioStreamStateChanged(m_state);
+        m_delegate->audioStreamStateChanged(state);
+    }
+}
+    
+bool Audio_Stream::onDecodeThread()
+{
+    return (m_decodeWorker && m_decodeWorker->isDecodeThread());
+}
+    
+bool Audio_Stream::hasRemoteDecodeThread()
+{
+    return (m_decodeWorker && m_decodeWorker->isRunning() && !m_decodeWorker->isDecodeThread());
+}
+    
+void Audio_Stream::publishStats()
+{
+    if (!onDecodeThread()) {
+        return;
+    }
+    
+    // Asking the audio queue here would create it
+    if (m_audioQueue && m_audioStreamParserRunning) {
+        m_publishedTimePlayed = m_seekPosition + m_audioQueue->timePlayedInSeconds();
+    }
+    m_publishedDuration = durationInSeconds();
+    m_publishedCachedDataSize = m_packetQueue->byteSize();
+    m_publishedCachedPacketCount = m_packetQueue->count();
+    m_publishedCachedDataDuration = m_packetQueue->duration();
+}
+    
+bool Audio_Stream::inputRunning()
+{
+    if (onDecodeThread()) {
+        // Bytes still in the decode input count as running input
+        return (!m_decodeInputEnded || m_decodeWorker->inputAvailable() > 0);
+    }
+    return m_inputStreamRunning;
+}
+    
+void Audio_Stream::setInputScheduled(bool scheduled)
+{
+    if (onDecodeThread()) {
+        // Throttle the decode input; the owner pauses the network once it fills up
+        bool wasPaused = m_decodeInputPaused;
+        
+        m_decodeInputPaused = !scheduled;
+        
+        if (wasPaused && scheduled) {
+            m_decodeWorker->signal();
+        }
+        return;
+    }
+    
+    if (m_inputStream) {
+        m_inputStream->setScheduledInRunLoop(scheduled);
+    }
+}
+    
+void Audio_Stream::parseBytes(UInt8 *data, UInt32 numBytes)
+{
+    UInt32 flags = 0;
+    
+    if (m_parseDiscontinuity) {
+        m_parseDiscontinuity = false;
+        flags = kAudioFileStreamParseFlag_Discontinuity;
+    }
+    
+    OSStatus result = AudioFileStreamParseBytes(m_audioFileStream, numBytes, data, flags);
+    
+    if (result != 0) {
+        AS_TRACE("%s: AudioFileStreamParseBytes error %d\n", __PRETTY_FUNCTION__, (int)result);
+        closeAndSignalError(AS_ERR_STREAM_PARSE);
+    } else if (m_initializationError == kAudioConverterErr_FormatNotSupported) {
+        AS_TRACE("Audio stream initialization failed due to unsupported format\n");
+        closeAndSignalError(AS_ERR_UNSUPPORTED_FORMAT);
+    } else if (m_initializationError != noErr) {
+        AS_TRACE("Audio stream initialization failed due to unknown error\n");
+        closeAndSignalError(AS_ERR_OPEN);
+    }
+}
+    
+void Audio_Stream::queueDecodeInput(UInt8 *data, UInt32 numBytes)
+{
+    size_t written = 0;
+    
+    m_decodeInputQueued += numBytes;
+    
+    // Keep the byte order: nothing goes to the ring before the pending bytes
+    if (m_pendingInputSize == 0) {
+        written = m_decodeWorker->writeInput(data, numBytes);
+    }
+    
+    if (written == numBytes) {
+        return;
+    }
+    
+    size_t remaining = numBytes - written;
+    
+    if (m_pendingInputSize + remaining > m_pendingInputCapacity) {
+        size_t capacity = m_pendingInputSize + remaining;
+        UInt8 *pendingInput = (UInt8 *)realloc(m_pendingInput, capacity);
+        
+        if (!pendingInput) {
+            AS_TRACE("%s: failed to keep %zu pending bytes\n", __PRETTY_FUNCTION__, remaining);
+            closeAndSignalError(AS_ERR_STREAM_PARSE);
+            return;
+        }
+        m_pendingInput = pendingInput;
+        m_pendingInputCapacity = capacity;
+    }
+    
+    memcpy(m_pendingInput + m_pendingInputSize, data + written, remaining);
+    m_pendingInputSize += remaining;
+    
+    AS_TRACE("Decode input full, disabling the HTTP stream\n");
+    
+    if (m_inputStream) {
+        m_inputStream->setScheduledInRunLoop(false);
     }
 }
     
@@ -880,9 +1479,9 @@ void Audio_Stream::setCookiesForStream(AudioFileStreamID inAudioFileStream)
         return;
     }
     
-    // set the cookie on the queue.
-    if (m_audioConverter) {
-        AudioConverterSetProperty(m_audioConverter, kAudioConverterDecompressionMagicCookie, cookieSize, cookieData);
+    // set the cookie on the decoder.
+    if (m_decoder) {
+        m_decoder->setMagicCookie(cookieData, cookieSize);
     }
     
     free(cookieData);
@@ -902,176 +1501,160 @@ unsigned Audio_Stream::bitrate()
     return sum / kAudioStreamBitrateBufferSize;
 }
     
-void Audio_Stream::watchdogTimerCallback(CFRunLoopTimerRef timer, void *info)
+void Audio_Stream::watchdogTask(void *info, intptr_t arg)
 {
     Audio_Stream *THIS = (Audio_Stream *)info;
     
+    THIS->m_watchdogTimer = 0;
+    
     if (PLAYING != THIS->state()) {
         AS_TRACE("The stream startup watchdog activated: stream didn't start to play soon enough\n");
         
         THIS->closeAndSignalError(AS_ERR_OPEN);
     }
 }
-
-int Audio_Stream::cachedDataCount()
-{
-    int count = 0;
-    queued_packet_t *cur = m_queuedHead;
-    while (cur) {
-        cur = cur->next;
-        count++;
-    }
-    return count;
-}
     
-void Audio_Stream::enqueueCachedData(int minPacketsRequired)
+void Audio_Stream::reconnectTask(void *info, intptr_t arg)
 {
-    if (!m_queueCanAcceptPackets) {
-        AS_TRACE("Queue cannot accept packets, return\n");
+    Audio_Stream *THIS = (Audio_Stream *)info;
+    
+    THIS->m_reconnectTimer = 0;
+    
+    if (!THIS->m_reconnecting || !THIS->m_inputStream) {
         return;
     }
     
-    if (m_converterRunOutOfData) {
-        AS_TRACE("Converted run out of data\n");
+    bool success;
+    
+    if (THIS->contentLength() > 0) {
+        // Resume the content from the next byte
+        Input_Stream_Position position;
+        position.start = THIS->m_inputPosition;
+        position.end = 0;
         
-        if (m_audioConverter) {
-            AudioConverterDispose(m_audioConverter);
-        }
+        success = THIS->m_inputStream->open(position);
+    } else {
+        // A live stream continues from where it is now
+        THIS->m_inputDiscontinuity = true;
         
-        OSStatus err = AudioConverterNew(&(m_srcFormat),
-                                         &(m_dstFormat),
-                                         &(m_audioConverter));
+        success = THIS->m_inputStream->open();
+    }
+    
+    if (success) {
+        // Keep a throttled input paused
+        bool decodeThread = (THIS->m_decodeWorker && THIS->m_decodeWorker->isRunning());
         
-        if (err) {
-            AS_TRACE("Error in creating an audio converter, error %i\n", err);
-            
-           m_initializationError = err;
+        if ((!decodeThread && THIS->m_inputThrottled) || THIS->m_pendingInputSize > 0) {
+            THIS->m_inputStream->setScheduledInRunLoop(false);
         }
-        
-        m_converterRunOutOfData = false;
+    } else if (!THIS->reconnectInput()) {
+        THIS->closeAndSignalError(AS_ERR_NETWORK);
+    }
+}
+    
+void Audio_Stream::stateChangedTask(void *info, intptr_t arg)
+{
+    Audio_Stream *THIS = (Audio_Stream *)info;
+    
+    THIS->notifyStateChange((State)arg);
+}
+    
+void Audio_Stream::closeTask(void *info, intptr_t arg)
+{
+    Audio_Stream *THIS = (Audio_Stream *)info;
+    
+    THIS->close();
+}
+    
+void Audio_Stream::errorTask(void *info, intptr_t arg)
+{
+    Audio_Stream *THIS = (Audio_Stream *)info;
+    
+    THIS->closeAndSignalError((int)arg);
+}
+    
+void Audio_Stream::inputEndedTask(void *info, intptr_t arg)
+{
+    Audio_Stream *THIS = (Audio_Stream *)info;
+    
+    THIS->m_decodeInputEnded = true;
+}
+
+void Audio_Stream::enqueueCachedData(int minPacketsRequired)
+{
+    if (!m_queueCanAcceptPackets) {
+        AS_TRACE("Queue cannot accept packets, return\n");
+        return;
     }
     
     if (state() == PAUSED) {
         return;
     }
     
-    int count = cachedDataCount();
+    if (!m_decoder) {
+        AS_TRACE("No decoder, returning...\n");
+        return;
+    }
     
-    if (count > minPacketsRequired) {
-        AudioBufferList outputBufferList;
-        outputBufferList.mNumberBuffers = 1;
-        outputBufferList.mBuffers[0].mNumberChannels = m_dstFormat.mChannelsPerFrame;
-        outputBufferList.mBuffers[0].mDataByteSize = m_outputBufferSize;
-        outputBufferList.mBuffers[0].mData = m_outputBuffer;
+    if (m_packetQueue->count() > (size_t)minPacketsRequired) {
+        // Decode straight into the audio queue buffer being filled
+        void *outputData;
+        UInt32 outputCapacity = audioQueue()->lendBuffer(&outputData);
         
-        AudioStreamPacketDescription description;
-        description.mStartOffset = 0;
-        description.mDataByteSize = m_outputBufferSize;
-        description.mVariableFramesInPacket = 0;
+        UInt32 ioOutputDataPackets = outputCapacity / m_dstFormat.mBytesPerPacket;
         
-        UInt32 ioOutputDataPackets = m_outputBufferSize / m_dstFormat.mBytesPerPacket;
+        if (ioOutputDataPackets == 0) {
+            AS_TRACE("No audio queue buffer available, returning...\n");
+            return;
+        }
         
-        AS_TRACE("calling AudioConverterFillComplexBuffer\n");
+        AudioBufferList outputBufferList;
+        outputBufferList.mNumberBuffers = 1;
+        outputBufferList.mBuffers[0].mNumberChannels = m_dstFormat.mChannelsPerFrame;
+        outputBufferList.mBuffers[0].mDataByteSize = ioOutputDataPackets * m_dstFormat.mBytesPerPacket;
+        outputBufferList.mBuffers[0].mData = outputData;
         
-        Stream_Configuration *config = Stream_Configuration::configuration();
+        OSStatus err = m_decoder->decode(&ioOutputDataPackets, &outputBufferList);
         
-        OSStatus err = AudioConverterFillComplexBuffer(m_audioConverter,
-                                                       &encoderDataCallback,
-                                                       this,
-                                                       &ioOutputDataPackets,
-                                                       &outputBufferList,
-                                                       NULL);
-        if (err == noErr) {
+        if (err == noErr && ioOutputDataPackets > 0) {
             AS_TRACE("%i output bytes available for the audio queue\n", (unsigned int)ioOutputDataPackets);
             
-            if (m_watchdogTimer) {
-                AS_TRACE("The stream started to play, canceling the watchdog\n");
-                
-                CFRunLoopTimerInvalidate(m_watchdogTimer);
-                CFRelease(m_watchdogTimer), m_watchdogTimer = 0;
-            }
-            
             setState(PLAYING);
             
-            audioQueue()->handleAudioPackets(outputBufferList.mBuffers[0].mDataByteSize,
-                                                   outputBufferList.mNumberBuffers,
-                                                   outputBufferList.mBuffers[0].mData,
-                                                   &description);
+            UInt32 outputBytes = ioOutputDataPackets * m_dstFormat.mBytesPerPacket;
             
-            if (m_delegate) {
-                m_delegate->samplesAvailable(outputBufferList, description);
-            }
+            outputBufferList.mBuffers[0].mDataByteSize = outputBytes;
             
-            for(std::list<queued_packet_t*>::iterator iter = m_processedPackets.begin();
-                iter != m_processedPackets.end(); iter++) {
-                queued_packet_t *cur = *iter;
+            // The samples must be tapped before the buffer is handed to the audio queue
+            if (onDecodeThread()) {
+                // The owner thread delivers them from the output ring
+                m_decodeWorker->writeOutput(outputData, outputBytes);
+            } else if (m_delegate) {
+                AudioStreamPacketDescription description;
+                description.mStartOffset = 0;
+                description.mDataByteSize = outputBytes;
+                description.mVariableFramesInPacket = 0;
                 
-                m_cachedDataSize -= cur->desc.mDataByteSize;
-                
-                if (m_cachedDataSize < config->maxPrebufferedByteCount) {
-                    AS_TRACE("Cache underflow, enabling the HTTP stream\n");
-                    
-                    if (m_inputStream) {
-                        m_inputStream->setScheduledInRunLoop(true);
-                    }
-                }
-                
-                free(cur);
+                m_delegate->samplesAvailable(outputBufferList, description);
             }
-            m_processedPackets.clear();
+            
+            audioQueue()->commitBuffer(outputBytes);
         } else {
-            AS_TRACE("AudioConverterFillComplexBuffer failed, error %i\n", err);
+            AS_TRACE("Nothing decoded, error %i\n", err);
         }
-    } else {
-        AS_TRACE("Less than %i packets queued, returning...\n", minPacketsRequired);
-    }
-}
-    
-OSStatus Audio_Stream::encoderDataCallback(AudioConverterRef inAudioConverter, UInt32 *ioNumberDataPackets, AudioBufferList *ioData, AudioStreamPacketDescription **outDataPacketDescription, void *inUserData)
-{
-    Audio_Stream *THIS = (Audio_Stream *)inUserData;
-    
-    AS_TRACE("encoderDataCallback called\n");
-    
-    // Dequeue one packet per time for the decoder
-    queued_packet_t *front = THIS->m_queuedHead;
-    
-    if (!front) {
-        /*
-         * End of stream - Inside your input procedure, you must set the total amount of packets read and the sizes of the data in the AudioBufferList to zero. The input procedure should also return noErr. This will signal the AudioConverter that you are out of data. More specifically, set ioNumberDataPackets and ioBufferList->mDataByteSize to zero in your input proc and return noErr. Where ioNumberDataPackets is the amount of data converted and ioBufferList->mDataByteSize is the size of the amount of data converted in each AudioBuffer within your input procedure callback. Your input procedure may be called a few more times; you should just keep returning zero and noErr.
-         */
-        
-        AS_TRACE("run out of data to provide for encoding\n");
-        
-        THIS->m_converterRunOutOfData = true;
-        
-        *ioNumberDataPackets = 0;
         
-        ioData->mBuffers[0].mDataByteSize = 0;
+        // The converter is done with the packets it consumed
+        m_packetQueue->releaseConsumed();
         
-        return noErr;
+        if (m_inputThrottled && refillNeeded()) {
+            AS_TRACE("Cache underflow, enabling the HTTP stream\n");
+            
+            m_inputThrottled = false;
+            setInputScheduled(true);
+        }
     } else {
-        THIS->m_converterRunOutOfData = false;
-    }
-    
-    *ioNumberDataPackets = 1;
-    
-    ioData->mBuffers[0].mData = front->data;
-	ioData->mBuffers[0].mDataByteSize = front->desc.mDataByteSize;
-	ioData->mBuffers[0].mNumberChannels = THIS->m_srcFormat.mChannelsPerFrame;
-    
-    if (outDataPacketDescription) {
-        *outDataPacketDescription = &front->desc;
+        AS_TRACE("Less than %i packets queued, returning...\n", minPacketsRequired);
     }
-    
-    THIS->m_queuedHead = front->next;
-    
-    front->next = NULL;
-    THIS->m_processedPackets.push_front(front);
-    
-    THIS->m_processedPacketsCount++;
-    
-    return noErr;
 }
     
 /* This is called by audio file stream parser when it finds property values */
@@ -1138,21 +1721,11 @@ void Audio_Stream::propertyValueCallback(void *inClientData, AudioFileStreamID i
             
             THIS->m_packetDuration = THIS->m_srcFormat.mFramesPerPacket / THIS->m_srcFormat.mSampleRate;
             
-            AS_TRACE("srcFormat, bytes per packet %i\n", (unsigned int)THIS->m_srcFormat.mBytesPerPacket);
+            THIS->m_packetQueue->setFormat(THIS->m_srcFormat);
             
-            if (THIS->m_audioConverter) {
-                AudioConverterDispose(THIS->m_audioConverter);
-            }
+            AS_TRACE("srcFormat, bytes per packet %i\n", (unsigned int)THIS->m_srcFormat.mBytesPerPacket);
             
-            err = AudioConverterNew(&(THIS->m_srcFormat),
-                                    &(THIS->m_dstFormat),
-                                    &(THIS->m_audioConverter));
-            
-            if (err) {
-                AS_TRACE("Error in creating an audio converter, error %i\n", err);
-                
-                THIS->m_initializationError = err;
-            }
+            THIS->createDecoder();
             
             THIS->setCookiesForStream(inAudioFileStream);
             
@@ -1171,7 +1744,6 @@ void Audio_Stream::streamDataCallback(void *inClientData, UInt32 inNumberBytes,
 {    
     AS_TRACE("%s: inNumberBytes %u, inNumberPackets %u\n", __FUNCTION__, inNumberBytes, inNumberPackets);
     
-    Stream_Configuration *config = Stream_Configuration::configuration();
     Audio_Stream *THIS = static_cast<Audio_Stream*>(inClientData);
     
     if (!THIS->m_audioStreamParserRunning) {
@@ -1179,45 +1751,54 @@ void Audio_Stream::streamDataCallback(void *inClientData, UInt32 inNumberBytes,
         return;
     }
     
+    AudioStreamPacketDescription cbrDescription;
+    
+    if (!inPacketDescriptions) {
+        // Constant bit rate data (LPCM) comes without descriptions, queue it as one block
+        cbrDescription.mStartOffset = 0;
+        cbrDescription.mVariableFramesInPacket = 0;
+        cbrDescription.mDataByteSize = inNumberBytes;
+        
+        inNumberPackets = 1;
+        inPacketDescriptions = &cbrDescription;
+    }
+    
+    if (!THIS->m_packetQueue->push(inNumberPackets, inInputData, inPacketDescriptions)) {
+        AS_TRACE("%s: failed to queue %u packets\n", __PRETTY_FUNCTION__, (unsigned int)inNumberPackets);
+        return;
+    }
+    
+    if (THIS->m_srcFormat.mBytesPerPacket > 0) {
+        // Constant bit rate, no need to sample
+        while (THIS->m_bitrateBufferIndex < kAudioStreamBitrateBufferSize) {
+            THIS->m_bitrateBuffer[THIS->m_bitrateBufferIndex++] = 8 * THIS->m_srcFormat.mBytesPerPacket / THIS->m_packetDuration;
+        }
+    }
+    
     for (int i = 0; i < inNumberPackets; i++) {
-        /* Allocate the packet */
-        UInt32 size = inPacketDescriptions[i].mDataByteSize;
-        queued_packet_t *packet = (queued_packet_t *)malloc(sizeof(queued_packet_t) + size);
+        AudioStreamPacketDescription *desc = &inPacketDescriptions[i];
         
         if (THIS->m_bitrateBufferIndex < kAudioStreamBitrateBufferSize) {
             // Only keep sampling for one buffer cycle; this is to keep the counters (for instance) duration
             // stable.
             
-            THIS->m_bitrateBuffer[THIS->m_bitrateBufferIndex++] = 8 * inPacketDescriptions[i].mDataByteSize / THIS->m_packetDuration;
+            THIS->m_bitrateBuffer[THIS->m_bitrateBufferIndex++] = 8 * desc->mDataByteSize / THIS->m_packetDuration;
         }
+    }
+    
+    if (!THIS->m_inputThrottled && THIS->prebufferFull()) {
+        AS_TRACE("Cache overflow, disabling the HTTP stream\n");
         
-        
-        /* Prepare the packet */
-        packet->next = NULL;
-        packet->desc = inPacketDescriptions[i];
-        packet->desc.mStartOffset = 0;
-        memcpy(packet->data, (const char *)inInputData + inPacketDescriptions[i].mStartOffset,
-               size);
-        
-        if (THIS->m_queuedHead == NULL) {
-            THIS->m_queuedHead = THIS->m_queuedTail = packet;
-        } else {
-            THIS->m_queuedTail->next = packet;
-            THIS->m_queuedTail = packet;
-        }
-        
-        THIS->m_cachedDataSize += size;
-        
-        if (THIS->m_cachedDataSize >= config->maxPrebufferedByteCount) {
-            AS_TRACE("Cache overflow, disabling the HTTP stream\n");
-            
-            if (THIS->m_inputStream) {
-                THIS->m_inputStream->setScheduledInRunLoop(false);
-            }
-        }
+        // Stays off until the cache drains to the refill watermark, so it refills in one burst
+        THIS->m_inputThrottled = true;
+        THIS->setInputScheduled(false);
+    }
+    
+    if (THIS->decodeThresholdReached()) {
+        THIS->enqueueCachedData(0);
     }
     
-    THIS->enqueueCachedData(config->decodeQueueSize);
+    THIS->publishStats();
 }
 
 } // namespace astreamer
\ No newline at end of file
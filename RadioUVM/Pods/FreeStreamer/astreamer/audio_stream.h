@@ -11,32 +11,35 @@
 
 #import "input_stream.h"
 #include "audio_queue.h"
+#include "packet_queue.h"
+#include "decode_worker.h"
+#include "audio_converter_decoder.h"
+#include "event_loop.h"
 
 #include <AudioToolbox/AudioToolbox.h>
-#include <list>
+
+#include <vector>
 
 namespace astreamer {
     
-typedef struct queued_packet {
-    AudioStreamPacketDescription desc;
-    struct queued_packet *next;
-    char data[];
-} queued_packet_t;
-    
 enum Audio_Stream_Error {
     AS_ERR_OPEN = 1,          // Cannot open the audio stream
     AS_ERR_STREAM_PARSE = 2,  // Parse error
     AS_ERR_NETWORK = 3,        // Network error
     AS_ERR_UNSUPPORTED_FORMAT = 4,
-    AS_ERR_BOUNCING = 5
+    AS_ERR_BOUNCING = 5,
+    AS_ERR_OUTPUT_FILE = 6    // Writing the output file failed, the playback continues
 };
     
 class Audio_Stream_Delegate;
 class File_Output;
     
 #define kAudioStreamBitrateBufferSize 50
+#define kAudioStreamDecodeInputSize 262144
+#define kAudioStreamDecodeOutputSize 262144
+#define kAudioStreamDecodeChunkSize 8192
 	
-class Audio_Stream : public Input_Stream_Delegate, public Audio_Queue_Delegate {
+class Audio_Stream : public Input_Stream_Delegate, public Audio_Queue_Delegate, public Decode_Worker_Delegate, public Decoder_Delegate {
 public:
     Audio_Stream_Delegate *m_delegate;
     
@@ -50,7 +53,10 @@ public:
         END_OF_FILE
     };
     
+    /* Runs on the run loop of the calling thread */
     Audio_Stream();
+    /* Runs on the event loop, which must outlive the stream */
+    Audio_Stream(Event_Loop *eventLoop);
     virtual ~Audio_Stream();
     
     void open();
@@ -79,11 +85,14 @@ public:
     State state();
     
     CFStringRef sourceFormatDescription();
+    AudioStreamBasicDescription outputFormat();
     CFStringRef contentType();
     
     CFStringRef createCacheIdentifierForURL(CFURLRef url);
     
     size_t cachedDataSize();
+    size_t cachedPacketCount();
+    double cachedDataDuration();
     
     /* Audio_Queue_Delegate */
     void audioQueueStateChanged(Audio_Queue::State state);
@@ -98,7 +107,15 @@ public:
     void streamHasBytesAvailable(UInt8 *data, UInt32 numBytes);
     void streamEndEncountered();
     void streamErrorOccurred();
-    void streamMetaDataAvailable(std::map<CFStringRef,CFStringRef> metaData);
+    void streamMetaDataAvailable(Meta_Data&& metaData);
+    
+    /* Decode_Worker_Delegate */
+    void decodeWorkerInputAvailable();
+    void decodeWorkerInputSpaceAvailable();
+    void decodeWorkerOutputAvailable();
+    
+    /* Decoder_Delegate */
+    UInt32 decoderInputPackets(UInt32 maxPackets, const void **data, UInt32 *numBytes, AudioStreamPacketDescription **descs);
 
 private:
     
@@ -110,21 +127,30 @@ private:
     
     UInt64 m_contentLength;
     
-    State m_state;
+    std::atomic<State> m_state;
     Input_Stream *m_inputStream;
     Audio_Queue *m_audioQueue;
     
-    CFRunLoopTimerRef m_watchdogTimer;
+    Event_Loop *m_eventLoop;
+    bool m_ownsEventLoop;
+    
+    unsigned m_watchdogTimer;
+    
+    /* A dropped input is reopened while the audio queue plays on */
+    unsigned m_reconnectTimer;
+    unsigned m_reconnectCount;          // reconnects without data in between
+    std::atomic<bool> m_reconnecting;
+    CFAbsoluteTime m_disconnectTime;
+    UInt64 m_inputPosition;             // the content offset of the next input byte
+    bool m_inputDiscontinuity;          // the next input bytes don't follow the previous ones
     
     AudioFileStreamID m_audioFileStream;	// the audio file stream parser
-    AudioConverterRef m_audioConverter;
+    Audio_Converter_Decoder *m_decoder;
+    AudioStreamBasicDescription m_decoderFormat;    // the source format m_decoder was created for
     AudioStreamBasicDescription m_srcFormat;
     AudioStreamBasicDescription m_dstFormat;
     OSStatus m_initializationError;
     
-    UInt32 m_outputBufferSize;
-    UInt8 *m_outputBuffer;
-    
     UInt64 m_dataOffset;
     unsigned m_seekPosition;
     size_t m_bounceCount;
@@ -138,12 +164,7 @@ private:
     
     CFURLRef m_outputFile;
     
-    queued_packet_t *m_queuedHead;
-    queued_packet_t *m_queuedTail;
-    
-    std::list <queued_packet_t*> m_processedPackets;
-    
-    size_t m_cachedDataSize;
+    Packet_Queue *m_packetQueue;
     
     UInt32 m_processedPacketsCount;      // global packet statistics: count
     UInt64 m_audioDataByteCount;
@@ -155,25 +176,69 @@ private:
     float m_outputVolume;
     
     bool m_queueCanAcceptPackets;
-    bool m_converterRunOutOfData;
+    bool m_inputThrottled;              // the input is paused until the cache drains to the refill watermark
+    
+    Decode_Worker *m_decodeWorker;
+    
+    UInt8 *m_pendingInput;              // owner thread: bytes waiting for room in the decode input
+    size_t m_pendingInputSize;
+    size_t m_pendingInputCapacity;
+    bool m_inputEndPending;
+    std::vector<UInt8> m_outputChunk;   // owner thread: decoded samples for the delegate
+    
+    bool m_decodeInputPaused;           // decode thread: stop reading the decode input
+    bool m_decodeInputEnded;
+    
+    UInt64 m_decodeInputQueued;         // owner thread: the bytes queued for the decode thread
+    UInt64 m_decodeInputConsumed;       // decode thread: the bytes parsed of them
+    std::atomic<UInt64> m_decodeDiscontinuity;  // the queued byte count where a discontinuity begins
+    bool m_parseDiscontinuity;          // the next parsed bytes don't follow the previous ones
+    
+    /* Published by the decode thread, for the getters called on the owner thread */
+    std::atomic<unsigned> m_publishedTimePlayed;
+    std::atomic<unsigned> m_publishedDuration;
+    std::atomic<size_t> m_publishedCachedDataSize;
+    std::atomic<size_t> m_publishedCachedPacketCount;
+    std::atomic<double> m_publishedCachedDataDuration;
     
     CFStringRef createHashForString(CFStringRef str);
     
     Audio_Queue *audioQueue();
     void closeAudioQueue();
     
+    void createDecoder();
+    
+    double queuedDuration();
+    bool decodeThresholdReached();
+    bool prebufferFull();
+    bool refillNeeded();
+    
     UInt64 contentLength();
+    bool reconnectInput();
     void closeAndSignalError(int error);
     void setState(State state);
+    void notifyStateChange(State state);
+    
+    bool onDecodeThread();
+    bool hasRemoteDecodeThread();
+    void publishStats();
+    bool inputRunning();
+    void setInputScheduled(bool scheduled);
+    void parseBytes(UInt8 *data, UInt32 numBytes);
+    void queueDecodeInput(UInt8 *data, UInt32 numBytes);
     void setCookiesForStream(AudioFileStreamID inAudioFileStream);
     unsigned bitrate();
     
-    int cachedDataCount();
     void enqueueCachedData(int minPacketsRequired);
     
-    static void watchdogTimerCallback(CFRunLoopTimerRef timer, void *info);
+    static void watchdogTask(void *info, intptr_t arg);
+    static void reconnectTask(void *info, intptr_t arg);
+    
+    static void stateChangedTask(void *info, intptr_t arg);
+    static void closeTask(void *info, intptr_t arg);
+    static void errorTask(void *info, intptr_t arg);
+    static void inputEndedTask(void *info, intptr_t arg);
     
-    static OSStatus encoderDataCallback(AudioConverterRef inAudioConverter, UInt32 *ioNumberDataPackets, AudioBufferList *ioData, AudioStreamPacketDescription **outDataPacketDescription, void *inUserData);
     static void propertyValueCallback(void *inClientData, AudioFileStreamID inAudioFileStream, AudioFileStreamPropertyID inPropertyID, UInt32 *ioFlags);
     static void streamDataCallback(void *inClientData, UInt32 inNumberBytes, UInt32 inNumberPackets, const void *inInputData, AudioStreamPacketDescription *inPacketDescriptions);
     
@@ -184,7 +249,8 @@ class Audio_Stream_Delegate {
 public:
     virtual void audioStreamStateChanged(Audio_Stream::State state) = 0;
     virtual void audioStreamErrorOccurred(int errorCode) = 0;
-    virtual void audioStreamMetaDataAvailable(std::map<CFStringRef,CFStringRef> metaData) = 0;
+    virtual void audioStreamMetaDataAvailable(Meta_Data&& metaData) = 0;
+    virtual void audioStreamReconnected(double gap) = 0;   // the seconds without data
     virtual void samplesAvailable(AudioBufferList samples, AudioStreamPacketDescription description) = 0;
 };    
 
@@ -0,0 +1,534 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "cache_index.h"
+#include "stream_configuration.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+//#define CI_DEBUG 1
+
+#if !defined (CI_DEBUG)
+#define CI_TRACE(...) do {} while (0)
+#else
+#define CI_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+namespace astreamer {
+
+Cache_Index::Cache_Index() :
+    m_configuredDirectory(0),
+    m_totalSize(0),
+    m_log(0),
+    m_logRecords(0)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+}
+    
+Cache_Index::~Cache_Index()
+{
+    clear();
+    
+    if (m_configuredDirectory) {
+        CFRelease(m_configuredDirectory);
+    }
+    
+    pthread_mutex_destroy(&m_mutex);
+}
+    
+Cache_Index *Cache_Index::index()
+{
+    static Cache_Index cacheIndex;
+    
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    pthread_mutex_lock(&cacheIndex.m_mutex);
+    
+    // The path is resolved again only when the configuration changes
+    if (config->cacheDirectory != cacheIndex.m_configuredDirectory) {
+        const bool changed = !(config->cacheDirectory &&
+                               cacheIndex.m_configuredDirectory &&
+                               CFEqual(config->cacheDirectory, cacheIndex.m_configuredDirectory));
+    
+        if (cacheIndex.m_configuredDirectory) {
+            CFRelease(cacheIndex.m_configuredDirectory);
+        }
+        cacheIndex.m_configuredDirectory = (config->cacheDirectory ? (CFStringRef)CFRetain(config->cacheDirectory) : 0);
+    
+        if (changed) {
+            char directory[PATH_MAX] = "";
+    
+            if (config->cacheDirectory) {
+                CFStringGetCString(config->cacheDirectory, directory, sizeof(directory), kCFStringEncodingUTF8);
+            }
+    
+            cacheIndex.setDirectory(directory);
+        }
+    }
+    
+    pthread_mutex_unlock(&cacheIndex.m_mutex);
+    
+    return &cacheIndex;
+}
+    
+bool Cache_Index::isCached(const std::string& key)
+{
+    pthread_mutex_lock(&m_mutex);
+    
+    std::unordered_map<std::string, Item>::iterator item = m_items.find(key);
+    
+    const bool cached = (item != m_items.end() && item->second.entry.complete);
+    
+    pthread_mutex_unlock(&m_mutex);
+    
+    return cached;
+}
+    
+bool Cache_Index::lookup(const std::string& key, Cache_Index_Entry& entry)
+{
+    pthread_mutex_lock(&m_mutex);
+    
+    std::unordered_map<std::string, Item>::iterator item = m_items.find(key);
+    
+    const bool found = (item != m_items.end());
+    
+    if (found) {
+        entry = item->second.entry;
+    }
+    
+    pthread_mutex_unlock(&m_mutex);
+    
+    return found;
+}
+    
+void Cache_Index::access(const std::string& key)
+{
+    pthread_mutex_lock(&m_mutex);
+    
+    std::unordered_map<std::string, Item>::iterator item = m_items.find(key);
+    
+    if (item != m_items.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, item->second.lru);
+    
+        item->second.entry.lastAccess = time(0);
+    
+        appendEntry(key, item->second.entry);
+    }
+    
+    pthread_mutex_unlock(&m_mutex);
+}
+    
+void Cache_Index::update(const std::string& key, UInt64 size, bool complete, CFStringRef contentType)
+{
+    pthread_mutex_lock(&m_mutex);
+    
+    std::unordered_map<std::string, Item>::iterator found = m_items.find(key);
+    
+    Item *item;
+    
+    if (found == m_items.end()) {
+        Cache_Index_Entry entry;
+        entry.size = 0;
+        entry.lastAccess = 0;
+        entry.complete = false;
+    
+        item = &insert(key, entry);
+    } else {
+        item = &found->second;
+    
+        m_lru.splice(m_lru.begin(), m_lru, item->lru);
+    }
+    
+    m_totalSize = m_totalSize - item->entry.size + size;
+    
+    item->entry.size = size;
+    item->entry.lastAccess = time(0);
+    item->entry.complete = complete;
+    
+    char type[256];
+    
+    if (contentType && CFStringGetCString(contentType, type, sizeof(type), kCFStringEncodingUTF8)) {
+        // The log separates the fields with spaces
+        type[strcspn(type, " \t\r\n")] = '\0';
+    
+        item->entry.contentType = type;
+    }
+    
+    appendEntry(key, item->entry);
+    
+    // Make room while the file is being written, not all at once later
+    evictLocked();
+    
+    pthread_mutex_unlock(&m_mutex);
+}
+    
+void Cache_Index::remove(const std::string& key)
+{
+    pthread_mutex_lock(&m_mutex);
+    
+    std::unordered_map<std::string, Item>::iterator item = m_items.find(key);
+    
+    if (item != m_items.end()) {
+        erase(item);
+    
+        appendRemoval(key);
+    }
+    
+    pthread_mutex_unlock(&m_mutex);
+}
+    
+void Cache_Index::retain(const std::string& key)
+{
+    pthread_mutex_lock(&m_mutex);
+    
+    m_useCounts[key]++;
+    
+    pthread_mutex_unlock(&m_mutex);
+}
+    
+void Cache_Index::release(const std::string& key)
+{
+    pthread_mutex_lock(&m_mutex);
+    
+    std::unordered_map<std::string, unsigned>::iterator useCount = m_useCounts.find(key);
+    
+    if (useCount != m_useCounts.end() && --useCount->second == 0) {
+        m_useCounts.erase(useCount);
+    }
+    
+    pthread_mutex_unlock(&m_mutex);
+}
+    
+void Cache_Index::evict()
+{
+    pthread_mutex_lock(&m_mutex);
+    
+    evictLocked();
+    
+    pthread_mutex_unlock(&m_mutex);
+}
+    
+/* private */
+    
+void Cache_Index::setDirectory(const std::string& directory)
+{
+    clear();
+    
+    m_directory = directory;
+    
+    if (m_directory.empty()) {
+        return;
+    }
+    
+    m_indexPath = m_directory + "/FSCache.index";
+    
+    bool damaged = false;
+    
+    if (replayLog(damaged)) {
+        if (damaged) {
+            // Records appended after a broken line would be lost with it
+            compact();
+        } else {
+            m_log = fopen(m_indexPath.c_str(), "a");
+        }
+    } else {
+        // No index yet, the directory is listed only this once
+        scanDirectory();
+        compact();
+    }
+    
+    CI_TRACE("%lu files, %llu bytes in the cache\n", m_items.size(), m_totalSize);
+}
+    
+void Cache_Index::clear()
+{
+    if (m_log) {
+        fclose(m_log), m_log = 0;
+    }
+    
+    m_lru.clear();
+    m_items.clear();
+    m_totalSize = 0;
+    m_logRecords = 0;
+}
+    
+bool Cache_Index::replayLog(bool& damaged)
+{
+    FILE *f = fopen(m_indexPath.c_str(), "r");
+    
+    if (!f) {
+        return false;
+    }
+    
+    char line[1024];
+    
+    if (!fgets(line, sizeof(line), f) || strcmp(line, "FSCache-Index 1\n") != 0) {
+        fclose(f);
+        return false;
+    }
+    
+    // The records are in the order of use, so the last one of a key is the current one
+    while (fgets(line, sizeof(line), f)) {
+        char key[256];
+        char type[256];
+        unsigned long long size, lastAccess;
+        int complete;
+    
+        m_logRecords++;
+    
+        if (!strchr(line, '\n')) {
+            // Cut short when writing it, or too long to be a record
+            damaged = true;
+            continue;
+        }
+    
+        if (sscanf(line, "+ %255s %llu %llu %d %255s", key, &size, &lastAccess, &complete, type) == 5) {
+            std::unordered_map<std::string, Item>::iterator item = m_items.find(key);
+    
+            if (item != m_items.end()) {
+                erase(item);
+            }
+    
+            Cache_Index_Entry entry;
+            entry.size = size;
+            entry.lastAccess = lastAccess;
+            entry.complete = (complete != 0);
+    
+            if (strcmp(type, "-") != 0) {
+                entry.contentType = type;
+            }
+    
+            insert(key, entry);
+        } else if (sscanf(line, "- %255s", key) == 1) {
+            std::unordered_map<std::string, Item>::iterator item = m_items.find(key);
+    
+            if (item != m_items.end()) {
+                erase(item);
+            }
+        } else {
+            damaged = true;
+        }
+    }
+    
+    fclose(f);
+    
+    return true;
+}
+    
+void Cache_Index::scanDirectory()
+{
+    DIR *dir = opendir(m_directory.c_str());
+    
+    if (!dir) {
+        return;
+    }
+    
+    std::vector<std::pair<UInt64, std::string> > files;
+    
+    struct dirent *file;
+    
+    while ((file = readdir(dir))) {
+        // The data files, not the .metadata or .ranges next to them
+        if (strncmp(file->d_name, "FSCache-", 8) != 0 || strchr(file->d_name, '.')) {
+            continue;
+        }
+    
+        const std::string path = m_directory + "/" + file->d_name;
+    
+        struct stat st;
+    
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+    
+        files.push_back(std::make_pair((UInt64)st.st_mtime, std::string(file->d_name)));
+    }
+    
+    closedir(dir);
+    
+    // The oldest first, the newest ends up as the most recently used
+    std::sort(files.begin(), files.end());
+    
+    for (std::vector<std::pair<UInt64, std::string> >::iterator f = files.begin(); f != files.end(); ++f) {
+        const std::string path = m_directory + "/" + f->second;
+    
+        struct stat st;
+    
+        if (stat(path.c_str(), &st) != 0) {
+            continue;
+        }
+    
+        Cache_Index_Entry entry;
+        // A sparse file takes less than its size
+        entry.size = std::min((UInt64)st.st_size, (UInt64)st.st_blocks * 512);
+        entry.lastAccess = f->first;
+        entry.complete = false;
+    
+        FILE *metaData = fopen((path + ".metadata").c_str(), "r");
+    
+        if (metaData) {
+            char type[256];
+    
+            if (fgets(type, sizeof(type), metaData)) {
+                type[strcspn(type, " \t\r\n")] = '\0';
+    
+                entry.contentType = type;
+            }
+    
+            entry.complete = true;
+    
+            fclose(metaData);
+        }
+    
+        insert(f->second, entry);
+    }
+}
+    
+void Cache_Index::compact()
+{
+    if (m_log) {
+        fclose(m_log), m_log = 0;
+    }
+    
+    const std::string tmpPath = m_indexPath + ".tmp";
+    
+    FILE *f = fopen(tmpPath.c_str(), "w");
+    
+    if (f) {
+        fprintf(f, "FSCache-Index 1\n");
+    
+        // The least recently used first, so that a replay restores the order
+        for (std::list<std::string>::reverse_iterator key = m_lru.rbegin(); key != m_lru.rend(); ++key) {
+            writeEntry(f, *key, m_items[*key].entry);
+        }
+    
+        const bool written = !ferror(f);
+    
+        if (fclose(f) == 0 && written && rename(tmpPath.c_str(), m_indexPath.c_str()) == 0) {
+            m_logRecords = m_items.size();
+        } else {
+            unlink(tmpPath.c_str());
+        }
+    }
+    
+    m_log = fopen(m_indexPath.c_str(), "a");
+}
+    
+void Cache_Index::appendEntry(const std::string& key, const Cache_Index_Entry& entry)
+{
+    if (!m_log) {
+        return;
+    }
+    
+    writeEntry(m_log, key, entry);
+    
+    fflush(m_log);
+    
+    if (++m_logRecords > 2 * m_items.size() + kMinCompactRecords) {
+        compact();
+    }
+}
+    
+void Cache_Index::appendRemoval(const std::string& key)
+{
+    if (!m_log) {
+        return;
+    }
+    
+    fprintf(m_log, "- %s\n", key.c_str());
+    
+    fflush(m_log);
+    
+    if (++m_logRecords > 2 * m_items.size() + kMinCompactRecords) {
+        compact();
+    }
+}
+    
+void Cache_Index::writeEntry(FILE *f, const std::string& key, const Cache_Index_Entry& entry)
+{
+    fprintf(f, "+ %s %llu %llu %d %s\n",
+            key.c_str(),
+            (unsigned long long)entry.size,
+            (unsigned long long)entry.lastAccess,
+            (entry.complete ? 1 : 0),
+            (entry.contentType.empty() ? "-" : entry.contentType.c_str()));
+}
+    
+Cache_Index::Item& Cache_Index::insert(const std::string& key, const Cache_Index_Entry& entry)
+{
+    m_lru.push_front(key);
+    
+    Item& item = m_items[key];
+    item.entry = entry;
+    item.lru = m_lru.begin();
+    
+    m_totalSize += entry.size;
+    
+    return item;
+}
+    
+void Cache_Index::erase(std::unordered_map<std::string, Item>::iterator item)
+{
+    m_totalSize -= item->second.entry.size;
+    
+    m_lru.erase(item->second.lru);
+    m_items.erase(item);
+}
+    
+void Cache_Index::removeFiles(const std::string& key)
+{
+    const std::string path = m_directory + "/" + key;
+    
+    // The marker first, a half removed file must not look cached
+    unlink((path + ".metadata").c_str());
+    unlink((path + ".ranges").c_str());
+    unlink(path.c_str());
+}
+    
+void Cache_Index::evictLocked()
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    if (config->maxDiskCacheSize <= 0) {
+        // No limit
+        return;
+    }
+    
+    const UInt64 maxSize = config->maxDiskCacheSize;
+    
+    for (std::list<std::string>::iterator lru = m_lru.end(); m_totalSize > maxSize && lru != m_lru.begin();) {
+        std::list<std::string>::iterator victim = --lru;
+    
+        if (m_useCounts.find(*victim) != m_useCounts.end()) {
+            continue;
+        }
+    
+        // Stays valid when the victim goes
+        ++lru;
+    
+        const std::string key = *victim;
+    
+        CI_TRACE("Evicting %s\n", key.c_str());
+    
+        removeFiles(key);
+    
+        erase(m_items.find(key));
+    
+        appendRemoval(key);
+    }
+}
+    
+} // namespace astreamer
@@ -0,0 +1,106 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_CACHE_INDEX_H
+#define ASTREAMER_CACHE_INDEX_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace astreamer {
+
+struct Cache_Index_Entry {
+    UInt64 size;                // the bytes in the cache file, without the holes
+    UInt64 lastAccess;          // seconds since the epoch
+    bool complete;
+    std::string contentType;
+};
+    
+/*
+ * Knows the files in the cache directory without listing it. The entries
+ * are kept in memory in the least recently used order and on the disk in
+ * FSCache.index, a log of the changes which is rewritten when it grows
+ * much longer than the entries. When the cache grows over maxDiskCacheSize,
+ * the least recently used files are removed, except the ones in use.
+ */
+class Cache_Index {
+public:
+    /* The index of the cache directory in the stream configuration */
+    static Cache_Index *index();
+    
+    bool isCached(const std::string& key);
+    bool lookup(const std::string& key, Cache_Index_Entry& entry);
+    
+    void access(const std::string& key);
+    void update(const std::string& key, UInt64 size, bool complete, CFStringRef contentType);
+    void remove(const std::string& key);
+    
+    /* A file in use is never evicted */
+    void retain(const std::string& key);
+    void release(const std::string& key);
+    
+    void evict();
+    
+private:
+    struct Item {
+        Cache_Index_Entry entry;
+        std::list<std::string>::iterator lru;
+    };
+    
+    enum {
+        kMinCompactRecords = 64
+    };
+    
+    Cache_Index();
+    ~Cache_Index();
+    
+    Cache_Index(const Cache_Index&);
+    Cache_Index& operator=(const Cache_Index&);
+    
+    pthread_mutex_t m_mutex;
+    
+    CFStringRef m_configuredDirectory;  // the one m_directory was resolved from
+    std::string m_directory;
+    std::string m_indexPath;
+    
+    /* The most recently used first */
+    std::list<std::string> m_lru;
+    std::unordered_map<std::string, Item> m_items;
+    std::unordered_map<std::string, unsigned> m_useCounts;
+    
+    UInt64 m_totalSize;
+    
+    FILE *m_log;
+    size_t m_logRecords;
+    
+    void setDirectory(const std::string& directory);
+    void clear();
+    
+    bool replayLog(bool& damaged);
+    void scanDirectory();
+    void compact();
+    
+    void appendEntry(const std::string& key, const Cache_Index_Entry& entry);
+    void appendRemoval(const std::string& key);
+    void writeEntry(FILE *f, const std::string& key, const Cache_Index_Entry& entry);
+    
+    Item& insert(const std::string& key, const Cache_Index_Entry& entry);
+    void erase(std::unordered_map<std::string, Item>::iterator item);
+    void removeFiles(const std::string& key);
+    void evictLocked();
+};
+    
+} // namespace astreamer
+
+#endif // ASTREAMER_CACHE_INDEX_H
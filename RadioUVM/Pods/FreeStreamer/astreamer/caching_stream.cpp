@@ -10,6 +10,13 @@
 #include "file_output.h"
 #include "stream_configuration.h"
 #include "file_stream.h"
+#include "event_loop.h"
+#include "cache_index.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 //#define CS_DEBUG 1
 
@@ -25,24 +32,42 @@
 
 namespace astreamer {
     
-Caching_Stream::Caching_Stream(Input_Stream *target) :
+Caching_Stream::Caching_Stream(Input_Stream *target, Event_Loop *eventLoop) :
     m_target(target),
     m_fileOutput(0),
-    m_fileStream(new File_Stream()),
+    m_fileStream(new File_Stream(eventLoop)),
+    m_eventLoop(eventLoop),
     m_cacheable(false),
     m_writable(false),
     m_useCache(false),
     m_cacheMetaDataWritten(false),
+    m_cacheLoaded(false),
+    m_readyReadSent(false),
+    m_switchPending(false),
+    m_scheduledInRunLoop(false),
+    m_cacheRetained(false),
     m_cacheIdentifier(0),
     m_fileUrl(0),
-    m_metaDataUrl(0)
+    m_metaDataUrl(0),
+    m_contentType(0),
+    m_contentLength(0),
+    m_unsavedBytes(0),
+    m_pendingRangesMark(0),
+    m_rangesPending(false),
+    m_readOffset(0),
+    m_sourceEnd(0)
 {
+    m_position.start = 0;
+    m_position.end = 0;
+    
     m_target->m_delegate = this;
     m_fileStream->m_delegate = this;
 }
 
 Caching_Stream::~Caching_Stream()
 {
+    close();
+    
     if (m_target) {
         delete m_target, m_target = 0;
     }
@@ -61,6 +86,9 @@ Caching_Stream::~Caching_Stream()
     if (m_metaDataUrl) {
         CFRelease(m_metaDataUrl), m_fileUrl = 0;
     }
+    if (m_contentType) {
+        CFRelease(m_contentType), m_contentType = 0;
+    }
 }
     
 CFURLRef Caching_Stream::createFileURLWithPath(CFStringRef path)
@@ -107,12 +135,10 @@ void Caching_Stream::readMetaData()
                 CFStringRef contentType = CFStringCreateWithBytes(kCFAllocatorDefault, buf, bytesRead, kCFStringEncodingUTF8, false);
                 
                 if (contentType) {
-                    if (m_fileStream) {
-                        CS_TRACE("Setting the content type of the file stream based on the meta data\n");
-                        CS_TRACE_CFSTRING(contentType);
-                        
-                        m_fileStream->setContentType(contentType);
-                    }
+                    CS_TRACE("Setting the content type of the file stream based on the meta data\n");
+                    CS_TRACE_CFSTRING(contentType);
+                    
+                    setContentType(contentType);
                     
                     CFRelease(contentType);
                 }
@@ -125,17 +151,419 @@ void Caching_Stream::readMetaData()
     }
 }
 
-Input_Stream_Position Caching_Stream::position()
+void Caching_Stream::writeMetaData()
 {
-    if (m_useCache) {
-        return m_fileStream->position();
+    // The meta data is written only when the whole content is in the file.
+    // In that way we can use the meta data as an indicator that there is a file to stream.
+    
+    CFWriteStreamRef writeStream = CFWriteStreamCreateWithFile(kCFAllocatorDefault, m_metaDataUrl);
+    
+    if (writeStream) {
+        if (CFWriteStreamOpen(writeStream)) {
+            if (m_contentType) {
+                UInt8 buf[1024];
+                CFIndex usedBytes = 0;
+                
+                CFStringGetBytes(m_contentType,
+                                 CFRangeMake(0, CFStringGetLength(m_contentType)),
+                                 kCFStringEncodingUTF8,
+                                 '?',
+                                 false,
+                                 buf,
+                                 1024,
+                                 &usedBytes);
+                
+                if (usedBytes > 0) {
+                    CS_TRACE("Writing the meta data\n");
+                    CS_TRACE_CFSTRING(m_contentType);
+                    
+                    CFWriteStreamWrite(writeStream, buf, usedBytes);
+                }
+            }
+            
+            CFWriteStreamClose(writeStream);
+        }
+        
+        CFRelease(writeStream);
+    }
+    
+    m_cacheMetaDataWritten = true;
+}
+    
+void Caching_Stream::loadCache()
+{
+    if (m_cacheLoaded) {
+        return;
+    }
+    
+    m_cacheLoaded = true;
+    m_cacheMetaDataWritten = false;
+    m_contentLength = 0;
+    m_unsavedBytes = 0;
+    m_ranges.clear();
+    
+    if (!m_fileUrl) {
+        return;
+    }
+    
+    if (CFURLResourceIsReachable(m_metaDataUrl, NULL) &&
+        CFURLResourceIsReachable(m_fileUrl, NULL)) {
+        readMetaData();
+        
+        m_contentLength = m_fileStream->contentLength();
+        
+        if (m_contentLength > 0) {
+            m_ranges[0] = m_contentLength;
+        }
+        
+        m_cacheMetaDataWritten = true;
+        
+        CS_TRACE("The file is cached\n");
+        CS_TRACE_CFURL(m_fileUrl);
+        return;
+    }
+    
+    readRanges();
+    
+#if CS_DEBUG
+    if (!m_ranges.empty()) CS_TRACE("%lu ranges of the file are cached\n", m_ranges.size());
+    else CS_TRACE("File not cached\n");
+#endif
+}
+    
+void Caching_Stream::resetCache()
+{
+    CS_TRACE("Dropping the cache\n");
+    
+    if (m_fileOutput) {
+        delete m_fileOutput, m_fileOutput = 0;
+    }
+    
+    m_writable = false;
+    m_cacheMetaDataWritten = false;
+    m_unsavedBytes = 0;
+    m_rangesPending = false;
+    m_ranges.clear();
+    
+    if (!m_filePath.empty()) {
+        unlink(m_rangesPath.c_str());
+        unlink((m_filePath + ".metadata").c_str());
+        unlink(m_filePath.c_str());
+    }
+    
+    Cache_Index::index()->remove(m_cacheKey);
+}
+    
+void Caching_Stream::readRanges()
+{
+    FILE *f = fopen(m_rangesPath.c_str(), "r");
+    
+    if (!f) {
+        return;
+    }
+    
+    char line[1024];
+    unsigned long long length = 0;
+    
+    if (fgets(line, sizeof(line), f) && strcmp(line, "FSCache-Ranges 1\n") == 0) {
+        while (fgets(line, sizeof(line), f)) {
+            unsigned long long start, end;
+            
+            if (strncmp(line, "type ", 5) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                
+                CFStringRef contentType = CFStringCreateWithCString(kCFAllocatorDefault, line + 5, kCFStringEncodingUTF8);
+                
+                if (contentType) {
+                    setContentType(contentType);
+                    
+                    CFRelease(contentType);
+                }
+            } else if (sscanf(line, "length %llu", &length) == 1) {
+                continue;
+            } else if (sscanf(line, "%llu %llu", &start, &end) == 2 && start < end && end <= length) {
+                addRange(start, end);
+            }
+        }
+    }
+    
+    fclose(f);
+    
+    // The ranges are no good without the file
+    if (length == 0 || !CFURLResourceIsReachable(m_fileUrl, NULL)) {
+        m_ranges.clear();
+        return;
+    }
+    
+    m_contentLength = length;
+}
+    
+void Caching_Stream::saveRanges()
+{
+    m_unsavedBytes = 0;
+    m_rangesPending = false;
+    
+    // The ranges must not claim bytes which are not in the file yet
+    if (m_fileOutput && !m_fileOutput->flush(true)) {
+        resetCache();
+        return;
+    }
+    
+    writeRanges(m_ranges);
+}
+    
+void Caching_Stream::writeRanges(const std::map<UInt64, UInt64>& ranges)
+{
+    if (m_rangesPath.empty() || m_contentLength == 0 || m_cacheMetaDataWritten) {
+        return;
+    }
+    
+    // Replace the old ranges only when the new ones are completely written
+    const std::string tmpPath = m_rangesPath + ".tmp";
+    
+    FILE *f = fopen(tmpPath.c_str(), "w");
+    
+    if (!f) {
+        return;
+    }
+    
+    fprintf(f, "FSCache-Ranges 1\nlength %llu\n", (unsigned long long)m_contentLength);
+    
+    char contentType[256];
+    
+    if (m_contentType && CFStringGetCString(m_contentType, contentType, sizeof(contentType), kCFStringEncodingUTF8)) {
+        fprintf(f, "type %s\n", contentType);
+    }
+    
+    for (std::map<UInt64, UInt64>::const_iterator r = ranges.begin(); r != ranges.end(); ++r) {
+        fprintf(f, "%llu %llu\n", (unsigned long long)r->first, (unsigned long long)r->second);
+    }
+    
+    const bool written = !ferror(f);
+    
+    if (fclose(f) == 0 && written) {
+        rename(tmpPath.c_str(), m_rangesPath.c_str());
+    } else {
+        unlink(tmpPath.c_str());
+    }
+    
+    Cache_Index::index()->update(m_cacheKey, cachedByteCount(ranges), false, m_contentType);
+}
+    
+void Caching_Stream::addRange(UInt64 start, UInt64 end)
+{
+    std::map<UInt64, UInt64>::iterator r = m_ranges.upper_bound(start);
+    
+    if (r != m_ranges.begin() && (--r)->second >= start) {
+        // Continues the range before it, the common case when downloading
+        if (r->second < end) {
+            r->second = end;
+        }
     } else {
-        return m_target->position();
+        r = m_ranges.insert(std::make_pair(start, end)).first;
+    }
+    
+    // Swallow the ranges it now reaches
+    std::map<UInt64, UInt64>::iterator next = r;
+    
+    for (++next; next != m_ranges.end() && next->first <= r->second;) {
+        if (next->second > r->second) {
+            r->second = next->second;
+        }
+        m_ranges.erase(next++);
+    }
+}
+    
+UInt64 Caching_Stream::cachedByteCount(const std::map<UInt64, UInt64>& ranges)
+{
+    UInt64 count = 0;
+    
+    for (std::map<UInt64, UInt64>::const_iterator r = ranges.begin(); r != ranges.end(); ++r) {
+        count += r->second - r->first;
     }
+    return count;
+}
+    
+void Caching_Stream::setContentType(CFStringRef contentType)
+{
+    if (m_contentType) {
+        CFRelease(m_contentType), m_contentType = 0;
+    }
+    if (contentType) {
+        m_contentType = CFStringCreateCopy(kCFAllocatorDefault, contentType);
+    }
+    
+    m_fileStream->setContentType(contentType);
+}
+    
+bool Caching_Stream::openSource()
+{
+    Input_Stream_Position position;
+    position.start = m_readOffset;
+    position.end = 0;
+    
+    std::map<UInt64, UInt64>::iterator next = m_ranges.upper_bound(m_readOffset);
+    
+    if (next != m_ranges.begin()) {
+        std::map<UInt64, UInt64>::iterator cached = next;
+        --cached;
+        
+        if (m_readOffset < cached->second) {
+            m_useCache = true;
+            m_sourceEnd = cached->second;
+            position.end = cached->second - 1;
+            
+            CS_TRACE("Reading %llu-%llu from the cache\n", position.start, position.end);
+            
+            // The bytes written lately may still be on their way to the file
+            const bool flushed = (!m_fileOutput || m_fileOutput->flush(true));
+            
+            if (flushed && (position.start == 0 ? m_fileStream->open() : m_fileStream->open(position))) {
+                return true;
+            }
+            
+            // The file is gone or can't be written, so are the ranges
+            resetCache();
+            m_cacheable = false;
+            
+            return openSource();
+        }
+    }
+    
+    // Request only the gap before the next cached range
+    m_useCache = false;
+    m_sourceEnd = (next != m_ranges.end() ? next->first : 0);
+    
+    if (m_sourceEnd > 0) {
+        position.end = m_sourceEnd - 1;
+    }
+    
+    if (m_fileOutput && m_writable) {
+        m_writable = m_fileOutput->seek(m_readOffset);
+    }
+    
+    CS_TRACE("Reading %llu-%llu from the network\n", position.start, position.end);
+    
+    if (position.start == 0 && position.end == 0) {
+        return m_target->open();
+    }
+    return m_target->open(position);
+}
+    
+void Caching_Stream::writeCache(const UInt8 *data, UInt32 numBytes)
+{
+    if (!m_fileOutput) {
+        CS_TRACE("Caching started for stream\n");
+        
+        m_fileOutput = new File_Output(m_fileUrl, true);
+        // The ranges keep track of the gaps, so the playback never waits for the disk
+        m_fileOutput->setQueuePolicy(File_Output::SKIP_WHEN_FULL);
+        
+        m_writable = m_fileOutput->seek(m_readOffset);
+    }
+    
+    if (!m_writable) {
+        return;
+    }
+    
+    if (m_fileOutput->write(data, numBytes) != (CFIndex)numBytes) {
+        if (m_fileOutput->failed()) {
+            // Out of space, for example. The bytes still queued behind the
+            // failed write are lost too, so none of the ranges can be trusted
+            CS_TRACE("Writing the cache failed, caching stopped\n");
+            
+            resetCache();
+            m_cacheable = false;
+        }
+        // Otherwise the disk is behind and the bytes are left as a gap
+        return;
+    }
+    
+    addRange(m_readOffset, m_readOffset + numBytes);
+    
+    m_unsavedBytes += numBytes;
+    
+    if (m_ranges.size() == 1 &&
+        m_ranges.begin()->first == 0 &&
+        m_ranges.begin()->second >= m_contentLength) {
+        // The metadata marks the whole file cached, so the bytes go first
+        if (!m_fileOutput->flush(true)) {
+            resetCache();
+            m_cacheable = false;
+            return;
+        }
+        
+        CS_TRACE("Successfully cached the stream\n");
+        CS_TRACE_CFURL(m_fileUrl);
+        
+        writeMetaData();
+        
+        unlink(m_rangesPath.c_str());
+        
+        m_unsavedBytes = 0;
+        m_rangesPending = false;
+        
+        Cache_Index::index()->update(m_cacheKey, m_contentLength, true, m_contentType);
+    } else {
+        if (m_rangesPending && m_fileOutput->bytesCompleted() >= m_pendingRangesMark) {
+            writeRanges(m_pendingRanges);
+            
+            m_rangesPending = false;
+        }
+        
+        if (!m_rangesPending && m_unsavedBytes >= kRangesSaveInterval) {
+            // Saved once the writer has caught up, without waiting for it here
+            m_pendingRanges = m_ranges;
+            m_pendingRangesMark = m_fileOutput->bytesAccepted();
+            m_rangesPending = true;
+            m_unsavedBytes = 0;
+            
+            m_fileOutput->flush(false);
+        }
+    }
+}
+    
+void Caching_Stream::switchSourceTask(void *info, intptr_t arg)
+{
+    Caching_Stream *THIS = (Caching_Stream *)info;
+    
+    THIS->m_switchPending = false;
+    
+    if (THIS->m_useCache) {
+        THIS->m_fileStream->close();
+    } else {
+        THIS->m_target->close();
+    }
+    
+    if (THIS->m_contentLength > 0 && THIS->m_readOffset >= THIS->m_contentLength) {
+        if (THIS->m_delegate) {
+            THIS->m_delegate->streamEndEncountered();
+        }
+        return;
+    }
+    
+    if (!THIS->openSource()) {
+        if (THIS->m_delegate) {
+            THIS->m_delegate->streamErrorOccurred();
+        }
+        return;
+    }
+    
+    if (!THIS->m_scheduledInRunLoop) {
+        THIS->setScheduledInRunLoop(false);
+    }
+}
+
+Input_Stream_Position Caching_Stream::position()
+{
+    return m_position;
 }
 
 CFStringRef Caching_Stream::contentType()
 {
+    if (m_contentType) {
+        return m_contentType;
+    }
     if (m_useCache) {
         return m_fileStream->contentType();
     } else {
@@ -145,6 +573,9 @@ CFStringRef Caching_Stream::contentType()
 
 size_t Caching_Stream::contentLength()
 {
+    if (m_contentLength > 0) {
+        return (size_t)m_contentLength;
+    }
     if (m_useCache) {
         return m_fileStream->contentLength();
     } else {
@@ -152,76 +583,90 @@ size_t Caching_Stream::contentLength()
     }
 }
 
-bool Caching_Stream::open()
+size_t Caching_Stream::totalLength()
 {
-    bool status;
-    
-    if (CFURLResourceIsReachable(m_metaDataUrl, NULL) &&
-        CFURLResourceIsReachable(m_fileUrl, NULL)) {
-        m_cacheable = false;
-        m_writable  = false;
-        m_useCache  = true;
-        m_cacheMetaDataWritten = false;
-        
-        readMetaData();
-        
-        CS_TRACE("Playing file from cache\n");
-        CS_TRACE_CFURL(m_fileUrl);
-        
-        status = m_fileStream->open();
+    if (m_contentLength > 0) {
+        return (size_t)m_contentLength;
+    }
+    if (m_useCache) {
+        return m_fileStream->contentLength();
     } else {
-        m_cacheable = true;
-        m_writable  = false;
-        m_useCache  = false;
-        m_cacheMetaDataWritten = false;
-        
-        CS_TRACE("File not cached\n");
-    
-        status = m_target->open();
+        return m_target->totalLength();
     }
+}
+
+bool Caching_Stream::open()
+{
+    Input_Stream_Position position;
+    position.start = 0;
+    position.end = 0;
     
-    return status;
+    return open(position);
 }
 
 bool Caching_Stream::open(const Input_Stream_Position& position)
 {
-    bool status;
+    Cache_Index *cacheIndex = Cache_Index::index();
+    Cache_Index_Entry entry;
     
-    if (CFURLResourceIsReachable(m_metaDataUrl, NULL) &&
-        CFURLResourceIsReachable(m_fileUrl, NULL)) {
-        m_cacheable = false;
-        m_writable  = false;
-        m_useCache  = true;
-        m_cacheMetaDataWritten = false;
-        
-        readMetaData();
-        
-        CS_TRACE("Playing file from cache\n");
-        CS_TRACE_CFURL(m_fileUrl);
-        
-        status = m_fileStream->open(position);
-    } else {
-        m_cacheable = false;
-        m_writable  = false;
-        m_useCache  = false;
-        m_cacheMetaDataWritten = false;
-        
-        CS_TRACE("File not cached\n");
-        
-        status = m_target->open(position);
+    if (m_cacheLoaded && !m_ranges.empty() && !cacheIndex->lookup(m_cacheKey, entry)) {
+        // Evicted since the last open
+        m_cacheLoaded = false;
+    }
+    
+    if (!m_cacheRetained && !m_cacheKey.empty()) {
+        cacheIndex->retain(m_cacheKey);
+        m_cacheRetained = true;
     }
     
-    return status;
+    cacheIndex->access(m_cacheKey);
+    
+    loadCache();
+    
+    m_position = position;
+    m_readOffset = position.start;
+    m_readyReadSent = false;
+    m_switchPending = false;
+    m_scheduledInRunLoop = true;
+    
+    // Without a length, the cache can't tell whether it has all of it
+    m_cacheable = (m_contentLength > 0);
+    
+    return openSource();
 }
 
 void Caching_Stream::close()
 {
+    m_eventLoop->cancel(this);
+    
+    m_switchPending = false;
+    
     m_fileStream->close();
     m_target->close();
+    
+    if (m_unsavedBytes > 0 || m_rangesPending) {
+        saveRanges();
+    }
+    
+    if (m_fileOutput) {
+        delete m_fileOutput, m_fileOutput = 0;
+    }
+    
+    if (m_cacheRetained) {
+        Cache_Index::index()->release(m_cacheKey);
+        m_cacheRetained = false;
+    }
 }
 
 void Caching_Stream::setScheduledInRunLoop(bool scheduledInRunLoop)
 {
+    m_scheduledInRunLoop = scheduledInRunLoop;
+    
+    if (m_switchPending) {
+        // The next source is scheduled accordingly
+        return;
+    }
+    
     if (m_useCache) {
         m_fileStream->setScheduledInRunLoop(scheduledInRunLoop);
     } else {
@@ -241,6 +686,7 @@ void Caching_Stream::setCacheIdentifier(CFStringRef cacheIdentifier)
     if (m_fileOutput) {
         delete m_fileOutput, m_fileOutput = 0;
     }
+    m_rangesPending = false;
     
     Stream_Configuration *config = Stream_Configuration::configuration();
     
@@ -259,6 +705,26 @@ void Caching_Stream::setCacheIdentifier(CFStringRef cacheIdentifier)
     
     m_fileStream->setUrl(m_fileUrl);
     
+    char key[256];
+    
+    if (CFStringGetCString(m_cacheIdentifier, key, sizeof(key), kCFStringEncodingUTF8)) {
+        m_cacheKey = key;
+    } else {
+        m_cacheKey.clear();
+    }
+    
+    char path[PATH_MAX];
+    
+    if (m_fileUrl && CFURLGetFileSystemRepresentation(m_fileUrl, true, (UInt8 *)path, sizeof(path))) {
+        m_filePath = path;
+        m_rangesPath = m_filePath + ".ranges";
+    } else {
+        m_filePath.clear();
+        m_rangesPath.clear();
+    }
+    
+    m_cacheLoaded = false;
+    
     CFRelease(filePath);
     CFRelease(metaDataPath);
 }
@@ -286,10 +752,10 @@ bool Caching_Stream::canHandleUrl(CFURLRef url)
 }
 
 /* ID3_Parser_Delegate */
-void Caching_Stream::id3metaDataAvailable(std::map<CFStringRef,CFStringRef> metaData)
+void Caching_Stream::id3metaDataAvailable(Meta_Data&& metaData)
 {
     if (m_delegate) {
-        m_delegate->streamMetaDataAvailable(metaData);
+        m_delegate->streamMetaDataAvailable(std::move(metaData));
     }
 }
     
@@ -297,11 +763,31 @@ void Caching_Stream::id3metaDataAvailable(std::map<CFStringRef,CFStringRef> meta
 
 void Caching_Stream::streamIsReadyRead()
 {
-    if (m_cacheable) {
-        // If the stream is cacheable (not seeked from some position)
-        // Check if the stream has a length. If there is no length,
-        // it is a continuous stream and thus cannot be cached.
-        m_cacheable = (m_target->contentLength() > 0);
+    if (!m_useCache) {
+        // A partial response tells the length of the whole content in its Content-Range
+        const UInt64 length = m_target->totalLength();
+        
+        if (m_contentLength > 0 &&
+            length > 0 &&
+            length != m_contentLength) {
+            CS_TRACE("The content has changed\n");
+            
+            resetCache();
+            
+            m_contentLength = 0;
+            m_sourceEnd = 0;
+        }
+        
+        if (m_contentLength == 0 && !m_filePath.empty()) {
+            m_contentLength = length;
+        }
+        
+        if (!m_contentType) {
+            setContentType(m_target->contentType());
+        }
+        
+        // If there is no length, it is a continuous stream and thus cannot be cached.
+        m_cacheable = (m_contentLength > 0);
     }
     
 #if CS_DEBUG
@@ -309,6 +795,13 @@ void Caching_Stream::streamIsReadyRead()
     else CS_TRACE("Stream cannot be cached\n");
 #endif
     
+    if (m_readyReadSent) {
+        // Switched between the file and the network, the delegate is already reading
+        return;
+    }
+    
+    m_readyReadSent = true;
+    
     if (m_delegate) {
         m_delegate->streamIsReadyRead();
     }
@@ -316,81 +809,65 @@ void Caching_Stream::streamIsReadyRead()
     
 void Caching_Stream::streamHasBytesAvailable(UInt8 *data, UInt32 numBytes)
 {
-    if (m_cacheable) {
-        if (numBytes > 0) {
-            if (!m_fileOutput) {
-                if (m_fileUrl) {
-                    CS_TRACE("Caching started for stream\n");
-                    
-                    m_fileOutput = new File_Output(m_fileUrl);
-                
-                    m_writable = true;
-                }
-            }
-            
-            if (m_writable && m_fileOutput) {
-                m_writable &= (m_fileOutput->write(data, numBytes) > 0);
-            }
+    if (m_switchPending) {
+        // The source read past its range; the next source continues from there
+        return;
+    }
+    
+    UInt32 count = numBytes;
+    bool sourceEnded = false;
+    
+    if (m_sourceEnd > 0 && m_readOffset + numBytes >= m_sourceEnd) {
+        count = (m_sourceEnd > m_readOffset ? (UInt32)(m_sourceEnd - m_readOffset) : 0);
+        sourceEnded = true;
+    }
+    
+    if (!m_useCache && m_cacheable && count > 0) {
+        writeCache(data, count);
+    }
+    
+    m_readOffset += count;
+    
+    if (sourceEnded) {
+        // Continue from the next source once the current one has returned
+        m_switchPending = true;
+        
+        if (m_useCache) {
+            m_fileStream->setScheduledInRunLoop(false);
+        } else {
+            m_target->setScheduledInRunLoop(false);
         }
+        
+        m_eventLoop->post(switchSourceTask, this, 0);
     }
-    if (m_delegate) {
-        m_delegate->streamHasBytesAvailable(data, numBytes);
+    
+    if (count > 0 && m_delegate) {
+        m_delegate->streamHasBytesAvailable(data, count);
     }
 }
     
 void Caching_Stream::streamEndEncountered()
 {
-    if (m_fileOutput) {
-        delete m_fileOutput, m_fileOutput = 0;
+    if (m_switchPending) {
+        return;
     }
     
-    if (m_cacheable) {
-        if (m_writable) {
-            CS_TRACE("Successfully cached the stream\n");
-            CS_TRACE_CFURL(m_fileUrl);
-            
-            // We only write the meta data if the stream was successfully streamed.
-            // In that way we can use the meta data as an indicator that there is a file to stream.
-            
-            if (!m_cacheMetaDataWritten) {
-                CFWriteStreamRef writeStream = CFWriteStreamCreateWithFile(kCFAllocatorDefault, m_metaDataUrl);
-                
-                if (writeStream) {
-                    if (CFWriteStreamOpen(writeStream)) {
-                        CFStringRef contentType = m_target->contentType();
-                        
-                        UInt8 buf[1024];
-                        CFIndex usedBytes = 0;
-                        
-                        CFStringGetBytes(contentType,
-                                         CFRangeMake(0, CFStringGetLength(contentType)),
-                                         kCFStringEncodingUTF8,
-                                         '?',
-                                         false,
-                                         buf,
-                                         1024,
-                                         &usedBytes);
-                        
-                        if (usedBytes > 0) {
-                            CS_TRACE("Writing the meta data\n");
-                            CS_TRACE_CFSTRING(contentType);
-                            
-                            CFWriteStreamWrite(writeStream, buf, usedBytes);
-                        }
-                        
-                        CFWriteStreamClose(writeStream);
-                    }
-                    
-                    CFRelease(writeStream);
-                }
-                
-                m_cacheable = false;
-                m_writable  = false;
-                m_useCache  = true;
-                m_cacheMetaDataWritten = true;
-            }
-        }
+    if (m_useCache) {
+        CS_TRACE("The cache file is shorter than the cached ranges\n");
+        
+        resetCache();
+        
+        m_cacheable = false;
+        m_switchPending = true;
+        
+        m_eventLoop->post(switchSourceTask, this, 0);
+        return;
+    }
+    
+    if (m_unsavedBytes > 0 || m_rangesPending) {
+        saveRanges();
     }
+    
     if (m_delegate) {
         m_delegate->streamEndEncountered();
     }
@@ -398,15 +875,23 @@ void Caching_Stream::streamEndEncountered()
     
 void Caching_Stream::streamErrorOccurred()
 {
+    if (m_switchPending) {
+        return;
+    }
+    
+    if (m_unsavedBytes > 0 || m_rangesPending) {
+        saveRanges();
+    }
+    
     if (m_delegate) {
         m_delegate->streamErrorOccurred();
     }
 }
     
-void Caching_Stream::streamMetaDataAvailable(std::map<CFStringRef,CFStringRef> metaData)
+void Caching_Stream::streamMetaDataAvailable(Meta_Data&& metaData)
 {
     if (m_delegate) {
-        m_delegate->streamMetaDataAvailable(metaData);
+        m_delegate->streamMetaDataAvailable(std::move(metaData));
     }
 }
     
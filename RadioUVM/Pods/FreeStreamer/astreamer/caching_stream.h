@@ -11,37 +11,94 @@
 
 #include "input_stream.h"
 
+#include <map>
+#include <string>
+
 namespace astreamer {
     
 class File_Output;
 class File_Stream;
+class Event_Loop;
     
+/*
+ * Caches the content of a known length into a sparse file. The byte
+ * ranges downloaded so far are kept in FSCache-<id>.ranges, so that a
+ * partial download survives seeks, dropped connections and restarts.
+ * Reads are served from the file where the range is cached and only
+ * the gaps are requested from the target. Once the whole content is
+ * in the file, the .ranges file is replaced by the .metadata file.
+ */
 class Caching_Stream : public Input_Stream, public Input_Stream_Delegate {
 private:
+    enum {
+        kRangesSaveInterval = 262144
+    };
+    
     Input_Stream *m_target;
     File_Output *m_fileOutput;
     File_Stream *m_fileStream;
+    Event_Loop *m_eventLoop;
     bool m_cacheable;
     bool m_writable;
     bool m_useCache;
     bool m_cacheMetaDataWritten;
+    bool m_cacheLoaded;
+    bool m_readyReadSent;
+    bool m_switchPending;
+    bool m_scheduledInRunLoop;
+    bool m_cacheRetained;
     CFStringRef m_cacheIdentifier;
     CFURLRef m_fileUrl;
     CFURLRef m_metaDataUrl;
+    CFStringRef m_contentType;
+    UInt64 m_contentLength;
+    
+    std::string m_cacheKey;
+    std::string m_filePath;
+    std::string m_rangesPath;
+    
+    /* The start and end of the cached byte ranges, never adjacent or overlapping */
+    std::map<UInt64, UInt64> m_ranges;
+    UInt64 m_unsavedBytes;
+    
+    /* A copy of the ranges, saved once the file output has written their bytes */
+    std::map<UInt64, UInt64> m_pendingRanges;
+    UInt64 m_pendingRangesMark;
+    bool m_rangesPending;
+    
+    Input_Stream_Position m_position;
+    UInt64 m_readOffset;
+    UInt64 m_sourceEnd;
     
 private:
     CFURLRef createFileURLWithPath(CFStringRef path);
     
     void readMetaData();
+    void writeMetaData();
+    
+    void loadCache();
+    void resetCache();
+    void readRanges();
+    void saveRanges();
+    void writeRanges(const std::map<UInt64, UInt64>& ranges);
+    void addRange(UInt64 start, UInt64 end);
+    UInt64 cachedByteCount(const std::map<UInt64, UInt64>& ranges);
+    void setContentType(CFStringRef contentType);
+    
+    bool openSource();
+    void writeCache(const UInt8 *data, UInt32 numBytes);
+    
+    static void switchSourceTask(void *info, intptr_t arg);
     
 public:
-    Caching_Stream(Input_Stream *target);
+    Caching_Stream(Input_Stream *target, Event_Loop *eventLoop);
     virtual ~Caching_Stream();
     
     Input_Stream_Position position();
     
     CFStringRef contentType();
     size_t contentLength();
+    size_t totalLength();
     
     bool open();
     bool open(const Input_Stream_Position& position);
@@ -56,13 +113,13 @@ public:
     static bool canHandleUrl(CFURLRef url);
     
     /* ID3_Parser_Delegate */
-    void id3metaDataAvailable(std::map<CFStringRef,CFStringRef> metaData);
+    void id3metaDataAvailable(Meta_Data&& metaData);
     
     void streamIsReadyRead();
     void streamHasBytesAvailable(UInt8 *data, UInt32 numBytes);
     void streamEndEncountered();
     void streamErrorOccurred();
-    void streamMetaDataAvailable(std::map<CFStringRef,CFStringRef> metaData);
+    void streamMetaDataAvailable(Meta_Data&& metaData);
 };
     
     
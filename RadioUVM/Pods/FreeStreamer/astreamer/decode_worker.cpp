@@ -0,0 +1,471 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "decode_worker.h"
+#include "run_loop_event_loop.h"
+
+//#define DW_DEBUG 1
+
+#if !defined (DW_DEBUG)
+#define DW_TRACE(...) do {} while (0)
+#else
+#define DW_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+namespace astreamer {
+
+typedef struct {
+    const std::function<void()> *fn;
+    bool done;
+} perform_call_t;
+
+/* public */
+
+Decode_Worker::Decode_Worker(size_t inputSize, size_t outputSize, Event_Loop *ownerLoop) :
+    m_delegate(0),
+    m_input(inputSize),
+    m_output(outputSize),
+    m_tasks(kTaskRingSize),
+    m_ownerTasks(kTaskRingSize),
+    m_ownerSpilled(false),
+    m_runLoop(0),
+    m_source(0),
+    m_eventLoop(0),
+    m_ownerLoop(ownerLoop),
+    m_ownerTasksPosted(false),
+    m_outputPosted(false),
+    m_running(false),
+    m_stopping(false),
+    m_inputBlocked(false),
+    m_taskSpaceWanted(false)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+    pthread_mutex_init(&m_spillMutex, NULL);
+}
+
+Decode_Worker::~Decode_Worker()
+{
+    stop();
+
+    delete m_eventLoop, m_eventLoop = 0;
+
+    m_ownerLoop->cancel(this);
+
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+    pthread_mutex_destroy(&m_spillMutex);
+}
+
+bool Decode_Worker::start()
+{
+    if (m_running) {
+        return true;
+    }
+
+    m_stopping = false;
+
+    // Whatever used the loop of the previous thread is gone by now
+    delete m_eventLoop, m_eventLoop = 0;
+
+    if (pthread_create(&m_thread, NULL, threadMain, this) != 0) {
+        DW_TRACE("%s: failed to create the decode thread\n", __PRETTY_FUNCTION__);
+        return false;
+    }
+
+    // Wait until the thread has its run loop up
+    pthread_mutex_lock(&m_mutex);
+    while (!m_running) {
+        pthread_cond_wait(&m_cond, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return true;
+}
+
+void Decode_Worker::stop()
+{
+    if (!m_running) {
+        return;
+    }
+
+    m_stopping = true;
+
+    CFRunLoopSourceSignal(m_source);
+    CFRunLoopWakeUp(m_runLoop);
+
+    pthread_join(m_thread, NULL);
+
+    m_running = false;
+    m_runLoop = 0;
+
+    // Whatever was left in flight is stale now
+    m_input.reset();
+    m_output.reset();
+    m_tasks.reset();
+    m_ownerTasks.reset();
+    m_inputBlocked = false;
+    m_outputPosted = false;
+
+    pthread_mutex_lock(&m_spillMutex);
+    m_ownerSpill.clear();
+    m_ownerSpilled = false;
+    pthread_mutex_unlock(&m_spillMutex);
+}
+
+bool Decode_Worker::isRunning()
+{
+    return m_running;
+}
+
+bool Decode_Worker::isDecodeThread()
+{
+    return (m_running && pthread_equal(pthread_self(), m_thread));
+}
+
+Event_Loop *Decode_Worker::eventLoop()
+{
+    return m_eventLoop;
+}
+
+size_t Decode_Worker::writeInput(const void *data, size_t numBytes)
+{
+    size_t written = m_input.write(data, numBytes);
+
+    if (written < numBytes) {
+        /* The decode thread tells when there is room again. If it
+         * freed space after our write already, the signal below
+         * makes it notice the flag.
+         */
+        m_inputBlocked = true;
+    }
+
+    if (m_running) {
+        CFRunLoopSourceSignal(m_source);
+        CFRunLoopWakeUp(m_runLoop);
+    }
+
+    return written;
+}
+
+bool Decode_Worker::post(Decode_Task task, void *info, intptr_t arg)
+{
+    if (!m_running) {
+        // No thread to run it on, run it here
+        task(info, arg);
+        return true;
+    }
+
+    if (!pushTask(&m_tasks, task, info, arg)) {
+        DW_TRACE("%s: task ring full\n", __PRETTY_FUNCTION__);
+        return false;
+    }
+
+    CFRunLoopSourceSignal(m_source);
+    CFRunLoopWakeUp(m_runLoop);
+
+    return true;
+}
+
+void Decode_Worker::perform(const std::function<void()>& fn)
+{
+    if (!m_running || isDecodeThread()) {
+        fn();
+        return;
+    }
+
+    perform_call_t call;
+    call.fn = &fn;
+    call.done = false;
+
+    pthread_mutex_lock(&m_mutex);
+
+    /* The flag is raised before trying, so a drain that frees the
+     * space after the failed post finds it and wakes us up
+     */
+    m_taskSpaceWanted = true;
+
+    while (!post(performTask, &call, (intptr_t)this)) {
+        pthread_cond_wait(&m_cond, &m_mutex);
+    }
+
+    m_taskSpaceWanted = false;
+
+    while (!call.done) {
+        pthread_cond_wait(&m_cond, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+bool Decode_Worker::readOutput(std::vector<UInt8>& chunk)
+{
+    size_t numBytes;
+
+    if (m_output.readAvailable() < sizeof(numBytes)) {
+        return false;
+    }
+
+    // The decode thread writes a chunk with its length at once
+    m_output.read(&numBytes, sizeof(numBytes));
+
+    chunk.resize(numBytes);
+
+    if (numBytes > 0) {
+        m_output.read(&chunk[0], numBytes);
+    }
+
+    return true;
+}
+
+size_t Decode_Worker::inputRegion(const void **data)
+{
+    return m_input.readRegion(data);
+}
+
+void Decode_Worker::inputAdvance(size_t numBytes)
+{
+    m_input.readAdvance(numBytes);
+
+    checkInputSpace();
+}
+
+size_t Decode_Worker::inputAvailable()
+{
+    return m_input.readAvailable();
+}
+
+void Decode_Worker::postToOwner(Decode_Task task, void *info, intptr_t arg)
+{
+    /* A full ring doesn't drop the task and doesn't wait for the owner
+     * either, which may itself be waiting for this thread in perform().
+     */
+    if (m_ownerSpilled || !pushTask(&m_ownerTasks, task, info, arg)) {
+        DW_TRACE("%s: owner task ring full, spilling\n", __PRETTY_FUNCTION__);
+
+        task_t t;
+        t.task = task;
+        t.info = info;
+        t.arg = arg;
+
+        pthread_mutex_lock(&m_spillMutex);
+        m_ownerSpill.push_back(t);
+        m_ownerSpilled = true;
+        pthread_mutex_unlock(&m_spillMutex);
+    }
+
+    // One drain at a time is enough, it runs all the tasks posted
+    if (!m_ownerTasksPosted.exchange(true)) {
+        m_ownerLoop->post(ownerTasksTask, this, 0);
+    }
+}
+
+bool Decode_Worker::writeOutput(const void *data, size_t numBytes)
+{
+    /* The audio must not wait for the owner: if it falls behind
+     * by the whole ring, the chunk is not delivered.
+     */
+    if (m_output.writeAvailable() < sizeof(numBytes) + numBytes) {
+        DW_TRACE("%s: output ring full, %zu bytes not delivered\n", __PRETTY_FUNCTION__, numBytes);
+        return false;
+    }
+
+    m_output.write(&numBytes, sizeof(numBytes));
+    m_output.write(data, numBytes);
+
+    if (!m_outputPosted.exchange(true)) {
+        postToOwner(outputAvailableTask, this, 0);
+    }
+
+    return true;
+}
+
+void Decode_Worker::signal()
+{
+    if (m_running) {
+        CFRunLoopSourceSignal(m_source);
+        CFRunLoopWakeUp(m_runLoop);
+    }
+}
+
+/* private */
+
+bool Decode_Worker::pushTask(Spsc_Ring *ring, Decode_Task task, void *info, intptr_t arg)
+{
+    if (ring->writeAvailable() < sizeof(task_t)) {
+        return false;
+    }
+
+    task_t t;
+    t.task = task;
+    t.info = info;
+    t.arg = arg;
+
+    ring->write(&t, sizeof(t));
+
+    return true;
+}
+
+void Decode_Worker::runTasks(Spsc_Ring *ring)
+{
+    task_t t;
+
+    while (!m_stopping && ring->readAvailable() >= sizeof(t)) {
+        ring->read(&t, sizeof(t));
+
+        t.task(t.info, t.arg);
+    }
+}
+
+void Decode_Worker::runOwnerTasks()
+{
+    runTasks(&m_ownerTasks);
+
+    while (!m_stopping) {
+        std::vector<task_t> spill;
+
+        pthread_mutex_lock(&m_spillMutex);
+
+        if (m_ownerSpill.empty()) {
+            pthread_mutex_unlock(&m_spillMutex);
+            break;
+        }
+
+        // The tasks in the ring were posted before the spilled ones
+        if (m_ownerTasks.readAvailable() >= sizeof(task_t)) {
+            pthread_mutex_unlock(&m_spillMutex);
+
+            runTasks(&m_ownerTasks);
+            continue;
+        }
+
+        spill.swap(m_ownerSpill);
+        m_ownerSpilled = false;
+
+        pthread_mutex_unlock(&m_spillMutex);
+
+        for (std::vector<task_t>::iterator it = spill.begin(); it != spill.end() && !m_stopping; ++it) {
+            it->task(it->info, it->arg);
+        }
+
+        runTasks(&m_ownerTasks);
+    }
+}
+
+void Decode_Worker::checkInputSpace()
+{
+    /* Wake up the owner once a quarter of the ring is free. The post
+     * can't fail, so the flag is cleared only for a wakeup on its way.
+     */
+    if (m_inputBlocked &&
+        m_input.writeAvailable() >= m_input.capacity() / 4 &&
+        m_inputBlocked.exchange(false)) {
+        postToOwner(inputSpaceAvailableTask, this, 0);
+    }
+}
+
+void *Decode_Worker::threadMain(void *arg)
+{
+    Decode_Worker *THIS = static_cast<Decode_Worker*>(arg);
+
+    CFRunLoopSourceContext ctx = {0, THIS, NULL, NULL, NULL, NULL, NULL, NULL, NULL, sourcePerform};
+
+    THIS->m_source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &ctx);
+
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), THIS->m_source, kCFRunLoopCommonModes);
+
+    THIS->m_eventLoop = new Run_Loop_Event_Loop();
+
+    pthread_mutex_lock(&THIS->m_mutex);
+    THIS->m_runLoop = CFRunLoopGetCurrent();
+    THIS->m_running = true;
+    pthread_cond_broadcast(&THIS->m_cond);
+    pthread_mutex_unlock(&THIS->m_mutex);
+
+    DW_TRACE("decode thread running\n");
+
+    while (!THIS->m_stopping) {
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 60, true);
+    }
+
+    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), THIS->m_source, kCFRunLoopCommonModes);
+    CFRunLoopSourceInvalidate(THIS->m_source);
+    CFRelease(THIS->m_source), THIS->m_source = 0;
+
+    DW_TRACE("decode thread exiting\n");
+
+    return NULL;
+}
+
+void Decode_Worker::sourcePerform(void *info)
+{
+    Decode_Worker *THIS = static_cast<Decode_Worker*>(info);
+
+    THIS->runTasks(&THIS->m_tasks);
+
+    if (THIS->m_taskSpaceWanted) {
+        pthread_mutex_lock(&THIS->m_mutex);
+        pthread_cond_broadcast(&THIS->m_cond);
+        pthread_mutex_unlock(&THIS->m_mutex);
+    }
+
+    if (THIS->m_stopping) {
+        return;
+    }
+
+    THIS->checkInputSpace();
+
+    if (THIS->m_delegate) {
+        THIS->m_delegate->decodeWorkerInputAvailable();
+    }
+}
+
+void Decode_Worker::ownerTasksTask(void *info, intptr_t arg)
+{
+    Decode_Worker *THIS = static_cast<Decode_Worker*>(info);
+
+    // Cleared first, so that a task pushed during the drain posts again
+    THIS->m_ownerTasksPosted = false;
+
+    THIS->runOwnerTasks();
+}
+
+void Decode_Worker::performTask(void *info, intptr_t arg)
+{
+    perform_call_t *call = static_cast<perform_call_t*>(info);
+    Decode_Worker *THIS = (Decode_Worker *)arg;
+
+    (*call->fn)();
+
+    pthread_mutex_lock(&THIS->m_mutex);
+    call->done = true;
+    pthread_cond_broadcast(&THIS->m_cond);
+    pthread_mutex_unlock(&THIS->m_mutex);
+}
+
+void Decode_Worker::inputSpaceAvailableTask(void *info, intptr_t arg)
+{
+    Decode_Worker *THIS = static_cast<Decode_Worker*>(info);
+
+    if (THIS->m_delegate) {
+        THIS->m_delegate->decodeWorkerInputSpaceAvailable();
+    }
+}
+
+void Decode_Worker::outputAvailableTask(void *info, intptr_t arg)
+{
+    Decode_Worker *THIS = static_cast<Decode_Worker*>(info);
+
+    // Cleared first, so that a chunk written during the delivery posts again
+    THIS->m_outputPosted = false;
+
+    if (THIS->m_delegate) {
+        THIS->m_delegate->decodeWorkerOutputAvailable();
+    }
+}
+
+} // namespace astreamer
@@ -0,0 +1,134 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_DECODE_WORKER_H
+#define ASTREAMER_DECODE_WORKER_H
+
+#include "spsc_ring.h"
+#include "event_loop.h"
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <pthread.h>
+#include <functional>
+#include <vector>
+
+namespace astreamer {
+
+class Decode_Worker_Delegate;
+
+typedef void (*Decode_Task)(void *info, intptr_t arg);
+
+/*
+ * A dedicated decoding thread running its own run loop.
+ *
+ * The owner thread (the one running the owner's event loop) writes the
+ * stream bytes to a lock-free input ring and the decode thread reads them.
+ * Tasks are passed to the decode thread, and back to the owner thread,
+ * through lock-free task rings. The decode thread drains its ring from
+ * a run loop source, the owner from a task posted to its event loop.
+ * The decoded output goes back to the owner through a second byte ring.
+ */
+class Decode_Worker {
+public:
+    Decode_Worker_Delegate *m_delegate;
+
+    Decode_Worker(size_t inputSize, size_t outputSize, Event_Loop *ownerLoop);
+    ~Decode_Worker();
+
+    bool start();
+    void stop();
+    bool isRunning();
+    bool isDecodeThread();
+
+    /* An event loop on the run loop of the decode thread, for what has to
+       call back on that thread, such as the audio queue. It is kept after
+       stop(), so that what was scheduled on it can still be torn down, and
+       replaced on the next start(). */
+    Event_Loop *eventLoop();
+
+    /* owner thread */
+    size_t writeInput(const void *data, size_t numBytes);
+    bool post(Decode_Task task, void *info, intptr_t arg);
+    void perform(const std::function<void()>& fn);
+    bool readOutput(std::vector<UInt8>& chunk);
+
+    /* decode thread */
+    size_t inputRegion(const void **data);
+    void inputAdvance(size_t numBytes);
+    size_t inputAvailable();
+    void postToOwner(Decode_Task task, void *info, intptr_t arg);
+    bool writeOutput(const void *data, size_t numBytes);
+    void signal();
+
+private:
+    Decode_Worker(const Decode_Worker&);
+    Decode_Worker& operator=(const Decode_Worker&);
+
+    typedef struct {
+        Decode_Task task;
+        void *info;
+        intptr_t arg;
+    } task_t;
+
+    Spsc_Ring m_input;
+    Spsc_Ring m_output;
+    Spsc_Ring m_tasks;
+    Spsc_Ring m_ownerTasks;
+
+    /* The owner tasks which didn't fit the ring, in the order posted.
+       Once a task is spilled the ones after it are too, until the owner
+       has run the ring empty and taken the spill. */
+    std::vector<task_t> m_ownerSpill;
+    std::atomic<bool> m_ownerSpilled;
+    pthread_mutex_t m_spillMutex;
+
+    pthread_t m_thread;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+
+    CFRunLoopRef m_runLoop;
+    CFRunLoopSourceRef m_source;
+    Event_Loop *m_eventLoop;
+
+    Event_Loop *m_ownerLoop;
+    std::atomic<bool> m_ownerTasksPosted;   // a drain of the owner ring is posted
+    std::atomic<bool> m_outputPosted;       // a delivery of the output is posted
+
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_stopping;
+    std::atomic<bool> m_inputBlocked;       // the owner has bytes waiting for space
+    std::atomic<bool> m_taskSpaceWanted;    // the owner waits for room in the task ring
+
+    enum {
+        kTaskRingSize = 4096
+    };
+
+    bool pushTask(Spsc_Ring *ring, Decode_Task task, void *info, intptr_t arg);
+    void runTasks(Spsc_Ring *ring);
+    void runOwnerTasks();
+    void checkInputSpace();
+
+    static void *threadMain(void *arg);
+    static void sourcePerform(void *info);
+    static void ownerTasksTask(void *info, intptr_t arg);
+    static void performTask(void *info, intptr_t arg);
+    static void inputSpaceAvailableTask(void *info, intptr_t arg);
+    static void outputAvailableTask(void *info, intptr_t arg);
+};
+
+class Decode_Worker_Delegate {
+public:
+    virtual void decodeWorkerInputAvailable() = 0;       // called on the decode thread
+    virtual void decodeWorkerInputSpaceAvailable() = 0;  // called on the owner thread
+    virtual void decodeWorkerOutputAvailable() = 0;      // called on the owner thread
+};
+
+} // namespace astreamer
+
+#endif // ASTREAMER_DECODE_WORKER_H
@@ -0,0 +1,197 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "epoll_event_loop.h"
+
+#if defined (__linux__)
+
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+//#define EEL_DEBUG 1
+
+#if !defined (EEL_DEBUG)
+#define EEL_TRACE(...) do {} while (0)
+#else
+#include <stdio.h>
+#define EEL_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+namespace astreamer {
+
+Epoll_Event_Loop::Epoll_Event_Loop() :
+    m_epollFd(epoll_create1(EPOLL_CLOEXEC)),
+    m_wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    m_numEvents(0)
+{
+    if (m_epollFd >= 0 && m_wakeFd >= 0) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = m_wakeFd;
+        
+        epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &ev);
+    }
+}
+
+Epoll_Event_Loop::~Epoll_Event_Loop()
+{
+    if (m_epollFd >= 0) {
+        ::close(m_epollFd), m_epollFd = -1;
+    }
+    if (m_wakeFd >= 0) {
+        ::close(m_wakeFd), m_wakeFd = -1;
+    }
+}
+    
+bool Epoll_Event_Loop::isValid() const
+{
+    return (m_epollFd >= 0 && m_wakeFd >= 0);
+}
+    
+bool Epoll_Event_Loop::watch(int fd, int events, Event_Loop_Handler *handler)
+{
+    if (fd < 0 || !handler) {
+        return false;
+    }
+    
+    if ((size_t)fd >= m_watches.size()) {
+        Watch none = { 0, 0 };
+        m_watches.resize(fd + 1, none);
+    }
+    
+    struct epoll_event ev;
+    ev.events = 0;
+    ev.data.fd = fd;
+    
+    if (events & kEventRead) {
+        ev.events |= EPOLLIN;
+    }
+    if (events & kEventWrite) {
+        ev.events |= EPOLLOUT;
+    }
+    
+    /* A silent descriptor is taken out of the set: epoll reports errors
+     * and hangups regardless of the events, and a hung up descriptor
+     * left in the set would wake up the wait over and over again.
+     */
+    const bool registered = (m_watches[fd].handler && m_watches[fd].events);
+    int op;
+    
+    if (events == 0) {
+        op = (registered ? EPOLL_CTL_DEL : 0);
+    } else {
+        op = (registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+    }
+    
+    if (op && epoll_ctl(m_epollFd, op, fd, &ev) != 0) {
+        EEL_TRACE("epoll_ctl failed for fd %i, errno %i\n", fd, errno);
+        return false;
+    }
+    
+    m_watches[fd].handler = handler;
+    m_watches[fd].events = events;
+    
+    return true;
+}
+    
+void Epoll_Event_Loop::unwatch(int fd)
+{
+    if (fd < 0 || (size_t)fd >= m_watches.size() || !m_watches[fd].handler) {
+        return;
+    }
+    
+    if (m_watches[fd].events) {
+        epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    
+    m_watches[fd].handler = 0;
+    m_watches[fd].events = 0;
+    
+    // The descriptor may be reused before the dispatch reaches its events
+    for (int i=0; i < m_numEvents; i++) {
+        if (m_events[i].data.fd == fd) {
+            m_events[i].data.fd = -1;
+        }
+    }
+}
+    
+bool Epoll_Event_Loop::runOnce(int timeoutMs)
+{
+    int n = epoll_wait(m_epollFd, m_events, kMaxEvents, waitTimeout(timeoutMs));
+    
+    if (n < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+        n = 0;
+    }
+    
+    m_numEvents = n;
+    
+    for (int i=0; i < m_numEvents; i++) {
+        const int fd = m_events[i].data.fd;
+        
+        if (fd == m_wakeFd) {
+            uint64_t count;
+            
+            while (read(m_wakeFd, &count, sizeof(count)) > 0) {
+            }
+            continue;
+        }
+        
+        if (fd < 0 || !m_watches[fd].handler) {
+            continue;
+        }
+        
+        const uint32_t ev = m_events[i].events;
+        int ready = 0;
+        
+        if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            ready |= kEventRead;
+        }
+        if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            ready |= kEventWrite;
+        }
+        
+        ready &= m_watches[fd].events;
+        
+        if (ready) {
+            m_watches[fd].handler->eventLoopReady(fd, ready);
+        }
+    }
+    
+    m_numEvents = 0;
+    
+    runTimersAndTasks();
+    
+    return true;
+}
+    
+/* protected */
+    
+void Epoll_Event_Loop::wakeUp()
+{
+    const uint64_t one = 1;
+    
+    while (write(m_wakeFd, &one, sizeof(one)) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            EEL_TRACE("waking up the loop failed, errno %i\n", errno);
+        }
+        // EAGAIN: the counter is saturated, so a wake up is already pending
+        break;
+    }
+}
+    
+} // namespace astreamer
+
+#endif // __linux__
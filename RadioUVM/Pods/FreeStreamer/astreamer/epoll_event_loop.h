@@ -0,0 +1,62 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_EPOLL_EVENT_LOOP_H
+#define ASTREAMER_EPOLL_EVENT_LOOP_H
+
+#if defined (__linux__)
+
+#include "event_loop.h"
+
+#include <sys/epoll.h>
+#include <vector>
+
+namespace astreamer {
+
+class Epoll_Event_Loop : public Event_Loop {
+public:
+    Epoll_Event_Loop();
+    virtual ~Epoll_Event_Loop();
+    
+    bool isValid() const;
+    
+    bool watch(int fd, int events, Event_Loop_Handler *handler);
+    void unwatch(int fd);
+    bool runOnce(int timeoutMs);
+    
+protected:
+    void wakeUp();
+    
+private:
+    int m_epollFd;
+    
+    /* An eventfd interrupting the wait for the posted tasks */
+    int m_wakeFd;
+    
+    struct Watch {
+        Event_Loop_Handler *handler;
+        int events;
+    };
+    
+    /* Indexed by the descriptor */
+    std::vector<Watch> m_watches;
+    
+    enum {
+        kMaxEvents = 64
+    };
+    
+    /* The events being dispatched */
+    struct epoll_event m_events[kMaxEvents];
+    int m_numEvents;
+};
+    
+} // namespace astreamer
+
+#endif // __linux__
+
+#endif // ASTREAMER_EPOLL_EVENT_LOOP_H
@@ -0,0 +1,237 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "event_loop.h"
+
+#if defined (__linux__)
+#include "epoll_event_loop.h"
+#include <time.h>
+#else
+#include "kqueue_event_loop.h"
+#include <mach/mach_time.h>
+#endif
+
+namespace astreamer {
+
+Event_Loop::Event_Loop() :
+    m_nextTimer(1),
+    m_runningTaskIndex(0)
+{
+    pthread_mutex_init(&m_tasksMutex, NULL);
+}
+    
+Event_Loop::~Event_Loop()
+{
+    pthread_mutex_destroy(&m_tasksMutex);
+}
+    
+Event_Loop *Event_Loop::create()
+{
+#if defined (__linux__)
+    Epoll_Event_Loop *loop = new Epoll_Event_Loop();
+#else
+    Kqueue_Event_Loop *loop = new Kqueue_Event_Loop();
+#endif
+    
+    if (!loop->isValid()) {
+        delete loop;
+        return 0;
+    }
+    return loop;
+}
+    
+unsigned Event_Loop::startTimer(unsigned intervalMs, bool repeats, Event_Loop_Task task, void *info, intptr_t arg)
+{
+    const unsigned timer = m_nextTimer++;
+    
+    if (m_nextTimer == 0) {
+        m_nextTimer = 1;
+    }
+    
+    Timer t;
+    t.deadline = m_deadlines.insert(std::make_pair(currentTimeMs() + intervalMs, timer));
+    t.intervalMs = intervalMs;
+    t.repeats = repeats;
+    t.task.task = task;
+    t.task.info = info;
+    t.task.arg = arg;
+    
+    m_timers[timer] = t;
+    
+    timersChanged();
+    
+    return timer;
+}
+    
+void Event_Loop::stopTimer(unsigned timer)
+{
+    std::map<unsigned, Timer>::iterator t = m_timers.find(timer);
+    
+    if (t != m_timers.end()) {
+        eraseTimer(t);
+        timersChanged();
+    }
+}
+    
+void Event_Loop::post(Event_Loop_Task task, void *info, intptr_t arg)
+{
+    Task t;
+    t.task = task;
+    t.info = info;
+    t.arg = arg;
+    
+    pthread_mutex_lock(&m_tasksMutex);
+    m_tasks.push_back(t);
+    pthread_mutex_unlock(&m_tasksMutex);
+    
+    wakeUp();
+}
+    
+void Event_Loop::cancel(void *info)
+{
+    for (std::map<unsigned, Timer>::iterator t = m_timers.begin(); t != m_timers.end();) {
+        if (t->second.task.info == info) {
+            eraseTimer(t++);
+        } else {
+            ++t;
+        }
+    }
+    
+    pthread_mutex_lock(&m_tasksMutex);
+    for (std::vector<Task>::iterator t = m_tasks.begin(); t != m_tasks.end();) {
+        if (t->info == info) {
+            t = m_tasks.erase(t);
+        } else {
+            ++t;
+        }
+    }
+    pthread_mutex_unlock(&m_tasksMutex);
+    
+    // The tasks which the current run hasn't reached yet
+    for (size_t i = m_runningTaskIndex; i < m_runningTasks.size(); i++) {
+        if (m_runningTasks[i].info == info) {
+            m_runningTasks[i].task = 0;
+        }
+    }
+    
+    timersChanged();
+}
+    
+bool Event_Loop::runsRunLoop()
+{
+    return false;
+}
+    
+/* protected */
+    
+void Event_Loop::timersChanged()
+{
+}
+    
+int Event_Loop::waitTimeout(int timeoutMs)
+{
+    pthread_mutex_lock(&m_tasksMutex);
+    const bool tasksPending = !m_tasks.empty();
+    pthread_mutex_unlock(&m_tasksMutex);
+    
+    if (tasksPending) {
+        return 0;
+    }
+    
+    if (m_deadlines.empty()) {
+        return timeoutMs;
+    }
+    
+    const uint64_t fireTime = m_deadlines.begin()->first;
+    const uint64_t now = currentTimeMs();
+    const uint64_t untilTimer = (fireTime > now ? fireTime - now : 0);
+    
+    if (timeoutMs >= 0 && (uint64_t)timeoutMs < untilTimer) {
+        return timeoutMs;
+    }
+    return (untilTimer > INT32_MAX ? INT32_MAX : (int)untilTimer);
+}
+    
+void Event_Loop::runTimersAndTasks()
+{
+    if (!m_deadlines.empty()) {
+        const uint64_t now = currentTimeMs();
+        std::vector<unsigned> due;
+    
+        for (Deadlines::iterator d = m_deadlines.begin(); d != m_deadlines.end() && d->first <= now; ++d) {
+            due.push_back(d->second);
+        }
+    
+        // A task may stop or start any of the timers
+        for (std::vector<unsigned>::iterator id = due.begin(); id != due.end(); ++id) {
+            std::map<unsigned, Timer>::iterator t = m_timers.find(*id);
+    
+            if (t == m_timers.end()) {
+                continue;
+            }
+    
+            const Task task = t->second.task;
+    
+            if (t->second.repeats) {
+                m_deadlines.erase(t->second.deadline);
+                t->second.deadline = m_deadlines.insert(std::make_pair(now + (t->second.intervalMs > 0 ? t->second.intervalMs : 1), t->first));
+            } else {
+                eraseTimer(t);
+            }
+    
+            task.task(task.info, task.arg);
+        }
+    
+        if (!due.empty()) {
+            timersChanged();
+        }
+    }
+    
+    pthread_mutex_lock(&m_tasksMutex);
+    m_runningTasks.swap(m_tasks);
+    pthread_mutex_unlock(&m_tasksMutex);
+    
+    for (m_runningTaskIndex = 0; m_runningTaskIndex < m_runningTasks.size(); m_runningTaskIndex++) {
+        const Task task = m_runningTasks[m_runningTaskIndex];
+    
+        if (task.task) {
+            task.task(task.info, task.arg);
+        }
+    }
+    
+    m_runningTasks.clear();
+    m_runningTaskIndex = 0;
+}
+    
+uint64_t Event_Loop::currentTimeMs()
+{
+#if defined (__linux__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    static mach_timebase_info_data_t timebase;
+    
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000000;
+#endif
+}
+    
+/* private */
+    
+void Event_Loop::eraseTimer(std::map<unsigned, Timer>::iterator timer)
+{
+    m_deadlines.erase(timer->second.deadline);
+    m_timers.erase(timer);
+}
+    
+} // namespace astreamer
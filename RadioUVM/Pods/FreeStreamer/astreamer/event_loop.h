@@ -0,0 +1,122 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_EVENT_LOOP_H
+#define ASTREAMER_EVENT_LOOP_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+namespace astreamer {
+
+class Event_Loop_Handler;
+    
+typedef void (*Event_Loop_Task)(void *info, intptr_t arg);
+    
+/*
+ * Dispatches the readiness of file descriptors, timers and posted tasks.
+ * All the calls and the callbacks happen on the thread running the loop,
+ * except post(), which may be called from any thread.
+ */
+class Event_Loop {
+public:
+    Event_Loop();
+    virtual ~Event_Loop();
+    
+    enum {
+        kEventRead  = 1,
+        kEventWrite = 2
+    };
+    
+    /* Creates the native implementation: epoll on Linux, kqueue on Darwin and BSD */
+    static Event_Loop *create();
+    
+    /* Sets the events the handler is called for; 0 keeps the handler but stops
+       watching the descriptor until it is watched for events again */
+    virtual bool watch(int fd, int events, Event_Loop_Handler *handler) = 0;
+    /* The handler is not called for the descriptor after this, also within the current dispatch */
+    virtual void unwatch(int fd) = 0;
+    
+    /* Runs the task after the interval, and then every interval if it repeats.
+       Returns the timer for stopTimer(). */
+    unsigned startTimer(unsigned intervalMs, bool repeats, Event_Loop_Task task, void *info, intptr_t arg);
+    void stopTimer(unsigned timer);
+    
+    /* Runs the task on the loop thread */
+    void post(Event_Loop_Task task, void *info, intptr_t arg);
+    
+    /* Drops the timers and the posted tasks of the info, as it is going away */
+    void cancel(void *info);
+    
+    /* Whether the loop runs a CFRunLoop, on which the CFNetwork streams
+       and the audio queue callbacks can be scheduled; see Run_Loop_Event_Loop */
+    virtual bool runsRunLoop();
+    
+    /* Waits up to the timeout (-1 waits forever) and dispatches the ready
+       descriptors, the due timers and the posted tasks. Returns false on
+       an error of the loop itself. */
+    virtual bool runOnce(int timeoutMs) = 0;
+    
+protected:
+    /* Interrupts the wait of the loop; called from any thread */
+    virtual void wakeUp() = 0;
+    /* Called on the loop thread when the next timer may have changed */
+    virtual void timersChanged();
+    
+    /* The timeout to wait for, shortened to the next timer */
+    int waitTimeout(int timeoutMs);
+    void runTimersAndTasks();
+    
+    static uint64_t currentTimeMs();
+    
+private:
+    Event_Loop(const Event_Loop&);
+    Event_Loop& operator=(const Event_Loop&);
+    
+    struct Task {
+        Event_Loop_Task task;
+        void *info;
+        intptr_t arg;
+    };
+    
+    /* The timers ordered by their fire time, so the next one is the first */
+    typedef std::multimap<uint64_t, unsigned> Deadlines;
+    
+    struct Timer {
+        Deadlines::iterator deadline;
+        unsigned intervalMs;
+        bool repeats;
+        Task task;
+    };
+    
+    std::map<unsigned, Timer> m_timers;
+    Deadlines m_deadlines;
+    unsigned m_nextTimer;
+    
+    void eraseTimer(std::map<unsigned, Timer>::iterator timer);
+    
+    /* Posted from any thread, guarded by the mutex */
+    std::vector<Task> m_tasks;
+    pthread_mutex_t m_tasksMutex;
+    
+    /* The tasks being run, for cancel() */
+    std::vector<Task> m_runningTasks;
+    size_t m_runningTaskIndex;
+};
+    
+class Event_Loop_Handler {
+public:
+    /* The events which are ready; errors and hangups wake up the watched events */
+    virtual void eventLoopReady(int fd, int events) = 0;
+};
+    
+} // namespace astreamer
+
+#endif // ASTREAMER_EVENT_LOOP_H
@@ -8,23 +8,516 @@
 
 #include "file_output.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+//#define FO_DEBUG 1
+
+#if !defined (FO_DEBUG)
+#define FO_TRACE(...) do {} while (0)
+#else
+#define FO_TRACE(...) printf(__VA_ARGS__)
+#endif
+
 namespace astreamer {
 
+struct File_Output::Writer {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    std::deque<File_Output *> outputs;  // the ones with blocks queued, in turn
+    
+    /* Shared by all the outputs; 0 if no thread could be created */
+    static Writer *shared();
+    static Writer *create();
+};
+    
+/* public */
+    
 File_Output::File_Output(CFURLRef fileURL) :
-    m_writeStream(CFWriteStreamCreateWithFile(kCFAllocatorDefault, fileURL))
+    m_fd(-1),
+    m_syncPolicy(SYNC_NEVER),
+    m_queuePolicy(WAIT_WHEN_FULL),
+    m_block(0),
+    m_offset(0),
+    m_bytesAccepted(0),
+    m_writer(0),
+    m_scheduled(false),
+    m_failed(false),
+    m_blockCount(0),
+    m_bytesCompleted(0)
+{
+    open(fileURL, O_WRONLY | O_CREAT | O_TRUNC);
+}
+    
+File_Output::File_Output(CFURLRef fileURL, bool keepContents) :
+    m_fd(-1),
+    m_syncPolicy(SYNC_NEVER),
+    m_queuePolicy(WAIT_WHEN_FULL),
+    m_block(0),
+    m_offset(0),
+    m_bytesAccepted(0),
+    m_writer(0),
+    m_scheduled(false),
+    m_failed(false),
+    m_blockCount(0),
+    m_bytesCompleted(0)
 {
-    CFWriteStreamOpen(m_writeStream);
+    open(fileURL, O_WRONLY | O_CREAT | (keepContents ? 0 : O_TRUNC));
 }
     
 File_Output::~File_Output()
 {
-    CFWriteStreamClose(m_writeStream);
-    CFRelease(m_writeStream);
+    submit();
+    
+    // No writer may be left with the output
+    waitUntilWritten();
+    
+    if (m_fd >= 0) {
+        if (m_syncPolicy != SYNC_NEVER && !m_failed) {
+            fsync(m_fd);
+        }
+        ::close(m_fd), m_fd = -1;
+    }
+    
+    FO_TRACE("%s: %llu bytes in %u blocks, %llu skipped, max latency %.3f s\n",
+             __PRETTY_FUNCTION__,
+             (unsigned long long)m_stats.bytesWritten,
+             m_stats.blocksWritten,
+             (unsigned long long)m_stats.bytesSkipped,
+             m_stats.maxWriteLatency);
+    
+    for (std::vector<Block *>::iterator b = m_freeBlocks.begin(); b != m_freeBlocks.end(); ++b) {
+        delete [] (*b)->data;
+        delete *b;
+    }
+    
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
 }
     
 CFIndex File_Output::write(const UInt8 *buffer, CFIndex bufferLength)
 {
-    return CFWriteStreamWrite(m_writeStream, buffer, bufferLength);
+    if (m_fd < 0 || bufferLength < 0 || failed()) {
+        return -1;
+    }
+    
+    if (m_queuePolicy == SKIP_WHEN_FULL && !reserve(bufferLength)) {
+        FO_TRACE("%s: the queue is full, skipping %li bytes\n", __PRETTY_FUNCTION__, (long)bufferLength);
+    
+        seek(m_offset + bufferLength);
+    
+        pthread_mutex_lock(&m_mutex);
+        m_stats.bytesSkipped += bufferLength;
+        pthread_mutex_unlock(&m_mutex);
+    
+        return -1;
+    }
+    
+    CFIndex copied = 0;
+    
+    while (copied < bufferLength) {
+        if (!m_block) {
+            if (m_queuePolicy == WAIT_WHEN_FULL && !waitForBlock()) {
+                // What was copied is in the blocks already queued
+                m_bytesAccepted += copied;
+    
+                return -1;
+            }
+    
+            pthread_mutex_lock(&m_mutex);
+            m_block = m_freeBlocks.back();
+            m_freeBlocks.pop_back();
+            pthread_mutex_unlock(&m_mutex);
+    
+            // The first block after a seek ends at the next aligned offset
+            m_block->offset = m_offset;
+            m_block->length = 0;
+            m_block->capacity = kBlockSize - (size_t)(m_offset % kBlockSize);
+        }
+    
+        const size_t n = std::min(m_block->capacity - m_block->length, (size_t)(bufferLength - copied));
+    
+        memcpy(m_block->data + m_block->length, buffer + copied, n);
+    
+        m_block->length += n;
+        m_offset += n;
+        copied += n;
+    
+        if (m_block->length == m_block->capacity) {
+            submit();
+        }
+    }
+    
+    m_bytesAccepted += bufferLength;
+    
+    return bufferLength;
+}
+    
+bool File_Output::seek(UInt64 offset)
+{
+    if (m_fd < 0) {
+        return false;
+    }
+    
+    if (offset != m_offset) {
+        submit();
+    
+        m_offset = offset;
+    }
+    return true;
 }
-
-} // namespace astreamer
\ No newline at end of file
+    
+bool File_Output::flush(bool wait)
+{
+    if (m_fd < 0) {
+        return false;
+    }
+    
+    submit();
+    
+    if (wait) {
+        waitUntilWritten();
+    
+        if (m_syncPolicy == SYNC_ON_FLUSH && !failed() && fsync(m_fd) != 0) {
+            pthread_mutex_lock(&m_mutex);
+            m_failed = true;
+            pthread_mutex_unlock(&m_mutex);
+        }
+    }
+    return !failed();
+}
+    
+void File_Output::setSyncPolicy(Sync_Policy policy)
+{
+    m_syncPolicy = policy;
+}
+    
+void File_Output::setQueuePolicy(Queue_Policy policy)
+{
+    m_queuePolicy = policy;
+}
+    
+bool File_Output::failed()
+{
+    pthread_mutex_lock(&m_mutex);
+    const bool failed = m_failed;
+    pthread_mutex_unlock(&m_mutex);
+    
+    return failed;
+}
+    
+UInt64 File_Output::bytesAccepted()
+{
+    return m_bytesAccepted;
+}
+    
+UInt64 File_Output::bytesCompleted()
+{
+    pthread_mutex_lock(&m_mutex);
+    const UInt64 completed = m_bytesCompleted;
+    pthread_mutex_unlock(&m_mutex);
+    
+    return completed;
+}
+    
+File_Output_Stats File_Output::stats()
+{
+    pthread_mutex_lock(&m_mutex);
+    const File_Output_Stats stats = m_stats;
+    pthread_mutex_unlock(&m_mutex);
+    
+    return stats;
+}
+    
+/* protected */
+    
+ssize_t File_Output::writeAt(const UInt8 *data, size_t length, UInt64 offset)
+{
+    return pwrite(m_fd, data, length, (off_t)offset);
+}
+    
+/* private */
+    
+void File_Output::open(CFURLRef fileURL, int flags)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+    
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+    
+    // A CFWriteStream truncates the file when opened, so it can't write
+    // into the middle of an existing file
+    char path[PATH_MAX];
+    
+    if (fileURL && CFURLGetFileSystemRepresentation(fileURL, true, (UInt8 *)path, sizeof(path))) {
+        m_fd = ::open(path, flags, 0644);
+    }
+    
+    if (m_fd < 0) {
+        m_failed = true;
+        return;
+    }
+    
+    m_writer = Writer::shared();
+    
+    if (!m_writer) {
+        FO_TRACE("%s: no writer thread, writing synchronously\n", __PRETTY_FUNCTION__);
+    }
+}
+    
+bool File_Output::reserve(size_t bytes)
+{
+    const size_t room = (m_block ? m_block->capacity - m_block->length : 0);
+    
+    if (bytes <= room) {
+        return true;
+    }
+    
+    // The blocks after the current one start at aligned offsets
+    const size_t firstCapacity = kBlockSize - (size_t)((m_offset + room) % kBlockSize);
+    const size_t remaining = bytes - room;
+    
+    unsigned needed = 1;
+    
+    if (remaining > firstCapacity) {
+        needed += (unsigned)((remaining - firstCapacity + kBlockSize - 1) / kBlockSize);
+    }
+    
+    pthread_mutex_lock(&m_mutex);
+    
+    const bool available = (m_freeBlocks.size() + (kMaxBlocks - m_blockCount) >= needed);
+    
+    while (available && m_freeBlocks.size() < needed) {
+        Block *block = new Block;
+        block->data = new UInt8[kBlockSize];
+    
+        m_freeBlocks.push_back(block);
+        m_blockCount++;
+    }
+    
+    pthread_mutex_unlock(&m_mutex);
+    
+    return available;
+}
+    
+bool File_Output::waitForBlock()
+{
+    pthread_mutex_lock(&m_mutex);
+    
+    // The writer returns a block to the free ones after each write
+    while (m_freeBlocks.empty() && m_blockCount >= kMaxBlocks && !m_failed) {
+        pthread_cond_wait(&m_cond, &m_mutex);
+    }
+    
+    const bool failed = m_failed;
+    
+    if (!failed && m_freeBlocks.empty()) {
+        Block *block = new Block;
+        block->data = new UInt8[kBlockSize];
+    
+        m_freeBlocks.push_back(block);
+        m_blockCount++;
+    }
+    
+    pthread_mutex_unlock(&m_mutex);
+    
+    return !failed;
+}
+    
+void File_Output::submit()
+{
+    if (!m_block) {
+        return;
+    }
+    
+    Block *block = m_block;
+    m_block = 0;
+    
+    if (block->length == 0) {
+        pthread_mutex_lock(&m_mutex);
+        m_freeBlocks.push_back(block);
+        pthread_mutex_unlock(&m_mutex);
+        return;
+    }
+    
+    if (!m_writer) {
+        writeBlock(block);
+        return;
+    }
+    
+    pthread_mutex_lock(&m_mutex);
+    
+    m_queue.push_back(block);
+    
+    if (m_queue.size() > m_stats.maxQueuedBlocks) {
+        m_stats.maxQueuedBlocks = (unsigned)m_queue.size();
+    }
+    
+    // Already scheduled, the writer keeps coming back until the queue is empty
+    const bool schedule = !m_scheduled;
+    m_scheduled = true;
+    
+    pthread_mutex_unlock(&m_mutex);
+    
+    if (schedule) {
+        pthread_mutex_lock(&m_writer->mutex);
+        m_writer->outputs.push_back(this);
+        pthread_cond_signal(&m_writer->cond);
+        pthread_mutex_unlock(&m_writer->mutex);
+    }
+}
+    
+void File_Output::waitUntilWritten()
+{
+    pthread_mutex_lock(&m_mutex);
+    while (m_scheduled) {
+        pthread_cond_wait(&m_cond, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+    
+void File_Output::writeBlock(Block *block)
+{
+    pthread_mutex_lock(&m_mutex);
+    bool failed = m_failed;
+    pthread_mutex_unlock(&m_mutex);
+    
+    size_t written = 0;
+    
+    const CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    
+    while (!failed && written < block->length) {
+        ssize_t n = writeAt(block->data + written, block->length - written, block->offset + written);
+    
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            FO_TRACE("%s: write failed, errno %i\n", __PRETTY_FUNCTION__, errno);
+    
+            failed = true;
+            break;
+        }
+        written += n;
+    }
+    
+    const double latency = CFAbsoluteTimeGetCurrent() - start;
+    
+    pthread_mutex_lock(&m_mutex);
+    
+    if (failed) {
+        m_failed = true;
+    } else {
+        m_stats.bytesWritten += written;
+        m_stats.blocksWritten++;
+        m_stats.totalWriteLatency += latency;
+    
+        if (latency > m_stats.maxWriteLatency) {
+            m_stats.maxWriteLatency = latency;
+        }
+    }
+    
+    m_bytesCompleted += block->length;
+    m_freeBlocks.push_back(block);
+    
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+}
+    
+/* Writes the next queued block on a writer thread; returns whether more are queued */
+bool File_Output::writeNext()
+{
+    pthread_mutex_lock(&m_mutex);
+    Block *block = m_queue.front();
+    m_queue.pop_front();
+    pthread_mutex_unlock(&m_mutex);
+    
+    writeBlock(block);
+    
+    pthread_mutex_lock(&m_mutex);
+    
+    const bool more = !m_queue.empty();
+    
+    if (!more) {
+        // The output may be deleted as soon as this is seen
+        m_scheduled = false;
+        pthread_cond_broadcast(&m_cond);
+    }
+    
+    pthread_mutex_unlock(&m_mutex);
+    
+    return more;
+}
+    
+void *File_Output::threadMain(void *info)
+{
+    Writer *writer = (Writer *)info;
+    
+    for (;;) {
+        pthread_mutex_lock(&writer->mutex);
+    
+        while (writer->outputs.empty()) {
+            pthread_cond_wait(&writer->cond, &writer->mutex);
+        }
+    
+        File_Output *output = writer->outputs.front();
+        writer->outputs.pop_front();
+    
+        pthread_mutex_unlock(&writer->mutex);
+    
+        // A block at a time, so that a busy output doesn't hold up the others
+        if (output->writeNext()) {
+            pthread_mutex_lock(&writer->mutex);
+            writer->outputs.push_back(output);
+            pthread_cond_signal(&writer->cond);
+            pthread_mutex_unlock(&writer->mutex);
+        }
+    }
+    return NULL;
+}
+    
+File_Output::Writer *File_Output::Writer::shared()
+{
+    static Writer *writer = create();
+    return writer;
+}
+    
+File_Output::Writer *File_Output::Writer::create()
+{
+    Writer *writer = new Writer();
+    
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    unsigned threads = 0;
+    
+    for (unsigned i = 0; i < kWriterThreads; i++) {
+        pthread_t thread;
+    
+        if (pthread_create(&thread, &attr, threadMain, writer) == 0) {
+            threads++;
+        }
+    }
+    
+    pthread_attr_destroy(&attr);
+    
+    if (threads == 0) {
+        pthread_cond_destroy(&writer->cond);
+        pthread_mutex_destroy(&writer->mutex);
+    
+        delete writer;
+        return 0;
+    }
+    return writer;
+}
+    
+} // namespace astreamer
@@ -11,22 +11,138 @@
 
 #import <CoreFoundation/CoreFoundation.h>
 
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <vector>
+
 namespace astreamer {
 
+struct File_Output_Stats {
+    UInt64 bytesWritten;
+    UInt64 bytesSkipped;        // the writes refused with the queue full, SKIP_WHEN_FULL only
+    unsigned blocksWritten;
+    unsigned maxQueuedBlocks;
+    double totalWriteLatency;   // seconds in write(2), on the writer thread
+    double maxWriteLatency;
+};
+    
+/*
+ * Writes a file without blocking the caller on the disk. The bytes are
+ * gathered into blocks aligned to kBlockSize in the file and the blocks
+ * are written in order by a small pool of writer threads, which all the
+ * outputs share, taking turns block by block. At most kMaxBlocks are
+ * queued: when the disk falls that much behind, write() waits for the
+ * writer, or with SKIP_WHEN_FULL skips the bytes so that a slow disk
+ * never stalls the caller. Only an output which keeps track of the gaps,
+ * like the cache, or which must not hold up the thread it runs on, like
+ * a recorder sharing an event loop, should skip.
+ */
 class File_Output  {
+public:
+    enum Sync_Policy {
+        SYNC_NEVER,
+        SYNC_ON_CLOSE,          // fsync() when deleted
+        SYNC_ON_FLUSH           // fsync() on every flush(true) and when deleted
+    };
+    
+    enum Queue_Policy {
+        WAIT_WHEN_FULL,         // nothing is dropped, the default
+        SKIP_WHEN_FULL
+    };
+    
+    /* Truncates the file */
+    File_Output(CFURLRef fileURL);
+    /* Keeps the existing contents, for writing at any offset with seek() */
+    File_Output(CFURLRef fileURL, bool keepContents);
+    /* Waits until everything is written */
+    virtual ~File_Output();
+    
+    /*
+     * Returns bufferLength once the bytes are buffered and -1 if the
+     * output has failed. With SKIP_WHEN_FULL, also -1 if the bytes were
+     * skipped; the next write still goes after them.
+     */
+    CFIndex write(const UInt8 *buffer, CFIndex bufferLength);
+    bool seek(UInt64 offset);
+    
+    /* Queues the partial block and, with wait, returns once all is written */
+    bool flush(bool wait);
+    
+    void setSyncPolicy(Sync_Policy policy);
+    void setQueuePolicy(Queue_Policy policy);
+    
+    /* The file could not be opened or a write to it failed: nothing after it is written */
+    bool failed();
+    
+    /* The bytes write() has taken and the ones done with on the writer thread */
+    UInt64 bytesAccepted();
+    UInt64 bytesCompleted();
+    
+    File_Output_Stats stats();
+    
+protected:
+    /*
+     * Writes on a writer thread, pwrite() by default. A subclass standing
+     * in for the disk must flush(true) in its destructor, so that no writer
+     * is in it when the subclass goes.
+     */
+    virtual ssize_t writeAt(const UInt8 *data, size_t length, UInt64 offset);
+    
 private:
+    enum {
+        kBlockSize = 65536,
+        kMaxBlocks = 16,
+        kWriterThreads = 2
+    };
+    
+    struct Block {
+        UInt8 *data;
+        UInt64 offset;
+        size_t length;
+        size_t capacity;
+    };
+    
     File_Output(const File_Output&);
     File_Output& operator=(const File_Output&);
     
-    CFWriteStreamRef m_writeStream;
+    int m_fd;
+    Sync_Policy m_syncPolicy;
+    Queue_Policy m_queuePolicy;
     
-public:
-    File_Output(CFURLRef fileURL);
-    ~File_Output();
+    /* Only touched by the thread calling write() */
+    Block *m_block;
+    UInt64 m_offset;
+    UInt64 m_bytesAccepted;
     
-    CFIndex write(const UInt8 *buffer, CFIndex bufferLength);
+    /* The writer threads, created on the first use and kept */
+    struct Writer;
+    Writer *m_writer;
+    
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+    bool m_scheduled;           // queued for a writer or being written by one
+    bool m_failed;
+    
+    std::deque<Block *> m_queue;
+    std::vector<Block *> m_freeBlocks;
+    unsigned m_blockCount;
+    UInt64 m_bytesCompleted;
+    File_Output_Stats m_stats;
+    
+    void open(CFURLRef fileURL, int flags);
+    
+    bool reserve(size_t bytes);
+    bool waitForBlock();
+    void submit();
+    void waitUntilWritten();
+    void writeBlock(Block *block);
+    bool writeNext();
+    
+    static void *threadMain(void *info);
 };
-
+    
 } // namespace astreamer
 
-#endif // ASTREAMER_FILE_OUTPUT_H
\ No newline at end of file
+#endif // ASTREAMER_FILE_OUTPUT_H
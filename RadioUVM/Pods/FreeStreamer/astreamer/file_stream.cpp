@@ -8,27 +8,55 @@
 
 #include "file_stream.h"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+//#define FS_DEBUG 1
+
+#if !defined (FS_DEBUG)
+#define FS_TRACE(...) do {} while (0)
+#else
+#define FS_TRACE(...) printf(__VA_ARGS__)
+#endif
+
 namespace astreamer {
     
-File_Stream::File_Stream() :
+File_Stream::File_Stream(Event_Loop *eventLoop) :
+    m_eventLoop(eventLoop),
     m_url(0),
-    m_readStream(0),
+    m_open(false),
     m_scheduledInRunLoop(false),
-    m_readPending(false),
-    m_fileReadBuffer(0),
+    m_readPosted(false),
+    m_endSent(false),
+    m_openCount(0),
+    m_mapping(0),
+    m_mappingLength(0),
+    m_mapped(false),
+    m_mappedDevice(0),
+    m_mappedInode(0),
+    m_readOffset(0),
+    m_readEnd(0),
+    m_readAheadEnd(0),
     m_id3Parser(new ID3_Parser()),
     m_contentType(0)
 {
     m_id3Parser->m_delegate = this;
+    
+    m_position.start = 0;
+    m_position.end = 0;
 }
     
 File_Stream::~File_Stream()
 {
     close();
     
-    if (m_fileReadBuffer) {
-        delete [] m_fileReadBuffer, m_fileReadBuffer = 0;
-    }
+    unmap();
     
     if (m_url) {
         CFRelease(m_url), m_url = 0;
@@ -148,51 +176,34 @@ bool File_Stream::open()
 bool File_Stream::open(const Input_Stream_Position& position)
 {
     bool success = false;
-    CFStreamClientContext CTX = { 0, this, NULL, NULL, NULL };
     
-    /* Already opened a read stream, return */
-    if (m_readStream) {
+    /* Already opened, return */
+    if (m_open) {
         goto out;
     }
     
-    if (!m_url) {
+    if (!m_url || !map()) {
         goto out;
     }
     
     /* Reset state */
     m_position = position;
     
-    m_readPending = false;
-	
-    /* Failed to create a stream */
-    if (!(m_readStream = CFReadStreamCreateWithFile(kCFAllocatorDefault, m_url))) {
-        goto out;
-    }
+    m_readOffset = std::min(position.start, (UInt64)m_mappingLength);
+    m_readEnd = m_mappingLength;
     
-    if (m_position.start > 0) {
-        CFNumberRef position = CFNumberCreate(0, kCFNumberLongLongType, &m_position.start);
-        CFReadStreamSetProperty(m_readStream, kCFStreamPropertyFileCurrentOffset, position);
-        CFRelease(position);
+    if (position.end > 0 && position.end < m_readEnd) {
+        m_readEnd = position.end + 1;
     }
     
-    if (!CFReadStreamSetClient(m_readStream, kCFStreamEventHasBytesAvailable |
-                               kCFStreamEventEndEncountered |
-                               kCFStreamEventErrorOccurred, readCallBack, &CTX)) {
-        CFRelease(m_readStream), m_readStream = 0;
-        goto out;
-    }
+    m_readAheadEnd = m_readOffset;
+    m_endSent = false;
+    m_open = true;
+    m_openCount++;
     
-    setScheduledInRunLoop(true);
+    readAhead();
     
-    if (!CFReadStreamOpen(m_readStream)) {
-        /* Open failed: clean */
-        CFReadStreamSetClient(m_readStream, 0, NULL, NULL);
-        setScheduledInRunLoop(false);
-        if (m_readStream) {
-            CFRelease(m_readStream), m_readStream = 0;
-        }
-        goto out;
-    }
+    setScheduledInRunLoop(true);
     
     success = true;
     
@@ -209,45 +220,37 @@ out:
 void File_Stream::close()
 {
     /* The stream has been already closed */
-    if (!m_readStream) {
+    if (!m_open) {
         return;
     }
     
-    CFReadStreamSetClient(m_readStream, 0, NULL, NULL);
-    setScheduledInRunLoop(false);
-    CFReadStreamClose(m_readStream);
-    CFRelease(m_readStream), m_readStream = 0;
+    // The mapping stays for the next open()
+    m_eventLoop->cancel(this);
+    
+    m_open = false;
+    m_readPosted = false;
+    m_scheduledInRunLoop = false;
+    m_openCount++;
 }
     
 void File_Stream::setScheduledInRunLoop(bool scheduledInRunLoop)
 {
     /* The stream has not been opened, or it has been already closed */
-    if (!m_readStream) {
+    if (!m_open) {
         return;
     }
     
-    /* The state doesn't change */
-    if (m_scheduledInRunLoop == scheduledInRunLoop) {
-        return;
-    }
+    m_scheduledInRunLoop = scheduledInRunLoop;
     
     if (m_scheduledInRunLoop) {
-        CFReadStreamUnscheduleFromRunLoop(m_readStream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
-    } else {
-        if (m_readPending) {
-            m_readPending = false;
-            
-            readCallBack(m_readStream, kCFStreamEventHasBytesAvailable, this);
-        }
-        
-        CFReadStreamScheduleWithRunLoop(m_readStream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
+        scheduleRead();
     }
-    
-    m_scheduledInRunLoop = scheduledInRunLoop;
 }
     
 void File_Stream::setUrl(CFURLRef url)
 {
+    unmap();
+    
     if (m_url) {
         CFRelease(m_url);
     }
@@ -281,72 +284,160 @@ bool File_Stream::canHandleUrl(CFURLRef url)
 }
     
 /* ID3_Parser_Delegate */
-void File_Stream::id3metaDataAvailable(std::map<CFStringRef,CFStringRef> metaData)
+void File_Stream::id3metaDataAvailable(Meta_Data&& metaData)
 {
     if (m_delegate) {
-        m_delegate->streamMetaDataAvailable(metaData);
+        m_delegate->streamMetaDataAvailable(std::move(metaData));
     }
 }
     
-void File_Stream::readCallBack(CFReadStreamRef stream, CFStreamEventType eventType, void *clientCallBackInfo)
+/* private */
+    
+bool File_Stream::map()
 {
-    File_Stream *THIS = static_cast<File_Stream*>(clientCallBackInfo);
+    char path[PATH_MAX];
+    struct stat st;
     
-    switch (eventType) {
-        case kCFStreamEventHasBytesAvailable: {
-            if (!THIS->m_fileReadBuffer) {
-                THIS->m_fileReadBuffer = new UInt8[1024];
-            }
-            
-            while (CFReadStreamHasBytesAvailable(stream)) {
-                if (!THIS->m_scheduledInRunLoop) {
-                    /*
-                     * This is critical - though the stream has data available,
-                     * do not try to feed the audio queue with data, if it has
-                     * indicated that it doesn't want more data due to buffers
-                     * full.
-                     */
-                    THIS->m_readPending = true;
-                    break;
-                }
-                
-                CFIndex bytesRead = CFReadStreamRead(stream, THIS->m_fileReadBuffer, 1024);
-                
-                if (CFReadStreamGetStatus(stream) == kCFStreamStatusError ||
-                    bytesRead < 0) {
-                    
-                    if (THIS->m_delegate) {
-                        THIS->m_delegate->streamErrorOccurred();
-                    }
-                    break;
-                }
+    if (!CFURLGetFileSystemRepresentation(m_url, true, (UInt8 *)path, sizeof(path)) ||
+        stat(path, &st) != 0) {
+        return false;
+    }
+    
+    // The file hasn't been replaced or grown since it was mapped
+    if (m_mapped &&
+        st.st_dev == m_mappedDevice &&
+        st.st_ino == m_mappedInode &&
+        (UInt64)st.st_size == m_mappingLength) {
+        return true;
+    }
+    
+    unmap();
+    
+    if ((UInt64)st.st_size > SIZE_MAX) {
+        return false;
+    }
+    
+    if (st.st_size > 0) {
+        int fd = ::open(path, O_RDONLY);
+        
+        if (fd < 0) {
+            return false;
+        }
+        
+        // The mapping doesn't need the descriptor once made
+        void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        
+        ::close(fd);
+        
+        if (mapping == MAP_FAILED) {
+            FS_TRACE("%s: mmap failed\n", __PRETTY_FUNCTION__);
+            return false;
+        }
+        
+        madvise(mapping, (size_t)st.st_size, MADV_SEQUENTIAL);
+        
+        m_mapping = (UInt8 *)mapping;
+    }
+    
+    m_mappingLength = (size_t)st.st_size;
+    m_mappedDevice = st.st_dev;
+    m_mappedInode = st.st_ino;
+    m_mapped = true;
+    
+    FS_TRACE("%s: mapped %zu bytes\n", __PRETTY_FUNCTION__, m_mappingLength);
+    
+    return true;
+}
+    
+void File_Stream::unmap()
+{
+    if (m_mapping) {
+        munmap(m_mapping, m_mappingLength), m_mapping = 0;
+    }
+    m_mappingLength = 0;
+    m_mapped = false;
+}
+    
+void File_Stream::readAhead()
+{
+    // Ask for the next window while the current one is being read
+    if (m_readAheadEnd >= m_readEnd || m_readAheadEnd > m_readOffset + kReadAheadSize / 2) {
+        return;
+    }
+    
+    const UInt64 pageSize = (UInt64)getpagesize();
+    const UInt64 start = std::max(m_readAheadEnd, m_readOffset) / pageSize * pageSize;
+    const UInt64 end = std::min(m_readOffset + kReadAheadSize, m_readEnd);
+    
+    if (start < end) {
+        madvise(m_mapping + start, (size_t)(end - start), MADV_WILLNEED);
+    }
+    
+    m_readAheadEnd = end;
+}
+    
+void File_Stream::scheduleRead()
+{
+    if (m_readPosted) {
+        return;
+    }
+    
+    m_readPosted = true;
+    
+    m_eventLoop->post(readTask, this, 0);
+}
+    
+void File_Stream::read()
+{
+    const unsigned openCount = m_openCount;
+    
+    for (unsigned chunks = 0; m_open && m_scheduledInRunLoop; chunks++) {
+        if (m_readOffset >= m_readEnd) {
+            if (!m_endSent) {
+                m_endSent = true;
                 
-                if (bytesRead > 0) {
-                    if (THIS->m_delegate) {
-                        THIS->m_delegate->streamHasBytesAvailable(THIS->m_fileReadBuffer, (UInt32)bytesRead);
-                    }
-                    
-                    if (THIS->m_id3Parser->wantData()) {
-                        THIS->m_id3Parser->feedData(THIS->m_fileReadBuffer, (UInt32)bytesRead);
-                    }
+                if (m_delegate) {
+                    m_delegate->streamEndEncountered();
                 }
             }
-            
-            break;
+            return;
         }
-        case kCFStreamEventEndEncountered: {
-            if (THIS->m_delegate) {
-                THIS->m_delegate->streamEndEncountered();
-            }
-            break;
+        
+        if (chunks == kChunksPerTask) {
+            // Let the other events in between
+            scheduleRead();
+            return;
         }
-        case kCFStreamEventErrorOccurred: {
-            if (THIS->m_delegate) {
-                THIS->m_delegate->streamErrorOccurred();
-            }
-            break;
+        
+        UInt8 *data = m_mapping + m_readOffset;
+        const UInt32 bytesRead = (UInt32)std::min((UInt64)kReadChunkSize, m_readEnd - m_readOffset);
+        
+        m_readOffset += bytesRead;
+        
+        readAhead();
+        
+        if (m_delegate) {
+            m_delegate->streamHasBytesAvailable(data, bytesRead);
+        }
+        
+        /* Closed, or closed and opened again, by the delegate */
+        if (openCount != m_openCount) {
+            return;
+        }
+        
+        if (m_id3Parser->wantData()) {
+            m_id3Parser->feedData(data, bytesRead);
         }
     }
 }
     
+void File_Stream::readTask(void *info, intptr_t arg)
+{
+    File_Stream *THIS = static_cast<File_Stream*>(info);
+    
+    THIS->m_readPosted = false;
+    
+    THIS->read();
+}
+    
 } // namespace astreamer
\ No newline at end of file
@@ -11,31 +11,63 @@
 
 #import "input_stream.h"
 #import "id3_parser.h"
+#import "event_loop.h"
+
+#include <sys/types.h>
 
 namespace astreamer {
     
+/*
+ * Reads a local file through a read-only mapping of it: the delegate is
+ * handed pointers into the mapping, so there are no read calls or copies.
+ * The bytes are delivered from tasks on the event loop, kReadChunkSize at
+ * a time. The mapping is kept over close(), so opening the unchanged file
+ * again at another position is only a matter of moving the read offset.
+ */
 class File_Stream : public Input_Stream {
 private:
+    enum {
+        kReadChunkSize = 16384,
+        kChunksPerTask = 16,
+        kReadAheadSize = 262144
+    };
     
     File_Stream(const File_Stream&);
     File_Stream& operator=(const File_Stream&);
     
+    Event_Loop *m_eventLoop;
     CFURLRef m_url;
-    CFReadStreamRef m_readStream;
+    bool m_open;
     bool m_scheduledInRunLoop;
-    bool m_readPending;
+    bool m_readPosted;
+    bool m_endSent;
+    unsigned m_openCount;
     Input_Stream_Position m_position;
     
-    UInt8 *m_fileReadBuffer;
+    UInt8 *m_mapping;
+    size_t m_mappingLength;
+    bool m_mapped;
+    dev_t m_mappedDevice;
+    ino_t m_mappedInode;
+    
+    UInt64 m_readOffset;
+    UInt64 m_readEnd;
+    UInt64 m_readAheadEnd;
     
     ID3_Parser *m_id3Parser;
     
     CFStringRef m_contentType;
     
-    static void readCallBack(CFReadStreamRef stream, CFStreamEventType eventType, void *clientCallBackInfo);
+    bool map();
+    void unmap();
+    void readAhead();
+    void scheduleRead();
+    void read();
+    
+    static void readTask(void *info, intptr_t arg);
     
 public:
-    File_Stream();
+    File_Stream(Event_Loop *eventLoop);
     virtual ~File_Stream();
     
     Input_Stream_Position position();
@@ -55,7 +87,7 @@ public:
     static bool canHandleUrl(CFURLRef url);
     
     /* ID3_Parser_Delegate */
-    void id3metaDataAvailable(std::map<CFStringRef,CFStringRef> metaData);
+    void id3metaDataAvailable(Meta_Data&& metaData);
 };
     
 } // namespace astreamer
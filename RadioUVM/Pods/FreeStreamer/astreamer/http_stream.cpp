@@ -10,6 +10,7 @@
 #include "audio_queue.h"
 #include "id3_parser.h"
 #include "stream_configuration.h"
+#include "run_loop_event_loop.h"
 
 //#define HS_DEBUG 1
 
@@ -36,7 +37,8 @@ CFStringRef HTTP_Stream::icyMetaDataValue  = CFSTR("1"); /* always request ICY m
 
     
 /* HTTP_Stream: public */
-HTTP_Stream::HTTP_Stream() :
+HTTP_Stream::HTTP_Stream(Event_Loop *eventLoop) :
+    m_eventLoop(eventLoop),
     m_readStream(0),
     m_scheduledInRunLoop(false),
     m_readPending(false),
@@ -44,6 +46,8 @@ HTTP_Stream::HTTP_Stream() :
     m_httpHeadersParsed(false),
     m_contentType(0),
     m_contentLength(0),
+    m_totalLength(0),
+    m_bytesToSkip(0),
     
     m_icyStream(false),
     m_icyHeaderCR(false),
@@ -52,15 +56,13 @@ HTTP_Stream::HTTP_Stream() :
     
     m_icyName(0),
     
-    m_icyMetaDataInterval(0),
-    m_dataByteReadCount(0),
-    m_metaDataBytesRemaining(0),
+    m_icyParser(new ICY_Parser()),
     
     m_httpReadBuffer(0),
-    m_icyReadBuffer(0),
     
     m_id3Parser(new ID3_Parser())
 {
+    m_icyParser->m_delegate = this;
     m_id3Parser->m_delegate = this;
 }
 
@@ -85,13 +87,11 @@ HTTP_Stream::~HTTP_Stream()
     if (m_httpReadBuffer) {
         delete [] m_httpReadBuffer, m_httpReadBuffer = 0;
     }
-    if (m_icyReadBuffer) {
-        delete [] m_icyReadBuffer, m_icyReadBuffer = 0;
-    }
     if (m_url) {
         CFRelease(m_url), m_url = 0;
     }
     
+    delete m_icyParser, m_icyParser = 0;
     delete m_id3Parser, m_id3Parser = 0;
 }
     
@@ -110,6 +110,11 @@ size_t HTTP_Stream::contentLength()
     return m_contentLength;
 }
     
+size_t HTTP_Stream::totalLength()
+{
+    return m_totalLength;
+}
+    
 bool HTTP_Stream::open()
 {
     Input_Stream_Position position;
@@ -117,6 +122,7 @@ bool HTTP_Stream::open()
     position.end = 0;
     
     m_contentLength = 0;
+    m_totalLength = 0;
 #ifdef INCLUDE_ID3TAG_SUPPORT
     m_id3Parser->reset();
 #endif
@@ -139,6 +145,7 @@ bool HTTP_Stream::open(const Input_Stream_Position& position)
     
     m_readPending = false;
     m_httpHeadersParsed = false;
+    m_bytesToSkip = 0;
     
     if (m_contentType) {
         CFRelease(m_contentType), m_contentType = NULL;
@@ -158,11 +165,10 @@ bool HTTP_Stream::open(const Input_Stream_Position& position)
     }
     
     m_icyHeaderLines.clear();
-    m_icyMetaDataInterval = 0;
-    m_dataByteReadCount = 0;
-    m_metaDataBytesRemaining = 0;
+    m_icyParser->reset();
     
-    if (!m_url) {
+    /* The read stream is scheduled on the run loop of the event loop */
+    if (!m_url || !m_eventLoop->runsRunLoop()) {
         goto out;
     }
 	
@@ -222,7 +228,7 @@ void HTTP_Stream::setScheduledInRunLoop(bool scheduledInRunLoop)
     }
     
     if (m_scheduledInRunLoop) {
-        CFReadStreamUnscheduleFromRunLoop(m_readStream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
+        CFReadStreamUnscheduleFromRunLoop(m_readStream, Run_Loop_Event_Loop::runLoopOf(m_eventLoop), kCFRunLoopCommonModes);
     } else {
         if (m_readPending) {
             m_readPending = false;
@@ -230,7 +236,7 @@ void HTTP_Stream::setScheduledInRunLoop(bool scheduledInRunLoop)
             readCallBack(m_readStream, kCFStreamEventHasBytesAvailable, this);
         }
         
-        CFReadStreamScheduleWithRunLoop(m_readStream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
+        CFReadStreamScheduleWithRunLoop(m_readStream, Run_Loop_Event_Loop::runLoopOf(m_eventLoop), kCFRunLoopCommonModes);
     }
     
     m_scheduledInRunLoop = scheduledInRunLoop;
@@ -270,10 +276,17 @@ bool HTTP_Stream::canHandleUrl(CFURLRef url)
     return true;
 }
     
-void HTTP_Stream::id3metaDataAvailable(std::map<CFStringRef,CFStringRef> metaData)
+void HTTP_Stream::id3metaDataAvailable(Meta_Data&& metaData)
+{
+    if (m_delegate) {
+        m_delegate->streamMetaDataAvailable(std::move(metaData));
+    }
+}
+    
+void HTTP_Stream::icyMetaDataAvailable(Meta_Data&& metaData)
 {
     if (m_delegate) {
-        m_delegate->streamMetaDataAvailable(metaData);
+        m_delegate->streamMetaDataAvailable(std::move(metaData));
     }
 }
     
@@ -297,12 +310,22 @@ CFReadStreamRef HTTP_Stream::createReadStream(CFURLRef url)
     
     CFHTTPMessageSetHeaderFieldValue(request, icyMetaDataHeader, icyMetaDataValue);
     
-    if (m_position.start > 0 && m_position.end > m_position.start) {
-        CFStringRef rangeHeaderValue = CFStringCreateWithFormat(NULL,
-                                                                NULL,
-                                                                CFSTR("bytes=%llu-%llu"),
-                                                                m_position.start,
-                                                                m_position.end);
+    if (m_position.start > 0) {
+        CFStringRef rangeHeaderValue;
+        
+        if (m_position.end > m_position.start) {
+            rangeHeaderValue = CFStringCreateWithFormat(NULL,
+                                                        NULL,
+                                                        CFSTR("bytes=%llu-%llu"),
+                                                        m_position.start,
+                                                        m_position.end);
+        } else {
+            /* Resume to the end of the content */
+            rangeHeaderValue = CFStringCreateWithFormat(NULL,
+                                                        NULL,
+                                                        CFSTR("bytes=%llu-"),
+                                                        m_position.start);
+        }
         
         CFHTTPMessageSetHeaderFieldValue(request, httpRangeHeader, rangeHeaderValue);
         CFRelease(rangeHeaderValue);
@@ -367,25 +390,27 @@ void HTTP_Stream::parseHttpHeadersIfNeeded(const UInt8 *buf, const CFIndex bufSi
             m_icyStream = true;
             m_icyHeadersParsed = true;
             m_icyHeadersRead = true;
-            m_icyMetaDataInterval = CFStringGetIntValue(icyMetaIntString);
+            m_icyParser->setMetaDataInterval(CFStringGetIntValue(icyMetaIntString));
+            
+            HS_TRACE("icy-metaint: %i\n", CFStringGetIntValue(icyMetaIntString));
+            
             CFRelease(icyMetaIntString);
         }
         
-        HS_TRACE("icy-metaint: %zu\n", m_icyMetaDataInterval);
-        
         CFStringRef icyNameString = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("icy-name"));
         if (icyNameString) {
             if (m_icyName) {
                 CFRelease(m_icyName);
             }
             m_icyName = icyNameString;
+            m_icyParser->setStationName(m_icyName);
             
-            if (m_delegate) {
-                std::map<CFStringRef,CFStringRef> metadataMap;
+            if (m_delegate && ICY_Parser::isMetaDataFieldSubscribed((const UInt8 *)"IcecastStationName", 18)) {
+                Meta_Data metaData;
                 
-                metadataMap[CFSTR("IcecastStationName")] = CFStringCreateCopy(kCFAllocatorDefault, m_icyName);
+                metaData.set(CFSTR("IcecastStationName"), CFStringCreateCopy(kCFAllocatorDefault, m_icyName));
                 
-                m_delegate->streamMetaDataAvailable(metadataMap);
+                m_delegate->streamMetaDataAvailable(std::move(metaData));
             }
         }
         
@@ -405,6 +430,30 @@ void HTTP_Stream::parseHttpHeadersIfNeeded(const UInt8 *buf, const CFIndex bufSi
             CFRelease(contentLengthString);
         }
         
+        m_totalLength = m_contentLength;
+        
+        if (CFHTTPMessageGetResponseStatusCode(response) == 206) {
+            m_totalLength = 0;
+            
+            CFStringRef contentRangeString = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Content-Range"));
+            if (contentRangeString) {
+                char contentRange[128];
+                
+                if (CFStringGetCString(contentRangeString, contentRange, sizeof(contentRange), kCFStringEncodingASCII)) {
+                    m_totalLength = contentRangeTotal(contentRange);
+                }
+                
+                CFRelease(contentRangeString);
+            }
+        }
+        
+        /* A server ignoring the range sends the content from the start */
+        if (m_position.start > 0 && CFHTTPMessageGetResponseStatusCode(response) == 200) {
+            HS_TRACE("Range ignored, skipping %llu bytes\n", m_position.start);
+            
+            m_bytesToSkip = m_position.start;
+        }
+        
         CFRelease(response);
     }
        
@@ -425,7 +474,7 @@ void HTTP_Stream::parseICYStream(const UInt8 *buf, const CFIndex bufSize)
         for (; offset < bufSize; offset++) {
             if (m_icyHeaderCR && buf[offset] == '\n') {
                 if (bytesFound > 0) {
-                    m_icyHeaderLines.push_back(createMetaDataStringWithMostReasonableEncoding(&buf[offset-bytesFound-1], bytesFound));
+                    m_icyHeaderLines.push_back(ICY_Parser::createMetaDataStringWithMostReasonableEncoding(&buf[offset-bytesFound-1], bytesFound));
                     
                     bytesFound = 0;
                     
@@ -492,11 +541,11 @@ void HTTP_Stream::parseICYStream(const UInt8 *buf, const CFIndex bufSize)
                                                                            CFRangeMake(icyMetaDataHeaderLength, lineLength - icyMetaDataHeaderLength));
                 
                 if (metadataInterval) {
-                    m_icyMetaDataInterval = CFStringGetIntValue(metadataInterval);
+                    m_icyParser->setMetaDataInterval(CFStringGetIntValue(metadataInterval));
                     
                     CFRelease(metadataInterval);
                 } else {
-                    m_icyMetaDataInterval = 0;
+                    m_icyParser->setMetaDataInterval(0);
                 }
             }
             
@@ -511,6 +560,8 @@ void HTTP_Stream::parseICYStream(const UInt8 *buf, const CFIndex bufSize)
                 m_icyName = CFStringCreateWithSubstring(kCFAllocatorDefault,
                                                         line,
                                                         CFRangeMake(icyNameHeaderLength, lineLength - icyNameHeaderLength));
+                
+                m_icyParser->setStationName(m_icyName);
             }
         }
         
@@ -522,143 +573,16 @@ void HTTP_Stream::parseICYStream(const UInt8 *buf, const CFIndex bufSize)
         }
     }
     
-    Stream_Configuration *config = Stream_Configuration::configuration();
-    
-    if (!m_icyReadBuffer) {
-        m_icyReadBuffer = new UInt8[config->httpConnectionBufferSize];
-    }
-    
     HS_TRACE("Reading ICY stream for playback\n");
     
-    UInt32 i=0;
+    UInt8 *audioData;
+    size_t audioBytes = m_icyParser->demux((UInt8 *)&buf[offset], bufSize - offset, &audioData);
     
-    for (; offset < bufSize; offset++) {
-        // is this a metadata byte?
-        if (m_metaDataBytesRemaining > 0) {
-            m_metaDataBytesRemaining--;
-            
-            if (m_metaDataBytesRemaining == 0) {
-                m_dataByteReadCount = 0;
-                
-                if (m_delegate && !m_icyMetaData.empty()) {
-                    std::map<CFStringRef,CFStringRef> metadataMap;
-                    
-                    CFStringRef metaData = createMetaDataStringWithMostReasonableEncoding(&m_icyMetaData[0],
-                                                                                          m_icyMetaData.size());
-                    
-                    if (!metaData) {
-                        // Metadata encoding failed, cannot parse.
-                        m_icyMetaData.clear();
-                        continue;
-                    }
-                    
-                    CFArrayRef tokens = CFStringCreateArrayBySeparatingStrings(kCFAllocatorDefault,
-                                                                               metaData,
-                                                                               CFSTR(";"));
-                    
-                    for (CFIndex i=0, max=CFArrayGetCount(tokens); i < max; i++) {
-                        CFStringRef token = (CFStringRef) CFArrayGetValueAtIndex(tokens, i);
-                        
-                        CFRange foundRange;
-                        
-                        if (CFStringFindWithOptions(token,
-                                                    CFSTR("='"),
-                                                    CFRangeMake(0, CFStringGetLength(token)),
-                                                    NULL,
-                                                    &foundRange) == true) {
-                            
-                            CFRange keyRange = CFRangeMake(0, foundRange.location);
-                            
-                            CFStringRef metadaKey = CFStringCreateWithSubstring(kCFAllocatorDefault,
-                                                                                token,
-                                                                                keyRange);
-                            
-                            CFRange valueRange = CFRangeMake(foundRange.location + 2, CFStringGetLength(token) - keyRange.length - 3);
-                            
-                            CFStringRef metadaValue = CFStringCreateWithSubstring(kCFAllocatorDefault,
-                                                                                  token,
-                                                                                  valueRange);
-                            
-                            metadataMap[metadaKey] = metadaValue;
-                        }
-                    }
-                    
-                    CFRelease(tokens);
-                    CFRelease(metaData);
-                    
-                    if (m_icyName) {
-                        metadataMap[CFSTR("IcecastStationName")] = CFStringCreateCopy(kCFAllocatorDefault, m_icyName);
-                    }
-                    
-                    m_delegate->streamMetaDataAvailable(metadataMap);
-                }
-                m_icyMetaData.clear();
-                continue;
-            }
-            
-            m_icyMetaData.push_back(buf[offset]);
-            continue;
-        }
-        
-        // is this the interval byte?
-        if (m_icyMetaDataInterval > 0 && m_dataByteReadCount == m_icyMetaDataInterval) {
-            m_metaDataBytesRemaining = buf[offset] * 16;
-            
-            if (m_metaDataBytesRemaining == 0) {
-                m_dataByteReadCount = 0;
-            }
-            continue;
-        }
-        
-        // a data byte
-        m_dataByteReadCount++;
-        m_icyReadBuffer[i++] = buf[offset];
+    if (m_delegate && audioBytes > 0) {
+        m_delegate->streamHasBytesAvailable(audioData, (UInt32)audioBytes);
     }
-    
-    if (m_delegate && i > 0) {
-        m_delegate->streamHasBytesAvailable(m_icyReadBuffer, i);
-    }
-}
-    
-#define TRY_ENCODING(STR,ENC) STR = CFStringCreateWithBytes(kCFAllocatorDefault, bytes, numBytes, ENC, false); \
-    if (STR != NULL) { return STR; }
-    
-CFStringRef HTTP_Stream::createMetaDataStringWithMostReasonableEncoding(const UInt8 *bytes, const CFIndex numBytes)
-{
-    CFStringRef metaData;
-    
-    TRY_ENCODING(metaData, kCFStringEncodingUTF8);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatin1);
-    TRY_ENCODING(metaData, kCFStringEncodingWindowsLatin1);
-    TRY_ENCODING(metaData, kCFStringEncodingNextStepLatin);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatin2);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatin3);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatin4);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatinCyrillic);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatinArabic);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatinGreek);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatinHebrew);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatin5);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatin6);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatinThai);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatin7);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatin8);
-    TRY_ENCODING(metaData, kCFStringEncodingISOLatin9);
-    TRY_ENCODING(metaData, kCFStringEncodingWindowsLatin2);
-    TRY_ENCODING(metaData, kCFStringEncodingWindowsCyrillic);
-    TRY_ENCODING(metaData, kCFStringEncodingWindowsGreek);
-    TRY_ENCODING(metaData, kCFStringEncodingWindowsLatin5);
-    TRY_ENCODING(metaData, kCFStringEncodingWindowsHebrew);
-    TRY_ENCODING(metaData, kCFStringEncodingWindowsArabic);
-    TRY_ENCODING(metaData, kCFStringEncodingKOI8_R);
-    TRY_ENCODING(metaData, kCFStringEncodingBig5);
-    TRY_ENCODING(metaData, kCFStringEncodingASCII);
-    
-    return metaData;
 }
     
-#undef TRY_ENCODING
-    
 void HTTP_Stream::readCallBack(CFReadStreamRef stream, CFStreamEventType eventType, void *clientCallBackInfo)
 {
     HTTP_Stream *THIS = static_cast<HTTP_Stream*>(clientCallBackInfo);
@@ -725,11 +649,17 @@ void HTTP_Stream::readCallBack(CFReadStreamRef stream, CFStreamEventType eventTy
                         HS_TRACE("Parsing ICY stream\n");
                         
                         THIS->parseICYStream(THIS->m_httpReadBuffer, bytesRead);
+                    } else if (THIS->m_bytesToSkip >= (UInt64)bytesRead) {
+                        THIS->m_bytesToSkip -= bytesRead;
                     } else {
+                        const CFIndex skip = (CFIndex)THIS->m_bytesToSkip;
+                        
+                        THIS->m_bytesToSkip = 0;
+                        
                         if (THIS->m_delegate) {
                             HS_TRACE("Not an ICY stream; calling the delegate back\n");
                             
-                            THIS->m_delegate->streamHasBytesAvailable(THIS->m_httpReadBuffer, (UInt32)bytesRead);
+                            THIS->m_delegate->streamHasBytesAvailable(THIS->m_httpReadBuffer + skip, (UInt32)(bytesRead - skip));
                         }
                     }
                 }
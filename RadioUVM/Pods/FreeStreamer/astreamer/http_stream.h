@@ -11,13 +11,14 @@
 
 #import <CFNetwork/CFNetwork.h>
 #import <vector>
-#import <map>
 #import "input_stream.h"
 #import "id3_parser.h"
+#import "icy_parser.h"
+#import "event_loop.h"
 
 namespace astreamer {
 
-class HTTP_Stream : public Input_Stream {
+class HTTP_Stream : public Input_Stream, public ICY_Parser_Delegate {
 private:
     
     HTTP_Stream(const HTTP_Stream&);
@@ -29,6 +30,7 @@ private:
     static CFStringRef icyMetaDataHeader;
     static CFStringRef icyMetaDataValue;
     
+    Event_Loop *m_eventLoop;
     CFURLRef m_url;
     CFReadStreamRef m_readStream;
     bool m_scheduledInRunLoop;
@@ -39,6 +41,8 @@ private:
     bool m_httpHeadersParsed;
     CFStringRef m_contentType;
     size_t m_contentLength;
+    size_t m_totalLength;
+    UInt64 m_bytesToSkip;           // the bytes before the requested range
     
     /* ICY protocol */
     bool m_icyStream;
@@ -49,33 +53,29 @@ private:
     CFStringRef m_icyName;
     
     std::vector<CFStringRef> m_icyHeaderLines;
-    size_t m_icyMetaDataInterval;
-    size_t m_dataByteReadCount;
-    size_t m_metaDataBytesRemaining;
     
-    std::vector<UInt8> m_icyMetaData;
+    ICY_Parser *m_icyParser;
     
     /* Read buffers */
     UInt8 *m_httpReadBuffer;
-    UInt8 *m_icyReadBuffer;
     
     ID3_Parser *m_id3Parser;
     
     CFReadStreamRef createReadStream(CFURLRef url);
     void parseHttpHeadersIfNeeded(const UInt8 *buf, const CFIndex bufSize);
     void parseICYStream(const UInt8 *buf, const CFIndex bufSize);
-    CFStringRef createMetaDataStringWithMostReasonableEncoding(const UInt8 *bytes, const CFIndex numBytes);
     
     static void readCallBack(CFReadStreamRef stream, CFStreamEventType eventType, void *clientCallBackInfo);
     
 public:
-    HTTP_Stream();
+    HTTP_Stream(Event_Loop *eventLoop);
     virtual ~HTTP_Stream();
     
     Input_Stream_Position position();
     
     CFStringRef contentType();
     size_t contentLength();
+    size_t totalLength();
     
     bool open();
     bool open(const Input_Stream_Position& position);
@@ -88,7 +88,10 @@ public:
     static bool canHandleUrl(CFURLRef url);
     
     /* ID3_Parser_Delegate */
-    void id3metaDataAvailable(std::map<CFStringRef,CFStringRef> metaData);
+    void id3metaDataAvailable(Meta_Data&& metaData);
+    
+    /* ICY_Parser_Delegate */
+    void icyMetaDataAvailable(Meta_Data&& metaData);
 };
 
 } // namespace astreamer
@@ -0,0 +1,420 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "icy_parser.h"
+#include "stream_configuration.h"
+
+#include <string.h>
+
+//#define ICY_DEBUG 1
+
+#if !defined (ICY_DEBUG)
+#define ICY_TRACE(...) do {} while (0)
+#else
+#define ICY_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+namespace astreamer {
+    
+ICY_Parser::ICY_Parser() :
+    m_delegate(0),
+    m_metaDataInterval(0),
+    m_dataByteReadCount(0),
+    m_metaDataBytesRemaining(0),
+    m_metaDataBlockSize(0),
+    m_metaDataHash(0),
+    m_metaDataHashValid(false),
+    m_metaDataDeliveryTime(0),
+    m_stationName(0),
+    m_audioBuffer(0),
+    m_audioBufferSize(0)
+{
+}
+    
+ICY_Parser::~ICY_Parser()
+{
+    if (m_stationName) {
+        CFRelease(m_stationName), m_stationName = 0;
+    }
+    if (m_audioBuffer) {
+        delete [] m_audioBuffer, m_audioBuffer = 0;
+    }
+}
+    
+void ICY_Parser::reset()
+{
+    m_metaDataInterval = 0;
+    m_dataByteReadCount = 0;
+    m_metaDataBytesRemaining = 0;
+    m_metaDataBlockSize = 0;
+    m_metaDataHashValid = false;
+    
+    if (m_stationName) {
+        CFRelease(m_stationName), m_stationName = 0;
+    }
+}
+    
+void ICY_Parser::setMetaDataInterval(size_t metaDataInterval)
+{
+    m_metaDataInterval = metaDataInterval;
+}
+    
+void ICY_Parser::setStationName(CFStringRef stationName)
+{
+    if (m_stationName) {
+        CFRelease(m_stationName);
+    }
+    m_stationName = (stationName ? (CFStringRef)CFRetain(stationName) : 0);
+}
+    
+size_t ICY_Parser::demux(UInt8 *buf, size_t bufSize, UInt8 **outAudioData)
+{
+    if (m_audioBufferSize < bufSize) {
+        delete [] m_audioBuffer;
+        
+        m_audioBuffer = new UInt8[bufSize];
+        m_audioBufferSize = bufSize;
+    }
+    
+    size_t offset = 0;
+    
+    /*
+     * The stream is handled in spans: the distance to the next metadata
+     * block is known from the interval, so whole runs of audio are moved
+     * at once. A read with a single audio run (no metadata block inside)
+     * is forwarded as is, without copying.
+     */
+    UInt8 *audioData = 0;
+    size_t audioBytes = 0;
+    
+    while (offset < bufSize) {
+        const size_t available = bufSize - offset;
+        
+        // is this metadata?
+        if (m_metaDataBytesRemaining > 0) {
+            const size_t n = (m_metaDataBytesRemaining < available ? m_metaDataBytesRemaining : available);
+            
+            memcpy(m_metaDataBlock + m_metaDataBlockSize, &buf[offset], n);
+            m_metaDataBlockSize += n;
+            
+            m_metaDataBytesRemaining -= n;
+            offset += n;
+            
+            if (m_metaDataBytesRemaining == 0) {
+                m_dataByteReadCount = 0;
+                
+                parseMetaData();
+                
+                m_metaDataBlockSize = 0;
+            }
+            continue;
+        }
+        
+        // is this the interval byte?
+        if (m_metaDataInterval > 0 && m_dataByteReadCount == m_metaDataInterval) {
+            m_metaDataBytesRemaining = buf[offset] * 16;
+            
+            if (m_metaDataBytesRemaining == 0) {
+                m_dataByteReadCount = 0;
+            }
+            offset++;
+            continue;
+        }
+        
+        // a run of data bytes, up to the next interval byte
+        size_t n = available;
+        
+        if (m_metaDataInterval > 0 && m_metaDataInterval - m_dataByteReadCount < n) {
+            n = m_metaDataInterval - m_dataByteReadCount;
+        }
+        
+        if (audioBytes == 0) {
+            audioData = &buf[offset];
+        } else {
+            // A second run in this read, gather the runs to the audio buffer
+            if (audioData != m_audioBuffer) {
+                memmove(m_audioBuffer, audioData, audioBytes);
+                audioData = m_audioBuffer;
+            }
+            memcpy(m_audioBuffer + audioBytes, &buf[offset], n);
+        }
+        
+        audioBytes += n;
+        m_dataByteReadCount += n;
+        offset += n;
+    }
+    
+    *outAudioData = audioData;
+    
+    return audioBytes;
+}
+
+    
+bool ICY_Parser::isMetaDataFieldSubscribed(const UInt8 *name, const size_t nameLength)
+{
+    CFArrayRef fields = Stream_Configuration::configuration()->icyMetaDataFields;
+    
+    if (!fields) {
+        // All the fields are delivered
+        return true;
+    }
+    
+    for (CFIndex i=0, max=CFArrayGetCount(fields); i < max; i++) {
+        CFStringRef field = (CFStringRef) CFArrayGetValueAtIndex(fields, i);
+        
+        char fieldName[64];
+        
+        if (!CFStringGetCString(field, fieldName, sizeof(fieldName), kCFStringEncodingUTF8)) {
+            continue;
+        }
+        
+        if (strlen(fieldName) == nameLength && memcmp(fieldName, name, nameLength) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+    
+CFStringRef ICY_Parser::createMetaDataStringWithMostReasonableEncoding(const UInt8 *bytes, const CFIndex numBytes)
+{
+    return createMetaDataString(bytes, numBytes, metaDataEncoding(bytes, numBytes));
+}
+    
+/* private */
+    
+CFStringRef ICY_Parser::createMetaDataString(const UInt8 *bytes, const CFIndex numBytes, CFStringEncoding encoding)
+{
+    CFStringRef str = CFStringCreateWithBytes(kCFAllocatorDefault, bytes, numBytes, encoding, false);
+    
+    if (!str && encoding != kCFStringEncodingISOLatin1) {
+        // The few bytes undefined in Windows-1252, Latin-1 accepts any byte
+        str = CFStringCreateWithBytes(kCFAllocatorDefault, bytes, numBytes, kCFStringEncodingISOLatin1, false);
+    }
+    return str;
+}
+    
+bool ICY_Parser::isValidUtf8(const UInt8 *bytes, const size_t numBytes)
+{
+    size_t i = 0;
+    
+    while (i < numBytes) {
+        // Metadata is mostly ASCII, skip it a word at a time
+        if (i + 8 <= numBytes) {
+            UInt64 word;
+            memcpy(&word, bytes + i, sizeof(word));
+            
+            if ((word & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        
+        const UInt8 c = bytes[i];
+        
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        
+        size_t continuationBytes;
+        UInt32 codePoint;
+        UInt32 minCodePoint;
+        
+        if ((c & 0xE0) == 0xC0) {
+            continuationBytes = 1;
+            codePoint = c & 0x1F;
+            minCodePoint = 0x80;
+        } else if ((c & 0xF0) == 0xE0) {
+            continuationBytes = 2;
+            codePoint = c & 0x0F;
+            minCodePoint = 0x800;
+        } else if ((c & 0xF8) == 0xF0) {
+            continuationBytes = 3;
+            codePoint = c & 0x07;
+            minCodePoint = 0x10000;
+        } else {
+            return false;
+        }
+        
+        if (continuationBytes >= numBytes - i) {
+            // Truncated sequence
+            return false;
+        }
+        
+        for (size_t k = 1; k <= continuationBytes; k++) {
+            const UInt8 cc = bytes[i + k];
+            
+            if ((cc & 0xC0) != 0x80) {
+                return false;
+            }
+            codePoint = (codePoint << 6) | (cc & 0x3F);
+        }
+        
+        // Overlong forms, surrogates and values past the Unicode range are invalid
+        if (codePoint < minCodePoint ||
+            codePoint > 0x10FFFF ||
+            (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+            return false;
+        }
+        
+        i += continuationBytes + 1;
+    }
+    return true;
+}
+    
+UInt64 ICY_Parser::metaDataHash(const UInt8 *bytes, const size_t numBytes)
+{
+    // 64-bit FNV-1a
+    UInt64 hash = 14695981039346656037ULL;
+    
+    for (size_t i = 0; i < numBytes; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+    
+CFStringEncoding ICY_Parser::metaDataEncoding(const UInt8 *bytes, const size_t numBytes)
+{
+    if (isValidUtf8(bytes, numBytes)) {
+        return kCFStringEncodingUTF8;
+    }
+    // Servers not sending UTF-8 mostly send Windows-1252, a superset of the printable Latin-1
+    return kCFStringEncodingWindowsLatin1;
+}
+    
+void ICY_Parser::parseMetaData()
+{
+    if (!m_delegate) {
+        return;
+    }
+    
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    if (config->icyMetaDataFields && CFArrayGetCount(config->icyMetaDataFields) == 0) {
+        // Nobody is interested in the metadata
+        return;
+    }
+    
+    // The block is padded with zeros up to the 16-byte unit
+    size_t size = m_metaDataBlockSize;
+    
+    while (size > 0 && m_metaDataBlock[size - 1] == 0) {
+        size--;
+    }
+    
+    if (size == 0) {
+        return;
+    }
+    
+    /*
+     * Servers resend the same block every interval; deliver it only when it
+     * changes, or when the refresh interval has passed.
+     */
+    const UInt64 hash = metaDataHash(m_metaDataBlock, size);
+    const CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    
+    if (m_metaDataHashValid && hash == m_metaDataHash) {
+        if (config->icyMetaDataRefreshInterval <= 0 ||
+            now - m_metaDataDeliveryTime < config->icyMetaDataRefreshInterval) {
+            ICY_TRACE("ICY metadata unchanged, not delivering\n");
+            return;
+        }
+    }
+    
+    m_metaDataHash = hash;
+    m_metaDataHashValid = true;
+    m_metaDataDeliveryTime = now;
+    
+    /*
+     * The block is tokenized in place: StreamTitle='...';StreamUrl='...';
+     * The encoding is detected once for the whole block, and strings are
+     * created only for the subscribed fields.
+     */
+    const CFStringEncoding encoding = metaDataEncoding(m_metaDataBlock, size);
+    
+    Meta_Data metaData;
+    
+    const UInt8 *p = m_metaDataBlock;
+    const UInt8 *end = m_metaDataBlock + size;
+    
+    while (p < end) {
+        const UInt8 *key = p;
+        const UInt8 *separator = (const UInt8 *)memchr(p, '=', end - p);
+        
+        if (!separator) {
+            break;
+        }
+        
+        const size_t keyLength = separator - key;
+        
+        const UInt8 *value = separator + 1;
+        const UInt8 *valueEnd;
+        
+        if (value < end && *value == '\'') {
+            value++;
+            
+            // Titles may contain quotes, the value ends with a quote followed by ';' or the block end
+            valueEnd = value;
+            
+            while ((valueEnd = (const UInt8 *)memchr(valueEnd, '\'', end - valueEnd)) != NULL) {
+                if (valueEnd + 1 == end || valueEnd[1] == ';') {
+                    break;
+                }
+                valueEnd++;
+            }
+            
+            if (!valueEnd) {
+                valueEnd = end;
+            }
+            p = (valueEnd < end ? valueEnd + 1 : end);
+        } else {
+            valueEnd = (const UInt8 *)memchr(value, ';', end - value);
+            
+            if (!valueEnd) {
+                valueEnd = end;
+            }
+            p = valueEnd;
+        }
+        
+        if (p < end && *p == ';') {
+            p++;
+        }
+        
+        if (keyLength == 0 || !isMetaDataFieldSubscribed(key, keyLength)) {
+            continue;
+        }
+        
+        CFStringRef metadaKey = Meta_Data::createKey(key, keyLength, encoding);
+        CFStringRef metadaValue = createMetaDataString(value, valueEnd - value, encoding);
+        
+        if (!metadaKey || !metadaValue) {
+            if (metadaKey) {
+                CFRelease(metadaKey);
+            }
+            if (metadaValue) {
+                CFRelease(metadaValue);
+            }
+            continue;
+        }
+        
+        metaData.set(metadaKey, metadaValue);
+    }
+    
+    if (m_stationName && isMetaDataFieldSubscribed((const UInt8 *)"IcecastStationName", 18)) {
+        metaData.set(CFSTR("IcecastStationName"), CFStringCreateCopy(kCFAllocatorDefault, m_stationName));
+    }
+    
+    if (metaData.empty()) {
+        return;
+    }
+    
+    m_delegate->icyMetaDataAvailable(std::move(metaData));
+}
+    
+} // namespace astreamer
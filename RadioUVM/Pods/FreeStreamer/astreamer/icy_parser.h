@@ -0,0 +1,85 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_ICY_PARSER_H
+#define ASTREAMER_ICY_PARSER_H
+
+#include "meta_data.h"
+
+namespace astreamer {
+
+class ICY_Parser_Delegate;
+
+/*
+ * Separates the ShoutCast/IceCast (ICY) metadata blocks from the
+ * audio of a stream body, and parses the blocks to metadata.
+ */
+class ICY_Parser {
+public:
+    ICY_Parser();
+    ~ICY_Parser();
+    
+    ICY_Parser_Delegate *m_delegate;
+    
+    void reset();
+    
+    /* The icy-metaint response header; 0 if the body has no metadata */
+    void setMetaDataInterval(size_t metaDataInterval);
+    /* The icy-name response header, delivered with the metadata */
+    void setStationName(CFStringRef stationName);
+    
+    /* Returns the number of audio bytes in the buffer, which points either
+       to the input or to the parser's own buffer until the next call */
+    size_t demux(UInt8 *buf, size_t bufSize, UInt8 **outAudioData);
+    
+    static bool isMetaDataFieldSubscribed(const UInt8 *name, const size_t nameLength);
+    static CFStringRef createMetaDataStringWithMostReasonableEncoding(const UInt8 *bytes, const CFIndex numBytes);
+    
+private:
+    ICY_Parser(const ICY_Parser&);
+    ICY_Parser& operator=(const ICY_Parser&);
+    
+    size_t m_metaDataInterval;
+    size_t m_dataByteReadCount;
+    size_t m_metaDataBytesRemaining;
+    
+    enum {
+        /* The length byte of a metadata block counts 16-byte units */
+        kMetaDataBlockMaxSize = 255 * 16
+    };
+    
+    UInt8 m_metaDataBlock[kMetaDataBlockMaxSize];
+    size_t m_metaDataBlockSize;
+    
+    /* The last delivered metadata block */
+    UInt64 m_metaDataHash;
+    bool m_metaDataHashValid;
+    CFAbsoluteTime m_metaDataDeliveryTime;
+    
+    CFStringRef m_stationName;
+    
+    /* The audio runs of a read are gathered here if a metadata block splits them */
+    UInt8 *m_audioBuffer;
+    size_t m_audioBufferSize;
+    
+    void parseMetaData();
+    
+    static CFStringRef createMetaDataString(const UInt8 *bytes, const CFIndex numBytes, CFStringEncoding encoding);
+    static UInt64 metaDataHash(const UInt8 *bytes, const size_t numBytes);
+    static bool isValidUtf8(const UInt8 *bytes, const size_t numBytes);
+    static CFStringEncoding metaDataEncoding(const UInt8 *bytes, const size_t numBytes);
+};
+    
+class ICY_Parser_Delegate {
+public:
+    virtual void icyMetaDataAvailable(Meta_Data&& metaData) = 0;
+};
+    
+} // namespace astreamer
+
+#endif // ASTREAMER_ICY_PARSER_H
@@ -8,7 +8,7 @@
 
 #include "id3_parser.h"
 
-#include <vector>
+#include <string.h>
 
 //#define ID3_DEBUG 1
 
@@ -22,11 +22,32 @@ namespace astreamer {
     
 enum ID3_Parser_State {
     ID3_Parser_State_Initial = 0,
-    ID3_Parser_State_Parse_Frames,
+    ID3_Parser_State_Extended_Header,
+    ID3_Parser_State_Frame_Header,
+    ID3_Parser_State_Frame_Data,
+    ID3_Parser_State_Picture_Header,
+    ID3_Parser_State_Picture_Data,
+    ID3_Parser_State_Skip,
+    ID3_Parser_State_Padding,
+    ID3_Parser_State_Footer,
     ID3_Parser_State_Tag_Parsed,
     ID3_Parser_State_Not_Valid_Tag
 };
     
+/* The text frames delivered as metadata, with the ID3v2.2 and ID3v2.3/2.4 frame IDs */
+static const struct {
+    const char *v22FrameId;
+    const char *frameId;
+    CFStringRef key;
+} textFrames[] = {
+    { "TT2", "TIT2", CFSTR("MPMediaItemPropertyTitle") },
+    { "TP1", "TPE1", CFSTR("MPMediaItemPropertyArtist") },
+    { "TAL", "TALB", CFSTR("MPMediaItemPropertyAlbumTitle") },
+    { "TP2", "TPE2", CFSTR("MPMediaItemPropertyAlbumArtist") },
+    { "TCO", "TCON", CFSTR("MPMediaItemPropertyGenre") },
+    { "TCM", "TCOM", CFSTR("MPMediaItemPropertyComposer") }
+};
+    
 /*
  * =======================================
  * Private class
@@ -43,19 +64,54 @@ public:
     void setState(ID3_Parser_State state);
     void reset();
     
-    CFStringRef parseContent(UInt32 framesize, UInt32 pos, CFStringEncoding encoding, bool byteOrderMark);
+    void parseTagHeader();
+    void feedTagData(const UInt8 *data, size_t numBytes);
+    void feedFrameData(const UInt8 *data, size_t numBytes);
+    void parseExtendedHeader();
+    void parseFrameHeader();
+    void parseFrame();
+    size_t parsePictureHeader();
+    void skip(UInt32 numBytes);
+    void deliverMetaData();
+    CFStringRef parseContent(const UInt8 *data, size_t numBytes);
+    
+    static CFStringRef keyForFrame(const char *frameId, UInt8 majorVersion);
+    static bool isPictureFrame(const char *frameId, UInt8 majorVersion);
+    static size_t removeUnsynchronisation(UInt8 *data, size_t numBytes);
     
     ID3_Parser *m_parser;
     ID3_Parser_State m_state;
-    UInt32 m_bytesReceived;
+    UInt8 m_majorVersion;
     UInt32 m_tagSize;
+    UInt32 m_tagBytesRemaining;
     bool m_hasFooter;
     bool m_usesUnsynchronisation;
     bool m_usesExtendedHeader;
-    CFStringRef m_title;
-    CFStringRef m_performer;
+    bool m_previousByteFF;
+    
+    /* The tag, extended and frame headers are collected here */
+    UInt8 m_header[10];
+    size_t m_headerBytes;
     
-    std::vector<UInt8> m_tagData;
+    UInt32 m_skipBytes;
+    
+    enum {
+        /* Larger text frames are skipped; also the window for finding the picture data */
+        kFrameWindowSize = 16384
+    };
+    
+    /* The frame being collected */
+    CFStringRef m_frameKey;
+    UInt16 m_frameFlags;
+    UInt32 m_frameSize;
+    UInt32 m_frameBytesRemaining;
+    size_t m_framePrefixSize;
+    UInt8 m_frameData[kFrameWindowSize];
+    size_t m_frameDataSize;
+    
+    /* The fields parsed so far from the tag */
+    Meta_Data m_metaData;
+    bool m_metaDataChanged;
 };
     
 /*
@@ -67,24 +123,27 @@ public:
 ID3_Parser_Private::ID3_Parser_Private() :
     m_parser(0),
     m_state(ID3_Parser_State_Initial),
-    m_bytesReceived(0),
+    m_majorVersion(0),
     m_tagSize(0),
+    m_tagBytesRemaining(0),
     m_hasFooter(false),
     m_usesUnsynchronisation(false),
     m_usesExtendedHeader(false),
-    m_title(NULL),
-    m_performer(NULL)
+    m_previousByteFF(false),
+    m_headerBytes(0),
+    m_skipBytes(0),
+    m_frameKey(0),
+    m_frameFlags(0),
+    m_frameSize(0),
+    m_frameBytesRemaining(0),
+    m_framePrefixSize(0),
+    m_frameDataSize(0),
+    m_metaDataChanged(false)
 {
 }
     
 ID3_Parser_Private::~ID3_Parser_Private()
 {
-    if (m_performer) {
-        CFRelease(m_performer), m_performer = NULL;
-    }
-    if (m_title) {
-        CFRelease(m_title), m_title = NULL;
-    }
 }
     
 bool ID3_Parser_Private::wantData()
@@ -101,232 +160,652 @@ bool ID3_Parser_Private::wantData()
     
 void ID3_Parser_Private::feedData(UInt8 *data, UInt32 numBytes)
 {
-    if (!wantData()) {
+    /*
+     * The tag is parsed incrementally as the data arrives. Only the text
+     * frames delivered as metadata are collected, one frame at a time;
+     * the other frames are skipped (or the pictures streamed to the sink)
+     * without buffering them. The fields are delivered as soon as they
+     * are parsed, not after the whole tag has arrived.
+     */
+    while (numBytes > 0 && wantData()) {
+        if (m_state == ID3_Parser_State_Initial) {
+            size_t n = sizeof(m_header) - m_headerBytes;
+            
+            if (n > numBytes) {
+                n = numBytes;
+            }
+            
+            memcpy(m_header + m_headerBytes, data, n);
+            m_headerBytes += n;
+            data += n;
+            numBytes -= n;
+            
+            if (m_headerBytes == sizeof(m_header)) {
+                m_headerBytes = 0;
+                
+                parseTagHeader();
+            }
+            continue;
+        }
+        
+        UInt32 n = (numBytes < m_tagBytesRemaining ? numBytes : m_tagBytesRemaining);
+        
+        if (m_state != ID3_Parser_State_Footer) {
+            feedTagData(data, n);
+        }
+        
+        data += n;
+        numBytes -= n;
+        m_tagBytesRemaining -= n;
+        
+        if (m_tagBytesRemaining > 0) {
+            continue;
+        }
+        
+        if (m_state == ID3_Parser_State_Footer) {
+            setState(ID3_Parser_State_Tag_Parsed);
+            continue;
+        }
+        
+        if (m_state == ID3_Parser_State_Picture_Data && m_parser->m_pictureSink) {
+            m_parser->m_pictureSink->id3pictureEnd(false);
+        }
+        
+        if (m_hasFooter) {
+            m_tagBytesRemaining = 10;
+            setState(ID3_Parser_State_Footer);
+        } else {
+            setState(ID3_Parser_State_Tag_Parsed);
+        }
+    }
+    
+    deliverMetaData();
+}
+
+void ID3_Parser_Private::setState(astreamer::ID3_Parser_State state)
+{
+    m_state = state;
+}
+    
+void ID3_Parser_Private::reset()
+{
+    if (m_state == ID3_Parser_State_Picture_Data && m_parser->m_pictureSink) {
+        m_parser->m_pictureSink->id3pictureEnd(false);
+    }
+    
+    m_state = ID3_Parser_State_Initial;
+    m_majorVersion = 0;
+    m_tagSize = 0;
+    m_tagBytesRemaining = 0;
+    m_hasFooter = false;
+    m_usesUnsynchronisation = false;
+    m_usesExtendedHeader = false;
+    m_previousByteFF = false;
+    m_headerBytes = 0;
+    m_skipBytes = 0;
+    m_frameKey = 0;
+    m_frameFlags = 0;
+    m_frameSize = 0;
+    m_frameBytesRemaining = 0;
+    m_framePrefixSize = 0;
+    m_frameDataSize = 0;
+    
+    m_metaData = Meta_Data();
+    m_metaDataChanged = false;
+}
+    
+void ID3_Parser_Private::parseTagHeader()
+{
+    if (!(m_header[0] == 'I' &&
+          m_header[1] == 'D' &&
+          m_header[2] == '3')) {
+        ID3_TRACE("Not an ID3 tag, bailing out\n");
+        
+        // Does not begin with the tag header; not an ID3 tag
+        setState(ID3_Parser_State_Not_Valid_Tag);
+        return;
+    }
+    
+    m_majorVersion = m_header[3];
+    
+    if (m_majorVersion < 2 || m_majorVersion > 4 || m_header[4] == 0xff) {
+        ID3_TRACE("ID3v2.%i not supported by the parser\n", m_majorVersion);
+        
+        setState(ID3_Parser_State_Not_Valid_Tag);
         return;
     }
     
-    m_bytesReceived += numBytes;
+    // Ignore the revision
+    
+    if ((m_header[6] | m_header[7] | m_header[8] | m_header[9]) & 0x80) {
+        // The tag size is a synchsafe integer
+        setState(ID3_Parser_State_Not_Valid_Tag);
+        return;
+    }
+    
+    m_tagSize = (m_header[6] << 21) + (m_header[7] << 14) + (m_header[8] << 7) + m_header[9];
+    
+    if (m_tagSize == 0) {
+        setState(ID3_Parser_State_Not_Valid_Tag);
+        return;
+    }
+    
+    m_tagBytesRemaining = m_tagSize;
+    
+    ID3_TRACE("ID3v2.%i tag size: %i\n", m_majorVersion, m_tagSize);
+    
+    // Parse the flags
+    const UInt8 flags = m_header[5];
+    
+    m_usesUnsynchronisation = ((flags & 0x80) != 0);
+    
+    if (m_majorVersion == 2) {
+        if ((flags & 0x40) != 0) {
+            // ID3v2.2 compression was never defined, skip the tag
+            setState(ID3_Parser_State_Padding);
+            return;
+        }
+    } else {
+        m_usesExtendedHeader = ((flags & 0x40) != 0);
+    }
+    
+    m_hasFooter = (m_majorVersion == 4 && (flags & 0x10) != 0);
     
-    ID3_TRACE("received %i bytes, total bytes %i\n", numBytes, m_bytesReceived);
+    setState(m_usesExtendedHeader ? ID3_Parser_State_Extended_Header : ID3_Parser_State_Frame_Header);
+}
     
-    for (CFIndex i=0; i < numBytes; i++) {
-        m_tagData.push_back(data[i]);
+void ID3_Parser_Private::feedTagData(const UInt8 *data, size_t numBytes)
+{
+    if (!m_usesUnsynchronisation || m_majorVersion == 4) {
+        // ID3v2.4 unsynchronises the frame data only, the frames are handled separately
+        feedFrameData(data, numBytes);
+        return;
     }
     
-    bool enoughBytesToParse = true;
+    // Drop the zero bytes inserted after 0xFF by the unsynchronisation
+    size_t start = 0;
     
-    while (enoughBytesToParse) {
+    for (size_t i=0; i < numBytes; i++) {
+        if (m_previousByteFF && data[i] == 0) {
+            feedFrameData(data + start, i - start);
+            start = i + 1;
+        }
+        m_previousByteFF = (data[i] == 0xff);
+    }
+    
+    feedFrameData(data + start, numBytes - start);
+}
+    
+void ID3_Parser_Private::feedFrameData(const UInt8 *data, size_t numBytes)
+{
+    while (numBytes > 0) {
         switch (m_state) {
-            case ID3_Parser_State_Initial: {
-                // Do we have enough bytes to determine if this is an ID3 tag or not?
-                if (m_bytesReceived <= 9) {
-                    enoughBytesToParse = false;
+            case ID3_Parser_State_Extended_Header:
+            case ID3_Parser_State_Frame_Header: {
+                if (m_state == ID3_Parser_State_Frame_Header && m_headerBytes == 0 && data[0] == 0) {
+                    ID3_TRACE("Padding reached\n");
+                    
+                    setState(ID3_Parser_State_Padding);
                     break;
                 }
                 
-                if (!(m_tagData[0] == 'I' &&
-                    m_tagData[1] == 'D' &&
-                    m_tagData[2] == '3')) {
-                    ID3_TRACE("Not an ID3 tag, bailing out\n");
-                    
-                    // Does not begin with the tag header; not an ID3 tag
-                    setState(ID3_Parser_State_Not_Valid_Tag);
-                    enoughBytesToParse = false;
-                    break;
+                const size_t headerSize = (m_state == ID3_Parser_State_Extended_Header ? 4 :
+                                           m_majorVersion == 2 ? 6 : 10);
+                
+                size_t n = headerSize - m_headerBytes;
+                
+                if (n > numBytes) {
+                    n = numBytes;
                 }
                 
-                UInt8 majorVersion = m_tagData[3];
-                // Currently support only id3v2.3
-                if (majorVersion != 3) {
-                    ID3_TRACE("ID3v2.%i not supported by the parser\n", majorVersion);
+                memcpy(m_header + m_headerBytes, data, n);
+                m_headerBytes += n;
+                data += n;
+                numBytes -= n;
+                
+                if (m_headerBytes == headerSize) {
+                    m_headerBytes = 0;
                     
-                    setState(ID3_Parser_State_Not_Valid_Tag);
-                    enoughBytesToParse = false;
-                    break;
+                    if (m_state == ID3_Parser_State_Extended_Header) {
+                        parseExtendedHeader();
+                    } else {
+                        parseFrameHeader();
+                    }
                 }
+                break;
+            }
                 
-                // Ignore the revision
-                
-                // Parse the flags
+            case ID3_Parser_State_Frame_Data: {
+                size_t n = m_frameSize - m_frameDataSize;
                 
-                if ((m_tagData[5] & 0x80) != 0) {
-                    m_usesUnsynchronisation = true;
-                } else if ((m_tagData[5] & 0x40) != 0) {
-                    m_usesExtendedHeader = true;
-                } else if ((m_tagData[5] & 0x10) != 0) {
-                    m_hasFooter = true;
+                if (n > numBytes) {
+                    n = numBytes;
                 }
                 
-                m_tagSize = (m_tagData[6] << 21) + (m_tagData[7] << 14) + (m_tagData[8] << 7) + m_tagData[9];
+                memcpy(m_frameData + m_frameDataSize, data, n);
+                m_frameDataSize += n;
+                data += n;
+                numBytes -= n;
                 
-                if (m_tagSize > 0) {
-                    if (m_hasFooter) {
-                        m_tagSize += 10;
-                    }
-                    m_tagSize += 10;
-                    
-                    ID3_TRACE("tag size: %i\n", m_tagSize);
+                if (m_frameDataSize == m_frameSize) {
+                    parseFrame();
                     
-                    setState(ID3_Parser_State_Parse_Frames);
-                    break;
+                    m_frameDataSize = 0;
+                    setState(ID3_Parser_State_Frame_Header);
                 }
-                
-                setState(ID3_Parser_State_Not_Valid_Tag);
-                enoughBytesToParse = false;
                 break;
             }
                 
-            case ID3_Parser_State_Parse_Frames: {
-                // Do we have enough data to parse the frames?
-                if (m_tagData.size() < m_tagSize) {
-                    ID3_TRACE("Not enough data received for parsing, have %lu bytes, need %i bytes\n",
-                              m_tagData.size(),
-                              m_tagSize);
-                    enoughBytesToParse = false;
-                    break;
+            case ID3_Parser_State_Picture_Header: {
+                size_t n = kFrameWindowSize - m_frameDataSize;
+                
+                if (n > m_frameBytesRemaining) {
+                    n = m_frameBytesRemaining;
+                }
+                if (n > numBytes) {
+                    n = numBytes;
                 }
                 
-                UInt32 pos = 10;
+                memcpy(m_frameData + m_frameDataSize, data, n);
+                m_frameDataSize += n;
+                m_frameBytesRemaining -= n;
+                data += n;
+                numBytes -= n;
                 
-                // Do we have an extended header? If we do, skip it
-                if (m_usesExtendedHeader) {
-                    UInt32 extendedHeaderSize = ((m_tagData[pos] << 21) |
-                                                 (m_tagData[pos+1] << 14) |
-                                                 (m_tagData[pos+2] << 7) |
-                                                 m_tagData[pos+3]);
-                    
-                    if (pos + extendedHeaderSize >= m_tagSize) {
-                        setState(ID3_Parser_State_Not_Valid_Tag);
-                        enoughBytesToParse = false;
-                        break;
-                    }
-                    
-                    ID3_TRACE("Skipping extended header, size %i\n", extendedHeaderSize);
-                    
-                    pos += extendedHeaderSize;
-                }
+                const size_t offset = parsePictureHeader();
                 
-                while (pos < m_tagSize) {
-                    char frameName[5];
-                    frameName[0] = m_tagData[pos];
-                    frameName[1] = m_tagData[pos+1];
-                    frameName[2] = m_tagData[pos+2];
-                    frameName[3] = m_tagData[pos+3];
-                    frameName[4] = 0;
-                    
-                    pos += 4;
-                    
-                    UInt32 framesize = ((m_tagData[pos] << 21) |
-                                        (m_tagData[pos+1] << 14) |
-                                        (m_tagData[pos+2] << 7) |
-                                        m_tagData[pos+3]);
-                    if (framesize == 0) {
-                        setState(ID3_Parser_State_Not_Valid_Tag);
-                        enoughBytesToParse = false;
-                        break;
+                if (offset > 0) {
+                    // The window holds the beginning of the picture data
+                    if (m_frameDataSize > offset) {
+                        m_parser->m_pictureSink->id3pictureData(m_frameData + offset, m_frameDataSize - offset);
                     }
+                    m_frameDataSize = 0;
                     
-                    pos += 6;
-                    
-                    CFStringEncoding encoding;
-                    bool byteOrderMark = false;
-                    
-                    if (m_tagData[pos] == 3) {
-                        encoding = kCFStringEncodingUTF8;
-                    } else if (m_tagData[pos] == 2) {
-                        encoding = kCFStringEncodingUTF16BE;
-                    } else if (m_tagData[pos] == 1) {
-                        encoding = kCFStringEncodingUTF16;
-                        byteOrderMark = true;
-                    } else {
-                        // ISO-8859-1 is the default encoding
-                        encoding = kCFStringEncodingISOLatin1;
-                    }
-                    
-                    if (!strcmp(frameName, "TIT2")) {
-                        if (m_title) {
-                            CFRelease(m_title);
-                        }
-                        m_title = parseContent(framesize, pos + 1, encoding, byteOrderMark);
-                        
-                        ID3_TRACE("ID3 title parsed: '%s'\n", CFStringGetCStringPtr(m_title, CFStringGetSystemEncoding()));
-                    } else if (!strcmp(frameName, "TPE1")) {
-                        if (m_performer) {
-                            CFRelease(m_performer);
-                        }
-                        m_performer = parseContent(framesize, pos + 1, encoding, byteOrderMark);
-                        
-                        ID3_TRACE("ID3 performer parsed: '%s'\n", CFStringGetCStringPtr(m_performer, CFStringGetSystemEncoding()));
+                    if (m_frameBytesRemaining == 0) {
+                        m_parser->m_pictureSink->id3pictureEnd(true);
+                        setState(ID3_Parser_State_Frame_Header);
                     } else {
-                        // Unknown/unhandled frame
-                        ID3_TRACE("Unknown/unhandled frame: %s, size %i\n", frameName, framesize);
+                        setState(ID3_Parser_State_Picture_Data);
                     }
+                } else if (m_frameDataSize == kFrameWindowSize || m_frameBytesRemaining == 0) {
+                    ID3_TRACE("No picture header found, skipping the frame\n");
                     
-                    pos += framesize;
+                    m_frameDataSize = 0;
+                    skip(m_frameBytesRemaining);
                 }
+                break;
+            }
                 
-                // Push out the metadata
-                if (m_parser->m_delegate) {
-                    std::map<CFStringRef,CFStringRef> metadataMap;
-                    
-                    if (m_performer && CFStringGetLength(m_performer) > 0) {
-                        metadataMap[CFSTR("MPMediaItemPropertyArtist")] =
-                            CFStringCreateCopy(kCFAllocatorDefault, m_performer);
-                    }
-                    
-                    if (m_title && CFStringGetLength(m_title) > 0) {
-                        metadataMap[CFSTR("MPMediaItemPropertyTitle")] =
-                            CFStringCreateCopy(kCFAllocatorDefault, m_title);
-                    }
+            case ID3_Parser_State_Picture_Data: {
+                size_t n = (numBytes < m_frameBytesRemaining ? numBytes : m_frameBytesRemaining);
+                
+                m_parser->m_pictureSink->id3pictureData(data, n);
+                m_frameBytesRemaining -= n;
+                data += n;
+                numBytes -= n;
                 
-                    m_parser->m_delegate->id3metaDataAvailable(metadataMap);
+                if (m_frameBytesRemaining == 0) {
+                    m_parser->m_pictureSink->id3pictureEnd(true);
+                    setState(ID3_Parser_State_Frame_Header);
                 }
+                break;
+            }
+                
+            case ID3_Parser_State_Skip: {
+                size_t n = (numBytes < m_skipBytes ? numBytes : m_skipBytes);
                 
-                setState(ID3_Parser_State_Tag_Parsed);
-                enoughBytesToParse = false;
+                data += n;
+                numBytes -= n;
+                m_skipBytes -= n;
+                
+                if (m_skipBytes == 0) {
+                    setState(ID3_Parser_State_Frame_Header);
+                }
                 break;
             }
                 
             default:
-                enoughBytesToParse = false;
-                break;
+                // Padding, nothing more to parse in the tag
+                return;
         }
     }
 }
-
-void ID3_Parser_Private::setState(astreamer::ID3_Parser_State state)
+    
+void ID3_Parser_Private::parseExtendedHeader()
 {
-    m_state = state;
+    UInt32 size;
+    
+    if (m_majorVersion == 4) {
+        // A synchsafe integer, including the size bytes
+        size = (m_header[0] << 21) | (m_header[1] << 14) | (m_header[2] << 7) | m_header[3];
+        
+        if (size < 6) {
+            setState(ID3_Parser_State_Padding);
+            return;
+        }
+        size -= 4;
+    } else {
+        size = (m_header[0] << 24) | (m_header[1] << 16) | (m_header[2] << 8) | m_header[3];
+    }
+    
+    if (size >= m_tagSize) {
+        setState(ID3_Parser_State_Padding);
+        return;
+    }
+    
+    ID3_TRACE("Skipping extended header, size %i\n", size);
+    
+    skip(size);
 }
     
-void ID3_Parser_Private::reset()
+void ID3_Parser_Private::parseFrameHeader()
 {
-    m_state = ID3_Parser_State_Initial;
-    m_bytesReceived = 0;
-    m_tagSize = 0;
-    m_hasFooter = false;
-    m_usesUnsynchronisation = false;
-    m_usesExtendedHeader = false;
+    char frameId[5];
+    UInt32 framesize;
+    
+    if (m_majorVersion == 2) {
+        memcpy(frameId, m_header, 3);
+        frameId[3] = 0;
+        
+        framesize = (m_header[3] << 16) | (m_header[4] << 8) | m_header[5];
+        m_frameFlags = 0;
+    } else {
+        memcpy(frameId, m_header, 4);
+        frameId[4] = 0;
+        
+        if (m_majorVersion == 4) {
+            // Only ID3v2.4 has synchsafe frame sizes
+            framesize = ((m_header[4] & 0x7f) << 21) |
+                        ((m_header[5] & 0x7f) << 14) |
+                        ((m_header[6] & 0x7f) << 7) |
+                        (m_header[7] & 0x7f);
+        } else {
+            framesize = (m_header[4] << 24) | (m_header[5] << 16) | (m_header[6] << 8) | m_header[7];
+        }
+        m_frameFlags = (m_header[8] << 8) | m_header[9];
+    }
+    
+    for (const char *c = frameId; *c; c++) {
+        if (!((*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9'))) {
+            ID3_TRACE("Invalid frame ID, skipping the rest of the tag\n");
+            
+            setState(ID3_Parser_State_Padding);
+            return;
+        }
+    }
+    
+    if (framesize > m_tagSize) {
+        ID3_TRACE("Frame %s size %u exceeds the tag, skipping the rest of the tag\n", frameId, framesize);
+        
+        setState(ID3_Parser_State_Padding);
+        return;
+    }
+    
+    m_frameKey = keyForFrame(frameId, m_majorVersion);
+    
+    // Compressed or encrypted frames are not handled
+    bool handled;
+    
+    if (m_majorVersion == 4) {
+        handled = ((m_frameFlags & 0x000c) == 0);
+        
+        m_framePrefixSize = ((m_frameFlags & 0x0040) ? 1 : 0) + ((m_frameFlags & 0x0001) ? 4 : 0);
+    } else {
+        handled = ((m_frameFlags & 0x00c0) == 0);
+        
+        m_framePrefixSize = ((m_frameFlags & 0x0020) ? 1 : 0);
+    }
+    
+    m_frameDataSize = 0;
+    
+    if (m_parser->m_pictureSink && handled && framesize > 0 && isPictureFrame(frameId, m_majorVersion)) {
+        // The unsynchronised ID3v2.4 frames cannot be streamed through as is
+        if (!(m_majorVersion == 4 && ((m_frameFlags & 0x0002) != 0 || m_usesUnsynchronisation))) {
+            m_frameBytesRemaining = framesize;
+            
+            setState(ID3_Parser_State_Picture_Header);
+            return;
+        }
+    }
     
-    if (m_title) {
-        CFRelease(m_title), m_title = NULL;
+    if (!m_frameKey || !handled || framesize == 0 || framesize > kFrameWindowSize) {
+        // Unknown/unhandled frame
+        ID3_TRACE("Skipping frame: %s, size %i\n", frameId, framesize);
+        
+        skip(framesize);
+        return;
     }
-    if (m_performer) {
-        CFRelease(m_performer), m_performer = NULL;
+    
+    m_frameSize = framesize;
+    
+    setState(ID3_Parser_State_Frame_Data);
+}
+    
+void ID3_Parser_Private::parseFrame()
+{
+    UInt8 *data = m_frameData;
+    size_t numBytes = m_frameDataSize;
+    
+    if (m_majorVersion == 4) {
+        if ((m_frameFlags & 0x0002) != 0 || m_usesUnsynchronisation) {
+            numBytes = removeUnsynchronisation(data, numBytes);
+        }
+        
+        // The grouping identity and the data length indicator precede the content
+        size_t extra = ((m_frameFlags & 0x0040) ? 1 : 0) + ((m_frameFlags & 0x0001) ? 4 : 0);
+        
+        if (extra > numBytes) {
+            return;
+        }
+        data += extra;
+        numBytes -= extra;
+    } else if (m_majorVersion == 3 && (m_frameFlags & 0x0020) != 0) {
+        // Grouping identity
+        if (numBytes < 1) {
+            return;
+        }
+        data++;
+        numBytes--;
     }
     
-    m_tagData.clear();
+    CFStringRef content = parseContent(data, numBytes);
+    
+    if (!content) {
+        return;
+    }
+    
+    if (CFStringGetLength(content) == 0) {
+        CFRelease(content);
+        return;
+    }
+    
+    ID3_TRACE("ID3 frame parsed: '%s'\n", CFStringGetCStringPtr(content, CFStringGetSystemEncoding()));
+    
+    m_metaData.set(m_frameKey, content);
+    m_metaDataChanged = true;
 }
     
-CFStringRef ID3_Parser_Private::parseContent(UInt32 framesize, UInt32 pos, CFStringEncoding encoding, bool byteOrderMark)
+size_t ID3_Parser_Private::parsePictureHeader()
 {
-    CFStringRef content = CFStringCreateWithBytes(kCFAllocatorDefault,
-                                                  &m_tagData[pos],
-                                                  framesize - 1,
-                                                  encoding,
-                                                  byteOrderMark);
+    // Text encoding, MIME type (image format in ID3v2.2), picture type, description
+    const UInt8 *data = m_frameData;
+    const size_t size = m_frameDataSize;
+    size_t pos = m_framePrefixSize;
+    
+    if (pos >= size) {
+        return 0;
+    }
+    
+    const UInt8 textEncoding = data[pos++];
+    size_t mimeTypeLength;
+    
+    if (m_majorVersion == 2) {
+        mimeTypeLength = 3;
+        
+        if (pos + mimeTypeLength > size) {
+            return 0;
+        }
+    } else {
+        const UInt8 *terminator = (const UInt8 *)memchr(data + pos, 0, size - pos);
+        
+        if (!terminator) {
+            return 0;
+        }
+        mimeTypeLength = terminator - (data + pos);
+    }
+    
+    const size_t mimeTypePos = pos;
+    
+    pos += mimeTypeLength + (m_majorVersion == 2 ? 0 : 1);
     
-    return content;
+    if (pos >= size) {
+        return 0;
+    }
+    
+    const UInt8 pictureType = data[pos++];
+    
+    if (textEncoding == 1 || textEncoding == 2) {
+        while (pos + 1 < size && (data[pos] != 0 || data[pos + 1] != 0)) {
+            pos += 2;
+        }
+        if (pos + 1 >= size) {
+            return 0;
+        }
+        pos += 2;
+    } else {
+        const UInt8 *terminator = (const UInt8 *)memchr(data + pos, 0, size - pos);
+        
+        if (!terminator) {
+            return 0;
+        }
+        pos = terminator - data + 1;
+    }
+    
+    CFStringRef mimeType = CFStringCreateWithBytes(kCFAllocatorDefault,
+                                                   data + mimeTypePos,
+                                                   mimeTypeLength,
+                                                   kCFStringEncodingISOLatin1,
+                                                   false);
+    
+    m_parser->m_pictureSink->id3pictureBegin(mimeType, pictureType);
+    
+    if (mimeType) {
+        CFRelease(mimeType);
+    }
+    
+    return pos;
+}
+    
+void ID3_Parser_Private::skip(UInt32 numBytes)
+{
+    if (numBytes == 0) {
+        setState(ID3_Parser_State_Frame_Header);
+        return;
+    }
+    m_skipBytes = numBytes;
+    setState(ID3_Parser_State_Skip);
+}
+    
+void ID3_Parser_Private::deliverMetaData()
+{
+    if (!m_metaDataChanged) {
+        return;
+    }
+    m_metaDataChanged = false;
+    
+    if (!m_parser->m_delegate) {
+        return;
+    }
+    
+    // All the fields so far, the later frames are added to the parser's own record
+    Meta_Data metaData;
+    
+    for (size_t i=0; i < m_metaData.count(); i++) {
+        metaData.set((CFStringRef)CFRetain(m_metaData.keyAt(i)),
+                     (CFStringRef)CFRetain(m_metaData.valueAt(i)));
+    }
+    
+    m_parser->m_delegate->id3metaDataAvailable(std::move(metaData));
+}
+    
+CFStringRef ID3_Parser_Private::parseContent(const UInt8 *data, size_t numBytes)
+{
+    if (numBytes < 1) {
+        return NULL;
+    }
+    
+    const UInt8 textEncoding = data[0];
+    
+    data++;
+    numBytes--;
+    
+    CFStringEncoding encoding;
+    bool byteOrderMark = false;
+    bool wide = false;
+    
+    if (textEncoding == 3) {
+        encoding = kCFStringEncodingUTF8;
+    } else if (textEncoding == 2) {
+        encoding = kCFStringEncodingUTF16BE;
+        wide = true;
+    } else if (textEncoding == 1) {
+        encoding = kCFStringEncodingUTF16;
+        byteOrderMark = true;
+        wide = true;
+    } else if (textEncoding == 0) {
+        // ISO-8859-1 is the default encoding
+        encoding = kCFStringEncodingISOLatin1;
+    } else {
+        return NULL;
+    }
+    
+    // The string ends at the terminator; ID3v2.4 separates multiple values with it
+    size_t length = 0;
+    
+    if (wide) {
+        while (length + 1 < numBytes && (data[length] != 0 || data[length + 1] != 0)) {
+            length += 2;
+        }
+    } else {
+        const UInt8 *terminator = (const UInt8 *)memchr(data, 0, numBytes);
+        
+        length = (terminator ? terminator - data : numBytes);
+    }
+    
+    return CFStringCreateWithBytes(kCFAllocatorDefault,
+                                   data,
+                                   length,
+                                   encoding,
+                                   byteOrderMark);
+}
+    
+CFStringRef ID3_Parser_Private::keyForFrame(const char *frameId, UInt8 majorVersion)
+{
+    for (size_t i=0; i < sizeof(textFrames) / sizeof(textFrames[0]); i++) {
+        if (!strcmp(frameId, (majorVersion == 2 ? textFrames[i].v22FrameId : textFrames[i].frameId))) {
+            return textFrames[i].key;
+        }
+    }
+    return 0;
+}
+    
+bool ID3_Parser_Private::isPictureFrame(const char *frameId, UInt8 majorVersion)
+{
+    return !strcmp(frameId, (majorVersion == 2 ? "PIC" : "APIC"));
+}
+    
+size_t ID3_Parser_Private::removeUnsynchronisation(UInt8 *data, size_t numBytes)
+{
+    size_t out = 0;
+    
+    for (size_t i=0; i < numBytes; i++) {
+        data[out++] = data[i];
+        
+        if (data[i] == 0xff && i + 1 < numBytes && data[i + 1] == 0) {
+            i++;
+        }
+    }
+    return out;
 }
     
 /*
@@ -337,6 +816,7 @@ CFStringRef ID3_Parser_Private::parseContent(UInt32 framesize, UInt32 pos, CFStr
     
 ID3_Parser::ID3_Parser() :
     m_delegate(0),
+    m_pictureSink(0),
     m_private(new ID3_Parser_Private())
 {
     m_private->m_parser = this;
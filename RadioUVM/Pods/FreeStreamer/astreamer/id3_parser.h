@@ -9,13 +9,14 @@
 #ifndef ASTREAMER_ID3_PARSER_H
 #define ASTREAMER_ID3_PARSER_H
 
-#include <map>
+#include "meta_data.h"
 
 #import <CFNetwork/CFNetwork.h>
 
 namespace astreamer {
 
 class ID3_Parser_Delegate;
+class ID3_Parser_Picture_Sink;
 class ID3_Parser_Private;
 
 class ID3_Parser {
@@ -29,13 +30,26 @@ public:
     
     ID3_Parser_Delegate *m_delegate;
     
+    /* Receives the attached pictures if set; they are skipped otherwise */
+    ID3_Parser_Picture_Sink *m_pictureSink;
+    
 private:
     ID3_Parser_Private *m_private;
 };
 
 class ID3_Parser_Delegate {
 public:
-    virtual void id3metaDataAvailable(std::map<CFStringRef,CFStringRef> metaData) = 0;
+    virtual void id3metaDataAvailable(Meta_Data&& metaData) = 0;
+};
+    
+/* The picture data is streamed through as it arrives, without buffering it */
+class ID3_Parser_Picture_Sink {
+public:
+    /* The MIME type is the image format ("JPG", "PNG") for ID3v2.2; the picture type 3 is the front cover */
+    virtual void id3pictureBegin(CFStringRef mimeType, UInt8 pictureType) = 0;
+    virtual void id3pictureData(const UInt8 *data, size_t numBytes) = 0;
+    /* Not complete if the tag ended or the parser was reset in the middle of the picture */
+    virtual void id3pictureEnd(bool complete) = 0;
 };
     
 } // namespace astreamer
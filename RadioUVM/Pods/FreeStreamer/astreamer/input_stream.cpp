@@ -8,6 +8,10 @@
 
 #include "input_stream.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
 namespace astreamer {
     
 Input_Stream::Input_Stream() : m_delegate(0)
@@ -18,4 +22,26 @@ Input_Stream::~Input_Stream()
 {
 }
     
+size_t Input_Stream::totalLength()
+{
+    return contentLength();
+}
+    
+size_t Input_Stream::contentRangeTotal(const char *value)
+{
+    const char *slash = strchr(value, '/');
+    
+    if (!slash || strncasecmp(value, "bytes", 5) != 0) {
+        return 0;
+    }
+    
+    char *end;
+    const unsigned long long total = strtoull(slash + 1, &end, 10);
+    
+    if (end == slash + 1) {
+        return 0;
+    }
+    return (size_t)total;
+}
+    
 }
\ No newline at end of file
@@ -32,6 +32,12 @@ public:
     virtual CFStringRef contentType() = 0;
     virtual size_t contentLength() = 0;
     
+    /*
+     * The length of the whole content, which a partial response tells in
+     * its Content-Range. Defaults to contentLength(); 0 when unknown.
+     */
+    virtual size_t totalLength();
+    
     virtual bool open() = 0;
     virtual bool open(const Input_Stream_Position& position) = 0;
     virtual void close() = 0;
@@ -39,6 +45,10 @@ public:
     virtual void setScheduledInRunLoop(bool scheduledInRunLoop) = 0;
     
     virtual void setUrl(CFURLRef url) = 0;
+    
+protected:
+    /* The total of a "bytes first-last/total" value, 0 for "*" or a malformed one */
+    static size_t contentRangeTotal(const char *value);
 };
 
 class Input_Stream_Delegate {
@@ -47,7 +57,7 @@ public:
     virtual void streamHasBytesAvailable(UInt8 *data, UInt32 numBytes) = 0;
     virtual void streamEndEncountered() = 0;
     virtual void streamErrorOccurred() = 0;
-    virtual void streamMetaDataAvailable(std::map<CFStringRef,CFStringRef> metaData) = 0;
+    virtual void streamMetaDataAvailable(Meta_Data&& metaData) = 0;
 };
 
 } // namespace astreamer
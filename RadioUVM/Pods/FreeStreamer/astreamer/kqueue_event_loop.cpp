@@ -0,0 +1,168 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "kqueue_event_loop.h"
+
+#if !defined (__linux__)
+
+#include <errno.h>
+#include <unistd.h>
+
+//#define KEL_DEBUG 1
+
+#if !defined (KEL_DEBUG)
+#define KEL_TRACE(...) do {} while (0)
+#else
+#include <stdio.h>
+#define KEL_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+namespace astreamer {
+
+Kqueue_Event_Loop::Kqueue_Event_Loop() :
+    m_kqueueFd(kqueue()),
+    m_numEvents(0)
+{
+    if (m_kqueueFd >= 0) {
+        struct kevent change;
+        
+        EV_SET(&change, kWakeUpIdent, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        
+        if (kevent(m_kqueueFd, &change, 1, NULL, 0, NULL) != 0) {
+            ::close(m_kqueueFd), m_kqueueFd = -1;
+        }
+    }
+}
+
+Kqueue_Event_Loop::~Kqueue_Event_Loop()
+{
+    if (m_kqueueFd >= 0) {
+        ::close(m_kqueueFd), m_kqueueFd = -1;
+    }
+}
+    
+bool Kqueue_Event_Loop::isValid() const
+{
+    return (m_kqueueFd >= 0);
+}
+    
+bool Kqueue_Event_Loop::watch(int fd, int events, Event_Loop_Handler *handler)
+{
+    if (fd < 0 || !handler) {
+        return false;
+    }
+    
+    if ((size_t)fd >= m_watches.size()) {
+        Watch none = { 0, 0 };
+        m_watches.resize(fd + 1, none);
+    }
+    
+    // Both filters are added once, then enabled or disabled
+    struct kevent changes[2];
+    
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD | ((events & kEventRead) ? EV_ENABLE : EV_DISABLE), 0, 0, NULL);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD | ((events & kEventWrite) ? EV_ENABLE : EV_DISABLE), 0, 0, NULL);
+    
+    if (kevent(m_kqueueFd, changes, 2, NULL, 0, NULL) != 0) {
+        KEL_TRACE("kevent failed for fd %i, errno %i\n", fd, errno);
+        return false;
+    }
+    
+    m_watches[fd].handler = handler;
+    m_watches[fd].events = events;
+    
+    return true;
+}
+    
+void Kqueue_Event_Loop::unwatch(int fd)
+{
+    if (fd < 0 || (size_t)fd >= m_watches.size() || !m_watches[fd].handler) {
+        return;
+    }
+    
+    struct kevent changes[2];
+    
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    
+    kevent(m_kqueueFd, changes, 2, NULL, 0, NULL);
+    
+    m_watches[fd].handler = 0;
+    m_watches[fd].events = 0;
+    
+    // The descriptor may be reused before the dispatch reaches its events
+    for (int i=0; i < m_numEvents; i++) {
+        if ((int)m_events[i].ident == fd) {
+            m_events[i].filter = 0;
+        }
+    }
+}
+    
+bool Kqueue_Event_Loop::runOnce(int timeoutMs)
+{
+    struct timespec timeout;
+    
+    timeoutMs = waitTimeout(timeoutMs);
+    
+    if (timeoutMs >= 0) {
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+    }
+    
+    int n = kevent(m_kqueueFd, NULL, 0, m_events, kMaxEvents, (timeoutMs >= 0 ? &timeout : NULL));
+    
+    if (n < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+        n = 0;
+    }
+    
+    m_numEvents = n;
+    
+    for (int i=0; i < m_numEvents; i++) {
+        const int fd = (int)m_events[i].ident;
+        
+        if (m_events[i].filter == 0 || m_events[i].filter == EVFILT_USER || !m_watches[fd].handler) {
+            continue;
+        }
+        
+        int ready = (m_events[i].filter == EVFILT_READ ? kEventRead : kEventWrite);
+        
+        if (m_events[i].flags & (EV_EOF | EV_ERROR)) {
+            ready |= kEventRead | kEventWrite;
+        }
+        
+        ready &= m_watches[fd].events;
+        
+        if (ready) {
+            m_watches[fd].handler->eventLoopReady(fd, ready);
+        }
+    }
+    
+    m_numEvents = 0;
+    
+    runTimersAndTasks();
+    
+    return true;
+}
+    
+/* protected */
+    
+void Kqueue_Event_Loop::wakeUp()
+{
+    struct kevent change;
+    
+    EV_SET(&change, kWakeUpIdent, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    
+    kevent(m_kqueueFd, &change, 1, NULL, 0, NULL);
+}
+    
+} // namespace astreamer
+
+#endif // !__linux__
@@ -0,0 +1,66 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_KQUEUE_EVENT_LOOP_H
+#define ASTREAMER_KQUEUE_EVENT_LOOP_H
+
+#if !defined (__linux__)
+
+#include "event_loop.h"
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <time.h>
+#include <vector>
+
+namespace astreamer {
+
+class Kqueue_Event_Loop : public Event_Loop {
+public:
+    Kqueue_Event_Loop();
+    virtual ~Kqueue_Event_Loop();
+    
+    bool isValid() const;
+    
+    bool watch(int fd, int events, Event_Loop_Handler *handler);
+    void unwatch(int fd);
+    bool runOnce(int timeoutMs);
+    
+protected:
+    void wakeUp();
+    
+private:
+    int m_kqueueFd;
+    
+    enum {
+        /* The EVFILT_USER event interrupting the wait for the posted tasks */
+        kWakeUpIdent = 1
+    };
+    
+    struct Watch {
+        Event_Loop_Handler *handler;
+        int events;
+    };
+    
+    /* Indexed by the descriptor */
+    std::vector<Watch> m_watches;
+    
+    enum {
+        kMaxEvents = 64
+    };
+    
+    /* The events being dispatched */
+    struct kevent m_events[kMaxEvents];
+    int m_numEvents;
+};
+    
+} // namespace astreamer
+
+#endif // !__linux__
+
+#endif // ASTREAMER_KQUEUE_EVENT_LOOP_H
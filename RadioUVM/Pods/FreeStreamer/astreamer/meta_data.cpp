@@ -0,0 +1,146 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "meta_data.h"
+
+#include <string.h>
+
+//#define MD_DEBUG 1
+
+#if !defined (MD_DEBUG)
+#define MD_TRACE(...) do {} while (0)
+#else
+#define MD_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+namespace astreamer {
+    
+/* The field names produced by the parsers */
+static const struct {
+    const char *name;
+    CFStringRef key;
+} knownKeys[] = {
+    { "StreamTitle",                    CFSTR("StreamTitle") },
+    { "StreamUrl",                      CFSTR("StreamUrl") },
+    { "IcecastStationName",             CFSTR("IcecastStationName") },
+    { "MPMediaItemPropertyTitle",       CFSTR("MPMediaItemPropertyTitle") },
+    { "MPMediaItemPropertyArtist",      CFSTR("MPMediaItemPropertyArtist") },
+    { "MPMediaItemPropertyAlbumTitle",  CFSTR("MPMediaItemPropertyAlbumTitle") },
+    { "MPMediaItemPropertyAlbumArtist", CFSTR("MPMediaItemPropertyAlbumArtist") },
+    { "MPMediaItemPropertyGenre",       CFSTR("MPMediaItemPropertyGenre") },
+    { "MPMediaItemPropertyComposer",    CFSTR("MPMediaItemPropertyComposer") }
+};
+
+Meta_Data::Meta_Data() :
+    m_count(0)
+{
+}
+
+Meta_Data::~Meta_Data()
+{
+    clear();
+}
+    
+Meta_Data::Meta_Data(Meta_Data&& other) :
+    m_count(other.m_count)
+{
+    memcpy(m_fields, other.m_fields, m_count * sizeof(Field));
+    other.m_count = 0;
+}
+    
+Meta_Data& Meta_Data::operator=(Meta_Data&& other)
+{
+    if (this != &other) {
+        clear();
+        
+        m_count = other.m_count;
+        memcpy(m_fields, other.m_fields, m_count * sizeof(Field));
+        other.m_count = 0;
+    }
+    return *this;
+}
+    
+void Meta_Data::set(CFStringRef key, CFStringRef value)
+{
+    for (size_t i=0; i < m_count; i++) {
+        if (CFStringCompare(m_fields[i].key, key, 0) == kCFCompareEqualTo) {
+            CFRelease(m_fields[i].key);
+            CFRelease(m_fields[i].value);
+            
+            m_fields[i].key = key;
+            m_fields[i].value = value;
+            return;
+        }
+    }
+    
+    if (m_count == kMaxFields) {
+        MD_TRACE("too many metadata fields, dropping\n");
+        
+        CFRelease(key);
+        CFRelease(value);
+        return;
+    }
+    
+    m_fields[m_count].key = key;
+    m_fields[m_count].value = value;
+    m_count++;
+}
+    
+size_t Meta_Data::count() const
+{
+    return m_count;
+}
+    
+bool Meta_Data::empty() const
+{
+    return (m_count == 0);
+}
+    
+CFStringRef Meta_Data::keyAt(size_t index) const
+{
+    return m_fields[index].key;
+}
+    
+CFStringRef Meta_Data::valueAt(size_t index) const
+{
+    return m_fields[index].value;
+}
+    
+CFStringRef Meta_Data::value(CFStringRef key) const
+{
+    for (size_t i=0; i < m_count; i++) {
+        if (CFStringCompare(m_fields[i].key, key, 0) == kCFCompareEqualTo) {
+            return m_fields[i].value;
+        }
+    }
+    return 0;
+}
+    
+CFStringRef Meta_Data::createKey(const UInt8 *bytes, size_t numBytes, CFStringEncoding encoding)
+{
+    for (size_t i=0; i < sizeof(knownKeys) / sizeof(knownKeys[0]); i++) {
+        if (strlen(knownKeys[i].name) == numBytes &&
+            memcmp(knownKeys[i].name, bytes, numBytes) == 0) {
+            return knownKeys[i].key;
+        }
+    }
+    return CFStringCreateWithBytes(kCFAllocatorDefault, bytes, numBytes, encoding, false);
+}
+    
+/* private */
+    
+void Meta_Data::clear()
+{
+    for (size_t i=0; i < m_count; i++) {
+        CFRelease(m_fields[i].key);
+        CFRelease(m_fields[i].value);
+    }
+    m_count = 0;
+}
+    
+} // namespace astreamer
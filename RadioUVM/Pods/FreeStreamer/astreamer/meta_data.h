@@ -0,0 +1,67 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_META_DATA_H
+#define ASTREAMER_META_DATA_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <utility>
+
+namespace astreamer {
+
+/*
+ * A set of metadata fields, such as the stream title. The record owns its
+ * keys and values and is moved, not copied, through the delegates. The
+ * fields are stored inline, so passing a record along does not allocate.
+ */
+class Meta_Data {
+public:
+    Meta_Data();
+    ~Meta_Data();
+    
+    Meta_Data(Meta_Data&& other);
+    Meta_Data& operator=(Meta_Data&& other);
+    
+    enum {
+        kMaxFields = 16
+    };
+    
+    /* Takes over both references (the Create rule); CFSTR() keys may be passed as is.
+       A field with an equal key is replaced. */
+    void set(CFStringRef key, CFStringRef value);
+    
+    size_t count() const;
+    bool empty() const;
+    
+    CFStringRef keyAt(size_t index) const;
+    CFStringRef valueAt(size_t index) const;
+    
+    /* Returns 0 if there is no such field */
+    CFStringRef value(CFStringRef key) const;
+    
+    /* Returns the shared key for the well-known field names; creates others */
+    static CFStringRef createKey(const UInt8 *bytes, size_t numBytes, CFStringEncoding encoding);
+    
+private:
+    Meta_Data(const Meta_Data&);
+    Meta_Data& operator=(const Meta_Data&);
+    
+    struct Field {
+        CFStringRef key;
+        CFStringRef value;
+    };
+    
+    Field m_fields[kMaxFields];
+    size_t m_count;
+    
+    void clear();
+};
+    
+} // namespace astreamer
+
+#endif // ASTREAMER_META_DATA_H
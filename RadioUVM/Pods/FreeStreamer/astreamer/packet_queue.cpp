@@ -0,0 +1,427 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "packet_queue.h"
+
+//#define PQ_DEBUG 1
+
+#if !defined (PQ_DEBUG)
+#define PQ_TRACE(...) do {} while (0)
+#else
+#define PQ_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+namespace astreamer {
+
+Packet_Queue::Packet_Queue() :
+    m_data(0),
+    m_dataCapacity(0),
+    m_readPos(0),
+    m_writePos(0),
+    m_wrapPos(0),
+    m_wrapped(false),
+    m_descs(0),
+    m_descCapacity(0),
+    m_descHead(0),
+    m_descCount(0),
+    m_consumedCount(0),
+    m_count(0),
+    m_byteSize(0),
+    m_frameCount(0),
+    m_maxCount(0),
+    m_maxByteSize(0),
+    m_allocationCount(0)
+{
+    memset(&m_format, 0, sizeof m_format);
+    memset(&m_splitDesc, 0, sizeof m_splitDesc);
+}
+
+Packet_Queue::~Packet_Queue()
+{
+    free(m_data), m_data = 0;
+    free(m_descs), m_descs = 0;
+}
+
+void Packet_Queue::setFormat(const AudioStreamBasicDescription& format)
+{
+    m_format = format;
+
+    // The per-packet frame count depends on the format, recount
+    m_frameCount = 0;
+
+    for (size_t i = m_consumedCount; i < m_descCount; i++) {
+        m_frameCount += framesInPacket(descAt(i));
+    }
+}
+
+bool Packet_Queue::push(UInt32 numPackets, const void *data, const AudioStreamPacketDescription *descs)
+{
+    size_t numBytes = 0;
+
+    for (UInt32 i = 0; i < numPackets; i++) {
+        numBytes += descs[i].mDataByteSize;
+    }
+
+    size_t offset;
+
+    if (!reserve(numBytes, numPackets, &offset)) {
+        return false;
+    }
+
+    // The packets are packed back to back, in the queue order
+    for (UInt32 i = 0; i < numPackets; i++) {
+        AudioStreamPacketDescription *desc = descAt(m_descCount++);
+
+        *desc = descs[i];
+        desc->mStartOffset = offset;
+
+        memcpy(m_data + offset, (const char *)data + descs[i].mStartOffset, descs[i].mDataByteSize);
+        offset += descs[i].mDataByteSize;
+
+        m_count++;
+        m_byteSize += desc->mDataByteSize;
+        m_frameCount += framesInPacket(desc);
+    }
+
+    m_writePos = offset;
+
+    if (m_count > m_maxCount) {
+        m_maxCount = m_count;
+    }
+    if (m_byteSize > m_maxByteSize) {
+        m_maxByteSize = m_byteSize;
+    }
+
+    return true;
+}
+
+AudioStreamPacketDescription *Packet_Queue::front()
+{
+    if (m_count == 0) {
+        return 0;
+    }
+    return descAt(m_consumedCount);
+}
+
+UInt32 Packet_Queue::consume(UInt32 maxPackets, const void **data, UInt32 *numBytes, AudioStreamPacketDescription **descs)
+{
+    if (m_count == 0) {
+        return 0;
+    }
+
+    // The batch ends where either of the rings wraps
+    size_t index = (m_descHead + m_consumedCount) % m_descCapacity;
+    size_t limit = m_descCapacity - index;
+
+    if (limit > m_count) {
+        limit = m_count;
+    }
+    if (limit > maxPackets) {
+        limit = maxPackets;
+    }
+
+    AudioStreamPacketDescription *first = &m_descs[index];
+    size_t start = first->mStartOffset;
+    size_t end = start;
+    UInt32 n = 0;
+
+    while (n < limit) {
+        AudioStreamPacketDescription *desc = &first[n];
+
+        if ((size_t)desc->mStartOffset != end) {
+            break;
+        }
+        end += desc->mDataByteSize;
+
+        m_count--;
+        m_byteSize -= desc->mDataByteSize;
+        m_frameCount -= framesInPacket(desc);
+
+        desc->mStartOffset -= start;
+        n++;
+    }
+
+    m_consumedCount += n;
+
+    *data = m_data + start;
+    *numBytes = (UInt32)(end - start);
+    *descs = first;
+
+    return n;
+}
+
+UInt32 Packet_Queue::consumeBytes(size_t maxBytes, const void **data, UInt32 *numBytes, AudioStreamPacketDescription **descs)
+{
+    if (m_count == 0 || maxBytes == 0) {
+        return 0;
+    }
+
+    AudioStreamPacketDescription *desc = descAt(m_consumedCount);
+
+    if (desc->mDataByteSize <= maxBytes) {
+        return consume(1, data, numBytes, descs);
+    }
+
+    /* Hand out the head and leave the tail queued as the oldest packet.
+     * The head stays below the read position until the next release,
+     * so pushing can't overwrite it while the decoder reads it.
+     */
+    UInt64 frames = framesInPacket(desc);
+
+    *data = m_data + desc->mStartOffset;
+    *numBytes = (UInt32)maxBytes;
+
+    desc->mStartOffset += maxBytes;
+    desc->mDataByteSize -= (UInt32)maxBytes;
+
+    m_byteSize -= maxBytes;
+    m_frameCount -= frames - framesInPacket(desc);
+
+    m_splitDesc.mStartOffset = 0;
+    m_splitDesc.mDataByteSize = (UInt32)maxBytes;
+    m_splitDesc.mVariableFramesInPacket = 0;
+
+    *descs = &m_splitDesc;
+
+    return 1;
+}
+
+const void *Packet_Queue::packetData(const AudioStreamPacketDescription *desc)
+{
+    return m_data + desc->mStartOffset;
+}
+
+void Packet_Queue::pop()
+{
+    const void *data;
+    UInt32 numBytes;
+    AudioStreamPacketDescription *descs;
+
+    if (consume(1, &data, &numBytes, &descs) > 0) {
+        releaseConsumed();
+    }
+}
+
+void Packet_Queue::releaseConsumed()
+{
+    if (m_descCount == 0) {
+        return;
+    }
+
+    m_descHead = (m_descHead + m_consumedCount) % m_descCapacity;
+    m_descCount -= m_consumedCount;
+    m_consumedCount = 0;
+
+    if (m_descCount == 0) {
+        m_readPos = m_writePos = 0;
+        m_wrapped = false;
+        return;
+    }
+
+    size_t readPos = descAt(0)->mStartOffset;
+
+    if (m_wrapped && readPos < m_readPos) {
+        // Reached the wrapped part of the ring
+        m_wrapped = false;
+    }
+    m_readPos = readPos;
+}
+
+void Packet_Queue::clear()
+{
+    m_readPos = m_writePos = m_wrapPos = 0;
+    m_wrapped = false;
+
+    m_descHead = m_descCount = m_consumedCount = 0;
+
+    m_count = 0;
+    m_byteSize = 0;
+    m_frameCount = 0;
+}
+
+bool Packet_Queue::empty()
+{
+    return (m_count == 0);
+}
+
+size_t Packet_Queue::count()
+{
+    return m_count;
+}
+
+size_t Packet_Queue::byteSize()
+{
+    return m_byteSize;
+}
+
+double Packet_Queue::duration()
+{
+    if (!(m_format.mSampleRate > 0)) {
+        return 0;
+    }
+    return m_frameCount / m_format.mSampleRate;
+}
+
+size_t Packet_Queue::bytesAllocated()
+{
+    return m_dataCapacity + m_descCapacity * sizeof(AudioStreamPacketDescription);
+}
+
+size_t Packet_Queue::maxCount()
+{
+    return m_maxCount;
+}
+
+size_t Packet_Queue::maxByteSize()
+{
+    return m_maxByteSize;
+}
+
+unsigned Packet_Queue::allocationCount()
+{
+    return m_allocationCount;
+}
+
+/* private */
+
+UInt64 Packet_Queue::framesInPacket(const AudioStreamPacketDescription *desc)
+{
+    if (desc->mVariableFramesInPacket > 0) {
+        return desc->mVariableFramesInPacket;
+    }
+    if (m_format.mBytesPerPacket > 0) {
+        // Constant bit rate, the packet may contain several frames (LPCM)
+        return (desc->mDataByteSize / m_format.mBytesPerPacket) * m_format.mFramesPerPacket;
+    }
+    return m_format.mFramesPerPacket;
+}
+
+AudioStreamPacketDescription *Packet_Queue::descAt(size_t index)
+{
+    return &m_descs[(m_descHead + index) % m_descCapacity];
+}
+
+bool Packet_Queue::reserve(size_t numBytes, size_t numDescs, size_t *offset)
+{
+    if (m_descCount == 0) {
+        m_readPos = m_writePos = 0;
+        m_wrapped = false;
+    }
+
+    if (m_descCount + numDescs > m_descCapacity) {
+        if (!growDescs(numDescs)) {
+            return false;
+        }
+    }
+
+    if (!m_wrapped) {
+        if (m_dataCapacity - m_writePos >= numBytes) {
+            *offset = m_writePos;
+            return true;
+        }
+        if (m_readPos >= numBytes) {
+            // Does not fit to the end, continue from the start of the ring
+            m_wrapPos = m_writePos;
+            m_wrapped = true;
+
+            *offset = 0;
+            return true;
+        }
+    } else if (m_readPos - m_writePos >= numBytes) {
+        *offset = m_writePos;
+        return true;
+    }
+
+    if (!growData(numBytes)) {
+        return false;
+    }
+
+    *offset = m_writePos;
+    return true;
+}
+
+bool Packet_Queue::growData(size_t numBytes)
+{
+    size_t firstPart = (m_wrapped ? m_wrapPos : m_writePos) - m_readPos;
+    size_t used = firstPart + (m_wrapped ? m_writePos : 0);
+    size_t capacity = (m_dataCapacity > 0 ? m_dataCapacity * 2 : kInitialDataCapacity);
+
+    while (capacity < used + numBytes) {
+        capacity *= 2;
+    }
+
+    UInt8 *data = (UInt8 *)malloc(capacity);
+
+    if (!data) {
+        PQ_TRACE("failed to grow the packet ring to %zu bytes\n", capacity);
+        return false;
+    }
+
+    // Linearize the ring, the oldest packet goes to the start
+    if (used > 0) {
+        memcpy(data, m_data + m_readPos, firstPart);
+
+        if (m_wrapped) {
+            memcpy(data + firstPart, m_data, m_writePos);
+        }
+    }
+
+    for (size_t i = 0; i < m_descCount; i++) {
+        AudioStreamPacketDescription *desc = descAt(i);
+
+        if (!m_wrapped || (size_t)desc->mStartOffset >= m_readPos) {
+            desc->mStartOffset -= m_readPos;
+        } else {
+            desc->mStartOffset += firstPart;
+        }
+    }
+
+    PQ_TRACE("packet ring grown from %zu to %zu bytes\n", m_dataCapacity, capacity);
+
+    free(m_data);
+
+    m_data = data;
+    m_dataCapacity = capacity;
+    m_allocationCount++;
+    m_readPos = 0;
+    m_writePos = used;
+    m_wrapped = false;
+
+    return true;
+}
+
+bool Packet_Queue::growDescs(size_t numDescs)
+{
+    size_t capacity = (m_descCapacity > 0 ? m_descCapacity * 2 : kInitialDescCapacity);
+
+    while (capacity < m_descCount + numDescs) {
+        capacity *= 2;
+    }
+
+    AudioStreamPacketDescription *descs = (AudioStreamPacketDescription *)malloc(capacity * sizeof(AudioStreamPacketDescription));
+
+    if (!descs) {
+        PQ_TRACE("failed to grow the description ring to %zu entries\n", capacity);
+        return false;
+    }
+
+    for (size_t i = 0; i < m_descCount; i++) {
+        descs[i] = *descAt(i);
+    }
+
+    free(m_descs);
+
+    m_descs = descs;
+    m_descCapacity = capacity;
+    m_allocationCount++;
+    m_descHead = 0;
+
+    return true;
+}
+
+} // namespace astreamer
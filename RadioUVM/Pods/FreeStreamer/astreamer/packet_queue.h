@@ -0,0 +1,106 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_PACKET_QUEUE_H
+#define ASTREAMER_PACKET_QUEUE_H
+
+#include <AudioToolbox/AudioToolbox.h>
+
+namespace astreamer {
+
+/*
+ * FIFO of audio packets, stored in one contiguous byte ring with a
+ * parallel ring of packet descriptions. The mStartOffset of a queued
+ * description is the offset of the packet in the byte ring, so the
+ * packets are written once on push and then read by reference.
+ *
+ * The packet count, byte size and the duration of the queued audio are
+ * kept up to date on every operation, so querying them is O(1).
+ *
+ * Packets are consumed in batches of adjacent packets, the consumed
+ * descriptions are rebased to be relative to the returned data. They
+ * stay in the ring until releaseConsumed() is called; the decoder may
+ * still be reading them. Pushing may grow the rings,
+ * which invalidates the references, so don't push while consumed
+ * packets are in use.
+ *
+ * The rings are the packet store that gets recycled: they never shrink
+ * and clear() keeps them, so once they have grown to the high-water
+ * mark of the stream, queuing packets allocates nothing.
+ */
+class Packet_Queue {
+public:
+    Packet_Queue();
+    ~Packet_Queue();
+
+    void setFormat(const AudioStreamBasicDescription& format);
+
+    bool push(UInt32 numPackets, const void *data, const AudioStreamPacketDescription *descs);
+    AudioStreamPacketDescription *front();
+    UInt32 consume(UInt32 maxPackets, const void **data, UInt32 *numBytes, AudioStreamPacketDescription **descs);
+    /* Consumes the oldest packet or, if it is larger, maxBytes of its head; the rest stays queued */
+    UInt32 consumeBytes(size_t maxBytes, const void **data, UInt32 *numBytes, AudioStreamPacketDescription **descs);
+    const void *packetData(const AudioStreamPacketDescription *desc);
+    void pop();
+    void releaseConsumed();
+    void clear();
+
+    bool empty();
+    size_t count();
+    size_t byteSize();
+    double duration();
+    size_t bytesAllocated();
+
+    /* The most queued at once and the number of times the rings grew */
+    size_t maxCount();
+    size_t maxByteSize();
+    unsigned allocationCount();
+
+private:
+    Packet_Queue(const Packet_Queue&);
+    Packet_Queue& operator=(const Packet_Queue&);
+
+    AudioStreamBasicDescription m_format;
+
+    UInt8 *m_data;                          // the byte ring
+    size_t m_dataCapacity;
+    size_t m_readPos;                       // start of the oldest packet
+    size_t m_writePos;                      // end of the newest packet
+    size_t m_wrapPos;                       // end of the data before the write position wrapped
+    bool m_wrapped;
+
+    AudioStreamPacketDescription *m_descs;  // the description ring
+    size_t m_descCapacity;
+    size_t m_descHead;                      // the oldest (possibly consumed) description
+    size_t m_descCount;                     // consumed + queued descriptions
+    size_t m_consumedCount;
+    AudioStreamPacketDescription m_splitDesc;   // the description of a consumed packet head
+
+    size_t m_count;
+    size_t m_byteSize;
+    UInt64 m_frameCount;
+
+    size_t m_maxCount;
+    size_t m_maxByteSize;
+    unsigned m_allocationCount;
+
+    enum {
+        kInitialDataCapacity = 65536,
+        kInitialDescCapacity = 512
+    };
+
+    UInt64 framesInPacket(const AudioStreamPacketDescription *desc);
+    AudioStreamPacketDescription *descAt(size_t index);
+    bool reserve(size_t numBytes, size_t numDescs, size_t *offset);
+    bool growData(size_t numBytes);
+    bool growDescs(size_t numDescs);
+};
+
+} // namespace astreamer
+
+#endif // ASTREAMER_PACKET_QUEUE_H
@@ -0,0 +1,222 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "run_loop_event_loop.h"
+
+namespace astreamer {
+
+/* The timer is rescheduled to the next timer of the loop, or parked this far */
+static const CFTimeInterval kTimerParkedInterval = 1.0e10;
+    
+Run_Loop_Event_Loop::Run_Loop_Event_Loop() :
+    Run_Loop_Event_Loop(CFRunLoopGetCurrent())
+{
+}
+    
+Run_Loop_Event_Loop::Run_Loop_Event_Loop(CFRunLoopRef runLoop) :
+    m_runLoop((CFRunLoopRef)CFRetain(runLoop)),
+    m_taskSource(0),
+    m_timer(0)
+{
+    CFRunLoopSourceContext sourceCtx = {0, this, NULL, NULL, NULL, NULL, NULL, NULL, NULL, taskSourcePerform};
+    
+    m_taskSource = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &sourceCtx);
+    
+    CFRunLoopAddSource(m_runLoop, m_taskSource, kCFRunLoopCommonModes);
+    
+    CFRunLoopTimerContext timerCtx = {0, this, NULL, NULL, NULL};
+    
+    m_timer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                   CFAbsoluteTimeGetCurrent() + kTimerParkedInterval,
+                                   kTimerParkedInterval,
+                                   0,
+                                   0,
+                                   timerCallback,
+                                   &timerCtx);
+    
+    CFRunLoopAddTimer(m_runLoop, m_timer, kCFRunLoopCommonModes);
+}
+    
+Run_Loop_Event_Loop::~Run_Loop_Event_Loop()
+{
+    while (!m_watches.empty()) {
+        unwatch(m_watches.begin()->first);
+    }
+    
+    CFRunLoopTimerInvalidate(m_timer);
+    CFRelease(m_timer), m_timer = 0;
+    
+    CFRunLoopRemoveSource(m_runLoop, m_taskSource, kCFRunLoopCommonModes);
+    CFRunLoopSourceInvalidate(m_taskSource);
+    CFRelease(m_taskSource), m_taskSource = 0;
+    
+    CFRelease(m_runLoop), m_runLoop = 0;
+}
+    
+bool Run_Loop_Event_Loop::watch(int fd, int events, Event_Loop_Handler *handler)
+{
+    if (fd < 0 || !handler) {
+        return false;
+    }
+    
+    std::map<int, Watch>::iterator w = m_watches.find(fd);
+    
+    if (w == m_watches.end()) {
+        CFFileDescriptorContext ctx = {0, this, NULL, NULL, NULL};
+        Watch watch;
+    
+        watch.descriptor = CFFileDescriptorCreate(kCFAllocatorDefault, fd, false, descriptorCallback, &ctx);
+        if (!watch.descriptor) {
+            return false;
+        }
+    
+        watch.source = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, watch.descriptor, 0);
+        if (!watch.source) {
+            CFFileDescriptorInvalidate(watch.descriptor);
+            CFRelease(watch.descriptor);
+            return false;
+        }
+    
+        CFRunLoopAddSource(m_runLoop, watch.source, kCFRunLoopCommonModes);
+    
+        watch.handler = handler;
+        watch.events = 0;
+    
+        w = m_watches.insert(std::make_pair(fd, watch)).first;
+    }
+    
+    w->second.handler = handler;
+    w->second.events = events;
+    
+    CFFileDescriptorDisableCallBacks(w->second.descriptor, kCFFileDescriptorReadCallBack | kCFFileDescriptorWriteCallBack);
+    
+    if (events) {
+        CFFileDescriptorEnableCallBacks(w->second.descriptor, callBackTypes(events));
+    }
+    
+    return true;
+}
+    
+void Run_Loop_Event_Loop::unwatch(int fd)
+{
+    std::map<int, Watch>::iterator w = m_watches.find(fd);
+    
+    if (w == m_watches.end()) {
+        return;
+    }
+    
+    /* Invalidating the descriptor removes its source from the run loop */
+    CFFileDescriptorInvalidate(w->second.descriptor);
+    CFRelease(w->second.source);
+    CFRelease(w->second.descriptor);
+    
+    m_watches.erase(w);
+}
+    
+bool Run_Loop_Event_Loop::runsRunLoop()
+{
+    return true;
+}
+    
+CFRunLoopRef Run_Loop_Event_Loop::runLoop()
+{
+    return m_runLoop;
+}
+    
+CFRunLoopRef Run_Loop_Event_Loop::runLoopOf(Event_Loop *eventLoop)
+{
+    if (!eventLoop || !eventLoop->runsRunLoop()) {
+        return NULL;
+    }
+    return static_cast<Run_Loop_Event_Loop*>(eventLoop)->runLoop();
+}
+    
+bool Run_Loop_Event_Loop::runOnce(int timeoutMs)
+{
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode,
+                       (timeoutMs >= 0 ? timeoutMs / 1000.0 : kTimerParkedInterval),
+                       true);
+    
+    return true;
+}
+    
+/* protected */
+    
+void Run_Loop_Event_Loop::wakeUp()
+{
+    CFRunLoopSourceSignal(m_taskSource);
+    CFRunLoopWakeUp(m_runLoop);
+}
+    
+void Run_Loop_Event_Loop::timersChanged()
+{
+    const int timeoutMs = waitTimeout(-1);
+    
+    CFRunLoopTimerSetNextFireDate(m_timer,
+                                  CFAbsoluteTimeGetCurrent() + (timeoutMs >= 0 ? timeoutMs / 1000.0 : kTimerParkedInterval));
+}
+    
+/* private */
+    
+CFOptionFlags Run_Loop_Event_Loop::callBackTypes(int events)
+{
+    return ((events & kEventRead) ? kCFFileDescriptorReadCallBack : 0) |
+           ((events & kEventWrite) ? kCFFileDescriptorWriteCallBack : 0);
+}
+    
+void Run_Loop_Event_Loop::taskSourcePerform(void *info)
+{
+    Run_Loop_Event_Loop *THIS = static_cast<Run_Loop_Event_Loop*>(info);
+    
+    THIS->runTimersAndTasks();
+}
+    
+void Run_Loop_Event_Loop::timerCallback(CFRunLoopTimerRef timer, void *info)
+{
+    Run_Loop_Event_Loop *THIS = static_cast<Run_Loop_Event_Loop*>(info);
+    
+    THIS->runTimersAndTasks();
+    THIS->timersChanged();
+}
+    
+void Run_Loop_Event_Loop::descriptorCallback(CFFileDescriptorRef descriptor, CFOptionFlags types, void *info)
+{
+    Run_Loop_Event_Loop *THIS = static_cast<Run_Loop_Event_Loop*>(info);
+    
+    const int fd = CFFileDescriptorGetNativeDescriptor(descriptor);
+    
+    std::map<int, Watch>::iterator w = THIS->m_watches.find(fd);
+    
+    if (w == THIS->m_watches.end() || w->second.descriptor != descriptor) {
+        return;
+    }
+    
+    int ready = 0;
+    
+    if (types & kCFFileDescriptorReadCallBack) {
+        ready |= kEventRead;
+    }
+    if (types & kCFFileDescriptorWriteCallBack) {
+        ready |= kEventWrite;
+    }
+    
+    ready &= w->second.events;
+    
+    if (ready) {
+        w->second.handler->eventLoopReady(fd, ready);
+    }
+    
+    /* The callbacks are one-shot: enable them again, unless the handler stopped watching */
+    w = THIS->m_watches.find(fd);
+    
+    if (w != THIS->m_watches.end() && w->second.events) {
+        CFFileDescriptorEnableCallBacks(w->second.descriptor, callBackTypes(w->second.events));
+    }
+}
+    
+} // namespace astreamer
@@ -0,0 +1,69 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_RUN_LOOP_EVENT_LOOP_H
+#define ASTREAMER_RUN_LOOP_EVENT_LOOP_H
+
+#include "event_loop.h"
+
+#include <CoreFoundation/CoreFoundation.h>
+
+namespace astreamer {
+
+/*
+ * An event loop on a CFRunLoop: the descriptors, the timers and the
+ * posted tasks are run loop sources, so they are dispatched whenever
+ * the run loop runs, for instance on the main thread of an app.
+ */
+class Run_Loop_Event_Loop : public Event_Loop {
+public:
+    /* Uses the run loop of the calling thread */
+    Run_Loop_Event_Loop();
+    Run_Loop_Event_Loop(CFRunLoopRef runLoop);
+    virtual ~Run_Loop_Event_Loop();
+    
+    bool watch(int fd, int events, Event_Loop_Handler *handler);
+    void unwatch(int fd);
+    
+    bool runsRunLoop();
+    CFRunLoopRef runLoop();
+    
+    /* The run loop of the loop if it runs one, NULL otherwise */
+    static CFRunLoopRef runLoopOf(Event_Loop *eventLoop);
+    
+    /* Runs the run loop in the default mode; call on the thread of the run loop */
+    bool runOnce(int timeoutMs);
+    
+protected:
+    void wakeUp();
+    void timersChanged();
+    
+private:
+    CFRunLoopRef m_runLoop;
+    CFRunLoopSourceRef m_taskSource;
+    CFRunLoopTimerRef m_timer;
+    
+    struct Watch {
+        CFFileDescriptorRef descriptor;
+        CFRunLoopSourceRef source;
+        Event_Loop_Handler *handler;
+        int events;
+    };
+    
+    std::map<int, Watch> m_watches;
+    
+    static CFOptionFlags callBackTypes(int events);
+    
+    static void taskSourcePerform(void *info);
+    static void timerCallback(CFRunLoopTimerRef timer, void *info);
+    static void descriptorCallback(CFFileDescriptorRef descriptor, CFOptionFlags types, void *info);
+};
+    
+} // namespace astreamer
+
+#endif // ASTREAMER_RUN_LOOP_EVENT_LOOP_H
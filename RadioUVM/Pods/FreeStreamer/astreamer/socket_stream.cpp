@@ -0,0 +1,1194 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "socket_stream.h"
+#include "stream_configuration.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <vector>
+
+//#define SS_DEBUG 1
+
+#if !defined (SS_DEBUG)
+#define SS_TRACE(...) do {} while (0)
+#else
+#define SS_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+#if !defined (MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace astreamer {
+
+/* Whichever of the resolver thread and the stream lets go of the
+   resolution last deletes it; the stream is 0 once it has let go */
+struct Socket_Stream::Resolving {
+    Socket_Stream *stream;
+    Event_Loop *eventLoop;
+    std::string host;
+    std::string port;
+    struct addrinfo *addresses;
+};
+
+static pthread_mutex_t resolvingMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Socket_Stream: public */
+Socket_Stream::Socket_Stream(Event_Loop *eventLoop) :
+    m_eventLoop(eventLoop),
+    m_url(0),
+    m_socket(-1),
+    m_state(IDLE),
+    m_scheduledInRunLoop(false),
+    m_generation(0),
+    m_redirectCount(0),
+    m_addresses(0),
+    m_nextAddress(0),
+    m_resolving(0),
+    m_timeoutTimer(0),
+    m_requestBytesSent(0),
+    m_contentType(0),
+    m_contentLength(0),
+    m_totalLength(0),
+    m_hasContentLength(false),
+    m_bodyBytesRemaining(0),
+    m_bodyBytesToSkip(0),
+    m_chunked(false),
+    m_chunkState(CHUNK_SIZE),
+    m_chunkBytesRemaining(0),
+    m_icyStream(false),
+    m_icyName(0),
+    m_icyParser(new ICY_Parser()),
+    m_readBuffer(0),
+    m_readBufferSize(0),
+    m_id3Parser(new ID3_Parser())
+{
+    m_position.start = 0;
+    m_position.end = 0;
+    
+    m_icyParser->m_delegate = this;
+    m_id3Parser->m_delegate = this;
+}
+    
+Socket_Stream::~Socket_Stream()
+{
+    close();
+    
+    if (m_contentType) {
+        CFRelease(m_contentType), m_contentType = 0;
+    }
+    if (m_icyName) {
+        CFRelease(m_icyName), m_icyName = 0;
+    }
+    if (m_readBuffer) {
+        delete [] m_readBuffer, m_readBuffer = 0;
+    }
+    if (m_url) {
+        CFRelease(m_url), m_url = 0;
+    }
+    
+    delete m_icyParser, m_icyParser = 0;
+    delete m_id3Parser, m_id3Parser = 0;
+}
+    
+Input_Stream_Position Socket_Stream::position()
+{
+    return m_position;
+}
+    
+CFStringRef Socket_Stream::contentType()
+{
+    return m_contentType;
+}
+    
+size_t Socket_Stream::contentLength()
+{
+    return m_contentLength;
+}
+    
+size_t Socket_Stream::totalLength()
+{
+    return m_totalLength;
+}
+    
+bool Socket_Stream::open()
+{
+    Input_Stream_Position position;
+    position.start = 0;
+    position.end = 0;
+    
+    m_contentLength = 0;
+    m_totalLength = 0;
+    m_id3Parser->reset();
+    
+    return open(position);
+}
+    
+bool Socket_Stream::open(const Input_Stream_Position& position)
+{
+    bool success = false;
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    /* Already opened a connection, return */
+    if (m_state != IDLE) {
+        goto out;
+    }
+    
+    m_generation++;
+    m_position = position;
+    m_redirectCount = 0;
+    m_scheduledInRunLoop = true;
+    
+    if (!m_url || !m_eventLoop) {
+        goto out;
+    }
+    
+    if (m_readBufferSize != config->httpConnectionBufferSize) {
+        delete [] m_readBuffer;
+    
+        m_readBufferSize = config->httpConnectionBufferSize;
+        m_readBuffer = new UInt8[m_readBufferSize];
+    }
+    
+    {
+        CFStringRef urlString = CFURLGetString(m_url);
+        const CFIndex urlSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(urlString), kCFStringEncodingUTF8) + 1;
+        std::vector<char> url(urlSize);
+    
+        if (!CFStringGetCString(urlString, &url[0], urlSize, kCFStringEncodingUTF8) ||
+            !setTarget(&url[0])) {
+            goto out;
+        }
+    }
+    
+    if (!startRequest()) {
+        close();
+        goto out;
+    }
+    
+    success = true;
+    
+out:
+    return success;
+}
+    
+void Socket_Stream::close()
+{
+    /* The stream has been already closed */
+    if (m_state == IDLE) {
+        return;
+    }
+    
+    closeSocket();
+    cancelResolving();
+    stopTimeout();
+    
+    if (m_addresses) {
+        freeaddrinfo(m_addresses), m_addresses = 0;
+    }
+    m_nextAddress = 0;
+    
+    m_state = IDLE;
+    m_generation++;
+}
+    
+void Socket_Stream::setScheduledInRunLoop(bool scheduledInRunLoop)
+{
+    /* The stream has not been opened, or it has been already closed */
+    if (m_state == IDLE) {
+        return;
+    }
+    
+    /* The state doesn't change */
+    if (m_scheduledInRunLoop == scheduledInRunLoop) {
+        return;
+    }
+    
+    m_scheduledInRunLoop = scheduledInRunLoop;
+    
+    updateWatch();
+    
+    // A paused connection isn't read, so it can't stall either
+    if (m_state == READING_HEADERS || m_state == READING_BODY) {
+        if (m_scheduledInRunLoop) {
+            startTimeout(Stream_Configuration::configuration()->readTimeoutMs);
+        } else {
+            stopTimeout();
+        }
+    }
+}
+    
+void Socket_Stream::setUrl(CFURLRef url)
+{
+    if (m_url) {
+        CFRelease(m_url);
+    }
+    if (url) {
+        m_url = (CFURLRef)CFRetain(url);
+    } else {
+        m_url = NULL;
+    }
+}
+    
+bool Socket_Stream::canHandleUrl(CFURLRef url)
+{
+    if (!url) {
+        return false;
+    }
+    
+    CFStringRef scheme = CFURLCopyScheme(url);
+    
+    if (scheme) {
+        /* Plain HTTP only: the stream doesn't do TLS */
+        const bool http = (CFStringCompare(scheme, CFSTR("http"), kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+    
+        CFRelease(scheme);
+    
+        return http;
+    }
+    
+    return false;
+}
+    
+void Socket_Stream::id3metaDataAvailable(Meta_Data&& metaData)
+{
+    if (m_delegate) {
+        m_delegate->streamMetaDataAvailable(std::move(metaData));
+    }
+}
+    
+void Socket_Stream::icyMetaDataAvailable(Meta_Data&& metaData)
+{
+    if (m_delegate) {
+        m_delegate->streamMetaDataAvailable(std::move(metaData));
+    }
+}
+    
+void Socket_Stream::eventLoopReady(int fd, int events)
+{
+    if (fd != m_socket) {
+        return;
+    }
+    
+    switch (m_state) {
+        case CONNECTING:
+            if (events & Event_Loop::kEventWrite) {
+                connected();
+            }
+            break;
+        case SENDING_REQUEST:
+            if (events & Event_Loop::kEventWrite) {
+                sendRequest();
+            }
+            break;
+        case READING_HEADERS:
+        case READING_BODY:
+            if (events & Event_Loop::kEventRead) {
+                readResponse();
+            }
+            break;
+        default:
+            break;
+    }
+}
+    
+/* private */
+    
+bool Socket_Stream::setTarget(const char *url)
+{
+    std::string path;
+    
+    if (strncasecmp(url, "http://", 7) == 0 || strncmp(url, "//", 2) == 0) {
+        const char *authority = strchr(url, '/') + 2;
+        const char *authorityEnd = authority + strcspn(authority, "/?#");
+    
+        /* Skip the user info */
+        for (const char *p = authorityEnd; p > authority; p--) {
+            if (*(p - 1) == '@') {
+                authority = p;
+                break;
+            }
+        }
+    
+        const char *hostEnd = authorityEnd;
+        const char *port = 0;
+    
+        if (*authority == '[') {
+            /* An IPv6 literal */
+            const char *bracket = (const char *)memchr(authority, ']', authorityEnd - authority);
+            if (!bracket) {
+                return false;
+            }
+            m_host.assign(authority + 1, bracket - authority - 1);
+    
+            if (bracket + 1 < authorityEnd && *(bracket + 1) == ':') {
+                port = bracket + 2;
+            }
+        } else {
+            const char *colon = (const char *)memchr(authority, ':', authorityEnd - authority);
+            if (colon) {
+                hostEnd = colon;
+                port = colon + 1;
+            }
+            m_host.assign(authority, hostEnd - authority);
+        }
+    
+        if (port && port < authorityEnd) {
+            m_port.assign(port, authorityEnd - port);
+    
+            if (m_port.find_first_not_of("0123456789") != std::string::npos) {
+                return false;
+            }
+        } else {
+            m_port = "80";
+        }
+    
+        if (m_host.empty()) {
+            return false;
+        }
+    
+        path.assign(authorityEnd);
+    } else if (strstr(url, "://") && strcspn(url, "/") > (size_t)(strstr(url, "://") - url)) {
+        /* Another scheme, HTTPS included */
+        return false;
+    } else if (m_host.empty()) {
+        /* A relative reference needs a base */
+        return false;
+    } else if (*url == '/') {
+        path.assign(url);
+    } else {
+        /* Relative to the directory of the current path */
+        const std::string base = m_path.substr(0, m_path.find_first_of("?#"));
+        path = base.substr(0, base.rfind('/') + 1) + url;
+    }
+    
+    /* The fragment is not sent */
+    path = path.substr(0, path.find('#'));
+    
+    if (path.empty() || path[0] != '/') {
+        path.insert(0, "/");
+    }
+    
+    m_path = path;
+    
+    SS_TRACE("Target host %s port %s path %s\n", m_host.c_str(), m_port.c_str(), m_path.c_str());
+    
+    return true;
+}
+    
+bool Socket_Stream::startRequest()
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    /* Reset the response state */
+    m_headers.clear();
+    m_location.clear();
+    
+    if (m_contentType) {
+        CFRelease(m_contentType), m_contentType = 0;
+    }
+    if (m_icyName) {
+        CFRelease(m_icyName), m_icyName = 0;
+    }
+    
+    m_hasContentLength = false;
+    m_totalLength = 0;
+    m_bodyBytesRemaining = 0;
+    m_chunked = false;
+    m_chunkState = CHUNK_SIZE;
+    m_chunkBytesRemaining = 0;
+    m_icyStream = false;
+    m_icyParser->reset();
+    
+    /* The request */
+    m_request = "GET " + m_path + " HTTP/1.1\r\n";
+    
+    m_request += "Host: ";
+    if (m_host.find(':') != std::string::npos) {
+        m_request += "[" + m_host + "]";
+    } else {
+        m_request += m_host;
+    }
+    if (m_port != "80") {
+        m_request += ":" + m_port;
+    }
+    m_request += "\r\n";
+    
+    if (config->userAgent) {
+        char userAgent[256];
+    
+        if (CFStringGetCString(config->userAgent, userAgent, sizeof(userAgent), kCFStringEncodingUTF8)) {
+            m_request += "User-Agent: ";
+            m_request += userAgent;
+            m_request += "\r\n";
+        }
+    }
+    
+    /* Always request ICY metadata, if available */
+    m_request += "Icy-MetaData: 1\r\n";
+    
+    if (m_position.start > 0) {
+        char range[64];
+    
+        if (m_position.end > m_position.start) {
+            snprintf(range, sizeof(range), "Range: bytes=%llu-%llu\r\n",
+                     (unsigned long long)m_position.start,
+                     (unsigned long long)m_position.end);
+        } else {
+            snprintf(range, sizeof(range), "Range: bytes=%llu-\r\n",
+                     (unsigned long long)m_position.start);
+        }
+    
+        m_request += range;
+    }
+    
+    m_request += "Connection: close\r\n\r\n";
+    m_requestBytesSent = 0;
+    
+    if (m_addresses) {
+        freeaddrinfo(m_addresses), m_addresses = 0;
+    }
+    m_nextAddress = 0;
+    
+    cancelResolving();
+    
+    /* The name resolution blocks, so it runs on a thread of its own */
+    Resolving *resolving = new Resolving();
+    resolving->stream = this;
+    resolving->eventLoop = m_eventLoop;
+    resolving->host = m_host;
+    resolving->port = m_port;
+    resolving->addresses = 0;
+    
+    pthread_attr_t attr;
+    pthread_t thread;
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    const int err = pthread_create(&thread, &attr, resolveThread, resolving);
+    
+    pthread_attr_destroy(&attr);
+    
+    if (err != 0) {
+        SS_TRACE("Failed to create the resolver thread\n");
+    
+        delete resolving;
+        return false;
+    }
+    
+    m_resolving = resolving;
+    m_state = RESOLVING;
+    
+    startTimeout(config->connectTimeoutMs);
+    
+    return true;
+}
+    
+void Socket_Stream::cancelResolving()
+{
+    if (!m_resolving) {
+        return;
+    }
+    
+    /* If the result is posted already, resolvedTask() deletes it;
+       otherwise the thread does when it finds the stream gone */
+    pthread_mutex_lock(&resolvingMutex);
+    m_resolving->stream = 0;
+    pthread_mutex_unlock(&resolvingMutex);
+    
+    m_resolving = 0;
+}
+    
+void Socket_Stream::resolved(struct addrinfo *addresses)
+{
+    if (!addresses) {
+        SS_TRACE("Failed to resolve %s\n", m_host.c_str());
+    
+        errorOccurred();
+        return;
+    }
+    
+    m_addresses = addresses;
+    m_nextAddress = m_addresses;
+    
+    if (!connectNextAddress()) {
+        errorOccurred();
+    }
+}
+    
+bool Socket_Stream::connectNextAddress()
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+    
+    closeSocket();
+    
+    while (m_nextAddress) {
+        struct addrinfo *address = m_nextAddress;
+        m_nextAddress = address->ai_next;
+    
+        int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+    
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    
+#if defined (SO_NOSIGPIPE)
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    
+        if (config->socketReceiveBufferSize > 0) {
+            /* Before connecting, so that the window scale is negotiated for it */
+            int size = config->socketReceiveBufferSize;
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+    
+        if (connect(fd, address->ai_addr, address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            SS_TRACE("connect() failed, errno %i\n", errno);
+    
+            ::close(fd);
+            continue;
+        }
+    
+        m_socket = fd;
+        m_state = CONNECTING;
+    
+        if (!m_eventLoop->watch(m_socket, Event_Loop::kEventWrite, this)) {
+            ::close(m_socket), m_socket = -1;
+            continue;
+        }
+    
+        return true;
+    }
+    
+    return false;
+}
+    
+void Socket_Stream::closeSocket()
+{
+    if (m_socket < 0) {
+        return;
+    }
+    
+    m_eventLoop->unwatch(m_socket);
+    ::close(m_socket), m_socket = -1;
+}
+    
+void Socket_Stream::updateWatch()
+{
+    if (m_socket < 0) {
+        return;
+    }
+    
+    int events = 0;
+    
+    switch (m_state) {
+        case CONNECTING:
+        case SENDING_REQUEST:
+            events = Event_Loop::kEventWrite;
+            break;
+        case READING_HEADERS:
+        case READING_BODY:
+            events = (m_scheduledInRunLoop ? Event_Loop::kEventRead : 0);
+            break;
+        default:
+            break;
+    }
+    
+    if (!m_eventLoop->watch(m_socket, events, this)) {
+        errorOccurred();
+    }
+}
+    
+void Socket_Stream::connected()
+{
+    int error = 0;
+    socklen_t errorSize = sizeof(error);
+    
+    if (getsockopt(m_socket, SOL_SOCKET, SO_ERROR, &error, &errorSize) < 0 || error != 0) {
+        SS_TRACE("Connecting failed, error %i\n", error);
+    
+        if (!connectNextAddress()) {
+            errorOccurred();
+        }
+        return;
+    }
+    
+    freeaddrinfo(m_addresses), m_addresses = 0;
+    m_nextAddress = 0;
+    
+    m_state = SENDING_REQUEST;
+    
+    sendRequest();
+}
+    
+void Socket_Stream::sendRequest()
+{
+    while (m_requestBytesSent < m_request.size()) {
+        const ssize_t bytesSent = send(m_socket,
+                                       m_request.data() + m_requestBytesSent,
+                                       m_request.size() - m_requestBytesSent,
+                                       MSG_NOSIGNAL);
+    
+        if (bytesSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                errorOccurred();
+            }
+            return;
+        }
+    
+        m_requestBytesSent += bytesSent;
+    }
+    
+    m_state = READING_HEADERS;
+    
+    updateWatch();
+    
+    if (m_scheduledInRunLoop) {
+        startTimeout(Stream_Configuration::configuration()->readTimeoutMs);
+    }
+}
+    
+void Socket_Stream::readResponse()
+{
+    const unsigned generation = m_generation;
+    
+    const ssize_t bytesRead = recv(m_socket, m_readBuffer, m_readBufferSize, 0);
+    
+    if (bytesRead < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            SS_TRACE("recv() failed, errno %i\n", errno);
+    
+            errorOccurred();
+        }
+        return;
+    }
+    
+    if (bytesRead == 0) {
+        /* Without a length, the end of the connection ends the body */
+        if (m_state == READING_BODY && !m_chunked && !m_hasContentLength) {
+            endEncountered();
+        } else {
+            SS_TRACE("The connection closed prematurely\n");
+    
+            errorOccurred();
+        }
+        return;
+    }
+    
+    SS_TRACE("Read %li bytes\n", (long)bytesRead);
+    
+    startTimeout(Stream_Configuration::configuration()->readTimeoutMs);
+    
+    if (m_state == READING_BODY) {
+        parseBody(m_readBuffer, bytesRead);
+        return;
+    }
+    
+    const size_t previousSize = m_headers.size();
+    
+    m_headers.append((const char *)m_readBuffer, bytesRead);
+    
+    /* Look for the empty line ending the headers; some servers end the lines with LF only */
+    size_t headerSize = 0;
+    
+    for (size_t i = (previousSize > 2 ? previousSize - 2 : 0), max = m_headers.size(); i < max; i++) {
+        if (m_headers[i] != '\n') {
+            continue;
+        }
+        if (i + 1 < max && m_headers[i + 1] == '\n') {
+            headerSize = i + 2;
+            break;
+        }
+        if (i + 2 < max && m_headers[i + 1] == '\r' && m_headers[i + 2] == '\n') {
+            headerSize = i + 3;
+            break;
+        }
+    }
+    
+    if (headerSize == 0) {
+        if (m_headers.size() > kMaxHeaderSize) {
+            SS_TRACE("The response headers are too long\n");
+    
+            errorOccurred();
+        }
+        return;
+    }
+    
+    parseHeaders(headerSize);
+    
+    if (generation != m_generation || m_state != READING_BODY) {
+        return;
+    }
+    
+    const size_t bodyOffset = headerSize - previousSize;
+    
+    parseBody(m_readBuffer + bodyOffset, bytesRead - bodyOffset);
+}
+    
+void Socket_Stream::parseHeaders(size_t headerSize)
+{
+    const char *line = m_headers.data();
+    const char *end = line + headerSize;
+    int statusCode = 0;
+    
+    /* The status line */
+    if (strncmp(line, "ICY ", 4) == 0) {
+        /* ShoutCast responds with "ICY 200 OK" */
+        m_icyStream = true;
+        statusCode = atoi(line + 4);
+    
+        SS_TRACE("Detected an IceCast stream\n");
+    } else if (strncmp(line, "HTTP/", 5) == 0) {
+        const char *space = (const char *)memchr(line, ' ', end - line);
+        if (space) {
+            statusCode = atoi(space + 1);
+        }
+    }
+    
+    SS_TRACE("Status code %i\n", statusCode);
+    
+    line = (const char *)memchr(line, '\n', end - line) + 1;
+    
+    while (line < end) {
+        const char *lineEnd = (const char *)memchr(line, '\n', end - line);
+        const char *next = lineEnd + 1;
+    
+        if (lineEnd > line && *(lineEnd - 1) == '\r') {
+            lineEnd--;
+        }
+    
+        const char *colon = (const char *)memchr(line, ':', lineEnd - line);
+    
+        if (colon) {
+            const char *value = colon + 1;
+            const char *valueEnd = lineEnd;
+    
+            while (value < valueEnd && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while (valueEnd > value && (*(valueEnd - 1) == ' ' || *(valueEnd - 1) == '\t')) {
+                valueEnd--;
+            }
+    
+            parseHeader(line, colon - line, value, valueEnd - value);
+        }
+    
+        line = next;
+    }
+    
+    if ((statusCode == 301 || statusCode == 302 || statusCode == 303 ||
+         statusCode == 307 || statusCode == 308) && !m_location.empty()) {
+        const std::string location = m_location;
+    
+        SS_TRACE("Redirected to %s\n", location.c_str());
+    
+        closeSocket();
+    
+        if (++m_redirectCount > kMaxRedirects ||
+            !setTarget(location.c_str()) ||
+            !startRequest()) {
+            errorOccurred();
+        }
+        return;
+    }
+    
+    if (statusCode != 200 && statusCode != 206) {
+        errorOccurred();
+        return;
+    }
+    
+    m_headers.clear();
+    
+    m_state = READING_BODY;
+    
+    // A partial response has the total in its Content-Range
+    if (statusCode == 200) {
+        m_totalLength = (m_hasContentLength ? m_contentLength : 0);
+    }
+    
+    if (m_hasContentLength && !m_chunked) {
+        m_bodyBytesRemaining = m_contentLength;
+    } else {
+        m_hasContentLength = false;
+    }
+    
+    /* A server ignoring the range sends the content from the start */
+    m_bodyBytesToSkip = (statusCode == 200 && !m_icyStream ? m_position.start : 0);
+    
+    const unsigned generation = m_generation;
+    
+    if (m_icyName) {
+        m_icyParser->setStationName(m_icyName);
+    
+        if (m_delegate && ICY_Parser::isMetaDataFieldSubscribed((const UInt8 *)"IcecastStationName", 18)) {
+            Meta_Data metaData;
+    
+            metaData.set(CFSTR("IcecastStationName"), CFStringCreateCopy(kCFAllocatorDefault, m_icyName));
+    
+            m_delegate->streamMetaDataAvailable(std::move(metaData));
+    
+            if (generation != m_generation) {
+                return;
+            }
+        }
+    }
+    
+    if (m_delegate) {
+        m_delegate->streamIsReadyRead();
+    }
+}
+    
+void Socket_Stream::parseHeader(const char *name, size_t nameLength, const char *value, size_t valueLength)
+{
+    const std::string headerValue(value, valueLength);
+    
+#define HEADER_IS(X) (nameLength == sizeof(X) - 1 && strncasecmp(name, X, nameLength) == 0)
+    
+    if (HEADER_IS("content-type")) {
+        if (m_contentType) {
+            CFRelease(m_contentType);
+        }
+        m_contentType = CFStringCreateWithBytes(kCFAllocatorDefault,
+                                                (const UInt8 *)value,
+                                                valueLength,
+                                                kCFStringEncodingISOLatin1,
+                                                false);
+    } else if (HEADER_IS("content-length")) {
+        m_contentLength = strtoull(headerValue.c_str(), 0, 10);
+        m_hasContentLength = true;
+    } else if (HEADER_IS("content-range")) {
+        m_totalLength = contentRangeTotal(headerValue.c_str());
+    } else if (HEADER_IS("transfer-encoding")) {
+        m_chunked = (strcasestr(headerValue.c_str(), "chunked") != 0);
+    } else if (HEADER_IS("location")) {
+        m_location = headerValue;
+    } else if (HEADER_IS("icy-metaint")) {
+        m_icyStream = true;
+        m_icyParser->setMetaDataInterval(atoi(headerValue.c_str()));
+    
+        SS_TRACE("icy-metaint: %i\n", atoi(headerValue.c_str()));
+    } else if (HEADER_IS("icy-name")) {
+        if (m_icyName) {
+            CFRelease(m_icyName);
+        }
+        m_icyName = ICY_Parser::createMetaDataStringWithMostReasonableEncoding((const UInt8 *)value, valueLength);
+    }
+    
+#undef HEADER_IS
+}
+    
+void Socket_Stream::parseBody(UInt8 *buf, size_t bufSize)
+{
+    if (m_chunked) {
+        parseChunkedBody(buf, bufSize);
+        return;
+    }
+    
+    if (!m_hasContentLength) {
+        bodyDataAvailable(buf, bufSize);
+        return;
+    }
+    
+    const unsigned generation = m_generation;
+    
+    /* Anything past the announced length is not part of the body */
+    if (bufSize > m_bodyBytesRemaining) {
+        bufSize = (size_t)m_bodyBytesRemaining;
+    }
+    m_bodyBytesRemaining -= bufSize;
+    
+    bodyDataAvailable(buf, bufSize);
+    
+    if (generation == m_generation && m_bodyBytesRemaining == 0) {
+        endEncountered();
+    }
+}
+    
+void Socket_Stream::parseChunkedBody(UInt8 *buf, size_t bufSize)
+{
+    const unsigned generation = m_generation;
+    size_t offset = 0;
+    
+    while (offset < bufSize) {
+        const UInt8 c = buf[offset];
+    
+        switch (m_chunkState) {
+            case CHUNK_SIZE: {
+                int digit = -1;
+    
+                if (c >= '0' && c <= '9') {
+                    digit = c - '0';
+                } else if (c >= 'a' && c <= 'f') {
+                    digit = c - 'a' + 10;
+                } else if (c >= 'A' && c <= 'F') {
+                    digit = c - 'A' + 10;
+                }
+    
+                if (digit >= 0) {
+                    if (m_chunkBytesRemaining >> 60) {
+                        errorOccurred();
+                        return;
+                    }
+                    m_chunkBytesRemaining = (m_chunkBytesRemaining << 4) | digit;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    m_chunkState = CHUNK_EXTENSION;
+                } else if (c == '\r') {
+                    m_chunkState = CHUNK_SIZE_LF;
+                } else if (c == '\n') {
+                    m_chunkState = (m_chunkBytesRemaining > 0 ? CHUNK_DATA : CHUNK_TRAILER);
+                } else {
+                    errorOccurred();
+                    return;
+                }
+                offset++;
+                break;
+            }
+            case CHUNK_EXTENSION:
+                if (c == '\r') {
+                    m_chunkState = CHUNK_SIZE_LF;
+                } else if (c == '\n') {
+                    m_chunkState = (m_chunkBytesRemaining > 0 ? CHUNK_DATA : CHUNK_TRAILER);
+                }
+                offset++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') {
+                    errorOccurred();
+                    return;
+                }
+                m_chunkState = (m_chunkBytesRemaining > 0 ? CHUNK_DATA : CHUNK_TRAILER);
+                offset++;
+                break;
+            case CHUNK_DATA: {
+                size_t numBytes = bufSize - offset;
+                if (numBytes > m_chunkBytesRemaining) {
+                    numBytes = (size_t)m_chunkBytesRemaining;
+                }
+    
+                m_chunkBytesRemaining -= numBytes;
+                if (m_chunkBytesRemaining == 0) {
+                    m_chunkState = CHUNK_DATA_CR;
+                }
+    
+                bodyDataAvailable(buf + offset, numBytes);
+    
+                if (generation != m_generation) {
+                    return;
+                }
+                offset += numBytes;
+                break;
+            }
+            case CHUNK_DATA_CR:
+                if (c == '\r') {
+                    m_chunkState = CHUNK_DATA_LF;
+                } else if (c == '\n') {
+                    m_chunkState = CHUNK_SIZE;
+                } else {
+                    errorOccurred();
+                    return;
+                }
+                offset++;
+                break;
+            case CHUNK_DATA_LF:
+                if (c != '\n') {
+                    errorOccurred();
+                    return;
+                }
+                m_chunkState = CHUNK_SIZE;
+                offset++;
+                break;
+            case CHUNK_TRAILER:
+                /* At the start of a trailer line; an empty line ends the body */
+                if (c == '\n') {
+                    m_chunkState = CHUNK_DONE;
+    
+                    endEncountered();
+                    return;
+                } else if (c != '\r') {
+                    m_chunkState = CHUNK_TRAILER_LINE;
+                }
+                offset++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') {
+                    m_chunkState = CHUNK_TRAILER;
+                }
+                offset++;
+                break;
+            case CHUNK_DONE:
+                return;
+        }
+    }
+}
+    
+void Socket_Stream::bodyDataAvailable(UInt8 *buf, size_t bufSize)
+{
+    if (bufSize == 0) {
+        return;
+    }
+    
+    const unsigned generation = m_generation;
+    
+    if (m_icyStream) {
+        UInt8 *audioData = 0;
+        const size_t audioDataSize = m_icyParser->demux(buf, bufSize, &audioData);
+    
+        if (generation != m_generation) {
+            return;
+        }
+    
+        if (audioDataSize > 0 && m_delegate) {
+            m_delegate->streamHasBytesAvailable(audioData, (UInt32)audioDataSize);
+        }
+        return;
+    }
+    
+    if (m_bodyBytesToSkip > 0) {
+        const size_t skip = (m_bodyBytesToSkip < bufSize ? (size_t)m_bodyBytesToSkip : bufSize);
+    
+        m_bodyBytesToSkip -= skip;
+        buf += skip;
+        bufSize -= skip;
+    
+        if (bufSize == 0) {
+            return;
+        }
+    }
+    
+    if (m_id3Parser->wantData()) {
+        m_id3Parser->feedData(buf, (UInt32)bufSize);
+    
+        if (generation != m_generation) {
+            return;
+        }
+    }
+    
+    if (m_delegate) {
+        m_delegate->streamHasBytesAvailable(buf, (UInt32)bufSize);
+    }
+}
+    
+void Socket_Stream::startTimeout(int timeoutMs)
+{
+    stopTimeout();
+    
+    if (timeoutMs > 0) {
+        m_timeoutTimer = m_eventLoop->startTimer(timeoutMs, false, timeoutTask, this, 0);
+    }
+}
+    
+void Socket_Stream::stopTimeout()
+{
+    if (m_timeoutTimer) {
+        m_eventLoop->stopTimer(m_timeoutTimer), m_timeoutTimer = 0;
+    }
+}
+    
+void Socket_Stream::endEncountered()
+{
+    close();
+    
+    if (m_delegate) {
+        m_delegate->streamEndEncountered();
+    }
+}
+    
+void Socket_Stream::errorOccurred()
+{
+    close();
+    
+    if (m_delegate) {
+        m_delegate->streamErrorOccurred();
+    }
+}
+    
+void *Socket_Stream::resolveThread(void *arg)
+{
+    Resolving *resolving = static_cast<Resolving*>(arg);
+    struct addrinfo hints;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    
+    if (getaddrinfo(resolving->host.c_str(), resolving->port.c_str(), &hints, &resolving->addresses) != 0) {
+        resolving->addresses = 0;
+    }
+    
+    /* Posted under the lock, so that a stream closed before it doesn't
+       get a task, and its event loop may be gone already */
+    pthread_mutex_lock(&resolvingMutex);
+    
+    const bool orphaned = (resolving->stream == 0);
+    
+    if (!orphaned) {
+        resolving->eventLoop->post(resolvedTask, resolving, 0);
+    }
+    
+    pthread_mutex_unlock(&resolvingMutex);
+    
+    if (orphaned) {
+        if (resolving->addresses) {
+            freeaddrinfo(resolving->addresses);
+        }
+        delete resolving;
+    }
+    
+    return NULL;
+}
+    
+void Socket_Stream::resolvedTask(void *info, intptr_t arg)
+{
+    Resolving *resolving = static_cast<Resolving*>(info);
+    
+    // The stream lets go of it on the loop thread only
+    Socket_Stream *THIS = resolving->stream;
+    struct addrinfo *addresses = resolving->addresses;
+    
+    delete resolving;
+    
+    if (!THIS) {
+        if (addresses) {
+            freeaddrinfo(addresses);
+        }
+        return;
+    }
+    
+    THIS->m_resolving = 0;
+    THIS->resolved(addresses);
+}
+    
+void Socket_Stream::timeoutTask(void *info, intptr_t arg)
+{
+    Socket_Stream *THIS = static_cast<Socket_Stream*>(info);
+    
+    THIS->m_timeoutTimer = 0;
+    
+    SS_TRACE("The connection timed out in state %i\n", THIS->m_state);
+    
+    THIS->errorOccurred();
+}
+    
+} // namespace astreamer
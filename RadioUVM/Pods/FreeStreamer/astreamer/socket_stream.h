@@ -0,0 +1,176 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_SOCKET_STREAM_H
+#define ASTREAMER_SOCKET_STREAM_H
+
+#include <string>
+#include "input_stream.h"
+#include "id3_parser.h"
+#include "icy_parser.h"
+#include "event_loop.h"
+
+struct addrinfo;
+
+namespace astreamer {
+
+/*
+ * An HTTP/1.1 and ICY input stream on a nonblocking POSIX socket.
+ * The stream is driven by an event loop, which must outlive the stream.
+ * The host name is resolved on a thread of its own, so that a slow
+ * resolver doesn't hold up the other streams on the loop.
+ */
+class Socket_Stream : public Input_Stream, public ICY_Parser_Delegate, public Event_Loop_Handler {
+private:
+    
+    Socket_Stream(const Socket_Stream&);
+    Socket_Stream& operator=(const Socket_Stream&);
+    
+    enum State {
+        IDLE,
+        RESOLVING,
+        CONNECTING,
+        SENDING_REQUEST,
+        READING_HEADERS,
+        READING_BODY
+    };
+    
+    enum Chunk_State {
+        CHUNK_SIZE,
+        CHUNK_EXTENSION,
+        CHUNK_SIZE_LF,
+        CHUNK_DATA,
+        CHUNK_DATA_CR,
+        CHUNK_DATA_LF,
+        CHUNK_TRAILER,
+        CHUNK_TRAILER_LINE,
+        CHUNK_DONE
+    };
+    
+    enum {
+        kMaxRedirects = 5,
+        kMaxHeaderSize = 16384
+    };
+    
+    Event_Loop *m_eventLoop;
+    
+    CFURLRef m_url;
+    int m_socket;
+    State m_state;
+    bool m_scheduledInRunLoop;
+    Input_Stream_Position m_position;
+    
+    /* Bumped on each open and close, so that a callback can tell if the
+       delegate closed or reopened the stream beneath it */
+    unsigned m_generation;
+    
+    /* The target of the current request, changed by redirects */
+    std::string m_host;
+    std::string m_port;
+    std::string m_path;
+    unsigned m_redirectCount;
+    
+    struct addrinfo *m_addresses;
+    struct addrinfo *m_nextAddress;
+    
+    /* The resolution in progress, shared with its thread */
+    struct Resolving;
+    Resolving *m_resolving;
+    
+    /* The connect timeout until the request is sent, the read timeout after it */
+    unsigned m_timeoutTimer;
+    
+    std::string m_request;
+    size_t m_requestBytesSent;
+    
+    /* HTTP headers */
+    std::string m_headers;
+    CFStringRef m_contentType;
+    size_t m_contentLength;
+    size_t m_totalLength;
+    bool m_hasContentLength;
+    UInt64 m_bodyBytesRemaining;
+    UInt64 m_bodyBytesToSkip;       // the bytes before the requested range
+    std::string m_location;
+    
+    /* Chunked transfer encoding */
+    bool m_chunked;
+    Chunk_State m_chunkState;
+    UInt64 m_chunkBytesRemaining;
+    
+    /* ICY protocol */
+    bool m_icyStream;
+    CFStringRef m_icyName;
+    ICY_Parser *m_icyParser;
+    
+    /* Read buffers */
+    UInt8 *m_readBuffer;
+    size_t m_readBufferSize;
+    
+    ID3_Parser *m_id3Parser;
+    
+    bool setTarget(const char *url);
+    bool startRequest();
+    void cancelResolving();
+    void resolved(struct addrinfo *addresses);
+    bool connectNextAddress();
+    void closeSocket();
+    void updateWatch();
+    void startTimeout(int timeoutMs);
+    void stopTimeout();
+    
+    void connected();
+    void sendRequest();
+    void readResponse();
+    
+    void parseHeaders(size_t headerSize);
+    void parseHeader(const char *name, size_t nameLength, const char *value, size_t valueLength);
+    void parseBody(UInt8 *buf, size_t bufSize);
+    void parseChunkedBody(UInt8 *buf, size_t bufSize);
+    void bodyDataAvailable(UInt8 *buf, size_t bufSize);
+    
+    void endEncountered();
+    void errorOccurred();
+    
+    static void *resolveThread(void *arg);
+    static void resolvedTask(void *info, intptr_t arg);
+    static void timeoutTask(void *info, intptr_t arg);
+    
+public:
+    Socket_Stream(Event_Loop *eventLoop);
+    virtual ~Socket_Stream();
+    
+    Input_Stream_Position position();
+    
+    CFStringRef contentType();
+    size_t contentLength();
+    size_t totalLength();
+    
+    bool open();
+    bool open(const Input_Stream_Position& position);
+    void close();
+    
+    void setScheduledInRunLoop(bool scheduledInRunLoop);
+    
+    void setUrl(CFURLRef url);
+    
+    static bool canHandleUrl(CFURLRef url);
+    
+    /* ID3_Parser_Delegate */
+    void id3metaDataAvailable(Meta_Data&& metaData);
+    
+    /* ICY_Parser_Delegate */
+    void icyMetaDataAvailable(Meta_Data&& metaData);
+    
+    /* Event_Loop_Handler */
+    void eventLoopReady(int fd, int events);
+};
+    
+} // namespace astreamer
+
+#endif // ASTREAMER_SOCKET_STREAM_H
@@ -0,0 +1,133 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "spsc_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace astreamer {
+
+Spsc_Ring::Spsc_Ring(size_t capacity) :
+    m_data(0),
+    m_capacity(1),
+    m_mask(0),
+    m_writePos(0),
+    m_readPos(0)
+{
+    while (m_capacity < capacity) {
+        m_capacity <<= 1;
+    }
+
+    m_data = (uint8_t *)malloc(m_capacity);
+
+    if (!m_data) {
+        m_capacity = 0;
+    } else {
+        m_mask = m_capacity - 1;
+    }
+}
+
+Spsc_Ring::~Spsc_Ring()
+{
+    free(m_data), m_data = 0;
+}
+
+size_t Spsc_Ring::write(const void *data, size_t numBytes)
+{
+    size_t writePos = m_writePos.load(std::memory_order_relaxed);
+    size_t readPos = m_readPos.load(std::memory_order_acquire);
+    size_t space = m_capacity - (writePos - readPos);
+
+    if (numBytes > space) {
+        numBytes = space;
+    }
+
+    size_t offset = writePos & m_mask;
+    size_t first = m_capacity - offset;
+
+    if (first > numBytes) {
+        first = numBytes;
+    }
+
+    memcpy(m_data + offset, data, first);
+    memcpy(m_data, (const uint8_t *)data + first, numBytes - first);
+
+    m_writePos.store(writePos + numBytes, std::memory_order_release);
+
+    return numBytes;
+}
+
+size_t Spsc_Ring::writeAvailable()
+{
+    return m_capacity - (m_writePos.load(std::memory_order_relaxed) - m_readPos.load(std::memory_order_acquire));
+}
+
+size_t Spsc_Ring::read(void *data, size_t numBytes)
+{
+    size_t readPos = m_readPos.load(std::memory_order_relaxed);
+    size_t writePos = m_writePos.load(std::memory_order_acquire);
+    size_t available = writePos - readPos;
+
+    if (numBytes > available) {
+        numBytes = available;
+    }
+
+    size_t offset = readPos & m_mask;
+    size_t first = m_capacity - offset;
+
+    if (first > numBytes) {
+        first = numBytes;
+    }
+
+    memcpy(data, m_data + offset, first);
+    memcpy((uint8_t *)data + first, m_data, numBytes - first);
+
+    m_readPos.store(readPos + numBytes, std::memory_order_release);
+
+    return numBytes;
+}
+
+size_t Spsc_Ring::readRegion(const void **data)
+{
+    size_t readPos = m_readPos.load(std::memory_order_relaxed);
+    size_t available = m_writePos.load(std::memory_order_acquire) - readPos;
+    size_t offset = readPos & m_mask;
+
+    // Only the part up to the end of the ring is contiguous
+    if (available > m_capacity - offset) {
+        available = m_capacity - offset;
+    }
+
+    *data = m_data + offset;
+
+    return available;
+}
+
+void Spsc_Ring::readAdvance(size_t numBytes)
+{
+    m_readPos.store(m_readPos.load(std::memory_order_relaxed) + numBytes, std::memory_order_release);
+}
+
+size_t Spsc_Ring::readAvailable()
+{
+    return m_writePos.load(std::memory_order_acquire) - m_readPos.load(std::memory_order_relaxed);
+}
+
+size_t Spsc_Ring::capacity()
+{
+    return m_capacity;
+}
+
+void Spsc_Ring::reset()
+{
+    m_writePos.store(0, std::memory_order_relaxed);
+    m_readPos.store(0, std::memory_order_relaxed);
+}
+
+} // namespace astreamer
@@ -0,0 +1,57 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_SPSC_RING_H
+#define ASTREAMER_SPSC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace astreamer {
+
+/*
+ * Lock-free single producer, single consumer byte ring. One thread
+ * may write while another one reads; the positions are published
+ * with release/acquire ordering, so the bytes written before a
+ * position update are visible to the other side.
+ */
+class Spsc_Ring {
+public:
+    Spsc_Ring(size_t capacity);
+    ~Spsc_Ring();
+
+    /* producer */
+    size_t write(const void *data, size_t numBytes);
+    size_t writeAvailable();
+
+    /* consumer */
+    size_t read(void *data, size_t numBytes);
+    size_t readRegion(const void **data);
+    void readAdvance(size_t numBytes);
+    size_t readAvailable();
+
+    size_t capacity();
+    void reset();
+
+private:
+    Spsc_Ring(const Spsc_Ring&);
+    Spsc_Ring& operator=(const Spsc_Ring&);
+
+    uint8_t *m_data;
+    size_t m_capacity;                  // a power of two
+    size_t m_mask;
+
+    std::atomic<size_t> m_writePos;     // free running, written by the producer
+    std::atomic<size_t> m_readPos;      // free running, written by the consumer
+};
+
+} // namespace astreamer
+
+#endif // ASTREAMER_SPSC_RING_H
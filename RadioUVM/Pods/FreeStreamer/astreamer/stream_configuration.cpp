@@ -11,7 +11,21 @@
 namespace astreamer {
     
 Stream_Configuration::Stream_Configuration() :
-    userAgent(NULL)
+    socketReceiveBufferSize(0),
+    outputSampleFormat(SAMPLE_FORMAT_INT16),
+    maxReconnectCount(5),
+    reconnectDelayMs(500),
+    maxReconnectDelayMs(8000),
+    connectTimeoutMs(15000),
+    readTimeoutMs(30000),
+    startupBufferMs(2000),
+    lowWatermarkMs(1000),
+    refillWatermarkMs(15000),
+    highWatermarkMs(30000),
+    userAgent(NULL),
+    backgroundDecoding(false),
+    icyMetaDataFields(NULL),
+    icyMetaDataRefreshInterval(0)
 {
 }
 
@@ -20,6 +34,9 @@ Stream_Configuration::~Stream_Configuration()
     if (userAgent) {
         CFRelease(userAgent), userAgent = NULL;
     }
+    if (icyMetaDataFields) {
+        CFRelease(icyMetaDataFields), icyMetaDataFields = NULL;
+    }
 }
 
 Stream_Configuration* Stream_Configuration::configuration()
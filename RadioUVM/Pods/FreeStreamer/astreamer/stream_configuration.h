@@ -13,22 +13,41 @@
 
 namespace astreamer {
     
+enum Sample_Format {
+    SAMPLE_FORMAT_INT16 = 0,    // 16-bit signed integer PCM
+    SAMPLE_FORMAT_FLOAT32 = 1   // 32-bit floating point PCM
+};
+    
 struct Stream_Configuration {
     unsigned bufferCount;
     unsigned bufferSize;
     unsigned maxPacketDescs;
     unsigned decodeQueueSize;
     unsigned httpConnectionBufferSize;
+    int socketReceiveBufferSize;     // SO_RCVBUF of Socket_Stream; 0 keeps the system default
     double outputSampleRate;
     long outputNumChannels;
+    Sample_Format outputSampleFormat;
     int bounceInterval;
     int maxBounceCount;
     int startupWatchdogPeriod;
+    int maxReconnectCount;           // reconnects of a dropped stream before it fails; 0 disables them
+    int reconnectDelayMs;            // the delay of the first reconnect, doubled for each next one
+    int maxReconnectDelayMs;
+    int connectTimeoutMs;            // Socket_Stream: resolving and connecting fail after this; 0 waits forever
+    int readTimeoutMs;               // Socket_Stream: a connection without data for this long fails; 0 waits forever
     int maxPrebufferedByteCount;
+    int startupBufferMs;
+    int lowWatermarkMs;
+    int refillWatermarkMs;           // the input paused at the high watermark resumes below this
+    int highWatermarkMs;
     CFStringRef userAgent;
     CFStringRef cacheDirectory;
     bool cacheEnabled;
     int maxDiskCacheSize;
+    bool backgroundDecoding;
+    CFArrayRef icyMetaDataFields;
+    int icyMetaDataRefreshInterval;
     
     static Stream_Configuration *configuration();
     
@@ -0,0 +1,256 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#include "stream_recorder.h"
+#include "file_output.h"
+#include "http_stream.h"
+#include "socket_stream.h"
+
+#include <stdio.h>
+#include <string.h>
+
+//#define SR_DEBUG 1
+
+#if !defined (SR_DEBUG)
+#define SR_TRACE(...) do {} while (0)
+#else
+#define SR_TRACE(...) printf(__VA_ARGS__)
+#endif
+
+namespace astreamer {
+
+Stream_Recorder::Stream_Recorder(Event_Loop *eventLoop) :
+    m_delegate(0),
+    m_eventLoop(eventLoop),
+    m_inputStream(0),
+    m_fileOutput(0),
+    m_recording(false),
+    m_inputStreamRunning(false),
+    m_reconnectTimer(0)
+{
+    memset(&m_stats, 0, sizeof m_stats);
+}
+    
+Stream_Recorder::~Stream_Recorder()
+{
+    stop();
+    
+    m_eventLoop->cancel(this);
+    
+    if (m_inputStream) {
+        m_inputStream->m_delegate = 0;
+        delete m_inputStream, m_inputStream = 0;
+    }
+    if (m_fileOutput) {
+        delete m_fileOutput, m_fileOutput = 0;
+    }
+}
+    
+void Stream_Recorder::setUrl(CFURLRef url)
+{
+    stop();
+    
+    if (m_inputStream) {
+        delete m_inputStream, m_inputStream = 0;
+    }
+    
+    if (!m_eventLoop->runsRunLoop() && Socket_Stream::canHandleUrl(url)) {
+        m_inputStream = new Socket_Stream(m_eventLoop);
+    } else if (HTTP_Stream::canHandleUrl(url)) {
+        m_inputStream = new HTTP_Stream(m_eventLoop);
+    }
+    
+    if (m_inputStream) {
+        m_inputStream->m_delegate = this;
+        m_inputStream->setUrl(url);
+    }
+}
+    
+void Stream_Recorder::setOutputFile(CFURLRef url)
+{
+    if (m_fileOutput) {
+        delete m_fileOutput, m_fileOutput = 0;
+    }
+    if (url) {
+        m_fileOutput = new File_Output(url);
+        m_fileOutput->setSyncPolicy(File_Output::SYNC_ON_CLOSE);
+        
+        // Waiting for a slow disk would hold up all the recorders on the loop
+        m_fileOutput->setQueuePolicy(File_Output::SKIP_WHEN_FULL);
+    }
+}
+    
+bool Stream_Recorder::start()
+{
+    if (m_recording) {
+        return true;
+    }
+    if (!m_inputStream) {
+        return false;
+    }
+    
+    m_recording = true;
+    
+    if (m_inputStream->open()) {
+        m_inputStreamRunning = true;
+    } else {
+        m_stats.errors++;
+        scheduleReconnect();
+    }
+    return true;
+}
+    
+void Stream_Recorder::stop()
+{
+    m_recording = false;
+    
+    if (m_reconnectTimer) {
+        m_eventLoop->stopTimer(m_reconnectTimer);
+        m_reconnectTimer = 0;
+    }
+    if (m_inputStreamRunning) {
+        m_inputStream->close();
+        m_inputStreamRunning = false;
+    }
+}
+    
+bool Stream_Recorder::isRecording()
+{
+    return m_recording;
+}
+    
+Stream_Recorder_Stats Stream_Recorder::stats()
+{
+    Stream_Recorder_Stats stats = m_stats;
+    
+    if (m_fileOutput) {
+        const File_Output_Stats outputStats = m_fileOutput->stats();
+        
+        stats.bytesSkipped = outputStats.bytesSkipped;
+        stats.maxWriteLatency = outputStats.maxWriteLatency;
+    }
+    return stats;
+}
+    
+void Stream_Recorder::streamIsReadyRead()
+{
+    SR_TRACE("%s\n", __PRETTY_FUNCTION__);
+}
+    
+void Stream_Recorder::streamHasBytesAvailable(UInt8 *data, UInt32 numBytes)
+{
+    if (!m_inputStreamRunning) {
+        SR_TRACE("%s: stray callback detected!\n", __PRETTY_FUNCTION__);
+        return;
+    }
+    
+    m_stats.bytesReceived += numBytes;
+    
+    if (m_fileOutput) {
+        CFIndex written = m_fileOutput->write(data, numBytes);
+    
+        if (written > 0) {
+            m_stats.bytesWritten += written;
+        } else if (m_fileOutput->failed()) {
+            SR_TRACE("%s: writing the output file failed\n", __PRETTY_FUNCTION__);
+    
+            // Out of space, for example; reconnecting would not help
+            m_stats.errors++;
+    
+            stop();
+    
+            if (m_delegate) {
+                m_delegate->streamRecorderErrorOccurred(this);
+            }
+        }
+    }
+}
+    
+void Stream_Recorder::streamEndEncountered()
+{
+    SR_TRACE("%s\n", __PRETTY_FUNCTION__);
+    
+    if (!m_inputStreamRunning) {
+        SR_TRACE("%s: stray callback detected!\n", __PRETTY_FUNCTION__);
+        return;
+    }
+    
+    m_inputStream->close();
+    m_inputStreamRunning = false;
+    
+    if (m_inputStream->contentLength() == 0) {
+        // A live stream has no end; the server dropped it
+        scheduleReconnect();
+        return;
+    }
+    
+    m_recording = false;
+    
+    if (m_delegate) {
+        m_delegate->streamRecorderEndEncountered(this);
+    }
+}
+    
+void Stream_Recorder::streamErrorOccurred()
+{
+    SR_TRACE("%s\n", __PRETTY_FUNCTION__);
+    
+    if (!m_inputStreamRunning) {
+        SR_TRACE("%s: stray callback detected!\n", __PRETTY_FUNCTION__);
+        return;
+    }
+    
+    m_inputStream->close();
+    m_inputStreamRunning = false;
+    
+    m_stats.errors++;
+    
+    scheduleReconnect();
+}
+    
+void Stream_Recorder::streamMetaDataAvailable(Meta_Data&& metaData)
+{
+    m_stats.metaDataUpdates++;
+    
+    if (m_delegate) {
+        m_delegate->streamRecorderMetaDataAvailable(this, std::move(metaData));
+    }
+}
+    
+/* private */
+    
+void Stream_Recorder::scheduleReconnect()
+{
+    if (m_recording && !m_reconnectTimer) {
+        m_reconnectTimer = m_eventLoop->startTimer(kReconnectDelayMs, false, reconnectTask, this, 0);
+    }
+}
+    
+void Stream_Recorder::reconnectTask(void *info, intptr_t arg)
+{
+    Stream_Recorder *THIS = (Stream_Recorder *)info;
+    
+    THIS->m_reconnectTimer = 0;
+    
+    if (!THIS->m_recording) {
+        return;
+    }
+    
+    SR_TRACE("reconnecting\n");
+    
+    THIS->m_stats.reconnects++;
+    
+    if (THIS->m_inputStream->open()) {
+        THIS->m_inputStreamRunning = true;
+    } else {
+        THIS->m_stats.errors++;
+        THIS->scheduleReconnect();
+    }
+}
+    
+} // namespace astreamer
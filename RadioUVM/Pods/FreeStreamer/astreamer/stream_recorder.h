@@ -0,0 +1,97 @@
+/*
+ * This file is part of the FreeStreamer project,
+ * (C)Copyright 2011-2014 Matias Muhonen <mmu@iki.fi>
+ * See the file ''LICENSE'' for using the code.
+ *
+ * https://github.com/muhku/FreeStreamer
+ */
+
+#ifndef ASTREAMER_STREAM_RECORDER_H
+#define ASTREAMER_STREAM_RECORDER_H
+
+#include "input_stream.h"
+#include "event_loop.h"
+
+namespace astreamer {
+
+class Stream_Recorder_Delegate;
+class File_Output;
+    
+struct Stream_Recorder_Stats {
+    UInt64 bytesReceived;       // the stream bytes, without the ICY metadata
+    UInt64 bytesWritten;
+    UInt64 bytesSkipped;        // the disk was too far behind
+    double maxWriteLatency;     // seconds
+    unsigned reconnects;
+    unsigned errors;            // the stream and the output file
+    unsigned metaDataUpdates;
+};
+    
+/*
+ * Records a stream to a file without decoding it: the input stream
+ * demuxes the ICY metadata and the bytes go straight to the file output.
+ * There is no audio queue or decode thread, so any number of recorders
+ * can share one event loop. The file outputs share their writer threads,
+ * and skip what a slow disk can't keep up with rather than hold up the
+ * loop. A live stream is reconnected when it fails or ends; a stream of
+ * a known length is recorded once.
+ */
+class Stream_Recorder : public Input_Stream_Delegate {
+public:
+    Stream_Recorder_Delegate *m_delegate;
+    
+    /* Runs on the event loop, which must outlive the recorder */
+    Stream_Recorder(Event_Loop *eventLoop);
+    virtual ~Stream_Recorder();
+    
+    void setUrl(CFURLRef url);
+    void setOutputFile(CFURLRef url);
+    
+    bool start();
+    void stop();
+    bool isRecording();
+    
+    Stream_Recorder_Stats stats();
+    
+    /* Input_Stream_Delegate */
+    void streamIsReadyRead();
+    void streamHasBytesAvailable(UInt8 *data, UInt32 numBytes);
+    void streamEndEncountered();
+    void streamErrorOccurred();
+    void streamMetaDataAvailable(Meta_Data&& metaData);
+    
+private:
+    
+    Stream_Recorder(const Stream_Recorder&);
+    Stream_Recorder& operator=(const Stream_Recorder&);
+    
+    enum {
+        kReconnectDelayMs = 2000
+    };
+    
+    Event_Loop *m_eventLoop;
+    Input_Stream *m_inputStream;
+    File_Output *m_fileOutput;
+    
+    bool m_recording;
+    bool m_inputStreamRunning;
+    unsigned m_reconnectTimer;
+    
+    Stream_Recorder_Stats m_stats;
+    
+    void scheduleReconnect();
+    
+    static void reconnectTask(void *info, intptr_t arg);
+};
+    
+class Stream_Recorder_Delegate {
+public:
+    virtual void streamRecorderMetaDataAvailable(Stream_Recorder *recorder, Meta_Data&& metaData) = 0;
+    virtual void streamRecorderEndEncountered(Stream_Recorder *recorder) = 0;
+    /* Writing the output file failed, the recording is stopped */
+    virtual void streamRecorderErrorOccurred(Stream_Recorder *recorder) = 0;
+};
+    
+} // namespace astreamer
+
+#endif // ASTREAMER_STREAM_RECORDER_H
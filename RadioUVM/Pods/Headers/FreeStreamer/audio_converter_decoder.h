@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/audio_converter_decoder.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/cache_index.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/epoll_event_loop.h
\ No newline at end of file
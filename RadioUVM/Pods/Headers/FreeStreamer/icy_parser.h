@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/icy_parser.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/packet_queue.h
\ No newline at end of file
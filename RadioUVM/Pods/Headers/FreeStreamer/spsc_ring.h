@@ -0,0 +1 @@
+../../FreeStreamer/astreamer/spsc_ring.h
\ No newline at end of file
@@ -0,0 +1,372 @@
+//
+//  FileOutputTests.mm
+//  RadioUVMTests
+//
+//  The batched writer against a stand-in for a slow disk, which takes a
+//  fixed time for every write call: the writes are batched into far fewer
+//  calls than the caller makes, nothing is dropped unless the output asks
+//  for it, the outputs share the writer threads, and a failed disk is
+//  reported instead of waited for.
+//
+
+#import <XCTest/XCTest.h>
+
+#include "file_output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace astreamer;
+
+enum {
+    kWriteSize = 4096,              // a typical read of the network
+    kFileSize = 2 * 1024 * 1024,
+    kDiskLatencyUs = 2000           // for every write call
+};
+
+static std::string temporaryPath(const char *name)
+{
+    const char *tmp = (getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp/");
+    std::string path(tmp);
+
+    if (path[path.size() - 1] != '/') {
+        path += '/';
+    }
+    return path + name;
+}
+
+static CFURLRef createFileUrl(const std::string& path)
+{
+    std::string url = "file://" + path;
+
+    CFStringRef urlString = CFStringCreateWithCString(kCFAllocatorDefault, url.c_str(), kCFStringEncodingUTF8);
+    CFURLRef urlRef = CFURLCreateWithString(kCFAllocatorDefault, urlString, NULL);
+
+    CFRelease(urlString);
+
+    return urlRef;
+}
+
+static std::vector<UInt8> fileContents(size_t length)
+{
+    std::vector<UInt8> contents(length);
+    unsigned seed = 3;
+
+    for (size_t i = 0; i < contents.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        contents[i] = (UInt8)(seed >> 16);
+    }
+    return contents;
+}
+
+static std::vector<UInt8> readFile(const std::string& path)
+{
+    std::vector<UInt8> contents;
+
+    FILE *f = fopen(path.c_str(), "rb");
+
+    if (!f) {
+        return contents;
+    }
+
+    UInt8 buf[65536];
+    size_t n;
+
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        contents.insert(contents.end(), buf, buf + n);
+    }
+
+    fclose(f);
+
+    return contents;
+}
+
+/* Takes kDiskLatencyUs for every write, or fails them all with ENOSPC */
+class Slow_Disk_Output : public File_Output {
+public:
+    unsigned m_writeCalls;
+    bool m_full;
+
+    Slow_Disk_Output(CFURLRef fileURL) :
+        File_Output(fileURL),
+        m_writeCalls(0),
+        m_full(false)
+    {
+    }
+
+    ~Slow_Disk_Output()
+    {
+        flush(true);
+    }
+
+protected:
+    ssize_t writeAt(const UInt8 *data, size_t length, UInt64 offset)
+    {
+        m_writeCalls++;
+
+        usleep(kDiskLatencyUs);
+
+        if (m_full) {
+            errno = ENOSPC;
+            return -1;
+        }
+        return File_Output::writeAt(data, length, offset);
+    }
+};
+
+/* The writes of the former File_Output: on the caller's thread, as they come */
+static unsigned writeDirectly(const std::string& path, const std::vector<UInt8>& contents)
+{
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    unsigned writeCalls = 0;
+
+    for (size_t offset = 0; offset < contents.size(); offset += kWriteSize) {
+        usleep(kDiskLatencyUs);
+
+        write(fd, &contents[offset], kWriteSize);
+        writeCalls++;
+    }
+
+    close(fd);
+
+    return writeCalls;
+}
+
+@interface FileOutputTests : XCTestCase
+
+@end
+
+@implementation FileOutputTests
+
+- (void)testBatchedWritesOnASlowDisk
+{
+    const std::vector<UInt8> contents = fileContents(kFileSize);
+    const std::string path = temporaryPath("file-output-test.bin");
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+    const unsigned directCalls = writeDirectly(path, contents);
+
+    const double directTime = CFAbsoluteTimeGetCurrent() - start;
+
+    XCTAssertTrue(readFile(path) == contents);
+
+    CFURLRef url = createFileUrl(path);
+
+    Slow_Disk_Output *output = new Slow_Disk_Output(url);
+
+    CFRelease(url);
+
+    double maxCallerLatency = 0;
+
+    start = CFAbsoluteTimeGetCurrent();
+
+    for (size_t offset = 0; offset < contents.size(); offset += kWriteSize) {
+        const CFAbsoluteTime writeStart = CFAbsoluteTimeGetCurrent();
+
+        XCTAssertEqual(output->write(&contents[offset], kWriteSize), (CFIndex)kWriteSize);
+
+        maxCallerLatency = std::max(maxCallerLatency, CFAbsoluteTimeGetCurrent() - writeStart);
+    }
+
+    XCTAssertTrue(output->flush(true));
+
+    const double batchedTime = CFAbsoluteTimeGetCurrent() - start;
+
+    const File_Output_Stats stats = output->stats();
+    const unsigned batchedCalls = output->m_writeCalls;
+
+    delete output;
+
+    NSLog(@"%u KB to a disk of %u us per write: direct %u writes in %.3f s, batched %u writes in %.3f s, max %.1f ms in write()",
+          kFileSize / 1024,
+          kDiskLatencyUs,
+          directCalls,
+          directTime,
+          batchedCalls,
+          batchedTime,
+          maxCallerLatency * 1000);
+
+    XCTAssertTrue(readFile(path) == contents);
+    XCTAssertEqual(stats.bytesWritten, (UInt64)kFileSize);
+    XCTAssertEqual(stats.bytesSkipped, (UInt64)0);
+
+    // 64 kB blocks instead of 4 kB writes
+    XCTAssertLessThanOrEqual(batchedCalls * 16, directCalls);
+    XCTAssertLessThan(batchedTime * 4, directTime);
+
+    unlink(path.c_str());
+}
+
+- (void)testFullQueueWaitsForTheDisk
+{
+    const std::vector<UInt8> contents = fileContents(kFileSize);
+    const std::string path = temporaryPath("file-output-test.bin");
+
+    CFURLRef url = createFileUrl(path);
+
+    Slow_Disk_Output *output = new Slow_Disk_Output(url);
+
+    CFRelease(url);
+
+    // Whole blocks at once, so the caller outruns the disk and fills the queue
+    for (size_t offset = 0; offset < contents.size(); offset += 65536) {
+        XCTAssertEqual(output->write(&contents[offset], 65536), (CFIndex)65536);
+    }
+
+    XCTAssertTrue(output->flush(true));
+
+    const File_Output_Stats stats = output->stats();
+
+    delete output;
+
+    XCTAssertEqual(stats.bytesSkipped, (UInt64)0);
+    XCTAssertLessThanOrEqual(stats.maxQueuedBlocks, (unsigned)16);
+
+    XCTAssertTrue(readFile(path) == contents);
+
+    unlink(path.c_str());
+}
+
+- (void)testSkipsWhenFullOnlyWhenAsked
+{
+    const std::vector<UInt8> contents = fileContents(kFileSize);
+    const std::string path = temporaryPath("file-output-test.bin");
+
+    CFURLRef url = createFileUrl(path);
+
+    Slow_Disk_Output *output = new Slow_Disk_Output(url);
+    output->setQueuePolicy(File_Output::SKIP_WHEN_FULL);
+
+    CFRelease(url);
+
+    std::vector<bool> accepted;
+    double maxCallerLatency = 0;
+
+    for (size_t offset = 0; offset < contents.size(); offset += 65536) {
+        const CFAbsoluteTime writeStart = CFAbsoluteTimeGetCurrent();
+
+        accepted.push_back(output->write(&contents[offset], 65536) == 65536);
+
+        maxCallerLatency = std::max(maxCallerLatency, CFAbsoluteTimeGetCurrent() - writeStart);
+    }
+
+    XCTAssertTrue(output->flush(true));
+
+    const File_Output_Stats stats = output->stats();
+
+    delete output;
+
+    XCTAssertGreaterThan(stats.bytesSkipped, (UInt64)0);
+    XCTAssertEqual(stats.bytesWritten + stats.bytesSkipped, (UInt64)kFileSize);
+
+    // Never waited for a disk write
+    XCTAssertLessThan(maxCallerLatency, kDiskLatencyUs / 1e6);
+
+    // The accepted bytes are where they belong, the skipped ones are holes
+    const std::vector<UInt8> written = readFile(path);
+
+    for (size_t block = 0; block < accepted.size(); block++) {
+        if (!accepted[block] || written.size() < (block + 1) * 65536) {
+            continue;
+        }
+        XCTAssertTrue(memcmp(&written[block * 65536], &contents[block * 65536], 65536) == 0);
+    }
+
+    unlink(path.c_str());
+}
+
+- (void)testOutputsShareTheWriters
+{
+    enum {
+        kOutputs = 32,
+        kOutputSize = 256 * 1024
+    };
+
+    const std::vector<UInt8> contents = fileContents(kOutputs * kOutputSize);
+
+    std::vector<Slow_Disk_Output *> outputs;
+
+    for (unsigned i = 0; i < kOutputs; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "file-output-test-%u.bin", i);
+
+        CFURLRef url = createFileUrl(temporaryPath(name));
+
+        outputs.push_back(new Slow_Disk_Output(url));
+
+        CFRelease(url);
+    }
+
+    // Interleaved, so that all the outputs have blocks queued at once
+    for (size_t offset = 0; offset < kOutputSize; offset += kWriteSize) {
+        for (unsigned i = 0; i < kOutputs; i++) {
+            XCTAssertEqual(outputs[i]->write(&contents[i * kOutputSize + offset], kWriteSize), (CFIndex)kWriteSize);
+        }
+    }
+
+    for (unsigned i = 0; i < kOutputs; i++) {
+        XCTAssertTrue(outputs[i]->flush(true));
+
+        delete outputs[i];
+    }
+
+    for (unsigned i = 0; i < kOutputs; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "file-output-test-%u.bin", i);
+
+        const std::string path = temporaryPath(name);
+        const std::vector<UInt8> expected(contents.begin() + i * kOutputSize, contents.begin() + (i + 1) * kOutputSize);
+
+        XCTAssertTrue(readFile(path) == expected);
+
+        unlink(path.c_str());
+    }
+}
+
+- (void)testFailedDiskIsReported
+{
+    const std::vector<UInt8> contents = fileContents(kFileSize);
+    const std::string path = temporaryPath("file-output-test.bin");
+
+    CFURLRef url = createFileUrl(path);
+
+    Slow_Disk_Output *output = new Slow_Disk_Output(url);
+    output->m_full = true;
+
+    CFRelease(url);
+
+    size_t offset = 0;
+
+    // A waiting write must not wait for a disk which has failed
+    for (; offset < contents.size(); offset += 65536) {
+        if (output->write(&contents[offset], 65536) < 0) {
+            break;
+        }
+    }
+
+    XCTAssertLessThan(offset, contents.size());
+    XCTAssertTrue(output->failed());
+    XCTAssertFalse(output->flush(true));
+
+    delete output;
+
+    unlink(path.c_str());
+
+    // A file which can't be opened has failed from the start
+    url = createFileUrl(temporaryPath("no-such-directory/file-output-test.bin"));
+
+    File_Output unopened(url);
+
+    CFRelease(url);
+
+    XCTAssertTrue(unopened.failed());
+    XCTAssertEqual(unopened.write(&contents[0], kWriteSize), (CFIndex)-1);
+}
+
+@end
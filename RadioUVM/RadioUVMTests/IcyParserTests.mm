@@ -0,0 +1,240 @@
+//
+//  IcyParserTests.mm
+//  RadioUVMTests
+//
+//  The span based ICY demuxer against the byte by byte loop it replaced:
+//  the audio must come out the same, and faster.
+//
+
+#import <XCTest/XCTest.h>
+
+#include "icy_parser.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace astreamer;
+
+enum {
+    kMetaDataInterval = 16000,  // the icy-metaint of most Shoutcast servers
+    kCaptureIntervals = 512     // about 8 MB of audio
+};
+
+/*
+ * A body in the Shoutcast wire format: kMetaDataInterval bytes of audio,
+ * then a length byte and the metadata block. Like a real server, the
+ * title is sent when it changes and empty blocks are sent in between.
+ */
+static void buildCapture(std::vector<UInt8> *capture, std::vector<UInt8> *audio)
+{
+    unsigned seed = 1;
+    unsigned title = 0;
+
+    for (unsigned i = 0; i < kCaptureIntervals; i++) {
+        for (unsigned j = 0; j < kMetaDataInterval; j++) {
+            seed = seed * 1103515245 + 12345;
+
+            const UInt8 byte = (UInt8)(seed >> 16);
+
+            capture->push_back(byte);
+            audio->push_back(byte);
+        }
+
+        if (i % 8 != 0) {
+            capture->push_back(0);
+            continue;
+        }
+
+        char text[256];
+        int length = snprintf(text, sizeof(text), "StreamTitle='Artist %u - Title %u';StreamUrl='';", title, title);
+        title++;
+
+        const size_t blocks = (length + 15) / 16;
+
+        capture->push_back((UInt8)blocks);
+        capture->insert(capture->end(), (const UInt8 *)text, (const UInt8 *)text + length);
+        capture->insert(capture->end(), blocks * 16 - length, 0);
+    }
+}
+
+/* The demuxing part of the former HTTP_Stream::parseICYStream() */
+class Byte_Loop_Demuxer {
+public:
+    size_t m_metaDataInterval;
+    size_t m_dataByteReadCount;
+    size_t m_metaDataBytesRemaining;
+    std::vector<UInt8> m_metaData;
+    unsigned m_metaDataBlocks;
+
+    Byte_Loop_Demuxer() :
+        m_metaDataInterval(kMetaDataInterval),
+        m_dataByteReadCount(0),
+        m_metaDataBytesRemaining(0),
+        m_metaDataBlocks(0)
+    {
+    }
+
+    size_t demux(const UInt8 *buf, size_t bufSize, UInt8 *readBuffer)
+    {
+        size_t i = 0;
+
+        for (size_t offset = 0; offset < bufSize; offset++) {
+            if (m_metaDataBytesRemaining > 0) {
+                m_metaDataBytesRemaining--;
+
+                if (m_metaDataBytesRemaining == 0) {
+                    m_dataByteReadCount = 0;
+
+                    if (!m_metaData.empty()) {
+                        m_metaDataBlocks++;
+                    }
+                    m_metaData.clear();
+                    continue;
+                }
+
+                m_metaData.push_back(buf[offset]);
+                continue;
+            }
+
+            if (m_metaDataInterval > 0 && m_dataByteReadCount == m_metaDataInterval) {
+                m_metaDataBytesRemaining = buf[offset] * 16;
+
+                if (m_metaDataBytesRemaining == 0) {
+                    m_dataByteReadCount = 0;
+                }
+                continue;
+            }
+
+            m_dataByteReadCount++;
+            readBuffer[i++] = buf[offset];
+        }
+        return i;
+    }
+};
+
+class Counting_Delegate : public ICY_Parser_Delegate {
+public:
+    unsigned m_count;
+
+    Counting_Delegate() : m_count(0) {}
+
+    void icyMetaDataAvailable(Meta_Data&& metaData)
+    {
+        m_count++;
+    }
+};
+
+@interface IcyParserTests : XCTestCase
+
+@end
+
+@implementation IcyParserTests
+
+- (void)testDemuxMatchesTheByteLoop
+{
+    std::vector<UInt8> capture, audio;
+    buildCapture(&capture, &audio);
+
+    ICY_Parser parser;
+    Counting_Delegate delegate;
+    parser.m_delegate = &delegate;
+    parser.setMetaDataInterval(kMetaDataInterval);
+
+    Byte_Loop_Demuxer byteLoop;
+
+    std::vector<UInt8> spanAudio, byteLoopAudio;
+    std::vector<UInt8> read(8192), readBuffer(8192);
+
+    unsigned seed = 7;
+    size_t offset = 0;
+
+    // Reads of random sizes, from single bytes to whole network buffers
+    while (offset < capture.size()) {
+        seed = seed * 1103515245 + 12345;
+
+        size_t n = 1 + ((seed >> 16) % (seed & 1 ? 16 : read.size()));
+
+        if (n > capture.size() - offset) {
+            n = capture.size() - offset;
+        }
+
+        memcpy(&read[0], &capture[offset], n);
+
+        UInt8 *audioData;
+        size_t audioBytes = parser.demux(&read[0], n, &audioData);
+
+        spanAudio.insert(spanAudio.end(), audioData, audioData + audioBytes);
+
+        audioBytes = byteLoop.demux(&capture[offset], n, &readBuffer[0]);
+
+        byteLoopAudio.insert(byteLoopAudio.end(), &readBuffer[0], &readBuffer[0] + audioBytes);
+
+        offset += n;
+    }
+
+    XCTAssertEqual(spanAudio.size(), audio.size());
+    XCTAssertTrue(spanAudio == audio);
+    XCTAssertTrue(spanAudio == byteLoopAudio);
+
+    // Every title changed, so every one of them is delivered
+    XCTAssertEqual(delegate.m_count, (unsigned)(kCaptureIntervals / 8));
+    XCTAssertEqual(byteLoop.m_metaDataBlocks, (unsigned)(kCaptureIntervals / 8));
+}
+
+- (void)testDemuxThroughput
+{
+    std::vector<UInt8> capture, audio;
+    buildCapture(&capture, &audio);
+
+    const size_t kReadSize = 1024;     // a typical read of a mobile connection
+    const unsigned kPasses = 4;
+
+    std::vector<UInt8> read(kReadSize), readBuffer(kReadSize);
+    size_t checksum = 0;
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+    for (unsigned pass = 0; pass < kPasses; pass++) {
+        Byte_Loop_Demuxer byteLoop;
+
+        for (size_t offset = 0; offset < capture.size(); offset += kReadSize) {
+            const size_t n = std::min(kReadSize, capture.size() - offset);
+
+            checksum += byteLoop.demux(&capture[offset], n, &readBuffer[0]);
+        }
+    }
+
+    const double byteLoopTime = CFAbsoluteTimeGetCurrent() - start;
+
+    start = CFAbsoluteTimeGetCurrent();
+
+    for (unsigned pass = 0; pass < kPasses; pass++) {
+        ICY_Parser parser;
+        parser.setMetaDataInterval(kMetaDataInterval);
+
+        for (size_t offset = 0; offset < capture.size(); offset += kReadSize) {
+            const size_t n = std::min(kReadSize, capture.size() - offset);
+
+            // The HTTP read buffer is refilled for every read
+            memcpy(&read[0], &capture[offset], n);
+
+            UInt8 *audioData;
+            checksum += parser.demux(&read[0], n, &audioData);
+        }
+    }
+
+    const double spanTime = CFAbsoluteTimeGetCurrent() - start;
+
+    const double megabytes = kPasses * capture.size() / (1024.0 * 1024.0);
+
+    NSLog(@"ICY demux, %zu byte reads: byte loop %.0f MB/s, spans %.0f MB/s (%zu)",
+          kReadSize,
+          megabytes / byteLoopTime,
+          megabytes / spanTime,
+          checksum);
+
+    XCTAssertEqual(checksum, 2 * kPasses * audio.size());
+    XCTAssertLessThan(spanTime * 2, byteLoopTime);
+}
+
+@end
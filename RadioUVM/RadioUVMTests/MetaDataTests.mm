@@ -0,0 +1,182 @@
+//
+//  MetaDataTests.mm
+//  RadioUVMTests
+//
+//  The metadata record is moved, not copied, from the parsers through the
+//  stream delegates: the hops must not allocate and every field the record
+//  takes over must be released exactly once.
+//
+
+#import <XCTest/XCTest.h>
+
+#include "meta_data.h"
+
+using namespace astreamer;
+
+typedef struct {
+    unsigned allocations;
+    unsigned deallocations;
+} allocation_counts_t;
+
+static void *countingAllocate(CFIndex size, CFOptionFlags hint, void *info)
+{
+    ((allocation_counts_t *)info)->allocations++;
+    return malloc(size);
+}
+
+static void *countingReallocate(void *ptr, CFIndex size, CFOptionFlags hint, void *info)
+{
+    return realloc(ptr, size);
+}
+
+static void countingDeallocate(void *ptr, void *info)
+{
+    ((allocation_counts_t *)info)->deallocations++;
+    free(ptr);
+}
+
+static CFAllocatorRef createCountingAllocator(allocation_counts_t *counts)
+{
+    CFAllocatorContext context;
+    memset(&context, 0, sizeof(context));
+    context.info = counts;
+    context.allocate = countingAllocate;
+    context.reallocate = countingReallocate;
+    context.deallocate = countingDeallocate;
+
+    return CFAllocatorCreate(kCFAllocatorDefault, &context);
+}
+
+/* Long and not ASCII, so CF can't hand out a tagged pointer instead of an object */
+static CFStringRef createValue(unsigned n)
+{
+    char text[64];
+    snprintf(text, sizeof(text), "Mot\xC3\xB6rhead \xE2\x80\x93 Ace of Spades (%u)", n);
+
+    return CFStringCreateWithCString(kCFAllocatorDefault, text, kCFStringEncodingUTF8);
+}
+
+static CFStringRef createKey(const char *name)
+{
+    return Meta_Data::createKey((const UInt8 *)name, strlen(name), kCFStringEncodingUTF8);
+}
+
+/* The delegate chain: ICY_Parser -> HTTP_Stream -> Caching_Stream -> Audio_Stream -> owner */
+static void deliver(Meta_Data&& metaData, unsigned hops, Meta_Data *owner)
+{
+    if (hops == 0) {
+        *owner = std::move(metaData);
+        return;
+    }
+
+    Meta_Data local(std::move(metaData));
+
+    deliver(std::move(local), hops - 1, owner);
+}
+
+@interface MetaDataTests : XCTestCase
+
+@end
+
+@implementation MetaDataTests
+
+- (void)testTheRecordIsMovedWithoutAllocating
+{
+    allocation_counts_t counts = { 0, 0 };
+
+    CFAllocatorRef previousAllocator = (CFAllocatorRef)CFRetain(CFAllocatorGetDefault());
+    CFAllocatorRef countingAllocator = createCountingAllocator(&counts);
+
+    CFAllocatorSetDefault(countingAllocator);
+
+    unsigned parsed;
+
+    {
+        Meta_Data owner;
+
+        for (unsigned i = 0; i < 100; i++) {
+            Meta_Data metaData;
+
+            // The well-known keys are shared, the unknown ones are created
+            metaData.set(createKey("StreamTitle"), createValue(i));
+            metaData.set(createKey("StreamGenre"), createValue(i));
+
+            parsed = counts.allocations;
+
+            deliver(std::move(metaData), 4, &owner);
+
+            XCTAssertEqual(counts.allocations, parsed);
+            XCTAssertTrue(metaData.empty());
+            XCTAssertEqual(owner.count(), (size_t)2);
+        }
+
+        XCTAssertGreaterThan(counts.allocations, (unsigned)0);
+        XCTAssertEqual(CFStringCompare(owner.keyAt(0), CFSTR("StreamTitle"), 0), kCFCompareEqualTo);
+    }
+
+    // Every string the records took over has been freed
+    XCTAssertEqual(counts.deallocations, counts.allocations);
+
+    CFAllocatorSetDefault(previousAllocator);
+    CFRelease(previousAllocator);
+    CFRelease(countingAllocator);
+}
+
+- (void)testFieldsAreReleasedOnce
+{
+    CFStringRef first = createValue(1);
+    CFStringRef second = createValue(2);
+    CFStringRef dropped = createValue(3);
+
+    // The test keeps a reference of its own to each value
+    CFRetain(first);
+    CFRetain(second);
+    CFRetain(dropped);
+
+    {
+        Meta_Data metaData;
+        metaData.set(CFSTR("StreamTitle"), first);
+
+        XCTAssertEqual(CFGetRetainCount(first), (CFIndex)2);
+
+        // An equal key replaces the field and releases the old value
+        metaData.set(createKey("StreamTitle"), second);
+
+        XCTAssertEqual(metaData.count(), (size_t)1);
+        XCTAssertEqual(metaData.value(CFSTR("StreamTitle")), second);
+        XCTAssertEqual(CFGetRetainCount(first), (CFIndex)1);
+
+        Meta_Data moved(std::move(metaData));
+
+        XCTAssertEqual(CFGetRetainCount(second), (CFIndex)2);
+
+        // A full record drops new fields
+        Meta_Data full;
+
+        for (unsigned i = 0; i < Meta_Data::kMaxFields; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), "Field%u", i);
+
+            full.set(createKey(name), createValue(i));
+        }
+
+        full.set(CFSTR("StreamUrl"), dropped);
+
+        XCTAssertEqual(full.count(), (size_t)Meta_Data::kMaxFields);
+        XCTAssertEqual(CFGetRetainCount(dropped), (CFIndex)1);
+
+        // Assigning over a record releases what it held
+        full = std::move(moved);
+
+        XCTAssertEqual(full.count(), (size_t)1);
+        XCTAssertEqual(CFGetRetainCount(second), (CFIndex)2);
+    }
+
+    XCTAssertEqual(CFGetRetainCount(second), (CFIndex)1);
+
+    CFRelease(first);
+    CFRelease(second);
+    CFRelease(dropped);
+}
+
+@end
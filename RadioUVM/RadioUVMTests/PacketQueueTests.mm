@@ -0,0 +1,209 @@
+//
+//  PacketQueueTests.mm
+//  RadioUVMTests
+//
+//  The packet queue accounting and a microbenchmark of its cost against
+//  the prebuffer size.
+//
+
+#import <XCTest/XCTest.h>
+
+#include "packet_queue.h"
+
+using namespace astreamer;
+
+enum {
+    kPacketSize = 417,          // a 128 kbit/s, 44.1 kHz MP3 frame
+    kFramesPerPacket = 1152,
+    kPacketsPerPush = 8         // about what a parser callback delivers
+};
+
+static void setUpFormat(Packet_Queue *queue)
+{
+    AudioStreamBasicDescription format;
+    memset(&format, 0, sizeof(format));
+    format.mSampleRate = 44100;
+    format.mFramesPerPacket = kFramesPerPacket;
+
+    queue->setFormat(format);
+}
+
+static void setUpPackets(UInt8 *data, AudioStreamPacketDescription *descs)
+{
+    for (UInt32 i = 0; i < kPacketsPerPush; i++) {
+        memset(data + i * kPacketSize, (int)i, kPacketSize);
+
+        descs[i].mStartOffset = i * kPacketSize;
+        descs[i].mDataByteSize = kPacketSize;
+        descs[i].mVariableFramesInPacket = 0;
+    }
+}
+
+/*
+ * Fills the queue to prebufferBytes and then keeps it there, pushing a
+ * batch and consuming one, querying the stats the stream asks for on
+ * every callback. Returns the nanoseconds per packet.
+ */
+static double steadyStateCost(size_t prebufferBytes, unsigned *allocationsAfterFill, unsigned *allocations)
+{
+    Packet_Queue queue;
+    setUpFormat(&queue);
+
+    UInt8 data[kPacketsPerPush * kPacketSize];
+    AudioStreamPacketDescription descs[kPacketsPerPush];
+    setUpPackets(data, descs);
+
+    while (queue.byteSize() < prebufferBytes) {
+        queue.push(kPacketsPerPush, data, descs);
+    }
+
+    *allocationsAfterFill = queue.allocationCount();
+
+    const unsigned kRounds = 100000;
+    size_t checksum = 0;
+
+    const CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+    for (unsigned i = 0; i < kRounds; i++) {
+        queue.push(kPacketsPerPush, data, descs);
+
+        const void *batch;
+        UInt32 numBytes;
+        AudioStreamPacketDescription *batchDescs;
+
+        UInt32 consumed = 0;
+        while (consumed < kPacketsPerPush) {
+            consumed += queue.consume(kPacketsPerPush - consumed, &batch, &numBytes, &batchDescs);
+        }
+        queue.releaseConsumed();
+
+        checksum += queue.count() + queue.byteSize() + (size_t)queue.duration();
+    }
+
+    const double elapsed = CFAbsoluteTimeGetCurrent() - start;
+
+    *allocations = queue.allocationCount();
+
+    return (checksum > 0 ? elapsed * 1e9 / (kRounds * kPacketsPerPush) : 0);
+}
+
+@interface PacketQueueTests : XCTestCase
+
+@end
+
+@implementation PacketQueueTests
+
+- (void)testAccountingFollowsPushAndConsume
+{
+    Packet_Queue queue;
+    setUpFormat(&queue);
+
+    UInt8 data[kPacketsPerPush * kPacketSize];
+    AudioStreamPacketDescription descs[kPacketsPerPush];
+    setUpPackets(data, descs);
+
+    XCTAssertTrue(queue.empty());
+
+    for (unsigned i = 0; i < 100; i++) {
+        XCTAssertTrue(queue.push(kPacketsPerPush, data, descs));
+    }
+
+    XCTAssertEqual(queue.count(), (size_t)(100 * kPacketsPerPush));
+    XCTAssertEqual(queue.byteSize(), (size_t)(100 * kPacketsPerPush * kPacketSize));
+    XCTAssertEqual((int)(queue.duration() * 1000), (int)(100 * kPacketsPerPush * kFramesPerPacket * 1000.0 / 44100));
+
+    const void *batch;
+    UInt32 numBytes;
+    AudioStreamPacketDescription *batchDescs;
+
+    UInt32 consumed = queue.consume(3, &batch, &numBytes, &batchDescs);
+
+    XCTAssertEqual(consumed, (UInt32)3);
+    XCTAssertEqual(numBytes, (UInt32)(3 * kPacketSize));
+    XCTAssertEqual(batchDescs[1].mStartOffset, (SInt64)kPacketSize);
+    XCTAssertEqual(((const UInt8 *)batch)[kPacketSize], (UInt8)1);
+    XCTAssertEqual(queue.count(), (size_t)(100 * kPacketsPerPush - 3));
+
+    queue.releaseConsumed();
+    queue.pop();
+
+    XCTAssertEqual(queue.count(), (size_t)(100 * kPacketsPerPush - 4));
+    XCTAssertEqual(queue.byteSize(), (size_t)((100 * kPacketsPerPush - 4) * kPacketSize));
+    XCTAssertEqual(queue.maxCount(), (size_t)(100 * kPacketsPerPush));
+
+    queue.clear();
+
+    XCTAssertTrue(queue.empty());
+    XCTAssertEqual(queue.byteSize(), (size_t)0);
+    XCTAssertEqual((int)queue.duration(), 0);
+    XCTAssertGreaterThan(queue.bytesAllocated(), (size_t)0);
+}
+
+- (void)testConstantBitRateBlocksAreSplit
+{
+    Packet_Queue queue;
+
+    AudioStreamBasicDescription format;
+    memset(&format, 0, sizeof(format));
+    format.mSampleRate = 44100;
+    format.mFramesPerPacket = 1;
+    format.mBytesPerPacket = 4;     // 16 bit stereo LPCM
+
+    queue.setFormat(format);
+
+    UInt8 block[4096];
+    for (unsigned i = 0; i < sizeof(block); i++) {
+        block[i] = (UInt8)i;
+    }
+
+    AudioStreamPacketDescription desc;
+    desc.mStartOffset = 0;
+    desc.mDataByteSize = sizeof(block);
+    desc.mVariableFramesInPacket = 0;
+
+    XCTAssertTrue(queue.push(1, block, &desc));
+
+    const void *data;
+    UInt32 numBytes;
+    AudioStreamPacketDescription *descs;
+    size_t offset = 0;
+
+    // The decoder asks for 100 frames at a time; the rest of the block waits
+    while (!queue.empty()) {
+        XCTAssertEqual(queue.consumeBytes(100 * 4, &data, &numBytes, &descs), (UInt32)1);
+        XCTAssertLessThanOrEqual(numBytes, (UInt32)(100 * 4));
+        XCTAssertEqual(memcmp(data, block + offset, numBytes), 0);
+
+        offset += numBytes;
+
+        XCTAssertEqual(queue.byteSize(), sizeof(block) - offset);
+        XCTAssertEqual((size_t)(queue.duration() * 44100 + 0.5), (sizeof(block) - offset) / 4);
+
+        queue.releaseConsumed();
+    }
+
+    XCTAssertEqual(offset, sizeof(block));
+}
+
+- (void)testStatsCostIsFlatAsThePrebufferGrows
+{
+    const size_t sizes[] = { 100 * 1024, 1024 * 1024, 10 * 1024 * 1024 };
+    double costs[3];
+
+    for (unsigned i = 0; i < 3; i++) {
+        unsigned allocationsAfterFill, allocations;
+
+        costs[i] = steadyStateCost(sizes[i], &allocationsAfterFill, &allocations);
+
+        NSLog(@"prebuffer %zu KB: %.1f ns per packet", sizes[i] / 1024, costs[i]);
+
+        // The rings are reused once grown to the prebuffer size
+        XCTAssertEqual(allocations, allocationsAfterFill);
+    }
+
+    // A walk of the 25000 packets per callback would be hundreds of times
+    // slower at 10 MB; what is left is the cache misses of the larger ring
+    XCTAssertLessThan(costs[2], costs[0] * 8);
+}
+
+@end
@@ -0,0 +1,467 @@
+//
+//  SocketStreamTests.mm
+//  RadioUVMTests
+//
+//  The POSIX socket stream against a stand-in Shoutcast server on the
+//  loopback interface: ICY metadata, redirects, chunked bodies and range
+//  requests, with receive buffers small enough to split every part of
+//  the responses.
+//
+
+#import <XCTest/XCTest.h>
+
+#include "socket_stream.h"
+#include "stream_configuration.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+using namespace astreamer;
+
+enum {
+    kMetaDataInterval = 8192,
+    kBodySize = 2 * 1024 * 1024,
+    kStalledBodySize = 4096
+};
+
+static std::string audioBody()
+{
+    std::string body(kBodySize, 0);
+    unsigned seed = 1;
+
+    for (size_t i = 0; i < body.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        body[i] = (char)(seed >> 16);
+    }
+    return body;
+}
+
+/*
+ * Serves one connection at a time on 127.0.0.1, like a Shoutcast or a
+ * plain HTTP server depending on the path:
+ *   /redirect   302 to /icy
+ *   /icy        ICY 200 OK with the metadata every kMetaDataInterval bytes
+ *   /chunked    HTTP/1.1 chunked encoding
+ *   /file       Content-Length, and 206 for a range request
+ */
+class Stand_In_Server {
+public:
+    Stand_In_Server() :
+        m_socket(-1),
+        m_port(0),
+        m_stopping(false),
+        m_requests(0),
+        m_body(audioBody())
+    {
+    }
+
+    bool start()
+    {
+        m_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (m_socket < 0) {
+            return false;
+        }
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+
+        socklen_t length = sizeof(address);
+
+        if (bind(m_socket, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+            listen(m_socket, 8) != 0 ||
+            getsockname(m_socket, (struct sockaddr *)&address, &length) != 0) {
+            return false;
+        }
+
+        m_port = ntohs(address.sin_port);
+
+        return (pthread_create(&m_thread, NULL, threadMain, this) == 0);
+    }
+
+    void stop()
+    {
+        __sync_synchronize();
+        m_stopping = true;
+
+        pthread_join(m_thread, NULL);
+        close(m_socket);
+    }
+
+    std::string url(const char *path)
+    {
+        char url[64];
+        snprintf(url, sizeof(url), "http://127.0.0.1:%u%s", m_port, path);
+        return url;
+    }
+
+    int m_socket;
+    unsigned m_port;
+    volatile bool m_stopping;
+    unsigned m_requests;
+    const std::string m_body;
+    pthread_t m_thread;
+
+private:
+    static bool send(int fd, const std::string& data)
+    {
+        size_t sent = 0;
+
+        while (sent < data.size()) {
+            ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, 0);
+
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+    void serve(int fd)
+    {
+        std::string request;
+        char buf[1024];
+
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+            if (n <= 0) {
+                return;
+            }
+            request.append(buf, n);
+        }
+
+        m_requests++;
+
+        const bool wantsMetaData = (request.find("Icy-MetaData: 1\r\n") != std::string::npos);
+
+        if (request.compare(0, 14, "GET /redirect ") == 0) {
+            send(fd, "HTTP/1.1 302 Found\r\nLocation: " + url("/icy") + "\r\nContent-Length: 0\r\n\r\n");
+        } else if (request.compare(0, 9, "GET /icy ") == 0) {
+            std::string response = "ICY 200 OK\r\n"
+                                   "icy-name: Stand-in FM\r\n"
+                                   "Content-Type: audio/mpeg\r\n";
+
+            if (wantsMetaData) {
+                char header[64];
+                snprintf(header, sizeof(header), "icy-metaint: %u\r\n", kMetaDataInterval);
+                response += header;
+            }
+            response += "\r\n";
+
+            for (size_t offset = 0; offset < m_body.size(); offset += kMetaDataInterval) {
+                response.append(m_body, offset, kMetaDataInterval);
+
+                if (!wantsMetaData) {
+                    continue;
+                }
+
+                char text[64];
+                const int length = snprintf(text, sizeof(text), "StreamTitle='Song %zu';", offset / kMetaDataInterval);
+                const size_t blocks = (length + 15) / 16;
+
+                response += (char)blocks;
+                response.append(text, length);
+                response.append(blocks * 16 - length, 0);
+            }
+            send(fd, response);
+        } else if (request.compare(0, 13, "GET /chunked ") == 0) {
+            std::string response = "HTTP/1.1 200 OK\r\n"
+                                   "Content-Type: audio/mpeg\r\n"
+                                   "Transfer-Encoding: chunked\r\n\r\n";
+            unsigned seed = 5;
+
+            for (size_t offset = 0; offset < m_body.size(); ) {
+                seed = seed * 1103515245 + 12345;
+
+                const size_t n = std::min((size_t)(1 + (seed >> 16) % 20000), m_body.size() - offset);
+
+                char size[32];
+                snprintf(size, sizeof(size), (seed & 1 ? "%zx;ext=1\r\n" : "%zX\r\n"), n);
+
+                response += size;
+                response.append(m_body, offset, n);
+                response += "\r\n";
+
+                offset += n;
+            }
+            response += "0\r\nX-Trailer: 1\r\n\r\n";
+
+            send(fd, response);
+        } else if (request.compare(0, 10, "GET /file ") == 0) {
+            const size_t rangePos = request.find("Range: bytes=");
+            const size_t start = (rangePos == std::string::npos ? 0 : strtoul(request.c_str() + rangePos + 13, NULL, 10));
+
+            char headers[256];
+
+            if (start > 0) {
+                snprintf(headers, sizeof(headers),
+                         "HTTP/1.1 206 Partial Content\r\nContent-Type: audio/mpeg\r\n"
+                         "Content-Length: %zu\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                         m_body.size() - start, start, m_body.size() - 1, m_body.size());
+            } else {
+                snprintf(headers, sizeof(headers),
+                         "HTTP/1.1 200 OK\r\nContent-Type: audio/mpeg\r\nContent-Length: %zu\r\n\r\n",
+                         m_body.size());
+            }
+            send(fd, headers + m_body.substr(start));
+        } else if (request.compare(0, 11, "GET /stall ") == 0) {
+            // Some of the body, and then nothing while the connection stays open
+            send(fd, "HTTP/1.1 200 OK\r\nContent-Type: audio/mpeg\r\n\r\n" + m_body.substr(0, kStalledBodySize));
+
+            for (unsigned i = 0; i < 500 && !m_stopping; i++) {
+                usleep(10000);
+            }
+        } else {
+            send(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        }
+    }
+
+    static void *threadMain(void *info)
+    {
+        Stand_In_Server *THIS = (Stand_In_Server *)info;
+
+        while (!THIS->m_stopping) {
+            struct pollfd pfd = { THIS->m_socket, POLLIN, 0 };
+
+            if (poll(&pfd, 1, 50) <= 0) {
+                continue;
+            }
+
+            const int fd = accept(THIS->m_socket, NULL, NULL);
+
+            if (fd < 0) {
+                continue;
+            }
+
+            THIS->serve(fd);
+            close(fd);
+        }
+        return NULL;
+    }
+};
+
+class Recording_Delegate : public Input_Stream_Delegate {
+public:
+    Input_Stream *m_stream;
+    std::string m_body;
+    size_t m_totalLength;
+    bool m_ready;
+    bool m_ended;
+    bool m_failed;
+    unsigned m_titles;
+    bool m_stationName;
+
+    Recording_Delegate() :
+        m_stream(0),
+        m_totalLength(0),
+        m_ready(false),
+        m_ended(false),
+        m_failed(false),
+        m_titles(0),
+        m_stationName(false)
+    {
+    }
+
+    void streamIsReadyRead()
+    {
+        m_ready = true;
+        m_totalLength = m_stream->totalLength();
+    }
+
+    void streamHasBytesAvailable(UInt8 *data, UInt32 numBytes)
+    {
+        m_body.append((const char *)data, numBytes);
+    }
+
+    void streamEndEncountered()
+    {
+        m_ended = true;
+    }
+
+    void streamErrorOccurred()
+    {
+        m_failed = true;
+    }
+
+    void streamMetaDataAvailable(Meta_Data&& metaData)
+    {
+        if (metaData.value(CFSTR("StreamTitle"))) {
+            m_titles++;
+        }
+        if (metaData.value(CFSTR("IcecastStationName"))) {
+            m_stationName = true;
+        }
+    }
+};
+
+/* Runs the stream to its end, or for 30 seconds */
+static void runStream(Stand_In_Server *server, const char *path, UInt64 start, Recording_Delegate *delegate)
+{
+    Event_Loop *eventLoop = Event_Loop::create();
+
+    Socket_Stream stream(eventLoop);
+    stream.m_delegate = delegate;
+    delegate->m_stream = &stream;
+
+    const std::string url = server->url(path);
+
+    CFStringRef urlString = CFStringCreateWithCString(kCFAllocatorDefault, url.c_str(), kCFStringEncodingUTF8);
+    CFURLRef urlRef = CFURLCreateWithString(kCFAllocatorDefault, urlString, NULL);
+
+    stream.setUrl(urlRef);
+
+    CFRelease(urlRef);
+    CFRelease(urlString);
+
+    Input_Stream_Position position = { start, 0 };
+
+    if (stream.open(position)) {
+        const CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + 30;
+
+        while (!delegate->m_ended && !delegate->m_failed && CFAbsoluteTimeGetCurrent() < deadline) {
+            eventLoop->runOnce(100);
+        }
+    } else {
+        delegate->m_failed = true;
+    }
+
+    stream.close();
+
+    delete eventLoop;
+}
+
+@interface SocketStreamTests : XCTestCase
+
+@end
+
+@implementation SocketStreamTests
+{
+    Stand_In_Server *_server;
+    unsigned _savedReadBufferSize;
+    int _savedReceiveBufferSize;
+}
+
+- (void)setUp
+{
+    [super setUp];
+
+    // Small buffers, so the headers, the metadata and the chunk sizes are split across reads
+    Stream_Configuration *config = Stream_Configuration::configuration();
+
+    _savedReadBufferSize = config->httpConnectionBufferSize;
+    _savedReceiveBufferSize = config->socketReceiveBufferSize;
+
+    config->httpConnectionBufferSize = 997;
+    config->socketReceiveBufferSize = 4096;
+
+    _server = new Stand_In_Server();
+
+    XCTAssertTrue(_server->start());
+}
+
+- (void)tearDown
+{
+    _server->stop();
+    delete _server;
+
+    Stream_Configuration *config = Stream_Configuration::configuration();
+
+    config->httpConnectionBufferSize = _savedReadBufferSize;
+    config->socketReceiveBufferSize = _savedReceiveBufferSize;
+
+    [super tearDown];
+}
+
+- (void)testIcyStreamBehindARedirect
+{
+    Recording_Delegate delegate;
+
+    runStream(_server, "/redirect", 0, &delegate);
+
+    XCTAssertTrue(delegate.m_ready);
+    XCTAssertTrue(delegate.m_ended);
+    XCTAssertFalse(delegate.m_failed);
+    XCTAssertEqual(_server->m_requests, (unsigned)2);
+
+    // The metadata is taken out of the audio and delivered
+    XCTAssertEqual(delegate.m_body.size(), _server->m_body.size());
+    XCTAssertTrue(delegate.m_body == _server->m_body);
+    XCTAssertTrue(delegate.m_stationName);
+    XCTAssertEqual(delegate.m_titles, (unsigned)(kBodySize / kMetaDataInterval));
+}
+
+- (void)testChunkedBody
+{
+    Recording_Delegate delegate;
+
+    runStream(_server, "/chunked", 0, &delegate);
+
+    XCTAssertTrue(delegate.m_ended);
+    XCTAssertFalse(delegate.m_failed);
+    XCTAssertTrue(delegate.m_body == _server->m_body);
+}
+
+- (void)testRangeRequest
+{
+    Recording_Delegate delegate;
+
+    runStream(_server, "/file", 100000, &delegate);
+
+    XCTAssertTrue(delegate.m_ended);
+    XCTAssertFalse(delegate.m_failed);
+    XCTAssertTrue(delegate.m_body == _server->m_body.substr(100000));
+
+    // The length of the whole file comes from the Content-Range
+    XCTAssertEqual(delegate.m_totalLength, (size_t)kBodySize);
+}
+
+- (void)testStalledConnectionTimesOut
+{
+    Stream_Configuration *config = Stream_Configuration::configuration();
+
+    const int savedReadTimeout = config->readTimeoutMs;
+
+    config->readTimeoutMs = 300;
+
+    Recording_Delegate delegate;
+
+    const CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+    runStream(_server, "/stall", 0, &delegate);
+
+    const double elapsed = CFAbsoluteTimeGetCurrent() - start;
+
+    config->readTimeoutMs = savedReadTimeout;
+
+    XCTAssertTrue(delegate.m_ready);
+    XCTAssertTrue(delegate.m_failed);
+    XCTAssertFalse(delegate.m_ended);
+    XCTAssertEqual(delegate.m_body.size(), (size_t)kStalledBodySize);
+
+    // Failed by the timeout, not by the server closing the connection after 5 seconds
+    XCTAssertLessThan(elapsed, 2.0);
+}
+
+- (void)testMissingStreamFails
+{
+    Recording_Delegate delegate;
+
+    runStream(_server, "/missing", 0, &delegate);
+
+    XCTAssertTrue(delegate.m_failed);
+    XCTAssertFalse(delegate.m_ready);
+}
+
+@end